@@ -10,6 +10,9 @@ BuildRequires: pkgconfig(Qt5Sql)
 BuildRequires: pkgconfig(Qt5DBus)
 BuildRequires: pkgconfig(Qt5Contacts) >= 5.2.0
 BuildRequires: pkgconfig(mlite5)
+BuildRequires: pkgconfig(sqlite3)
+BuildRequires: pkgconfig(liblz4)
+BuildRequires: pkgconfig(libzstd)
 Requires: qt5-plugin-sqldriver-sqlite
 
 %description
@@ -50,7 +53,7 @@ This package contains extension headers for the qtcontacts-sqlite-qt5 library.
 %setup -q -n %{name}-%{version}
 
 %build
-%qmake5 "VERSION=%{version}" "PKGCONFIG_LIB=%{_lib}"
+%qmake5 "VERSION=%{version}" "PKGCONFIG_LIB=%{_lib}" "CONFIG+=lz4 zstd"
 make %{?_smp_mflags}
 
 %install
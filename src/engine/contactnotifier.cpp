@@ -91,65 +91,107 @@ QVector<quint32> idVector(const QList<QContactCollectionId> &collectionIds)
     return ids;
 }
 
+const char *signalName(int signal)
+{
+    static const char *names[] = {
+        "collectionsAdded",
+        "collectionsChanged",
+        "contactsAdded",
+        "contactsChanged",
+        "contactsPresenceChanged",
+        "collectionContactsChanged",
+        "contactsRemoved",
+        "collectionsRemoved",
+        "relationshipsAdded",
+        "relationshipsRemoved"
+    };
+    return names[signal];
+}
+
 }
 
-ContactNotifier::ContactNotifier(bool nonprivileged)
+ContactNotifier::ContactNotifier(bool nonprivileged, int coalescingInterval, int coalescingLimit)
     : m_nonprivileged(nonprivileged)
+    , m_coalescingInterval(coalescingInterval)
+    , m_coalescingLimit(coalescingLimit)
+    , m_pendingCount(0)
+    , m_displayLabelGroupsPending(false)
+    , m_pendingChangedTypesUnspecified(false)
+    , m_mutex(QMutex::Recursive)
 {
     initialize();
 }
 
+ContactNotifier::~ContactNotifier()
+{
+    // Don't discard notifications that are still being accumulated
+    flush();
+}
+
+bool ContactNotifier::coalescing() const
+{
+    return m_coalescingInterval > 0;
+}
+
 void ContactNotifier::collectionsAdded(const QList<QContactCollectionId> &collectionIds)
 {
     if (!collectionIds.isEmpty()) {
-        QDBusMessage message = createSignal("collectionsAdded", m_nonprivileged);
-        message.setArguments(QVariantList() << QVariant::fromValue(idVector(collectionIds)));
-        QDBusConnection::sessionBus().send(message);
+        notify(CollectionsAdded, idVector(collectionIds));
     }
 }
 
 void ContactNotifier::collectionsChanged(const QList<QContactCollectionId> &collectionIds)
 {
     if (!collectionIds.isEmpty()) {
-        QDBusMessage message = createSignal("collectionsChanged", m_nonprivileged);
-        message.setArguments(QVariantList() << QVariant::fromValue(idVector(collectionIds)));
-        QDBusConnection::sessionBus().send(message);
+        notify(CollectionsChanged, idVector(collectionIds));
     }
 }
 
 void ContactNotifier::collectionsRemoved(const QList<QContactCollectionId> &collectionIds)
 {
     if (!collectionIds.isEmpty()) {
-        QDBusMessage message = createSignal("collectionsRemoved", m_nonprivileged);
-        message.setArguments(QVariantList() << QVariant::fromValue(idVector(collectionIds)));
-        QDBusConnection::sessionBus().send(message);
+        notify(CollectionsRemoved, idVector(collectionIds));
     }
 }
 
 void ContactNotifier::contactsAdded(const QList<QContactId> &contactIds)
 {
     if (!contactIds.isEmpty()) {
-        QDBusMessage message = createSignal("contactsAdded", m_nonprivileged);
-        message.setArguments(QVariantList() << QVariant::fromValue(idVector(contactIds)));
-        QDBusConnection::sessionBus().send(message);
+        notify(ContactsAdded, idVector(contactIds));
     }
 }
 
-void ContactNotifier::contactsChanged(const QList<QContactId> &contactIds)
+void ContactNotifier::contactsChanged(const QList<QContactId> &contactIds, const QList<QContactDetail::DetailType> &detailTypes)
 {
-    if (!contactIds.isEmpty()) {
-        QDBusMessage message = createSignal("contactsChanged", m_nonprivileged);
-        message.setArguments(QVariantList() << QVariant::fromValue(idVector(contactIds)));
-        QDBusConnection::sessionBus().send(message);
+    if (contactIds.isEmpty())
+        return;
+
+    QVector<quint32> types;
+    types.reserve(detailTypes.count());
+    foreach (QContactDetail::DetailType type, detailTypes) {
+        types.append(static_cast<quint32>(type));
     }
+
+    if (m_coalescingInterval <= 0) {
+        send(ContactsChanged, idVector(contactIds), types);
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    if (types.isEmpty()) {
+        m_pendingChangedTypesUnspecified = true;
+    } else {
+        foreach (quint32 type, types) {
+            m_pendingChangedTypes.insert(type);
+        }
+    }
+    notify(ContactsChanged, idVector(contactIds));
 }
 
 void ContactNotifier::contactsPresenceChanged(const QList<QContactId> &contactIds)
 {
     if (!contactIds.isEmpty()) {
-        QDBusMessage message = createSignal("contactsPresenceChanged", m_nonprivileged);
-        message.setArguments(QVariantList() << QVariant::fromValue(idVector(contactIds)));
-        QDBusConnection::sessionBus().send(message);
+        notify(ContactsPresenceChanged, idVector(contactIds));
     }
 }
 
@@ -157,24 +199,23 @@ void ContactNotifier::contactsPresenceChanged(const QList<QContactId> &contactId
 void ContactNotifier::collectionContactsChanged(const QList<QContactCollectionId> &collectionIds)
 {
     if (!collectionIds.isEmpty()) {
-        QDBusMessage message = createSignal("collectionContactsChanged", m_nonprivileged);
-        message.setArguments(QVariantList() << QVariant::fromValue(idVector(collectionIds)));
-        QDBusConnection::sessionBus().send(message);
+        notify(CollectionContactsChanged, idVector(collectionIds));
     }
 }
 
 void ContactNotifier::contactsRemoved(const QList<QContactId> &contactIds)
 {
     if (!contactIds.isEmpty()) {
-        QDBusMessage message = createSignal("contactsRemoved", m_nonprivileged);
-        message.setArguments(QVariantList() << QVariant::fromValue(idVector(contactIds)));
-        QDBusConnection::sessionBus().send(message);
+        notify(ContactsRemoved, idVector(contactIds));
     }
 }
 
 void ContactNotifier::selfContactIdChanged(QContactId oldId, QContactId newId)
 {
     if (oldId != newId) {
+        // Preserve the ordering with respect to any accumulated notifications
+        flush();
+
         QDBusMessage message = createSignal("selfContactIdChanged", m_nonprivileged);
         message.setArguments(QVariantList() << QVariant::fromValue(ContactId::databaseId(oldId)) << QVariant::fromValue(ContactId::databaseId(newId)));
         QDBusConnection::sessionBus().send(message);
@@ -184,27 +225,140 @@ void ContactNotifier::selfContactIdChanged(QContactId oldId, QContactId newId)
 void ContactNotifier::relationshipsAdded(const QSet<QContactId> &contactIds)
 {
     if (!contactIds.isEmpty()) {
-        QDBusMessage message = createSignal("relationshipsAdded", m_nonprivileged);
-        message.setArguments(QVariantList() << QVariant::fromValue(idVector(contactIds.toList())));
-        QDBusConnection::sessionBus().send(message);
+        notify(RelationshipsAdded, idVector(contactIds.toList()));
     }
 }
 
 void ContactNotifier::relationshipsRemoved(const QSet<QContactId> &contactIds)
 {
     if (!contactIds.isEmpty()) {
-        QDBusMessage message = createSignal("relationshipsRemoved", m_nonprivileged);
-        message.setArguments(QVariantList() << QVariant::fromValue(idVector(contactIds.toList())));
-        QDBusConnection::sessionBus().send(message);
+        notify(RelationshipsRemoved, idVector(contactIds.toList()));
     }
 }
 
 void ContactNotifier::displayLabelGroupsChanged()
 {
+    if (m_coalescingInterval > 0) {
+        QMutexLocker locker(&m_mutex);
+        if (m_pendingCount == 0 && !m_displayLabelGroupsPending) {
+            m_pendingTimer.start();
+        }
+        m_displayLabelGroupsPending = true;
+        return;
+    }
+
     QDBusMessage message = createSignal("displayLabelGroupsChanged", m_nonprivileged);
     QDBusConnection::sessionBus().send(message);
 }
 
+void ContactNotifier::flush()
+{
+    // Accumulated notifications may be flushed by another thread than the one accumulating them
+    QMutexLocker locker(&m_mutex);
+    if (m_pendingCount == 0 && !m_displayLabelGroupsPending)
+        return;
+
+    if (m_displayLabelGroupsPending) {
+        m_displayLabelGroupsPending = false;
+        QDBusMessage message = createSignal("displayLabelGroupsChanged", m_nonprivileged);
+        QDBusConnection::sessionBus().send(message);
+    }
+
+    // Contacts that were added or removed within the interval need not also be reported as changed,
+    // and contacts both added and removed need not be reported at all
+    QSet<quint32> &removedContacts(m_pendingIds[ContactsRemoved]);
+    QSet<quint32> &addedContacts(m_pendingIds[ContactsAdded]);
+    if (!removedContacts.isEmpty()) {
+        const QSet<quint32> addedAndRemoved(QSet<quint32>(addedContacts).intersect(removedContacts));
+        addedContacts.subtract(addedAndRemoved);
+        removedContacts.subtract(addedAndRemoved);
+        m_pendingIds[ContactsChanged].subtract(removedContacts).subtract(addedAndRemoved);
+        m_pendingIds[ContactsPresenceChanged].subtract(removedContacts).subtract(addedAndRemoved);
+    }
+    m_pendingIds[ContactsChanged].subtract(addedContacts);
+
+    QSet<quint32> &removedCollections(m_pendingIds[CollectionsRemoved]);
+    m_pendingIds[CollectionsChanged].subtract(removedCollections);
+    m_pendingIds[CollectionContactsChanged].subtract(removedCollections);
+
+    QVector<quint32> changedTypes;
+    if (!m_pendingChangedTypesUnspecified) {
+        changedTypes.reserve(m_pendingChangedTypes.count());
+        foreach (quint32 type, m_pendingChangedTypes) {
+            changedTypes.append(type);
+        }
+    }
+
+    for (int signal = 0; signal < IdSignalCount; ++signal) {
+        QSet<quint32> &ids(m_pendingIds[signal]);
+        if (!ids.isEmpty()) {
+            QVector<quint32> idList;
+            idList.reserve(ids.count());
+            foreach (quint32 id, ids) {
+                idList.append(id);
+            }
+            ids.clear();
+            send(static_cast<IdSignal>(signal), idList, changedTypes);
+        }
+    }
+
+    m_pendingChangedTypes.clear();
+    m_pendingChangedTypesUnspecified = false;
+    m_pendingCount = 0;
+}
+
+bool ContactNotifier::flushDue() const
+{
+    return flushDelay() == 0;
+}
+
+int ContactNotifier::flushDelay() const
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_pendingCount == 0 && !m_displayLabelGroupsPending)
+        return -1;
+
+    return static_cast<int>(qMax<qint64>(m_coalescingInterval - m_pendingTimer.elapsed(), 0));
+}
+
+void ContactNotifier::notify(IdSignal signal, const QVector<quint32> &ids)
+{
+    if (m_coalescingInterval <= 0) {
+        send(signal, ids);
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    if (m_pendingCount == 0 && !m_displayLabelGroupsPending) {
+        m_pendingTimer.start();
+    }
+
+    QSet<quint32> &pending(m_pendingIds[signal]);
+    const int previousCount = pending.count();
+    foreach (quint32 id, ids) {
+        pending.insert(id);
+    }
+    m_pendingCount += pending.count() - previousCount;
+
+    if (m_pendingCount > m_coalescingLimit) {
+        flush();
+    }
+}
+
+void ContactNotifier::send(IdSignal signal, const QVector<quint32> &ids, const QVector<quint32> &detailTypes)
+{
+    if (signal == ContactsChanged) {
+        // Receivers of the types are notified first, so that they can ignore the following contactsChanged
+        QDBusMessage message = createSignal("contactsDetailsChanged", m_nonprivileged);
+        message.setArguments(QVariantList() << QVariant::fromValue(ids) << QVariant::fromValue(detailTypes));
+        QDBusConnection::sessionBus().send(message);
+    }
+
+    QDBusMessage message = createSignal(signalName(signal), m_nonprivileged);
+    message.setArguments(QVariantList() << QVariant::fromValue(ids));
+    QDBusConnection::sessionBus().send(message);
+}
+
 bool ContactNotifier::connect(const char *name, const char *signature, QObject *receiver, const char *slot)
 {
     static QDBusConnection connection(QDBusConnection::sessionBus());
@@ -36,24 +36,44 @@
 #include "contactid_p.h"
 
 #include <QContact>
+#include <QElapsedTimer>
+#include <QMutex>
 #include <QObject>
 #include <QSet>
+#include <QVector>
 
 QTCONTACTS_USE_NAMESPACE
 
 class ContactNotifier
 {
-    bool m_nonprivileged;
-
 public:
-    ContactNotifier(bool nonprivileged);
+    enum { DefaultCoalescingLimit = 1000 };
+
+    // With a non-zero coalescingInterval, notifications are accumulated and emitted together, no
+    // more than coalescingInterval milliseconds after the first of them, or once more than
+    // coalescingLimit ids are pending; ids are merged and deduplicated per signal
+    ContactNotifier(bool nonprivileged, int coalescingInterval = 0, int coalescingLimit = DefaultCoalescingLimit);
+    ~ContactNotifier();
+
+    // Whether notifications are accumulated rather than emitted immediately
+    bool coalescing() const;
+
+    // Emit any accumulated notifications now; may be called from any thread
+    void flush();
+
+    // Whether accumulated notifications have reached the end of the coalescing interval, and the
+    // time in milliseconds until they do, or -1 if there are none
+    bool flushDue() const;
+    int flushDelay() const;
 
     void collectionsAdded(const QList<QContactCollectionId> &collectionIds);
     void collectionsChanged(const QList<QContactCollectionId> &collectionIds);
     void collectionsRemoved(const QList<QContactCollectionId> &collectionIds);
     void collectionContactsChanged(const QList<QContactCollectionId> &collectionIds);
     void contactsAdded(const QList<QContactId> &contactIds);
-    void contactsChanged(const QList<QContactId> &contactIds);
+    // The ids and types are sent in contactsDetailsChanged, followed by the ids alone in contactsChanged
+    // for receivers expecting only ids; an empty type list indicates that the types are unspecified
+    void contactsChanged(const QList<QContactId> &contactIds, const QList<QContactDetail::DetailType> &detailTypes);
     void contactsPresenceChanged(const QList<QContactId> &contactIds);
     void contactsRemoved(const QList<QContactId> &contactIds);
     void selfContactIdChanged(QContactId oldId, QContactId newId);
@@ -62,6 +82,36 @@ public:
     void displayLabelGroupsChanged();
 
     bool connect(const char *name, const char *signature, QObject *receiver, const char *slot);
+
+private:
+    // Signals carrying id lists, in the order in which accumulated notifications are emitted
+    enum IdSignal {
+        CollectionsAdded = 0,
+        CollectionsChanged,
+        ContactsAdded,
+        ContactsChanged,
+        ContactsPresenceChanged,
+        CollectionContactsChanged,
+        ContactsRemoved,
+        CollectionsRemoved,
+        RelationshipsAdded,
+        RelationshipsRemoved,
+        IdSignalCount
+    };
+
+    void notify(IdSignal signal, const QVector<quint32> &ids);
+    void send(IdSignal signal, const QVector<quint32> &ids, const QVector<quint32> &detailTypes = QVector<quint32>());
+
+    bool m_nonprivileged;
+    int m_coalescingInterval;
+    int m_coalescingLimit;
+    int m_pendingCount;
+    bool m_displayLabelGroupsPending;
+    QSet<quint32> m_pendingIds[IdSignalCount];
+    QSet<quint32> m_pendingChangedTypes;
+    bool m_pendingChangedTypesUnspecified;
+    QElapsedTimer m_pendingTimer;
+    mutable QMutex m_mutex;
 };
 
 #endif
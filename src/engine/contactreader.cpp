@@ -1852,6 +1852,11 @@ ContactReader::ContactReader(ContactsDatabase &database, const QString &managerU
 
 ContactReader::~ContactReader()
 {
+    // Devices outliving the reader can no longer access the database
+    QMutexLocker locker(m_database.accessMutex());
+    foreach (OOBDevice *device, m_oobDevices) {
+        device->detach();
+    }
 }
 
 struct Table
@@ -2202,6 +2207,35 @@ QString expandWhere(const QString &where, const QContactFilter &filter, const bo
 
 }
 
+static void appendContactChanges(const QList<QContact> &contacts,
+                                 QList<QContact> *addedContacts,
+                                 QList<QContact> *modifiedContacts,
+                                 QList<QContact> *deletedContacts,
+                                 QList<QContact> *unmodifiedContacts)
+{
+    for (QList<QContact>::const_iterator it = contacts.constBegin(); it != contacts.constEnd(); it++) {
+        const QContactStatusFlags flags = it->detail<QContactStatusFlags>();
+        if (flags.testFlag(QContactStatusFlags::IsDeleted)) {
+            if (deletedContacts) {
+                deletedContacts->append(*it);
+            }
+        } else if (flags.testFlag(QContactStatusFlags::IsAdded)) {
+            if (addedContacts) {
+                addedContacts->append(*it);
+            }
+        } else if (flags.testFlag(QContactStatusFlags::IsModified)) {
+            if (modifiedContacts) {
+                modifiedContacts->append(*it);
+            }
+        } else {
+            Q_ASSERT(unmodifiedContacts);
+            if (unmodifiedContacts) {
+                unmodifiedContacts->append(*it);
+            }
+        }
+    }
+}
+
 QContactManager::Error ContactReader::fetchContacts(const QContactCollectionId &collectionId,
                                                     QList<QContact> *addedContacts,
                                                     QList<QContact> *modifiedContacts,
@@ -2235,29 +2269,173 @@ QContactManager::Error ContactReader::fetchContacts(const QContactCollectionId &
             QContactFetchHint(),
             keepChangeFlags);
 
-    for (QList<QContact>::const_iterator it = allContacts.constBegin(); it != allContacts.constEnd(); it++) {
-        const QContactStatusFlags flags = it->detail<QContactStatusFlags>();
-        if (flags.testFlag(QContactStatusFlags::IsDeleted)) {
-            if (deletedContacts) {
-                deletedContacts->append(*it);
-            }
-        } else if (flags.testFlag(QContactStatusFlags::IsAdded)) {
-            if (addedContacts) {
-                addedContacts->append(*it);
-            }
-        } else if (flags.testFlag(QContactStatusFlags::IsModified)) {
-            if (modifiedContacts) {
-                modifiedContacts->append(*it);
-            }
-        } else {
-            Q_ASSERT(unmodifiedContacts);
-            if (unmodifiedContacts) {
-                unmodifiedContacts->append(*it);
+    appendContactChanges(allContacts, addedContacts, modifiedContacts, deletedContacts, unmodifiedContacts);
+
+    return error;
+}
+
+QContactManager::Error ContactReader::fetchContactChanges(const QContactCollectionId &collectionId,
+                                                          quint32 *lastContactId,
+                                                          int batchSize,
+                                                          QtContactsSqliteExtensions::ContactManagerEngine::UnmodifiedContacts unmodified,
+                                                          QList<QContact> *addedContacts,
+                                                          QList<QContact> *modifiedContacts,
+                                                          QList<QContact> *deletedContacts,
+                                                          QList<QContact> *unmodifiedContacts,
+                                                          bool *complete)
+{
+    typedef QtContactsSqliteExtensions::ContactManagerEngine Engine;
+
+    QMutexLocker locker(m_database.accessMutex());
+
+    // Page through the collection by contactId, so that each batch is found from the
+    // primary key rather than by skipping the rows already returned
+    const QString pageStatement(QStringLiteral(
+        " SELECT contactId, changeFlags"
+        " FROM Contacts"
+        " WHERE collectionId = :collectionId"
+        " AND contactId > :lastContactId"
+        " AND contactId > 2"
+        " AND isDeactivated = 0"
+        " %1"
+        " ORDER BY contactId"
+        " LIMIT :limit"
+    ).arg(unmodified == Engine::ExcludeUnmodifiedContacts ? QStringLiteral("AND changeFlags != 0") : QString()));
+
+    QVariantList changedIds;
+    QVariantList unmodifiedIds;
+    int count = 0;
+    {
+        ContactsDatabase::Query query(m_database.prepare(pageStatement));
+        query.bindValue(":collectionId", ContactCollectionId::databaseId(collectionId));
+        query.bindValue(":lastContactId", *lastContactId);
+        query.bindValue(":limit", batchSize);
+
+        if (!ContactsDatabase::execute(query)) {
+            query.reportError("Failed to page contact changes");
+            return QContactManager::UnspecifiedError;
+        }
+
+        while (query.next()) {
+            const quint32 contactId = query.value<quint32>(0);
+            const int changeFlags = query.value<int>(1);
+            if (changeFlags != 0 || unmodified == Engine::IncludeUnmodifiedContacts) {
+                changedIds.append(contactId);
+            } else {
+                unmodifiedIds.append(contactId);
             }
+            *lastContactId = contactId;
+            ++count;
         }
+        query.finish();
     }
 
-    return error;
+    *complete = (count < batchSize);
+
+    const QString table(QStringLiteral("FetchContactChanges"));
+    const bool keepChangeFlags = true;
+
+    QList<QContact> contacts;
+    if (!changedIds.isEmpty()) {
+        m_database.clearTemporaryContactIdsTable(table);
+        if (!m_database.createTemporaryContactIdsTable(table, changedIds)) {
+            return QContactManager::UnspecifiedError;
+        }
+
+        const QContactManager::Error error = queryContacts(table, &contacts, QContactFetchHint(), false, false, keepChangeFlags);
+        if (error != QContactManager::NoError) {
+            return error;
+        }
+    }
+
+    if (!unmodifiedIds.isEmpty()) {
+        // The sync metadata is enough for the caller to match the contact to its remote counterpart
+        QContactFetchHint metadataHint;
+        metadataHint.setDetailTypesHint(QList<QContactDetail::DetailType>()
+                << QContactGuid::Type
+                << QContactOriginMetadata::Type
+                << QContactSyncTarget::Type
+                << QContactExtendedDetail::Type);
+        metadataHint.setOptimizationHints(QContactFetchHint::NoRelationships);
+
+        m_database.clearTemporaryContactIdsTable(table);
+        if (!m_database.createTemporaryContactIdsTable(table, unmodifiedIds)) {
+            return QContactManager::UnspecifiedError;
+        }
+
+        const QContactManager::Error error = queryContacts(table, &contacts, metadataHint, false, false, keepChangeFlags);
+        if (error != QContactManager::NoError) {
+            return error;
+        }
+    }
+
+    appendContactChanges(contacts, addedContacts, modifiedContacts, deletedContacts, unmodifiedContacts);
+
+    return QContactManager::NoError;
+}
+
+QContactManager::Error ContactReader::readContactChanges(const QString &table,
+                                                         const QList<quint32> &databaseIds,
+                                                         QList<QContact> *contacts,
+                                                         QHash<quint32, int> *unhandledContactFlags,
+                                                         QHash<quint32, int> *unhandledDetailFlags)
+{
+    QMutexLocker locker(m_database.accessMutex());
+
+    QVariantList boundIds;
+    boundIds.reserve(databaseIds.size());
+    foreach (quint32 id, databaseIds) {
+        boundIds.append(id);
+    }
+
+    m_database.clearTemporaryContactIdsTable(table);
+    if (!m_database.createTemporaryContactIdsTable(table, boundIds)) {
+        return QContactManager::UnspecifiedError;
+    }
+
+    // Read the contacts including deleted contacts and details, with their change flags
+    const bool keepChangeFlags = true;
+    QContactManager::Error error = queryContacts(table, contacts, QContactFetchHint(), false, false, keepChangeFlags);
+    if (error != QContactManager::NoError) {
+        return error;
+    }
+
+    // The unhandled flags identify the changes made since the changes were last fetched
+    const QString contactFlagsStatement(QStringLiteral(
+        " SELECT Contacts.contactId, Contacts.unhandledChangeFlags"
+        " FROM temp.%1"
+        " CROSS JOIN Contacts ON temp.%1.contactId = Contacts.contactId"
+        " WHERE Contacts.unhandledChangeFlags != 0"
+    ).arg(table));
+
+    ContactsDatabase::Query contactFlagsQuery(m_database.prepare(contactFlagsStatement));
+    if (!ContactsDatabase::execute(contactFlagsQuery)) {
+        contactFlagsQuery.reportError("Failed to query unhandled contact change flags");
+        return QContactManager::UnspecifiedError;
+    }
+    while (contactFlagsQuery.next()) {
+        unhandledContactFlags->insert(contactFlagsQuery.value<quint32>(0), contactFlagsQuery.value<int>(1));
+    }
+    contactFlagsQuery.finish();
+
+    const QString detailFlagsStatement(QStringLiteral(
+        " SELECT Details.detailId, Details.unhandledChangeFlags"
+        " FROM temp.%1"
+        " CROSS JOIN Details ON temp.%1.contactId = Details.contactId"
+        " WHERE Details.unhandledChangeFlags != 0"
+    ).arg(table));
+
+    ContactsDatabase::Query detailFlagsQuery(m_database.prepare(detailFlagsStatement));
+    if (!ContactsDatabase::execute(detailFlagsQuery)) {
+        detailFlagsQuery.reportError("Failed to query unhandled detail change flags");
+        return QContactManager::UnspecifiedError;
+    }
+    while (detailFlagsQuery.next()) {
+        unhandledDetailFlags->insert(detailFlagsQuery.value<quint32>(0), detailFlagsQuery.value<int>(1));
+    }
+    detailFlagsQuery.finish();
+
+    return QContactManager::NoError;
 }
 
 QContactManager::Error ContactReader::readContacts(
@@ -2573,6 +2751,24 @@ QContactManager::Error ContactReader::queryContacts(
     const bool includeRelationships(relationshipQuery.isValid());
     const bool includeDetails(detailQuery.isValid());
 
+    // Find the transient details for all contacts in this fetch together, rather than per contact
+    QHash<quint32, QPair<QDateTime, QList<QContactDetail> > > fetchTransientDetails;
+    {
+        const QString idQueryStatement(QStringLiteral("SELECT contactId FROM temp.%1 ORDER BY contactId ASC").arg(tableName));
+        ContactsDatabase::Query idQuery(m_database.prepare(idQueryStatement));
+        idQuery.setForwardOnly(true);
+        if (!ContactsDatabase::execute(idQuery)) {
+            idQuery.reportError(QStringLiteral("Failed to query contact ids for transient details"));
+            return QContactManager::UnspecifiedError;
+        }
+
+        QList<quint32> contactIds;
+        while (idQuery.next()) {
+            contactIds.append(idQuery.value<quint32>(0));
+        }
+        fetchTransientDetails = m_database.transientDetails(contactIds);
+    }
+
     // We need to report our retrievals periodically
     int unreportedCount = 0;
 
@@ -2624,8 +2820,9 @@ QContactManager::Error ContactReader::queryContacts(
         QSet<QContactDetail::DetailType> transientTypes;
 
         // Find any transient details for this contact
-        if (m_database.hasTransientDetails(dbId)) {
-            const QPair<QDateTime, QList<QContactDetail> > transientDetails(m_database.transientDetails(dbId));
+        QHash<quint32, QPair<QDateTime, QList<QContactDetail> > >::const_iterator transientIt = fetchTransientDetails.constFind(dbId);
+        if (transientIt != fetchTransientDetails.constEnd()) {
+            const QPair<QDateTime, QList<QContactDetail> > &transientDetails(*transientIt);
             if (!transientDetails.first.isNull()) {
                 // Update the contact timestamp to that of the transient details
                 setValue(&timestamp, QContactTimestamp::FieldModificationTimestamp, transientDetails.first);
@@ -3361,64 +3558,277 @@ QContactManager::Error ContactReader::recordUnhandledChangeFlags(
     return QContactManager::DoesNotExistError;
 }
 
-bool ContactReader::fetchOOB(const QString &scope, const QStringList &keys, QMap<QString, QVariant> *values)
+static void insertOOBValue(ContactsDatabase &database, const QString &key, const QVariant &value, quint32 compressed, QMap<QString, QVariant> *values)
 {
-    QVariantList keyNames;
-
-    QString statement(QStringLiteral("SELECT name, value, compressed FROM OOB WHERE name "));
-    if (keys.isEmpty()) {
-        statement.append(QStringLiteral("LIKE '%1:%%'").arg(scope));
+    if (compressed > ContactsDatabase::OOBUncompressed) {
+        QByteArray data;
+        if (!database.decodeOOBValue(value.value<QByteArray>(), compressed, &data)) {
+            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Invalid compressed OOB data:%1, key:%2")
+                    .arg(compressed).arg(key));
+        } else if (ContactsDatabase::oobEncodingForm(compressed) == ContactsDatabase::OOBCompressedString) {
+            // QString data
+            values->insert(key, QVariant(QString::fromUtf8(data)));
+        } else {
+            // QByteArray data
+            values->insert(key, QVariant(data));
+        }
     } else {
-        const QChar colon(QChar::fromLatin1(':'));
+        values->insert(key, value);
+    }
+}
+
+// Reads an OOB value incrementally from its blob, decoding chunks on demand.  The blob is only
+// opened for the duration of each read, so that no read transaction is held between reads.
+class OOBDevice : public QIODevice
+{
+public:
+    OOBDevice(ContactReader *reader, ContactsDatabase &database)
+        : m_reader(reader)
+        , m_database(&database)
+        , m_rowId(0)
+        , m_blobSize(0)
+        , m_codec(OOBCodec::Zlib)
+        , m_size(0)
+        , m_cachedChunk(-1)
+        , m_chunked(false)
+        , m_inMemory(false)
+    {
+        m_reader->m_oobDevices.insert(this);
+    }
 
-        QString keyList;
-        foreach (const QString &key, keys) {
-            keyNames.append(scope + colon + key);
-            keyList.append(keyList.isEmpty() ? QStringLiteral("?") : QStringLiteral(",?"));
+    ~OOBDevice()
+    {
+        if (m_database) {
+            QMutexLocker locker(m_database->accessMutex());
+            m_reader->m_oobDevices.remove(this);
         }
-        statement.append(QStringLiteral("IN (%1)").arg(keyList));
     }
 
-    QSqlQuery query(m_database);
-    query.setForwardOnly(true);
-    if (!query.prepare(statement)) {
-        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to prepare OOB query:\n%1\nQuery:\n%2")
-                .arg(query.lastError().text())
-                .arg(statement));
-        return false;
+    // Called when the reader is destroyed before the device; subsequent reads fail
+    void detach()
+    {
+        m_reader = 0;
+        m_database = 0;
+        setErrorString(QStringLiteral("The contact manager of the device has been destroyed"));
     }
 
-    foreach (const QVariant &name, keyNames) {
-        query.addBindValue(name);
+    bool open(qint64 rowId, quint32 encoding)
+    {
+        const quint32 form = ContactsDatabase::oobEncodingForm(encoding);
+        m_codec = ContactsDatabase::oobEncodingCodec(encoding);
+        m_rowId = rowId;
+
+        ContactsDatabase::Blob blob;
+        if (!m_database->openBlob(&blob, "OOB", "value", m_rowId, false))
+            return false;
+        m_blobSize = blob.size();
+
+        if (form == ContactsDatabase::OOBUncompressed) {
+            m_size = m_blobSize;
+        } else if (form == ContactsDatabase::OOBChunkedBytes) {
+            // Index the chunks from their headers, without reading the payloads
+            qint64 blobOffset = 0;
+            while (blobOffset < m_blobSize) {
+                char header[ContactsDatabase::OOBChunkHeaderSize];
+                Chunk chunk;
+                if (!blob.read(header, ContactsDatabase::OOBChunkHeaderSize, blobOffset)
+                        || !ContactsDatabase::decodeOOBChunkHeader(header, &chunk.storedLength, &chunk.length)) {
+                    QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Invalid chunked OOB data at offset:%1").arg(blobOffset));
+                    return false;
+                }
+                chunk.blobOffset = blobOffset + ContactsDatabase::OOBChunkHeaderSize;
+                chunk.offset = m_size;
+                m_chunks.append(chunk);
+
+                blobOffset = chunk.blobOffset + chunk.storedLength;
+                m_size += chunk.length;
+            }
+            if (blobOffset != m_blobSize) {
+                QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Truncated chunked OOB data"));
+                return false;
+            }
+        } else if (form == ContactsDatabase::OOBCompressedBytes
+                   || form == ContactsDatabase::OOBCompressedString) {
+            // Values compressed as a whole can only be read by decompressing them entirely
+            QByteArray compressed(m_blobSize, Qt::Uninitialized);
+            if (!blob.read(compressed.data(), compressed.size(), 0))
+                return false;
+            blob.close();
+
+            QByteArray data;
+            if (!m_database->decodeOOBValue(compressed, encoding, &data))
+                return false;
+            return open(data);
+        } else {
+            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Invalid compression type for OOB data:%1").arg(encoding));
+            return false;
+        }
+        m_chunked = (form == ContactsDatabase::OOBChunkedBytes);
+
+        return QIODevice::open(QIODevice::ReadOnly);
     }
 
-    if (!ContactsDatabase::execute(query)) {
-        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to query OOB: %1")
-                .arg(query.lastError().text()));
-        return false;
+    bool open(const QByteArray &data)
+    {
+        m_inMemory = true;
+        m_data = data;
+        m_size = m_data.size();
+        return QIODevice::open(QIODevice::ReadOnly);
     }
-    while (query.next()) {
-        const QString name(query.value(0).toString());
-        const QVariant value(query.value(1));
-        const quint32 compressed(query.value(2).toUInt());
-
-        const QString key(name.mid(scope.length() + 1));
-        if (compressed > 0) {
-            QByteArray compressedData(value.value<QByteArray>());
-            if (compressed == 1) {
-                // QByteArray data
-                values->insert(key, QVariant(qUncompress(compressedData)));
-            } else if (compressed == 2) {
-                // QString data
-                values->insert(key, QVariant(QString::fromUtf8(qUncompress(compressedData))));
+
+    bool isSequential() const override { return false; }
+    qint64 size() const override { return m_size; }
+
+protected:
+    qint64 readData(char *data, qint64 maxSize) override
+    {
+        const qint64 offset = pos();
+        const qint64 length = qMin(maxSize, m_size - offset);
+        if (length <= 0)
+            return 0;
+
+        if (m_inMemory) {
+            ::memcpy(data, m_data.constData() + offset, length);
+            return length;
+        }
+
+        if (!m_database)
+            return -1;
+
+        QMutexLocker locker(m_database->accessMutex());
+
+        // The blob is closed again on return, before the mutex is released
+        ContactsDatabase::Blob blob;
+        if (!m_database->openBlob(&blob, "OOB", "value", m_rowId, false))
+            return -1;
+        if (blob.size() != m_blobSize) {
+            setErrorString(QStringLiteral("The OOB value has been replaced"));
+            return -1;
+        }
+
+        if (!m_chunked) {
+            return blob.read(data, static_cast<int>(length), offset) ? length : -1;
+        }
+
+        // Read across chunks until the request is satisfied, since short reads end QIODevice::read()
+        qint64 count = 0;
+        while (count < length) {
+            const int index = chunkIndex(offset + count);
+            if (index != m_cachedChunk) {
+                const Chunk &chunk(m_chunks.at(index));
+                QByteArray stored(chunk.storedLength, Qt::Uninitialized);
+                if (!blob.read(stored.data(), stored.size(), chunk.blobOffset))
+                    return count ? count : -1;
+
+                m_data = m_database->decodeOOBChunk(stored, chunk.length, m_codec);
+                if (m_data.size() != static_cast<int>(chunk.length)) {
+                    m_cachedChunk = -1;
+                    return count ? count : -1;
+                }
+                m_cachedChunk = index;
+            }
+
+            const Chunk &chunk(m_chunks.at(index));
+            const qint64 chunkOffset = offset + count - chunk.offset;
+            const qint64 available = qMin<qint64>(length - count, chunk.length - chunkOffset);
+            ::memcpy(data + count, m_data.constData() + chunkOffset, available);
+            count += available;
+        }
+        return count;
+    }
+
+    qint64 writeData(const char *, qint64) override
+    {
+        return -1;
+    }
+
+private:
+    struct Chunk {
+        qint64 blobOffset;
+        qint64 offset;
+        quint32 storedLength;
+        quint32 length;
+    };
+
+    int chunkIndex(qint64 offset) const
+    {
+        int lower = 0;
+        int upper = m_chunks.count() - 1;
+        while (lower < upper) {
+            const int middle = (lower + upper + 1) / 2;
+            if (m_chunks.at(middle).offset <= offset) {
+                lower = middle;
             } else {
-                QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Invalid compression type for OOB data:%1, key:%2")
-                        .arg(compressed).arg(key));
+                upper = middle - 1;
             }
-        } else {
-            values->insert(key, value);
         }
+        return lower;
+    }
+
+    ContactReader *m_reader;
+    ContactsDatabase *m_database;
+    qint64 m_rowId;
+    qint64 m_blobSize;
+    OOBCodec::Codec m_codec;
+    qint64 m_size;
+    QVector<Chunk> m_chunks;
+    int m_cachedChunk;
+    bool m_chunked;
+    bool m_inMemory;
+    QByteArray m_data;
+};
+
+QIODevice *ContactReader::openOOB(const QString &scope, const QString &key)
+{
+    QMutexLocker locker(m_database.accessMutex());
+
+    const QChar colon(QChar::fromLatin1(':'));
+
+    ContactsDatabase::Query query(m_database.prepare(
+        "SELECT rowid, compressed, CASE typeof(value) WHEN 'blob' THEN NULL ELSE value END FROM OOB WHERE name = :name"));
+    query.bindValue(QStringLiteral(":name"), scope + colon + key);
+
+    if (!ContactsDatabase::execute(query)) {
+        query.reportError("Failed to query OOB");
+        return 0;
+    }
+    if (!query.next()) {
+        return 0;
+    }
+
+    const qint64 rowId = query.value<qint64>(0);
+    const quint32 encoding = query.value<quint32>(1);
+    const QVariant value(query.value(2));
+    query.finish();
+
+    OOBDevice *device = new OOBDevice(this, m_database);
+
+    // Only blobs can be read incrementally; other values are converted in the same way as by fetchOOB
+    const bool opened = value.isNull() ? device->open(rowId, encoding)
+                                       : device->open(value.type() == QVariant::String ? value.toString().toUtf8()
+                                                                                       : value.toByteArray());
+    if (!opened) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to open OOB data for key:%1").arg(key));
+        delete device;
+        return 0;
     }
+    return device;
+}
+
+bool ContactReader::fetchOOBStorageSize(const QString &scope, qint64 *size)
+{
+    QMutexLocker locker(m_database.accessMutex());
+
+    // Text values are stored as UTF-16, which is what their conversion to blob yields
+    ContactsDatabase::Query query(m_database.prepare(QStringLiteral("SELECT TOTAL(LENGTH(CAST(value AS BLOB))) FROM OOB WHERE ")
+                                                     + ContactsDatabase::oobScopeCondition(scope)));
+    ContactsDatabase::bindOOBScope(query, scope);
+
+    if (!ContactsDatabase::execute(query)) {
+        query.reportError("Failed to query OOB storage size");
+        return false;
+    }
+    *size = query.next() ? static_cast<qint64>(query.value<double>(0)) : 0;
     query.finish();
 
     return true;
@@ -3426,20 +3836,16 @@ bool ContactReader::fetchOOB(const QString &scope, const QStringList &keys, QMap
 
 bool ContactReader::fetchOOBKeys(const QString &scope, QStringList *keys)
 {
-    QString statement(QStringLiteral("SELECT name FROM OOB WHERE name LIKE '%1:%%'").arg(scope));
+    QMutexLocker locker(m_database.accessMutex());
 
-    QSqlQuery query(m_database);
-    query.setForwardOnly(true);
-    if (!query.prepare(statement)) {
-        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to prepare OOB query:\n%1\nQuery:\n%2")
-                .arg(query.lastError().text())
-                .arg(statement));
-        return false;
-    }
+    // Satisfied from the scope index alone
+    ContactsDatabase::Query query(m_database.prepare(QStringLiteral("SELECT name FROM OOB WHERE ")
+                                                     + ContactsDatabase::oobScopeCondition(scope)
+                                                     + QStringLiteral(" ORDER BY name")));
+    ContactsDatabase::bindOOBScope(query, scope);
 
     if (!ContactsDatabase::execute(query)) {
-        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to query OOB: %1")
-                .arg(query.lastError().text()));
+        query.reportError("Failed to query OOB keys");
         return false;
     }
     while (query.next()) {
@@ -3451,6 +3857,98 @@ bool ContactReader::fetchOOBKeys(const QString &scope, QStringList *keys)
     return true;
 }
 
+QContactManager::Error ContactReader::fetchChangeJournal(
+        quint64 sinceSequence,
+        QList<QtContactsSqliteExtensions::ContactManagerEngine::ChangeJournalEntry> *entries,
+        quint64 *latestSequence,
+        bool *refetchRequired)
+{
+    typedef QtContactsSqliteExtensions::ContactManagerEngine::ChangeJournalEntry ChangeJournalEntry;
+
+    QMutexLocker locker(m_database.accessMutex());
+
+    entries->clear();
+    *refetchRequired = false;
+
+    // The entries following a cursor preceding the horizon have been discarded
+    const quint64 horizon = m_database.changeJournalHorizon();
+    if (sinceSequence < horizon) {
+        ContactsDatabase::Query query(m_database.prepare("SELECT MAX(sequence) FROM ChangeJournal"));
+        if (!ContactsDatabase::execute(query)) {
+            query.reportError("Failed to query latest change journal sequence");
+            return QContactManager::UnspecifiedError;
+        }
+        *latestSequence = query.next() ? query.value<quint64>(0) : 0;
+        *refetchRequired = true;
+        return QContactManager::NoError;
+    }
+
+    const QString entriesStatement(QStringLiteral(
+        " SELECT sequence, kind, ids, detailTypes, folded FROM ChangeJournal"
+        " WHERE sequence > :sinceSequence"
+        " ORDER BY sequence"));
+
+    // Folded entries have the lowest sequences; if the first entry returned is folded, the cursor
+    // lies within the folded range, and the preceding folded entries must be included
+    QList<ChangeJournalEntry> fetched;
+    quint64 since = sinceSequence;
+    for (int pass = 0; pass < 2; ++pass) {
+        ContactsDatabase::Query query(m_database.prepare(entriesStatement));
+        query.bindValue(QStringLiteral(":sinceSequence"), since);
+        if (!ContactsDatabase::execute(query)) {
+            query.reportError("Failed to query change journal");
+            return QContactManager::UnspecifiedError;
+        }
+
+        fetched.clear();
+        while (query.next()) {
+            ChangeJournalEntry entry;
+            entry.sequence = query.value<quint64>(0);
+            entry.kind = static_cast<ChangeJournalEntry::Kind>(query.value<int>(1));
+            entry.folded = query.value<int>(4) != 0;
+
+            const QList<quint32> ids(ContactsDatabase::unpackJournalValues(query.value<QByteArray>(2)));
+            if (entry.kind >= ChangeJournalEntry::CollectionsAdded) {
+                foreach (quint32 id, ids) {
+                    entry.collectionIds.append(ContactCollectionId::apiId(id, m_managerUri));
+                }
+            } else {
+                foreach (quint32 id, ids) {
+                    entry.contactIds.append(ContactId::apiId(id, m_managerUri));
+                }
+                foreach (quint32 type, ContactsDatabase::unpackJournalValues(query.value<QByteArray>(3))) {
+                    entry.detailTypes.append(static_cast<QContactDetail::DetailType>(type));
+                }
+            }
+            fetched.append(entry);
+        }
+
+        if (since == 0 || fetched.isEmpty() || !fetched.first().folded) {
+            break;
+        }
+        since = 0;
+    }
+
+    if (!fetched.isEmpty()) {
+        // The latest sequence is taken from the entries read, so that a cursor never passes an
+        // entry committed after the query
+        *latestSequence = fetched.last().sequence;
+    } else {
+        // A latest sequence lower than the cursor indicates that the database has been recreated
+        ContactsDatabase::Query query(m_database.prepare("SELECT MAX(sequence) FROM ChangeJournal"));
+        if (!ContactsDatabase::execute(query)) {
+            query.reportError("Failed to query latest change journal sequence");
+            return QContactManager::UnspecifiedError;
+        }
+        const quint64 maximumSequence = query.next() ? query.value<quint64>(0) : 0;
+        *latestSequence = qMin(maximumSequence, sinceSequence);
+        *refetchRequired = (maximumSequence < sinceSequence);
+    }
+
+    *entries = fetched;
+    return QContactManager::NoError;
+}
+
 void ContactReader::contactsAvailable(const QList<QContact> &)
 {
 }
@@ -36,14 +36,20 @@
 #include "contactid_p.h"
 #include "contactsdatabase.h"
 
+#include "../extensions/contactmanagerengine.h"
+
 #include <QContact>
 #include <QContactManager>
 
+#include <QIODevice>
+#include <QSet>
 #include <QSqlDatabase>
 #include <QSqlQuery>
 
 QTCONTACTS_USE_NAMESPACE
 
+class OOBDevice;
+
 class ContactReader
 {
 public:
@@ -116,6 +122,24 @@ public:
             QList<QContact> *deletedContacts,
             QList<QContact> *unmodifiedContacts);
 
+    QContactManager::Error fetchContactChanges(
+            const QContactCollectionId &collectionId,
+            quint32 *lastContactId,
+            int batchSize,
+            QtContactsSqliteExtensions::ContactManagerEngine::UnmodifiedContacts unmodified,
+            QList<QContact> *addedContacts,
+            QList<QContact> *modifiedContacts,
+            QList<QContact> *deletedContacts,
+            QList<QContact> *unmodifiedContacts,
+            bool *complete);
+
+    QContactManager::Error readContactChanges(
+            const QString &table,
+            const QList<quint32> &databaseIds,
+            QList<QContact> *contacts,
+            QHash<quint32, int> *unhandledContactFlags,
+            QHash<quint32, int> *unhandledDetailFlags);
+
     QContactManager::Error recordUnhandledChangeFlags(
             const QContactCollectionId &collectionId,
             bool *record);
@@ -124,6 +148,16 @@ public:
 
     bool fetchOOBKeys(const QString &scope, QStringList *keys);
 
+    QIODevice *openOOB(const QString &scope, const QString &key);
+
+    bool fetchOOBStorageSize(const QString &scope, qint64 *size);
+
+    QContactManager::Error fetchChangeJournal(
+            quint64 sinceSequence,
+            QList<QtContactsSqliteExtensions::ContactManagerEngine::ChangeJournalEntry> *entries,
+            quint64 *latestSequence,
+            bool *refetchRequired);
+
 protected:
     QContactManager::Error readDeletedContactIds(
             QList<QContactId> *contactIds,
@@ -151,8 +185,11 @@ protected:
     virtual void collectionsAvailable(const QList<QContactCollection> &collections);
 
 private:
+    friend class OOBDevice;
+
     ContactsDatabase &m_database;
     QString m_managerUri;
+    QSet<OOBDevice *> m_oobDevices;
 };
 
 #endif
@@ -39,6 +39,8 @@
 #include <QContactGender>
 #include <QContactName>
 #include <QContactDisplayLabel>
+#include <QContactGlobalPresence>
+#include <QContactPresence>
 
 #include <QPluginLoader>
 #include <QElapsedTimer>
@@ -47,15 +49,15 @@
 #include <QFile>
 #include <QFileInfo>
 #include <QLocale>
+#include <QSet>
 #include <QSqlDriver>
 #include <QSqlError>
 #include <QSqlQuery>
+#include <QtEndian>
 
 #include <QtDebug>
 
-#ifdef QTCONTACTS_SQLITE_LOAD_ICU
 #include <sqlite3.h>
-#endif
 
 static const char *setupEncoding =
         "\n PRAGMA encoding = \"UTF-16\";";
@@ -69,6 +71,9 @@ static const char *setupJournal =
 static const char *setupSynchronous =
         "\n PRAGMA synchronous = FULL;";
 
+static const char *setupNormalSynchronous =
+        "\n PRAGMA synchronous = NORMAL;";
+
 static const char *createCollectionsTable =
         "\n CREATE TABLE Collections ("
         "\n collectionId INTEGER PRIMARY KEY ASC AUTOINCREMENT,"
@@ -342,7 +347,8 @@ static const char *createDetailsTable =
         "\n modifiable BOOL,"
         "\n nonexportable BOOL,"
         "\n changeFlags INTEGER DEFAULT 0,"
-        "\n unhandledChangeFlags INTEGER DEFAULT 0);";
+        "\n unhandledChangeFlags INTEGER DEFAULT 0,"
+        "\n contentHash INTEGER);";
 
 static const char *createDetailsRemoveIndex =
         "\n CREATE INDEX DetailsRemoveIndex ON Details(contactId, detail);";
@@ -371,17 +377,28 @@ static const char *createDeletedContactsTable =
         "\n collectionId INTEGER NOT NULL,"
         "\n deleted DATETIME);";
 
+// name is the scope and key, separated by a colon
 static const char *createOOBTable =
         "\n CREATE TABLE OOB ("
         "\n name TEXT PRIMARY KEY,"
         "\n value BLOB,"
-        "\n compressed INTEGER DEFAULT 0);";
+        "\n compressed INTEGER DEFAULT 0,"
+        "\n scope TEXT);";
 
 static const char *createDbSettingsTable =
         "\n CREATE TABLE DbSettings ("
         "\n name TEXT PRIMARY KEY,"
         "\n value TEXT );";
 
+// sequence numbers are never reused; folded entries summarize the compacted oldest entries
+static const char *createChangeJournalTable =
+        "\n CREATE TABLE ChangeJournal ("
+        "\n sequence INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "\n kind INTEGER NOT NULL,"
+        "\n ids BLOB,"
+        "\n detailTypes BLOB,"
+        "\n folded INTEGER DEFAULT 0);";
+
 // as at b8084fa7
 static const char *createRemoveTrigger_0 =
         "\n CREATE TRIGGER RemoveContactDetails"
@@ -674,6 +691,9 @@ static const char *createContactsModifiedIndex =
 static const char *createContactsTypeIndex =
         "\n CREATE INDEX ContactsTypeIndex ON Contacts(type);";
 
+static const char *createOOBScopeIndex =
+        "\n CREATE INDEX OOBScopeIndex ON OOB(scope, name);";
+
 static const char *createRelationshipsFirstIdIndex =
         "\n CREATE INDEX RelationshipsFirstIdIndex ON Relationships(firstId);";
 
@@ -745,7 +765,8 @@ static const char *createAnalyzeData3 =
         "\n   ('OriginMetadata','OriginMetadataIdIndex','2500 6'),"
         "\n   ('PhoneNumbers','PhoneNumbersIndex','4500 7'),"
         "\n   ('EmailAddresses','EmailAddressesIndex','4000 5'),"
-        "\n   ('OOB','sqlite_autoindex_OOB_1','29 1');";
+        "\n   ('OOB','sqlite_autoindex_OOB_1','29 1'),"
+        "\n   ('OOB','OOBScopeIndex','29 10 1');";
 
 static const char *createStatements[] =
 {
@@ -786,6 +807,7 @@ static const char *createStatements[] =
     createRelationshipsTable,
     createOOBTable,
     createDbSettingsTable,
+    createChangeJournalTable,
     createRemoveTrigger,
     createContactsCollectionIdIndex,
     createContactsChangeFlagsIndex,
@@ -801,6 +823,7 @@ static const char *createStatements[] =
     createOriginMetadataGroupIdIndex,
     createContactsModifiedIndex,
     createContactsTypeIndex,
+    createOOBScopeIndex,
     createAnalyzeData1,
     createAnalyzeData2,
     createAnalyzeData3,
@@ -1586,7 +1609,12 @@ static const char *upgradeVersion20[] = {
     // we also need to drop and recreate OOB as it will have stale
     // sync data in it.
     "DROP TABLE OOB",
-    createOOBTable,
+    // We can't create this in final form anymore, since we're modifying it in version 24->25
+    //createOOBTable,
+    "CREATE TABLE OOB ("
+        "name TEXT PRIMARY KEY,"
+        "value BLOB,"
+        "compressed INTEGER DEFAULT 0)",
     // rebuild the indexes we dropped
     createDetailsRemoveIndex,
     createPhoneNumbersIndex,
@@ -1644,6 +1672,27 @@ static const char *upgradeVersion21[] = {
     "PRAGMA user_version=22",
     0 // NULL-terminated
 };
+static const char *upgradeVersion22[] = {
+    // content fingerprint of each detail, populated as details are written.
+    "ALTER TABLE Details ADD COLUMN contentHash INTEGER",
+    "PRAGMA user_version=23",
+    0 // NULL-terminated
+};
+static const char *upgradeVersion23[] = {
+    createChangeJournalTable,
+    "PRAGMA user_version=24",
+    0 // NULL-terminated
+};
+static const char *upgradeVersion24[] = {
+    // index the scope of OOB values, so that a scope is read and removed by a range scan.
+    // A scope containing ':' cannot be distinguished from its key here; such rows are
+    // matched by name as well (see oobScopeCondition)
+    "ALTER TABLE OOB ADD COLUMN scope TEXT",
+    "UPDATE OOB SET scope = substr(name, 1, instr(name, ':') - 1) WHERE instr(name, ':') > 0",
+    createOOBScopeIndex,
+    "PRAGMA user_version=25",
+    0 // NULL-terminated
+};
 
 typedef bool (*UpgradeFunction)(QSqlDatabase &database);
 
@@ -2165,9 +2214,12 @@ static UpgradeOperation upgradeVersions[] = {
     { forceRegenDisplayLabelGroups, upgradeVersion19 },
     { 0,                            upgradeVersion20 },
     { 0,                            upgradeVersion21 },
+    { 0,                            upgradeVersion22 },
+    { 0,                            upgradeVersion23 },
+    { 0,                            upgradeVersion24 },
 };
 
-static const int currentSchemaVersion = 22;
+static const int currentSchemaVersion = 25;
 
 static bool execute(QSqlDatabase &database, const QString &statement)
 {
@@ -2199,6 +2251,23 @@ static bool rollbackTransaction(QSqlDatabase &database)
     return execute(database, QStringLiteral("ROLLBACK TRANSACTION"));
 }
 
+static bool setSavepoint(QSqlDatabase &database, const QString &name)
+{
+    return execute(database, QStringLiteral("SAVEPOINT %1").arg(name));
+}
+
+static bool releaseSavepoint(QSqlDatabase &database, const QString &name)
+{
+    return execute(database, QStringLiteral("RELEASE SAVEPOINT %1").arg(name));
+}
+
+static bool rollbackToSavepoint(QSqlDatabase &database, const QString &name)
+{
+    // Rolling back to a savepoint does not remove it from the transaction stack
+    return execute(database, QStringLiteral("ROLLBACK TRANSACTION TO SAVEPOINT %1").arg(name))
+        && releaseSavepoint(database, name);
+}
+
 static bool finalizeTransaction(QSqlDatabase &database, bool success)
 {
     if (success) {
@@ -3211,9 +3280,88 @@ void ContactsDatabase::Query::reportError(const char *text) const
     reportError(QString::fromLatin1(text));
 }
 
+bool ContactsDatabase::Blob::read(char *data, int length, qint64 offset)
+{
+    if (!m_blob || offset < 0 || offset + length > m_size)
+        return false;
+
+    const int rv = sqlite3_blob_read(m_blob, data, length, static_cast<int>(offset));
+    if (rv != SQLITE_OK) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to read blob: %1").arg(QString::fromUtf8(sqlite3_errstr(rv))));
+        return false;
+    }
+    return true;
+}
+
+bool ContactsDatabase::Blob::write(const char *data, int length, qint64 offset)
+{
+    if (!m_blob || offset < 0 || offset + length > m_size)
+        return false;
+
+    const int rv = sqlite3_blob_write(m_blob, data, length, static_cast<int>(offset));
+    if (rv != SQLITE_OK) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to write blob: %1").arg(QString::fromUtf8(sqlite3_errstr(rv))));
+        return false;
+    }
+    return true;
+}
+
+void ContactsDatabase::Blob::close()
+{
+    if (m_blob) {
+        sqlite3_blob_close(m_blob);
+        m_blob = 0;
+        m_size = 0;
+    }
+}
+
+// Reads the modification timestamps of stored contacts, to validate a restored transient snapshot
+class StoredContactTimestamps : public ContactsTransientStore::StoredTimestamps
+{
+public:
+    explicit StoredContactTimestamps(QSqlDatabase &database)
+        : m_database(database)
+    {
+    }
+
+    QHash<quint32, QDateTime> modificationTimestamps(const QList<quint32> &contactIds) override
+    {
+        QHash<quint32, QDateTime> timestamps;
+
+        enum { BatchSize = 167 };
+        for (int i = 0; i < contactIds.count(); i += BatchSize) {
+            QStringList ids;
+            foreach (quint32 contactId, contactIds.mid(i, BatchSize)) {
+                ids.append(QString::number(contactId));
+            }
+
+            QSqlQuery query(m_database);
+            if (!query.exec(QStringLiteral("SELECT contactId, modified FROM Contacts WHERE contactId IN (%1)").arg(ids.join(QChar(','))))) {
+                QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to query contact timestamps for transient snapshot: %1")
+                        .arg(query.lastError().text()));
+                continue;
+            }
+            while (query.next()) {
+                timestamps.insert(query.value(0).toUInt(), ContactsDatabase::fromDateTimeString(query.value(1).toString()));
+            }
+        }
+
+        return timestamps;
+    }
+
+private:
+    QSqlDatabase &m_database;
+};
+
 ContactsDatabase::ContactsDatabase(ContactsEngine *engine)
     : m_engine(engine)
+    , m_temporaryTimestampsGeneration(0)
+    , m_temporaryPresenceGeneration(0)
+    , m_transientSnapshotGeneration(0)
+    , m_transactionActive(false)
     , m_mutex(QMutex::Recursive)
+    , m_writeLockWaitTime(0)
+    , m_writeLockSite(QtContactsSqliteExtensions::ContactManagerEngine::SaveLockSite)
     , m_nonprivileged(false)
     , m_autoTest(false)
     , m_localeName(QLocale().name())
@@ -3387,13 +3535,13 @@ bool ContactsDatabase::open(const QString &connectionName, bool nonprivileged, b
 
     if (databasePreexisting && databaseOwner) {
         // Try to upgrade, if necessary
-        if (mutex->lock()) {
+        if (lockProcessMutex(QtContactsSqliteExtensions::ContactManagerEngine::UpgradeLockSite)) {
             // Perform an integrity check
             if (!checkDatabase(m_database)) {
                 QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to check integrity of contacts database: %1")
                         .arg(m_database.lastError().text()));
                 m_database.close();
-                mutex->unlock();
+                unlockProcessMutex();
                 return false;
             }
 
@@ -3401,11 +3549,11 @@ bool ContactsDatabase::open(const QString &connectionName, bool nonprivileged, b
                 QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to upgrade contacts database: %1")
                         .arg(m_database.lastError().text()));
                 m_database.close();
-                mutex->unlock();
+                unlockProcessMutex();
                 return false;
             }
 
-            mutex->unlock();
+            unlockProcessMutex();
         } else {
             QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to lock mutex for contacts database: %1")
                     .arg(databaseFile));
@@ -3433,8 +3581,36 @@ bool ContactsDatabase::open(const QString &connectionName, bool nonprivileged, b
         }
     }
 
+    if (m_engine && m_engine->durabilityProfile() == ContactsEngine::NormalDurability
+            && !::execute(m_database, QLatin1String(setupNormalSynchronous))) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to configure durability: %1").arg(m_database.lastError().text()));
+    }
+
+    if (m_engine) {
+        // Checkpoints are scheduled by the engine; auto-checkpoint only as a fallback, well beyond the size limit
+        QSqlQuery query(m_database);
+        if (query.exec(QStringLiteral("PRAGMA page_size")) && query.next() && query.value(0).toInt() > 0) {
+            const int pages = (2 * m_engine->walSizeLimit()) / query.value(0).toInt();
+            query.finish();
+            ::execute(m_database, QStringLiteral("PRAGMA wal_autocheckpoint = %1").arg(qMax(pages, 1000)));
+        }
+    }
+
+    // The primary connection of each process maintains the transient store snapshot, if configured
+    m_transientSnapshotPath.clear();
+    int snapshotMaximumAge = 0;
+    if (m_engine && m_engine->transientSnapshotInterval() > 0 && !secondaryConnection) {
+        m_transientSnapshotPath = databaseDir.absoluteFilePath(QStringLiteral("transient-snapshot"));
+        snapshotMaximumAge = m_engine->transientSnapshotMaximumAge();
+        if (!databasePreexisting) {
+            // The snapshot describes contacts of a previous database
+            QFile::remove(m_transientSnapshotPath);
+        }
+    }
+
     // Attach to the transient store - any process can create it, but only the primary connection of each
-    if (!m_transientStore.open(nonprivileged, !secondaryConnection, !databasePreexisting)) {
+    StoredContactTimestamps storedTimestamps(m_database);
+    if (!m_transientStore.open(nonprivileged, !secondaryConnection, !databasePreexisting, m_transientSnapshotPath, snapshotMaximumAge, &storedTimestamps)) {
         QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to open contacts transient store"));
         m_database.close();
         return false;
@@ -3480,19 +3656,41 @@ bool ContactsDatabase::aggregating() const
     return !m_nonprivileged;
 }
 
-bool ContactsDatabase::beginTransaction()
+bool ContactsDatabase::lockProcessMutex(WriteLockSite site)
 {
-    ProcessMutex *mutex(processMutex());
+    QElapsedTimer waitTimer;
+    waitTimer.start();
+
+    if (!processMutex()->lock())
+        return false;
 
+    m_writeLockWaitTime = waitTimer.nsecsElapsed() / 1000;
+    m_writeLockSite = site;
+    m_writeLockTimer.start();
+    return true;
+}
+
+void ContactsDatabase::unlockProcessMutex()
+{
+    processMutex()->unlock();
+    if (m_engine) {
+        m_engine->recordWriteLock(m_writeLockSite, m_writeLockWaitTime, m_writeLockTimer.nsecsElapsed() / 1000);
+    }
+}
+
+bool ContactsDatabase::beginTransaction(WriteLockSite site)
+{
     // We use a cross-process mutex to ensure only one process can write
     // to the DB at once.  Without external locking, SQLite will back off
     // on write contention, and the backed-off process may never get access
     // if other processes are performing regular writes.
-    if (mutex->lock()) {
-        if (::beginTransaction(m_database))
+    if (lockProcessMutex(site)) {
+        if (::beginTransaction(m_database)) {
+            m_transactionActive = true;
             return true;
+        }
 
-        mutex->unlock();
+        unlockProcessMutex();
     }
 
     return false;
@@ -3503,11 +3701,21 @@ bool ContactsDatabase::commitTransaction()
     ProcessMutex *mutex(processMutex());
 
     if (::commitTransaction(m_database)) {
+        m_transactionActive = false;
+        m_savepointTransientChanges.clear();
+
+        // Write the transient changes while still excluding other writers, so that
+        // they cannot be overtaken by a subsequent durable change to the same contact
+        applyPendingTransientChanges();
+
         if (mutex->isLocked()) {
-            mutex->unlock();
+            unlockProcessMutex();
         } else {
             QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Lock error: no lock held on commit"));
         }
+        if (m_engine) {
+            m_engine->transactionCommitted();
+        }
         return true;
     }
 
@@ -3520,8 +3728,17 @@ bool ContactsDatabase::rollbackTransaction()
 
     const bool rv = ::rollbackTransaction(m_database);
 
+    // The transient changes made within the transaction are discarded with it
+    m_transactionActive = false;
+    m_pendingTransientChanges.clear();
+    m_savepointTransientChanges.clear();
+
+    // The temporary tables may have been populated within the transaction
+    m_temporaryTimestampsGeneration = 0;
+    m_temporaryPresenceGeneration = 0;
+
     if (mutex->isLocked()) {
-        mutex->unlock();
+        unlockProcessMutex();
     } else {
         QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Lock error: no lock held on rollback"));
     }
@@ -3529,6 +3746,117 @@ bool ContactsDatabase::rollbackTransaction()
     return rv;
 }
 
+bool ContactsDatabase::setSavepoint(const QString &name)
+{
+    if (!processMutex()->isLocked()) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Lock error: no lock held for savepoint %1").arg(name));
+        return false;
+    }
+
+    if (!::setSavepoint(m_database, name))
+        return false;
+
+    m_savepointTransientChanges.append(m_pendingTransientChanges);
+    return true;
+}
+
+bool ContactsDatabase::releaseSavepoint(const QString &name)
+{
+    if (!::releaseSavepoint(m_database, name))
+        return false;
+
+    // The changes made since the savepoint now belong to the enclosing transaction
+    if (!m_savepointTransientChanges.isEmpty()) {
+        m_savepointTransientChanges.removeLast();
+    }
+    return true;
+}
+
+bool ContactsDatabase::rollbackToSavepoint(const QString &name)
+{
+    m_temporaryTimestampsGeneration = 0;
+    m_temporaryPresenceGeneration = 0;
+
+    // The transient changes made since the savepoint are discarded with the others
+    if (!m_savepointTransientChanges.isEmpty()) {
+        m_pendingTransientChanges = m_savepointTransientChanges.takeLast();
+    }
+
+    return ::rollbackToSavepoint(m_database, name);
+}
+
+bool ContactsDatabase::checkpoint(CheckpointMode mode)
+{
+    QMutexLocker locker(accessMutex());
+
+    // A truncating checkpoint must wait for writers to finish, so exclude them via the process mutex
+    const bool truncate(mode == TruncateCheckpoint);
+    if (truncate && !lockProcessMutex(QtContactsSqliteExtensions::ContactManagerEngine::CheckpointLockSite)) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to lock mutex for checkpoint"));
+        return false;
+    }
+
+    QSqlQuery query(m_database);
+    const bool rv = query.exec(truncate ? QStringLiteral("PRAGMA wal_checkpoint(TRUNCATE)")
+                                        : QStringLiteral("PRAGMA wal_checkpoint(PASSIVE)"));
+    if (!rv) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to checkpoint database: %1").arg(query.lastError().text()));
+    } else if (query.next() && query.value(0).toInt() != 0) {
+        QTCONTACTS_SQLITE_DEBUG(QString::fromLatin1("Checkpoint could not complete: %1 of %2 frames")
+                .arg(query.value(2).toInt()).arg(query.value(1).toInt()));
+    }
+    query.finish();
+
+    if (truncate) {
+        unlockProcessMutex();
+    }
+    return rv;
+}
+
+ContactsDatabase::DataRevision ContactsDatabase::dataRevision()
+{
+    DataRevision revision;
+
+    ContactsDatabase::Query query(prepare("PRAGMA data_version"));
+    if (ContactsDatabase::execute(query) && query.next()) {
+        revision.dataVersion = query.value<qint64>(0);
+    } else {
+        query.reportError("Failed to query data version");
+    }
+    revision.transientGeneration = m_transientStore.generation();
+
+    return revision;
+}
+
+bool ContactsDatabase::openBlob(Blob *blob, const char *table, const char *column, qint64 rowId, bool writable)
+{
+    blob->close();
+
+    QVariant v = m_database.driver()->handle();
+    sqlite3 *handle = v.isValid() ? *static_cast<sqlite3 **>(v.data()) : 0;
+    if (!handle) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to access database handle for blob"));
+        return false;
+    }
+
+    const int rv = sqlite3_blob_open(handle, "main", table, column, rowId, writable ? 1 : 0, &blob->m_blob);
+    if (rv != SQLITE_OK) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to open blob %1.%2 of row %3: %4")
+                .arg(QLatin1String(table)).arg(QLatin1String(column)).arg(rowId)
+                .arg(QString::fromUtf8(sqlite3_errmsg(handle))));
+        blob->close();
+        return false;
+    }
+
+    blob->m_size = sqlite3_blob_bytes(blob->m_blob);
+    return true;
+}
+
+qint64 ContactsDatabase::walSize() const
+{
+    return QFileInfo(m_database.databaseName() + QStringLiteral("-wal")).size();
+}
+
 ContactsDatabase::Query ContactsDatabase::prepare(const char *statement)
 {
     return prepare(QString::fromLatin1(statement));
@@ -3556,29 +3884,161 @@ ContactsDatabase::Query ContactsDatabase::prepare(const QString &statement)
 
 bool ContactsDatabase::hasTransientDetails(quint32 contactId)
 {
+    QMutexLocker locker(accessMutex());
+
+    PendingTransientChanges::const_iterator it = m_pendingTransientChanges.constFind(contactId);
+    if (it != m_pendingTransientChanges.constEnd())
+        return !it->removed;
+
     return m_transientStore.contains(contactId);
 }
 
 QPair<QDateTime, QList<QContactDetail> > ContactsDatabase::transientDetails(quint32 contactId) const
 {
+    QMutexLocker locker(accessMutex());
+
+    PendingTransientChanges::const_iterator it = m_pendingTransientChanges.constFind(contactId);
+    if (it != m_pendingTransientChanges.constEnd()) {
+        return it->removed ? QPair<QDateTime, QList<QContactDetail> >()
+                           : qMakePair(it->timestamp, it->details);
+    }
+
     return m_transientStore.contactDetails(contactId);
 }
 
+QHash<quint32, QPair<QDateTime, QList<QContactDetail> > > ContactsDatabase::transientDetails(const QList<quint32> &contactIds) const
+{
+    QMutexLocker locker(accessMutex());
+
+    QHash<quint32, QPair<QDateTime, QList<QContactDetail> > > rv(m_transientStore.contactDetails(contactIds));
+    if (!m_pendingTransientChanges.isEmpty()) {
+        foreach (quint32 contactId, contactIds) {
+            PendingTransientChanges::const_iterator it = m_pendingTransientChanges.constFind(contactId);
+            if (it == m_pendingTransientChanges.constEnd()) {
+                continue;
+            }
+            if (it->removed) {
+                rv.remove(contactId);
+            } else {
+                rv.insert(contactId, qMakePair(it->timestamp, it->details));
+            }
+        }
+    }
+    return rv;
+}
+
 bool ContactsDatabase::setTransientDetails(quint32 contactId, const QDateTime &timestamp, const QList<QContactDetail> &details)
 {
-    return m_transientStore.setContactDetails(contactId, timestamp, details);
+    QMutexLocker locker(accessMutex());
+
+    if (m_transactionActive) {
+        PendingTransientDetails &pending(m_pendingTransientChanges[contactId]);
+        pending.removed = false;
+        pending.timestamp = timestamp;
+        pending.details = details;
+        return true;
+    }
+
+    return writeTransientDetails(contactId, timestamp, details);
 }
 
 bool ContactsDatabase::removeTransientDetails(quint32 contactId)
 {
-    return m_transientStore.remove(contactId);
+    QMutexLocker locker(accessMutex());
+
+    if (m_transactionActive) {
+        PendingTransientDetails &pending(m_pendingTransientChanges[contactId]);
+        pending.removed = true;
+        pending.timestamp = QDateTime();
+        pending.details.clear();
+        return true;
+    }
+
+    return eraseTransientDetails(contactId);
 }
 
 bool ContactsDatabase::removeTransientDetails(const QList<quint32> &contactIds)
 {
+    QMutexLocker locker(accessMutex());
+
+    if (m_transactionActive) {
+        foreach (quint32 contactId, contactIds) {
+            removeTransientDetails(contactId);
+        }
+        return true;
+    }
+
     return m_transientStore.remove(contactIds);
 }
 
+bool ContactsDatabase::writeTransientDetails(quint32 contactId, const QDateTime &timestamp, const QList<QContactDetail> &details)
+{
+    const quint64 previousGeneration = (m_temporaryTimestampsGeneration || m_temporaryPresenceGeneration) ? m_transientStore.generation() : 0;
+    if (!m_transientStore.setContactDetails(contactId, timestamp, details))
+        return false;
+
+    if (previousGeneration) {
+        updateTemporaryTransientState(previousGeneration, contactId, timestamp, details);
+    }
+    return true;
+}
+
+bool ContactsDatabase::eraseTransientDetails(quint32 contactId)
+{
+    const quint64 previousGeneration = (m_temporaryTimestampsGeneration || m_temporaryPresenceGeneration) ? m_transientStore.generation() : 0;
+    if (!m_transientStore.remove(contactId))
+        return false;
+
+    if (previousGeneration) {
+        updateTemporaryTransientState(previousGeneration, contactId, QDateTime(), QList<QContactDetail>());
+    }
+    return true;
+}
+
+void ContactsDatabase::applyPendingTransientChanges()
+{
+    QMutexLocker locker(accessMutex());
+
+    const PendingTransientChanges changes(m_pendingTransientChanges);
+    m_pendingTransientChanges.clear();
+
+    for (PendingTransientChanges::const_iterator it = changes.constBegin(); it != changes.constEnd(); ++it) {
+        if (it->removed) {
+            eraseTransientDetails(it.key());
+        } else if (!writeTransientDetails(it.key(), it->timestamp, it->details)) {
+            // The durable data remains visible for this contact
+            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to store committed transient details for contact: %1").arg(it.key()));
+        }
+    }
+}
+
+bool ContactsDatabase::saveTransientSnapshot()
+{
+    if (m_transientSnapshotPath.isEmpty())
+        return false;
+
+    // Nothing to write if no process has modified the store since the last snapshot
+    const quint64 generation = m_transientStore.generation();
+    if (generation != 0 && generation == m_transientSnapshotGeneration)
+        return true;
+
+    if (!m_transientStore.saveSnapshot(m_transientSnapshotPath))
+        return false;
+
+    m_transientSnapshotGeneration = generation;
+    return true;
+}
+
+int ContactsDatabase::transientStoreUtilization() const
+{
+    return m_transientStore.utilization();
+}
+
+int ContactsDatabase::transientStoreFragmentation() const
+{
+    return m_transientStore.fragmentation();
+}
+
 bool ContactsDatabase::execute(QSqlQuery &query)
 {
     static const bool debugSql = !qgetenv("QTCONTACTS_SQLITE_DEBUG_SQL").isEmpty();
@@ -3731,47 +4191,133 @@ bool ContactsDatabase::populateTemporaryTransientState(bool timestamps, bool glo
 
     QMutexLocker locker(accessMutex());
 
+    // Tables already reflecting the current content of the transient store need not be rebuilt
+    const quint64 currentGeneration = m_transientStore.generation();
+    if (currentGeneration != 0) {
+        if (timestamps && m_temporaryTimestampsGeneration == currentGeneration) {
+            timestamps = false;
+        }
+        if (globalPresence && m_temporaryPresenceGeneration == currentGeneration) {
+            globalPresence = false;
+        }
+    }
+    if (!timestamps && !globalPresence) {
+        return true;
+    }
+
     if (timestamps) {
+        m_temporaryTimestampsGeneration = 0;
         ::clearTemporaryContactTimestampTable(*this, m_database, timestampTable);
     }
     if (globalPresence) {
+        m_temporaryPresenceGeneration = 0;
         ::clearTemporaryContactPresenceTable(*this, m_database, presenceTable);
     }
 
     // Find the current temporary states from transient storage
     QList<QPair<quint32, qint64> > presenceValues;
     QList<QPair<quint32, QString> > timestampValues;
+    quint64 populatedGeneration = 0;
 
     {
         ContactsTransientStore::DataLock lock(m_transientStore.dataLock());
+        if (lock) {
+            // No modification can occur while the lock is held
+            populatedGeneration = m_transientStore.generation();
+        }
+
         ContactsTransientStore::const_iterator it = m_transientStore.constBegin(lock), end = m_transientStore.constEnd(lock);
         for ( ; it != end; ++it) {
-            QPair<QDateTime, QList<QContactDetail> > details(it.value());
-            if (details.first.isNull())
+            // Only the entry headers are needed here
+            const QDateTime timestamp(it.timestamp());
+            if (timestamp.isNull())
                 continue;
 
             if (timestamps) {
-                timestampValues.append(qMakePair<quint32, QString>(it.key(), dateTimeString(details.first)));
+                timestampValues.append(qMakePair<quint32, QString>(it.key(), dateTimeString(timestamp)));
             }
 
-            if (globalPresence) {
-                foreach (const QContactDetail &detail, details.second) {
-                    if (detail.type() == QContactGlobalPresence::Type) {
-                        presenceValues.append(qMakePair<quint32, qint64>(it.key(), detail.value<int>(QContactGlobalPresence::FieldPresenceState)));
-                        break;
-                    }
-                }
+            int presenceState;
+            if (globalPresence && it.globalPresenceState(&presenceState)) {
+                presenceValues.append(qMakePair<quint32, qint64>(it.key(), presenceState));
             }
         }
     }
 
-    bool rv = true;
-    if (timestamps && !::createTemporaryContactTimestampTable(*this, m_database, timestampTable, timestampValues)) {
-        rv = false;
-    } else if (globalPresence && !::createTemporaryContactPresenceTable(*this, m_database, presenceTable, presenceValues)) {
-        rv = false;
+    if (timestamps) {
+        if (!::createTemporaryContactTimestampTable(*this, m_database, timestampTable, timestampValues)) {
+            return false;
+        }
+        m_temporaryTimestampsGeneration = populatedGeneration;
+    }
+    if (globalPresence) {
+        if (!::createTemporaryContactPresenceTable(*this, m_database, presenceTable, presenceValues)) {
+            return false;
+        }
+        m_temporaryPresenceGeneration = populatedGeneration;
+    }
+    return true;
+}
+
+void ContactsDatabase::updateTemporaryTransientState(quint64 previousGeneration, quint32 contactId, const QDateTime &timestamp, const QList<QContactDetail> &details)
+{
+    // If our modification was the only one since the temporary tables were populated, they can be
+    // patched to reflect it; otherwise they will be rebuilt when next required
+    const quint64 currentGeneration = m_transientStore.generation();
+    if (currentGeneration == 0 || currentGeneration != previousGeneration + 2)
+        return;
+
+    // Entries without a timestamp are not represented in either table
+    const bool valid = timestamp.isValid();
+
+    if (m_temporaryTimestampsGeneration == previousGeneration) {
+        m_temporaryTimestampsGeneration = 0;
+
+        const QString statement(valid
+                ? QStringLiteral("INSERT OR REPLACE INTO temp.Timestamps (contactId, modified) VALUES (:contactId, :modified)")
+                : QStringLiteral("DELETE FROM temp.Timestamps WHERE contactId = :contactId"));
+        ContactsDatabase::Query query(prepare(statement));
+        query.bindValue(QStringLiteral(":contactId"), contactId);
+        if (valid) {
+            query.bindValue(QStringLiteral(":modified"), dateTimeString(QDateTime::fromMSecsSinceEpoch(timestamp.toMSecsSinceEpoch(), Qt::UTC)));
+        }
+        if (ContactsDatabase::execute(query)) {
+            m_temporaryTimestampsGeneration = currentGeneration;
+        } else {
+            query.reportError(QString::fromLatin1("Failed to update temporary timestamp for contact %1").arg(contactId));
+        }
+    }
+
+    if (m_temporaryPresenceGeneration == previousGeneration) {
+        m_temporaryPresenceGeneration = 0;
+
+        bool hasPresence = false;
+        int presenceState = 0;
+        if (valid) {
+            for (const QContactDetail &detail : details) {
+                if (detail.type() == QContactGlobalPresence::Type) {
+                    hasPresence = true;
+                    presenceState = detail.value<int>(QContactGlobalPresence::FieldPresenceState);
+                    break;
+                }
+            }
+        }
+
+        const QString statement(hasPresence
+                ? QStringLiteral("INSERT OR REPLACE INTO temp.GlobalPresenceStates (contactId, presenceState, isOnline) VALUES (:contactId, :presenceState, :isOnline)")
+                : QStringLiteral("DELETE FROM temp.GlobalPresenceStates WHERE contactId = :contactId"));
+        ContactsDatabase::Query query(prepare(statement));
+        query.bindValue(QStringLiteral(":contactId"), contactId);
+        if (hasPresence) {
+            query.bindValue(QStringLiteral(":presenceState"), presenceState);
+            query.bindValue(QStringLiteral(":isOnline"), presenceState >= QContactPresence::PresenceAvailable && presenceState <= QContactPresence::PresenceExtendedAway);
+        }
+        if (ContactsDatabase::execute(query)) {
+            m_temporaryPresenceGeneration = currentGeneration;
+        } else {
+            query.reportError(QString::fromLatin1("Failed to update temporary presence state for contact %1").arg(contactId));
+        }
     }
-    return rv;
 }
 
 QString ContactsDatabase::dateTimeString(const QDateTime &qdt)
@@ -3820,9 +4366,309 @@ QDateTime ContactsDatabase::fromDateTimeString(const QString &s)
     return QDateTime(datepart, timepart, Qt::UTC);
 }
 
+QByteArray ContactsDatabase::packJournalValues(const QList<quint32> &values)
+{
+    QByteArray data(values.count() * sizeof(quint32), Qt::Uninitialized);
+    uchar *p = reinterpret_cast<uchar *>(data.data());
+    foreach (quint32 value, values) {
+        qToLittleEndian(value, p);
+        p += sizeof(quint32);
+    }
+    return data;
+}
+
+QList<quint32> ContactsDatabase::unpackJournalValues(const QByteArray &data)
+{
+    QList<quint32> values;
+    const int count = data.size() / sizeof(quint32);
+    values.reserve(count);
+
+    const uchar *p = reinterpret_cast<const uchar *>(data.constData());
+    for (int i = 0; i < count; ++i, p += sizeof(quint32)) {
+        values.append(qFromLittleEndian<quint32>(p));
+    }
+    return values;
+}
+
+quint64 ContactsDatabase::changeJournalHorizon()
+{
+    ContactsDatabase::Query query(prepare("SELECT value FROM DbSettings WHERE name = 'ChangeJournalHorizon'"));
+    if (!execute(query)) {
+        query.reportError("Failed to query change journal horizon");
+        return 0;
+    }
+    const quint64 horizon = query.next() ? query.value<quint64>(0) : 0;
+    query.finish();
+    return horizon;
+}
+
+bool ContactsDatabase::setChangeJournalHorizon(quint64 sequence)
+{
+    ContactsDatabase::Query query(prepare("INSERT OR REPLACE INTO DbSettings (name, value) VALUES ('ChangeJournalHorizon', :value)"));
+    query.bindValue(QStringLiteral(":value"), QString::number(sequence));
+    if (!execute(query)) {
+        query.reportError("Failed to store change journal horizon");
+        return false;
+    }
+    query.finish();
+    return true;
+}
+
+static QString oobDictionaryName(quint32 id)
+{
+    return QStringLiteral("OOBDictionary:%1").arg(id);
+}
+
+static QString oobScopeDictionaryName(const QString &scope)
+{
+    return QStringLiteral("OOBScopeDictionary:") + scope;
+}
+
+bool ContactsDatabase::loadOOBDictionary(quint32 id)
+{
+    if (m_oobCodec.hasDictionary(id))
+        return true;
+
+    ContactsDatabase::Query query(prepare("SELECT value FROM DbSettings WHERE name = :name"));
+    query.bindValue(QStringLiteral(":name"), oobDictionaryName(id));
+    if (!execute(query)) {
+        query.reportError("Failed to query OOB dictionary");
+        return false;
+    }
+    if (!query.next()) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("OOB dictionary not found: %1").arg(id));
+        return false;
+    }
+
+    const QByteArray dictionary(query.value<QByteArray>(0));
+    query.finish();
+    return m_oobCodec.addDictionary(dictionary);
+}
+
+quint32 ContactsDatabase::oobDictionary(const QString &scope)
+{
+    if (!OOBCodec::isAvailable(OOBCodec::ZstdDictionary))
+        return 0;
+
+    ContactsDatabase::Query query(prepare("SELECT value FROM DbSettings WHERE name = :name"));
+    query.bindValue(QStringLiteral(":name"), oobScopeDictionaryName(scope));
+    if (!execute(query)) {
+        query.reportError("Failed to query OOB scope dictionary");
+        return 0;
+    }
+    if (!query.next())
+        return 0;
+
+    const quint32 id = query.value<quint32>(0);
+    query.finish();
+    return loadOOBDictionary(id) ? id : 0;
+}
+
+bool ContactsDatabase::storeOOBDictionary(const QString &scope, const QByteArray &dictionary)
+{
+    const quint32 id = OOBCodec::dictionaryId(dictionary);
+    if (id == 0 || !m_oobCodec.addDictionary(dictionary))
+        return false;
+
+    // A replaced dictionary is retained while values compressed with it remain
+    ContactsDatabase::Query query(prepare("INSERT OR REPLACE INTO DbSettings (name, value) VALUES (:name, :value)"));
+    query.bindValue(QStringLiteral(":name"), oobDictionaryName(id));
+    query.bindValue(QStringLiteral(":value"), dictionary);
+    if (!execute(query)) {
+        query.reportError("Failed to store OOB dictionary");
+        return false;
+    }
+    query.finish();
+
+    query.bindValue(QStringLiteral(":name"), oobScopeDictionaryName(scope));
+    query.bindValue(QStringLiteral(":value"), QString::number(id));
+    if (!execute(query)) {
+        query.reportError("Failed to store OOB scope dictionary");
+        return false;
+    }
+    query.finish();
+
+    return removeUnusedOOBDictionaries();
+}
+
+bool ContactsDatabase::removeOOBScopeDictionary(const QString &scope)
+{
+    ContactsDatabase::Query query(prepare("DELETE FROM DbSettings WHERE name = :name"));
+    query.bindValue(QStringLiteral(":name"), oobScopeDictionaryName(scope));
+    if (!execute(query)) {
+        query.reportError("Failed to remove OOB scope dictionary");
+        return false;
+    }
+    query.finish();
+
+    return removeUnusedOOBDictionaries();
+}
+
+bool ContactsDatabase::removeUnusedOOBDictionaries()
+{
+    // Dictionaries are used by the scopes they are assigned to, and by the values compressed with them
+    QSet<quint32> usedIds;
+    {
+        ContactsDatabase::Query query(prepare("SELECT value FROM DbSettings WHERE substr(name, 1, 19) = 'OOBScopeDictionary:'"));
+        if (!execute(query)) {
+            query.reportError("Failed to query OOB scope dictionaries");
+            return false;
+        }
+        while (query.next()) {
+            usedIds.insert(query.value<quint32>(0));
+        }
+        query.finish();
+    }
+    {
+        // The dictionary ID is stored in the frame header, which is at most 18 bytes
+        ContactsDatabase::Query query(prepare("SELECT substr(value, 1, 18) FROM OOB WHERE (compressed >> :codecShift) = :codec"));
+        query.bindValue(QStringLiteral(":codecShift"), static_cast<int>(OOBCodecShift));
+        query.bindValue(QStringLiteral(":codec"), static_cast<int>(OOBCodec::ZstdDictionary));
+        if (!execute(query)) {
+            query.reportError("Failed to query dictionary-compressed OOB values");
+            return false;
+        }
+        while (query.next()) {
+            usedIds.insert(OOBCodec::frameDictionaryId(query.value<QByteArray>(0)));
+        }
+        query.finish();
+    }
+
+    QStringList unusedNames;
+    {
+        ContactsDatabase::Query query(prepare("SELECT name FROM DbSettings WHERE substr(name, 1, 14) = 'OOBDictionary:'"));
+        if (!execute(query)) {
+            query.reportError("Failed to query OOB dictionaries");
+            return false;
+        }
+        while (query.next()) {
+            const QString name(query.value<QString>(0));
+            if (!usedIds.contains(name.mid(14).toUInt())) {
+                unusedNames.append(name);
+            }
+        }
+        query.finish();
+    }
+
+    if (!unusedNames.isEmpty()) {
+        ContactsDatabase::Query query(prepare("DELETE FROM DbSettings WHERE name = :name"));
+        foreach (const QString &name, unusedNames) {
+            query.bindValue(QStringLiteral(":name"), name);
+            if (!execute(query)) {
+                query.reportError("Failed to remove OOB dictionary");
+                return false;
+            }
+            query.finish();
+        }
+    }
+    return true;
+}
+
+bool ContactsDatabase::decodeOOBValue(const QByteArray &stored, quint32 encoding, QByteArray *data)
+{
+    const quint32 form = oobEncodingForm(encoding);
+    const OOBCodec::Codec codec = oobEncodingCodec(encoding);
+
+    if (form == OOBChunkedBytes)
+        return decodeOOBChunks(stored, codec, data);
+
+    if (form != OOBCompressedBytes && form != OOBCompressedString) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Invalid OOB encoding: %1").arg(encoding));
+        return false;
+    }
+
+    if (codec == OOBCodec::ZstdDictionary && !loadOOBDictionary(OOBCodec::frameDictionaryId(stored)))
+        return false;
+
+    return m_oobCodec.decompress(codec, stored, data);
+}
+
+QString ContactsDatabase::oobScopeCondition(const QString &scope)
+{
+    if (!scope.contains(QChar::fromLatin1(':')))
+        return QStringLiteral("scope = :scope");
+
+    return QStringLiteral("(scope = :scope OR (scope = :migratedScope AND substr(name, 1, :prefixLength) = :prefix))");
+}
+
+void ContactsDatabase::bindOOBScope(Query &query, const QString &scope)
+{
+    query.bindValue(QStringLiteral(":scope"), scope);
+
+    const int separator = scope.indexOf(QChar::fromLatin1(':'));
+    if (separator != -1) {
+        query.bindValue(QStringLiteral(":migratedScope"), scope.left(separator));
+        query.bindValue(QStringLiteral(":prefixLength"), scope.length() + 1);
+        query.bindValue(QStringLiteral(":prefix"), scope + QChar::fromLatin1(':'));
+    }
+}
+
+QByteArray ContactsDatabase::encodeOOBChunk(OOBCodec &codecs, const QByteArray &data, OOBCodec::Codec codec, bool compress)
+{
+    QByteArray stored;
+    if (compress) {
+        stored = codecs.compress(codec, data);
+    }
+    if (stored.isEmpty() || stored.size() >= data.size()) {
+        // Chunks which do not compress are stored as they are
+        stored = data;
+    }
+
+    QByteArray chunk(OOBChunkHeaderSize, Qt::Uninitialized);
+    uchar *p = reinterpret_cast<uchar *>(chunk.data());
+    qToLittleEndian<quint32>(stored.size(), p);
+    qToLittleEndian<quint32>(data.size(), p + sizeof(quint32));
+    chunk.append(stored);
+    return chunk;
+}
+
+bool ContactsDatabase::decodeOOBChunkHeader(const char *header, quint32 *storedLength, quint32 *length)
+{
+    const uchar *p = reinterpret_cast<const uchar *>(header);
+    *storedLength = qFromLittleEndian<quint32>(p);
+    *length = qFromLittleEndian<quint32>(p + sizeof(quint32));
+    return *storedLength <= *length;
+}
+
+QByteArray ContactsDatabase::decodeOOBChunk(const QByteArray &stored, quint32 length, OOBCodec::Codec codec)
+{
+    if (static_cast<quint32>(stored.size()) == length)
+        return stored;
+
+    QByteArray data;
+    if (!m_oobCodec.decompress(codec, stored, &data) || static_cast<quint32>(data.size()) != length) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Invalid OOB chunk: %1 bytes, expected %2").arg(data.size()).arg(length));
+        return QByteArray();
+    }
+    return data;
+}
+
+bool ContactsDatabase::decodeOOBChunks(const QByteArray &encoded, OOBCodec::Codec codec, QByteArray *decoded)
+{
+    int offset = 0;
+    while (offset < encoded.size()) {
+        quint32 storedLength = 0;
+        quint32 length = 0;
+        if (encoded.size() - offset < static_cast<int>(OOBChunkHeaderSize)
+                || !decodeOOBChunkHeader(encoded.constData() + offset, &storedLength, &length)
+                || encoded.size() - offset - OOBChunkHeaderSize < storedLength) {
+            return false;
+        }
+        offset += OOBChunkHeaderSize;
+
+        const QByteArray data(decodeOOBChunk(encoded.mid(offset, storedLength), length, codec));
+        if (data.size() != static_cast<int>(length))
+            return false;
+
+        decoded->append(data);
+        offset += storedLength;
+    }
+    return true;
+}
+
 void ContactsDatabase::regenerateDisplayLabelGroups()
 {
-    if (!beginTransaction()) {
+    if (!beginTransaction(QtContactsSqliteExtensions::ContactManagerEngine::UpgradeLockSite)) {
         qWarning() << "Unable to begin transaction to regenerate display label groups";
     } else {
         bool changed = false;
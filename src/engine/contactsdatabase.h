@@ -35,12 +35,15 @@
 
 #include "semaphore_p.h"
 #include "contactstransientstore.h"
+#include "oobcodec_p.h"
+#include "../extensions/contactmanagerengine.h"
 #include "../extensions/displaylabelgroupgenerator.h"
 
 #ifdef HAS_MLITE
 #include <mgconfitem.h>
 #endif
 
+#include <QElapsedTimer>
 #include <QHash>
 #include <QMutex>
 #include <QScopedPointer>
@@ -52,6 +55,8 @@
 
 #include <QContact>
 
+struct sqlite3_blob;
+
 class ContactsEngine;
 class ContactsDatabase
 {
@@ -74,6 +79,34 @@ public:
         IsDeleted = 4
     };
 
+    enum CheckpointMode {
+        PassiveCheckpoint,
+        TruncateCheckpoint
+    };
+
+    // The forms of OOB values, recorded in the low bits of the 'compressed' column.  The codec
+    // of compressed forms is recorded above them; rows stored before the codec was recorded
+    // have codec zero, which is zlib.
+    enum OOBEncoding {
+        OOBUncompressed = 0,
+        OOBCompressedBytes = 1,
+        OOBCompressedString = 2,
+        // A sequence of chunks, each optionally compressed, which can be read incrementally
+        OOBChunkedBytes = 3
+    };
+
+    enum {
+        OOBChunkSize = 64 * 1024,
+        // The stored and uncompressed lengths of the chunk, little-endian
+        OOBChunkHeaderSize = 2 * sizeof(quint32),
+        OOBFormMask = 0xf,
+        OOBCodecShift = 4
+    };
+
+    static quint32 oobEncoding(OOBEncoding form, OOBCodec::Codec codec) { return form | (codec << OOBCodecShift); }
+    static quint32 oobEncodingForm(quint32 encoding) { return encoding & OOBFormMask; }
+    static OOBCodec::Codec oobEncodingCodec(quint32 encoding) { return static_cast<OOBCodec::Codec>(encoding >> OOBCodecShift); }
+
     class ProcessMutex
     {
         Semaphore m_semaphore;
@@ -90,6 +123,24 @@ public:
         bool isInitialProcess() const;
     };
 
+    // Identifies the state of the stored data, as changed by commits of other connections,
+    // and of the transient store
+    struct DataRevision
+    {
+        DataRevision() : dataVersion(-1), transientGeneration(0) {}
+
+        qint64 dataVersion;
+        quint64 transientGeneration;
+
+        // An unknown revision matches no other revision
+        bool operator==(const DataRevision &other) const
+        {
+            return dataVersion != -1 && dataVersion == other.dataVersion
+                && transientGeneration == other.transientGeneration;
+        }
+        bool operator!=(const DataRevision &other) const { return !(*this == other); }
+    };
+
     // This class is required to finish() each query at destruction
     class Query
     {
@@ -125,6 +176,30 @@ public:
         void reportError(const char *text) const;
     };
 
+    // Incremental access to a BLOB value, which is valid until it is closed or its row is modified
+    // through this connection.  Must be used with the access mutex held.
+    class Blob
+    {
+        friend class ContactsDatabase;
+
+        sqlite3_blob *m_blob;
+        qint64 m_size;
+
+    public:
+        Blob() : m_blob(0), m_size(0) {}
+        ~Blob() { close(); }
+
+        bool isOpen() const { return m_blob != 0; }
+        qint64 size() const { return m_size; }
+
+        bool read(char *data, int length, qint64 offset);
+        bool write(const char *data, int length, qint64 offset);
+        void close();
+
+    private:
+        Q_DISABLE_COPY(Blob)
+    };
+
     ContactsDatabase(ContactsEngine *engine);
     ~ContactsDatabase();
 
@@ -143,10 +218,24 @@ public:
     bool aggregating() const;
     bool localized() const;
 
-    bool beginTransaction();
+    typedef QtContactsSqliteExtensions::ContactManagerEngine::WriteLockSite WriteLockSite;
+
+    bool beginTransaction(WriteLockSite site = QtContactsSqliteExtensions::ContactManagerEngine::SaveLockSite);
     bool commitTransaction();
     bool rollbackTransaction();
 
+    // Savepoints may only be used within a transaction
+    bool setSavepoint(const QString &name);
+    bool releaseSavepoint(const QString &name);
+    bool rollbackToSavepoint(const QString &name);
+
+    bool checkpoint(CheckpointMode mode);
+    qint64 walSize() const;
+
+    DataRevision dataRevision();
+
+    bool openBlob(Blob *blob, const char *table, const char *column, qint64 rowId, bool writable);
+
     bool createTemporaryContactIdsTable(const QString &table, const QVariantList &boundIds, int limit = 0);
     bool createTemporaryContactIdsTable(const QString &table, const QString &join, const QString &where, const QString &orderBy, const QVariantList &boundValues, int limit = 0);
     bool createTemporaryContactIdsTable(const QString &table, const QString &join, const QString &where, const QString &orderBy, const QMap<QString, QVariant> &boundValues, int limit = 0);
@@ -164,14 +253,23 @@ public:
     Query prepare(const char *statement);
     Query prepare(const QString &statement);
 
+    // Transient store changes made within a transaction are visible through this
+    // connection immediately, but only written to the store when the transaction commits
     bool hasTransientDetails(quint32 contactId);
 
     QPair<QDateTime, QList<QContactDetail> > transientDetails(quint32 contactId) const;
+    QHash<quint32, QPair<QDateTime, QList<QContactDetail> > > transientDetails(const QList<quint32> &contactIds) const;
     bool setTransientDetails(quint32 contactId, const QDateTime &timestamp, const QList<QContactDetail> &details);
 
     bool removeTransientDetails(quint32 contactId);
     bool removeTransientDetails(const QList<quint32> &contactIds);
 
+    // Writes the transient store to the snapshot file, if snapshots are enabled and the store has changed
+    bool saveTransientSnapshot();
+
+    int transientStoreUtilization() const;
+    int transientStoreFragmentation() const;
+
     void regenerateDisplayLabelGroups();
     QString displayLabelGroupPreferredProperty() const;
     QString determineDisplayLabelGroup(const QContact &c, bool *emitDisplayLabelGroupChange = Q_NULLPTR);
@@ -192,16 +290,85 @@ public:
     // Output is UTC
     static QDateTime fromDateTimeString(const QString &s);
 
+    // Packed representation of the id and detail type lists stored in the ChangeJournal table
+    static QByteArray packJournalValues(const QList<quint32> &values);
+    static QList<quint32> unpackJournalValues(const QByteArray &data);
+
+    // The sequence up to which change journal entries have been discarded, or zero if none have
+    quint64 changeJournalHorizon();
+    // Must be called within a write transaction
+    bool setChangeJournalHorizon(quint64 sequence);
+
+    // The condition selecting the OOB rows of a scope, whose values are bound by bindOOBScope().
+    // Rows stored before the scope column was added were assigned the part of their name preceding
+    // the first ':', so for a scope containing ':' those rows are also selected by name
+    static QString oobScopeCondition(const QString &scope);
+    static void bindOOBScope(Query &query, const QString &scope);
+
+    // Compression of OOB values; must be used with the access mutex held
+    OOBCodec &oobCodec() { return m_oobCodec; }
+
+    // The dictionary with which small values of the scope are compressed, or zero if there is none
+    quint32 oobDictionary(const QString &scope);
+    // Must be called within a write transaction.  Dictionaries which are neither assigned to a scope
+    // nor used by any stored value are removed when a dictionary is replaced or unassigned
+    bool storeOOBDictionary(const QString &scope, const QByteArray &dictionary);
+    bool removeOOBScopeDictionary(const QString &scope);
+    bool removeUnusedOOBDictionaries();
+
+    // Yields the bytes of a compressed or chunked value; string values are UTF-8
+    bool decodeOOBValue(const QByteArray &stored, quint32 encoding, QByteArray *data);
+
+    // Chunks of OOBChunkedBytes values
+    static QByteArray encodeOOBChunk(OOBCodec &codecs, const QByteArray &data, OOBCodec::Codec codec, bool compress);
+    static bool decodeOOBChunkHeader(const char *header, quint32 *storedLength, quint32 *length);
+    QByteArray decodeOOBChunk(const QByteArray &stored, quint32 length, OOBCodec::Codec codec);
+    bool decodeOOBChunks(const QByteArray &encoded, OOBCodec::Codec codec, QByteArray *decoded);
+
 private:
+    bool lockProcessMutex(WriteLockSite site);
+    void unlockProcessMutex();
+
+    void updateTemporaryTransientState(quint64 previousGeneration, quint32 contactId, const QDateTime &timestamp, const QList<QContactDetail> &details);
+
+    struct PendingTransientDetails
+    {
+        PendingTransientDetails() : removed(false) {}
+
+        bool removed;
+        QDateTime timestamp;
+        QList<QContactDetail> details;
+    };
+    typedef QHash<quint32, PendingTransientDetails> PendingTransientChanges;
+
+    bool writeTransientDetails(quint32 contactId, const QDateTime &timestamp, const QList<QContactDetail> &details);
+    bool eraseTransientDetails(quint32 contactId);
+    void applyPendingTransientChanges();
+
+    bool loadOOBDictionary(quint32 id);
+
     ContactsEngine *m_engine;
     QSqlDatabase m_database;
     ContactsTransientStore m_transientStore;
+    // The transient store generations reflected by the temporary Timestamps and GlobalPresenceStates tables
+    quint64 m_temporaryTimestampsGeneration;
+    quint64 m_temporaryPresenceGeneration;
+    QString m_transientSnapshotPath;
+    quint64 m_transientSnapshotGeneration;
+    bool m_transactionActive;
+    PendingTransientChanges m_pendingTransientChanges;
+    // The pending transient changes at each open savepoint, restored if it is rolled back
+    QVector<PendingTransientChanges> m_savepointTransientChanges;
     QMutex m_mutex;
     mutable QScopedPointer<ProcessMutex> m_processMutex;
+    QElapsedTimer m_writeLockTimer;
+    qint64 m_writeLockWaitTime;
+    WriteLockSite m_writeLockSite;
     bool m_nonprivileged;
     bool m_autoTest;
     QString m_localeName;
     QHash<QString, QSqlQuery> m_preparedQueries;
+    OOBCodec m_oobCodec;
     QVector<QtContactsSqliteExtensions::DisplayLabelGroupGenerator*> m_dlgGenerators;
     QScopedPointer<QtContactsSqliteExtensions::DisplayLabelGroupGenerator> m_defaultGenerator;
     QMap<QString, int> m_knownDisplayLabelGroupsSortValues;
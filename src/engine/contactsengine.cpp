@@ -46,6 +46,7 @@
 #include "qcontactchangessaverequest_p.h"
 #include "qcontactclearchangeflagsrequest_p.h"
 #include "displaylabelgroupgenerator.h"
+#include "qcontactoriginmetadata.h"
 
 #include <QCoreApplication>
 #include <QMutex>
@@ -73,11 +74,14 @@
 #include <QtContacts/QContactRingtone>
 #include <QtContacts/QContactPresence>
 #include <QtContacts/QContactGlobalPresence>
+#include <QtContacts/QContactOnlineAccount>
 #include <QtContacts/QContactName>
 // -----------------------------------
 
 #include <QtDebug>
 
+#include <limits>
+
 class Job
 {
 public:
@@ -114,6 +118,12 @@ public:
     virtual void clear() = 0;
 
     virtual void execute(ContactReader *reader, WriterProxy &writer) = 0;
+
+    // Jobs which only write contact data may be executed together within a single transaction
+    virtual bool groupable() const { return false; }
+    virtual void executeGrouped(ContactReader *reader, WriterProxy &writer) { execute(reader, writer); }
+    virtual void revert() {}
+
     virtual void update(QMutex *) {}
     virtual void updateState(QContactAbstractRequest::State state) = 0;
     virtual void setError(QContactManager::Error) {}
@@ -176,6 +186,35 @@ public:
         m_error = writer->save(&m_contacts, m_definitionMask, 0, &m_errorMap, false, false, false);
     }
 
+    bool groupable() const override
+    {
+        return true;
+    }
+
+    void executeGrouped(ContactReader *, WriterProxy &writer) override
+    {
+        m_unsavedIndexes.clear();
+        for (int i = 0; i < m_contacts.count(); ++i) {
+            if (ContactId::databaseId(m_contacts.at(i)) == 0) {
+                m_unsavedIndexes.append(i);
+            }
+        }
+
+        m_error = writer->save(&m_contacts, m_definitionMask, 0, &m_errorMap, true, false, false);
+    }
+
+    void revert() override
+    {
+        // Any contacts we 'added' are not actually added - clear their IDs
+        foreach (int i, m_unsavedIndexes) {
+            QContact &contact = m_contacts[i];
+            if (!contact.id().isNull()) {
+                contact.setId(QContactId());
+                m_errorMap.insert(i, QContactManager::UnspecifiedError);
+            }
+        }
+    }
+
     void updateState(QContactAbstractRequest::State state) override
     {
          QContactManagerEngine::updateContactSaveRequest(
@@ -195,6 +234,7 @@ private:
     QList<QContact> m_contacts;
     ContactWriter::DetailList m_definitionMask;
     QMap<int, QContactManager::Error> m_errorMap;
+    QList<int> m_unsavedIndexes;
 };
 
 class ContactRemoveJob : public TemplateJob<QContactRemoveRequest>
@@ -212,6 +252,17 @@ public:
         m_error = writer->remove(m_contactIds, &m_errorMap, false, false);
     }
 
+    bool groupable() const override
+    {
+        return true;
+    }
+
+    void executeGrouped(ContactReader *, WriterProxy &writer) override
+    {
+        m_errorMap.clear();
+        m_error = writer->remove(m_contactIds, &m_errorMap, true, false);
+    }
+
     void updateState(QContactAbstractRequest::State state) override
     {
         QContactManagerEngine::updateContactRemoveRequest(
@@ -548,6 +599,16 @@ public:
         m_error = writer->save(m_relationships, &m_errorMap, false, false);
     }
 
+    bool groupable() const override
+    {
+        return true;
+    }
+
+    void executeGrouped(ContactReader *, WriterProxy &writer) override
+    {
+        m_error = writer->save(m_relationships, &m_errorMap, true, false);
+    }
+
     void updateState(QContactAbstractRequest::State state) override
     {
          QContactManagerEngine::updateRelationshipSaveRequest(
@@ -579,6 +640,16 @@ public:
         m_error = writer->remove(m_relationships, &m_errorMap, false);
     }
 
+    bool groupable() const override
+    {
+        return true;
+    }
+
+    void executeGrouped(ContactReader *, WriterProxy &writer) override
+    {
+        m_error = writer->remove(m_relationships, &m_errorMap, true);
+    }
+
     void updateState(QContactAbstractRequest::State state) override
     {
         QContactManagerEngine::updateRelationshipRemoveRequest(
@@ -752,12 +823,15 @@ private:
     QList<QContactCollection> m_unmodifiedCollections;
 };
 
-class ContactChangesFetchJob : public TemplateJob<QContactChangesFetchRequest>
+class ContactChangesFetchJob
+        : public TemplateJob<QContactChangesFetchRequest>
+        , public QtContactsSqliteExtensions::ContactManagerEngine::ContactChangesReceiver
 {
 public:
     ContactChangesFetchJob(QContactChangesFetchRequest *request, QContactChangesFetchRequestPrivate *d)
         : TemplateJob(request)
         , m_collectionId(d->collectionId)
+        , m_unmodifiedMetadataOnly(d->unmodifiedContactsMetadataOnly)
         , m_addedContacts(d->addedContacts)
         , m_modifiedContacts(d->modifiedContacts)
         , m_removedContacts(d->removedContacts)
@@ -767,12 +841,33 @@ public:
 
     void execute(ContactReader *, WriterProxy &writer) override
     {
-        m_error = writer->fetchContactChanges(
-                m_collectionId,
-                &m_addedContacts,
-                &m_modifiedContacts,
-                &m_removedContacts,
-                &m_unmodifiedContacts);
+        if (m_unmodifiedMetadataOnly) {
+            // Read in pages, so the write lock is not held while the contacts are read
+            m_error = writer->fetchContactChanges(
+                    m_collectionId,
+                    ContactChangesBatchSize,
+                    QtContactsSqliteExtensions::ContactManagerEngine::UnmodifiedContactMetadata,
+                    this);
+        } else {
+            m_error = writer->fetchContactChanges(
+                    m_collectionId,
+                    &m_addedContacts,
+                    &m_modifiedContacts,
+                    &m_removedContacts,
+                    &m_unmodifiedContacts);
+        }
+    }
+
+    bool contactChangesAvailable(const QList<QContact> &addedContacts,
+                                 const QList<QContact> &modifiedContacts,
+                                 const QList<QContact> &deletedContacts,
+                                 const QList<QContact> &unmodifiedContacts) override
+    {
+        m_addedContacts.append(addedContacts);
+        m_modifiedContacts.append(modifiedContacts);
+        m_removedContacts.append(deletedContacts);
+        m_unmodifiedContacts.append(unmodifiedContacts);
+        return true;
     }
 
     void updateState(QContactAbstractRequest::State state) override
@@ -801,7 +896,10 @@ public:
     }
 
 private:
+    enum { ContactChangesBatchSize = 500 };
+
     const QContactCollectionId m_collectionId;
+    const bool m_unmodifiedMetadataOnly;
     QList<QContact> m_addedContacts;
     QList<QContact> m_modifiedContacts;
     QList<QContact> m_removedContacts;
@@ -960,8 +1058,45 @@ private:
     const QList<QContactId> m_contactIds;
 };
 
+// Marks the point in the queue at which accumulated notifications are emitted; it has no request
+class FlushNotificationsJob : public Job
+{
+public:
+    QObject *request() override
+    {
+        return 0;
+    }
+
+    void clear() override
+    {
+    }
+
+    void execute(ContactReader *, WriterProxy &writer) override
+    {
+        writer.notifier.flush();
+    }
+
+    void updateState(QContactAbstractRequest::State) override
+    {
+    }
+
+    QString description() const override
+    {
+        QString s(QLatin1String("Flush Notifications"));
+        return s;
+    }
+
+    QContactManager::Error error() const override
+    {
+        return QContactManager::NoError;
+    }
+};
+
 class JobThread : public QThread
 {
+    // The maximum number of write jobs which are committed together
+    enum { MaximumGroupedJobs = 32 };
+
     struct MutexUnlocker {
         QMutexLocker &m_locker;
 
@@ -983,6 +1118,10 @@ public:
         , m_databaseUuid(databaseUuid)
         , m_updatePending(false)
         , m_running(false)
+        , m_checkpointPending(false)
+        , m_snapshotPending(false)
+        , m_notifier(0)
+        , m_holdingJobs(false)
         , m_nonprivileged(nonprivileged)
         , m_autoTest(autoTest)
     {
@@ -1006,6 +1145,9 @@ public:
     }
 
     void run();
+    void executeGroup(const QList<Job*> &jobs, ContactReader *reader, Job::WriterProxy &writer);
+    void checkpoint(bool idle);
+    void snapshot(bool idle);
 
     bool databaseOpen() const
     {
@@ -1017,9 +1159,58 @@ public:
         return m_nonprivileged;
     }
 
+    void scheduleCheckpoint()
+    {
+        // Restart the idle period after which the checkpoint is performed
+        QMutexLocker locker(&m_mutex);
+        m_checkpointPending = true;
+        m_wait.wakeOne();
+    }
+
+    void scheduleSnapshot()
+    {
+        // The transient store may have been modified, by this or another process
+        QMutexLocker locker(&m_mutex);
+        if (!m_snapshotPending) {
+            m_snapshotPending = true;
+            m_wait.wakeOne();
+        }
+    }
+
+    void flushNotifications()
+    {
+        // Notifications are flushed once the jobs already queued are complete
+        enqueue(new FlushNotificationsJob);
+    }
+
+    void flushHeldNotifications()
+    {
+        // The notifier is not destroyed while we hold the mutex
+        QMutexLocker locker(&m_mutex);
+        if (m_notifier) {
+            m_notifier->flush();
+        }
+    }
+
+    void setHoldingJobs(bool holding)
+    {
+        // Jobs enqueued while holding are only made pending together, once released
+        QMutexLocker locker(&m_mutex);
+        m_holdingJobs = holding;
+        if (!holding && !m_heldJobs.isEmpty()) {
+            m_pendingJobs.append(m_heldJobs);
+            m_heldJobs.clear();
+            m_wait.wakeOne();
+        }
+    }
+
     void enqueue(Job *job)
     {
         QMutexLocker locker(&m_mutex);
+        if (Q_UNLIKELY(m_holdingJobs)) {
+            m_heldJobs.append(job);
+            return;
+        }
         m_pendingJobs.append(job);
         m_wait.wakeOne();
     }
@@ -1035,11 +1226,26 @@ public:
             }
         }
 
+        for (QList<Job*>::iterator it = m_heldJobs.begin(); it != m_heldJobs.end(); it++) {
+            if ((*it)->request() == request) {
+                delete *it;
+                m_heldJobs.erase(it);
+                return true;
+            }
+        }
+
         if (m_currentJob && m_currentJob->request() == request) {
             m_currentJob->clear();
             return false;
         }
 
+        for (QList<Job*>::iterator it = m_groupedJobs.begin(); it != m_groupedJobs.end(); it++) {
+            if ((*it)->request() == request) {
+                (*it)->clear();
+                return false;
+            }
+        }
+
         for (QList<Job*>::iterator it = m_finishedJobs.begin(); it != m_finishedJobs.end(); it++) {
             if ((*it)->request() == request) {
                 delete *it;
@@ -1067,6 +1273,13 @@ public:
                 return true;
             }
         }
+        for (QList<Job*>::iterator it = m_heldJobs.begin(); it != m_heldJobs.end(); it++) {
+            if ((*it)->request() == request) {
+                m_cancelledJobs.append(*it);
+                m_heldJobs.erase(it);
+                return true;
+            }
+        }
         return false;
     }
 
@@ -1081,11 +1294,18 @@ public:
             QMutexLocker locker(&m_mutex);
             for (;;) {
                 bool pendingJob = false;
-                if (m_currentJob && m_currentJob->request() == request) {
+                if ((m_currentJob && m_currentJob->request() == request) || isGrouped(request)) {
                     QTCONTACTS_SQLITE_DEBUG(QString::fromLatin1("Wait for current job: %1 ms").arg(timeout));
                     // wait for the current job to updateState.
+                    QElapsedTimer timer;
+                    timer.start();
                     if (!m_finishedWait.wait(&m_mutex, timeout))
                         return false;
+                    // a grouped job is only finished once the entire group is committed
+                    timeout -= timer.elapsed();
+                    if (timeout <= 0)
+                        return false;
+                    pendingJob = isGrouped(request);
                 } else for (int i = 0; i < m_pendingJobs.size(); i++) {
                     Job *job = m_pendingJobs[i];
                     if (job->request() == request) {
@@ -1132,6 +1352,16 @@ public:
         return false;
     }
 
+    bool isGrouped(QObject *request) const
+    {
+        foreach (Job *job, m_groupedJobs) {
+            if (job->request() == request) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     void postUpdate()
     {
         if (!m_updatePending) {
@@ -1201,8 +1431,10 @@ public:
 private:
     QMutex m_mutex;
     QWaitCondition m_wait;
-    QWaitCondition m_finishedWait;
     QList<Job*> m_pendingJobs;
+    QList<Job*> m_heldJobs;
+    QList<Job*> m_pendingJobs;
+    QList<Job*> m_groupedJobs;
     QList<Job*> m_finishedJobs;
     QList<Job*> m_cancelledJobs;
     Job *m_currentJob;
@@ -1211,8 +1443,14 @@ private:
     QString m_databaseUuid;
     bool m_updatePending;
     bool m_running;
+    bool m_checkpointPending;
+    bool m_snapshotPending;
+    ContactNotifier *m_notifier;
+    bool m_holdingJobs;
     bool m_nonprivileged;
     bool m_autoTest;
+    QElapsedTimer m_checkpointTimer;
+    QElapsedTimer m_snapshotTimer;
 };
 
 class JobContactReader : public ContactReader
@@ -1273,13 +1511,62 @@ void JobThread::run()
             }
         }
     } else {
-        ContactNotifier notifier(m_nonprivileged);
+        ContactNotifier notifier(m_nonprivileged, m_engine->notificationInterval(), m_engine->notificationLimit());
+        m_notifier = &notifier;
         JobContactReader reader(m_database, m_engine->managerUri(), this);
         Job::WriterProxy writer(*m_engine, m_database, notifier, reader);
 
+        m_checkpointTimer.start();
+        m_snapshotTimer.start();
+
+        const int snapshotInterval = m_engine->transientSnapshotInterval();
+
         while (m_running) {
-            if (m_pendingJobs.isEmpty()) {
-                m_wait.wait(&m_mutex);
+            const int notificationDelay = notifier.flushDelay();
+            if (notificationDelay == 0) {
+                // Emit the notifications accumulated by preceding jobs
+                MutexUnlocker unlocker(locker);
+                notifier.flush();
+            } else if (m_pendingJobs.isEmpty()) {
+                if (notificationDelay > 0 && (!m_checkpointPending || notificationDelay < m_engine->checkpointInterval())) {
+                    // Accumulated notifications are due before any idle work
+                    m_wait.wait(&m_mutex, notificationDelay);
+                } else if (!m_checkpointPending) {
+                    if (snapshotInterval <= 0 || !m_snapshotPending) {
+                        m_wait.wait(&m_mutex);
+                    } else if (!m_wait.wait(&m_mutex, qMax<qint64>(snapshotInterval - m_snapshotTimer.elapsed(), 0))) {
+                        // The transient store has been modified since we became idle
+                        m_snapshotPending = false;
+                        MutexUnlocker unlocker(locker);
+                        snapshot(true);
+                    }
+                } else if (!m_wait.wait(&m_mutex, m_engine->checkpointInterval())) {
+                    // We have been idle since the last commit; checkpoint the write-ahead log
+                    m_checkpointPending = false;
+                    MutexUnlocker unlocker(locker);
+                    checkpoint(true);
+                    snapshot(false);
+                }
+            } else if (m_pendingJobs.first()->groupable()
+                    && m_pendingJobs.count() > 1 && m_pendingJobs.at(1)->groupable()) {
+                // Consecutive write jobs are executed within a single transaction
+                while (!m_pendingJobs.isEmpty() && m_pendingJobs.first()->groupable()
+                        && m_groupedJobs.count() < MaximumGroupedJobs) {
+                    m_groupedJobs.append(m_pendingJobs.takeFirst());
+                }
+
+                {
+                    const QList<Job*> jobs(m_groupedJobs);
+                    MutexUnlocker unlocker(locker);
+                    executeGroup(jobs, &reader, writer);
+                    checkpoint(false);
+                    snapshot(false);
+                }
+
+                m_finishedJobs.append(m_groupedJobs);
+                m_groupedJobs.clear();
+                postUpdate();
+                m_finishedWait.wakeAll();
             } else {
                 m_currentJob = m_pendingJobs.takeFirst();
 
@@ -1291,6 +1578,9 @@ void JobThread::run()
                     m_currentJob->execute(&reader, writer);
                     QTCONTACTS_SQLITE_DEBUG(QString::fromLatin1("Job executed in %1 ms : %2 : error = %3")
                             .arg(timer.elapsed()).arg(m_currentJob->description()).arg(m_currentJob->error()));
+
+                    checkpoint(false);
+                    snapshot(false);
                 }
 
                 m_finishedJobs.append(m_currentJob);
@@ -1299,7 +1589,101 @@ void JobThread::run()
                 m_finishedWait.wakeOne();
             }
         }
+
+        if (m_checkpointPending) {
+            // Don't leave commits unsynchronized when the engine is destroyed
+            MutexUnlocker unlocker(locker);
+            checkpoint(true);
+        }
+
+        if (snapshotInterval > 0) {
+            // Capture the latest transient state for the next restart
+            MutexUnlocker unlocker(locker);
+            snapshot(true);
+        }
+
+        // Notifications still accumulated are emitted when the notifier is destroyed
+        m_notifier = 0;
+    }
+}
+
+void JobThread::checkpoint(bool idle)
+{
+    // While busy, only checkpoint when the write-ahead log is too large, or when
+    // commits have remained unsynchronized for longer than the checkpoint interval
+    const qint64 walSize = m_database.walSize();
+    const bool truncate = walSize > m_engine->walSizeLimit();
+    if (!idle && !truncate
+            && (m_engine->durabilityProfile() == ContactsEngine::FullDurability
+                || m_checkpointTimer.elapsed() < m_engine->checkpointInterval())) {
+        return;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    if (m_database.checkpoint(truncate ? ContactsDatabase::TruncateCheckpoint : ContactsDatabase::PassiveCheckpoint)) {
+        m_engine->recordCheckpoint(walSize, timer.elapsed());
+        QTCONTACTS_SQLITE_DEBUG(QString::fromLatin1("%1 checkpoint of %2 bytes in %3 ms")
+                .arg(truncate ? QStringLiteral("Truncate") : QStringLiteral("Passive")).arg(walSize).arg(timer.elapsed()));
+    }
+    m_checkpointTimer.restart();
+}
+
+void JobThread::snapshot(bool idle)
+{
+    // Snapshots are written at most once per interval, and are skipped if the store is unchanged
+    const int interval = m_engine->transientSnapshotInterval();
+    if (interval <= 0 || (!idle && m_snapshotTimer.elapsed() < interval))
+        return;
+
+    QElapsedTimer timer;
+    timer.start();
+    if (!m_database.saveTransientSnapshot()) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to save transient store snapshot"));
+    } else {
+        QTCONTACTS_SQLITE_DEBUG(QString::fromLatin1("Transient store snapshot checked in %1 ms").arg(timer.elapsed()));
+    }
+    m_snapshotTimer.restart();
+}
+
+void JobThread::executeGroup(const QList<Job*> &jobs, ContactReader *reader, Job::WriterProxy &writer)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    if (!writer->beginGroupTransaction()) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin transaction for grouped jobs; executing individually"));
+        foreach (Job *job, jobs) {
+            job->execute(reader, writer);
+        }
+        return;
+    }
+
+    // Each job is isolated by a savepoint, so that a failure does not affect the others
+    QList<Job*> writtenJobs;
+    foreach (Job *job, jobs) {
+        if (!writer->beginGroupedWrite()) {
+            job->setError(QContactManager::UnspecifiedError);
+            continue;
+        }
+
+        job->executeGrouped(reader, writer);
+        if (writer->endGroupedWrite(job->error() == QContactManager::NoError)) {
+            writtenJobs.append(job);
+        } else {
+            job->revert();
+        }
     }
+
+    if (!writer->commitGroupTransaction()) {
+        foreach (Job *job, writtenJobs) {
+            job->setError(QContactManager::UnspecifiedError);
+            job->revert();
+        }
+    }
+
+    QTCONTACTS_SQLITE_DEBUG(QString::fromLatin1("Grouped jobs executed in %1 ms : %2 jobs : %3 failed")
+            .arg(timer.elapsed()).arg(jobs.count()).arg(jobs.count() - writtenJobs.count()));
 }
 
 ContactsEngine::ContactsEngine(const QString &name, const QMap<QString, QString> &parameters)
@@ -1331,6 +1715,78 @@ ContactsEngine::ContactsEngine(const QString &name, const QMap<QString, QString>
         setAutoTest(true);
     }
 
+    QString skipUnchangedWrites = m_parameters.value(QString::fromLatin1("skipUnchangedWrites"));
+    if (skipUnchangedWrites.toLower() == QLatin1String("true") ||
+        skipUnchangedWrites.toInt() == 1) {
+        setSkipUnchangedWrites(true);
+    }
+
+    QString prepareWrites = m_parameters.value(QString::fromLatin1("prepareWrites"));
+    if (prepareWrites.toLower() == QLatin1String("false") ||
+        prepareWrites == QLatin1String("0")) {
+        setPrepareWrites(false);
+    }
+
+    QString durability = m_parameters.value(QString::fromLatin1("durability"));
+    if (durability.toLower() == QLatin1String("normal")) {
+        setDurabilityProfile(NormalDurability);
+    } else if (!durability.isEmpty() && durability.toLower() != QLatin1String("full")) {
+        qWarning("Unknown 'durability' option: %s - using full durability", qPrintable(durability));
+    }
+
+    QString oobCompression = m_parameters.value(QString::fromLatin1("oobCompression")).toLower();
+    if (oobCompression == QLatin1String("lz4") || oobCompression == QLatin1String("zstd")) {
+        const bool lz4 = (oobCompression == QLatin1String("lz4"));
+        if (OOBCodec::isAvailable(lz4 ? OOBCodec::LZ4 : OOBCodec::Zstd)) {
+            setOOBCompression(lz4 ? LZ4Compression : ZstdCompression);
+        } else {
+            qWarning("'oobCompression' option not available in this build: %s - using zlib", qPrintable(oobCompression));
+        }
+    } else if (!oobCompression.isEmpty() && oobCompression != QLatin1String("zlib")) {
+        qWarning("Unknown 'oobCompression' option: %s - using zlib", qPrintable(oobCompression));
+    }
+
+    bool ok = false;
+    const int checkpointInterval = m_parameters.value(QString::fromLatin1("checkpointInterval")).toInt(&ok);
+    if (ok && checkpointInterval > 0) {
+        setCheckpointInterval(checkpointInterval);
+    }
+
+    const int walSizeLimit = m_parameters.value(QString::fromLatin1("walSizeLimit")).toInt(&ok);
+    if (ok && walSizeLimit > 0) {
+        setWalSizeLimit(walSizeLimit);
+    }
+
+    const int transientSnapshotInterval = m_parameters.value(QString::fromLatin1("transientSnapshotInterval")).toInt(&ok);
+    if (ok && transientSnapshotInterval > 0) {
+        setTransientSnapshotInterval(transientSnapshotInterval);
+    }
+
+    const int transientSnapshotMaximumAge = m_parameters.value(QString::fromLatin1("transientSnapshotMaximumAge")).toInt(&ok);
+    if (ok && transientSnapshotMaximumAge > 0) {
+        setTransientSnapshotMaximumAge(transientSnapshotMaximumAge);
+    }
+
+    const int notificationInterval = m_parameters.value(QString::fromLatin1("notificationInterval")).toInt(&ok);
+    if (ok && notificationInterval > 0) {
+        setNotificationInterval(notificationInterval);
+    }
+
+    const int notificationLimit = m_parameters.value(QString::fromLatin1("notificationLimit")).toInt(&ok);
+    if (ok && notificationLimit > 0) {
+        setNotificationLimit(notificationLimit);
+    }
+
+    const int changeJournalLimit = m_parameters.value(QString::fromLatin1("changeJournalLimit")).toInt(&ok);
+    if (ok && changeJournalLimit >= 0) {
+        setChangeJournalLimit(changeJournalLimit);
+    }
+
+    const int lockWarningThreshold = m_parameters.value(QString::fromLatin1("lockWarningThreshold")).toInt(&ok);
+    if (ok && lockWarningThreshold >= 0) {
+        setLockWarningThreshold(lockWarningThreshold);
+    }
+
     /* Store the engine into a property of QCoreApplication, so that it can be
      * retrieved by the extension code */
     QCoreApplication *app = QCoreApplication::instance();
@@ -1355,6 +1811,176 @@ ContactsEngine::~ContactsEngine()
     app->setProperty(CONTACT_MANAGER_ENGINE_PROP, engines);
 }
 
+int ContactsEngine::unchangedWriteCheckCount() const
+{
+    return m_unchangedWriteChecks.load();
+}
+
+int ContactsEngine::elidedWriteCount() const
+{
+    return m_elidedWrites.load();
+}
+
+void ContactsEngine::resetElidedWriteCounts()
+{
+    m_unchangedWriteChecks.store(0);
+    m_elidedWrites.store(0);
+}
+
+int ContactsEngine::walSize() const
+{
+    return m_walSize.load();
+}
+
+int ContactsEngine::checkpointCount() const
+{
+    return m_checkpointCount.load();
+}
+
+int ContactsEngine::lastCheckpointDuration() const
+{
+    return m_lastCheckpointDuration.load();
+}
+
+int ContactsEngine::maximumCheckpointDuration() const
+{
+    return m_maximumCheckpointDuration.load();
+}
+
+QList<int> ContactsEngine::writeLockHoldTimes() const
+{
+    QList<int> counts;
+    for (int i = 0; i < LockHistogramBuckets; ++i) {
+        int count = 0;
+        for (int site = 0; site < WriteLockSiteCount; ++site)
+            count += m_writeLockHoldTimes[site][i].load();
+        counts.append(count);
+    }
+    return counts;
+}
+
+QtContactsSqliteExtensions::ContactManagerEngine::WriteLockStatistics ContactsEngine::writeLockStatistics(WriteLockSite site) const
+{
+    WriteLockStatistics statistics;
+    statistics.acquisitions = m_writeLockAcquisitions[site].load();
+    statistics.totalWaitTime = m_writeLockTotalWaitTime[site].load();
+    statistics.totalHoldTime = m_writeLockTotalHoldTime[site].load();
+    statistics.maximumWaitTime = m_writeLockMaximumWaitTime[site].load();
+    statistics.maximumHoldTime = m_writeLockMaximumHoldTime[site].load();
+    for (int i = 0; i < LockHistogramBuckets; ++i) {
+        statistics.waitTimes.append(m_writeLockWaitTimes[site][i].load());
+        statistics.holdTimes.append(m_writeLockHoldTimes[site][i].load());
+    }
+    return statistics;
+}
+
+void ContactsEngine::resetWriteLockStatistics()
+{
+    for (int site = 0; site < WriteLockSiteCount; ++site) {
+        m_writeLockAcquisitions[site].store(0);
+        m_writeLockTotalWaitTime[site].store(0);
+        m_writeLockTotalHoldTime[site].store(0);
+        m_writeLockMaximumWaitTime[site].store(0);
+        m_writeLockMaximumHoldTime[site].store(0);
+        for (int i = 0; i < LockHistogramBuckets; ++i) {
+            m_writeLockWaitTimes[site][i].store(0);
+            m_writeLockHoldTimes[site][i].store(0);
+        }
+    }
+}
+
+void ContactsEngine::recordUnchangedWriteCheck(bool elided)
+{
+    m_unchangedWriteChecks.ref();
+    if (elided) {
+        m_elidedWrites.ref();
+    }
+}
+
+void ContactsEngine::recordCheckpoint(qint64 walSize, int duration)
+{
+    m_walSize.store(static_cast<int>(qMin<qint64>(walSize, INT32_MAX)));
+    m_checkpointCount.ref();
+    m_lastCheckpointDuration.store(duration);
+
+    int maximum = m_maximumCheckpointDuration.load();
+    while (duration > maximum && !m_maximumCheckpointDuration.testAndSetOrdered(maximum, duration)) {
+        maximum = m_maximumCheckpointDuration.load();
+    }
+}
+
+static int lockHistogramBucket(qint64 usecs)
+{
+    int bucket = 0;
+    while (bucket < QtContactsSqliteExtensions::ContactManagerEngine::LockHistogramBuckets - 1 && usecs >= (250 << bucket)) {
+        ++bucket;
+    }
+    return bucket;
+}
+
+static void recordMaximum(QAtomicInt &maximum, qint64 usecs)
+{
+    const int value = static_cast<int>(qMin<qint64>(usecs, std::numeric_limits<int>::max()));
+    int current = maximum.load();
+    while (value > current && !maximum.testAndSetOrdered(current, value)) {
+        current = maximum.load();
+    }
+}
+
+static const char *writeLockSiteName(QtContactsSqliteExtensions::ContactManagerEngine::WriteLockSite site)
+{
+    switch (site) {
+        case QtContactsSqliteExtensions::ContactManagerEngine::SaveLockSite: return "save";
+        case QtContactsSqliteExtensions::ContactManagerEngine::RemoveLockSite: return "remove";
+        case QtContactsSqliteExtensions::ContactManagerEngine::OOBLockSite: return "OOB";
+        case QtContactsSqliteExtensions::ContactManagerEngine::ClearChangeFlagsLockSite: return "clearChangeFlags";
+        case QtContactsSqliteExtensions::ContactManagerEngine::SyncLockSite: return "sync";
+        case QtContactsSqliteExtensions::ContactManagerEngine::PresenceLockSite: return "presence";
+        case QtContactsSqliteExtensions::ContactManagerEngine::UpgradeLockSite: return "upgrade";
+        case QtContactsSqliteExtensions::ContactManagerEngine::CheckpointLockSite: return "checkpoint";
+        default: break;
+    }
+    return "unknown";
+}
+
+void ContactsEngine::recordWriteLock(WriteLockSite site, qint64 waitUsecs, qint64 holdUsecs)
+{
+    if (site < 0 || site >= WriteLockSiteCount)
+        return;
+
+    m_writeLockAcquisitions[site].ref();
+    m_writeLockTotalWaitTime[site].fetchAndAddRelaxed(waitUsecs);
+    m_writeLockTotalHoldTime[site].fetchAndAddRelaxed(holdUsecs);
+    recordMaximum(m_writeLockMaximumWaitTime[site], waitUsecs);
+    recordMaximum(m_writeLockMaximumHoldTime[site], holdUsecs);
+    m_writeLockWaitTimes[site][lockHistogramBucket(waitUsecs)].ref();
+    m_writeLockHoldTimes[site][lockHistogramBucket(holdUsecs)].ref();
+
+    const qint64 threshold = static_cast<qint64>(lockWarningThreshold()) * 1000;
+    if (threshold > 0 && (waitUsecs > threshold || holdUsecs > threshold)) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Write lock for %1 waited %2 ms, held %3 ms")
+                .arg(QLatin1String(writeLockSiteName(site)))
+                .arg(waitUsecs / 1000)
+                .arg(holdUsecs / 1000));
+    }
+}
+
+void ContactsEngine::transactionCommitted()
+{
+    if (m_jobThread) {
+        m_jobThread->scheduleCheckpoint();
+        m_jobThread->scheduleSnapshot();
+    }
+}
+
+void ContactsEngine::transientStoreChanged()
+{
+    // Changes reported by other processes may have modified the transient store
+    if (m_jobThread) {
+        m_jobThread->scheduleSnapshot();
+    }
+}
+
 QString ContactsEngine::databaseUuid()
 {
     if (m_databaseUuid.isEmpty()) {
@@ -1381,7 +2007,8 @@ QContactManager::Error ContactsEngine::open()
                 m_notifier->connect("collectionsRemoved", "au", this, SLOT(_q_collectionsRemoved(QVector<quint32>)));
                 m_notifier->connect("collectionContactsChanged", "au", this, SLOT(_q_collectionContactsChanged(QVector<quint32>)));
                 m_notifier->connect("contactsAdded", "au", this, SLOT(_q_contactsAdded(QVector<quint32>)));
-                m_notifier->connect("contactsChanged", "au", this, SLOT(_q_contactsChanged(QVector<quint32>)));
+                m_notifier->connect("contactsChanged", "au", this, SLOT(_q_contactsChanged(QVector<quint32>,QDBusMessage)));
+                m_notifier->connect("contactsDetailsChanged", "auau", this, SLOT(_q_contactsDetailsChanged(QVector<quint32>,QVector<quint32>,QDBusMessage)));
                 m_notifier->connect("contactsPresenceChanged", "au", this, SLOT(_q_contactsPresenceChanged(QVector<quint32>)));
                 m_notifier->connect("contactsRemoved", "au", this, SLOT(_q_contactsRemoved(QVector<quint32>)));
                 m_notifier->connect("selfContactIdChanged", "uu", this, SLOT(_q_selfContactIdChanged(quint32,quint32)));
@@ -1924,6 +2551,24 @@ bool ContactsEngine::fetchContactChanges(const QContactCollectionId &collectionI
     return (*error == QContactManager::NoError);
 }
 
+bool ContactsEngine::fetchContactChanges(const QContactCollectionId &collectionId,
+                                         int batchSize,
+                                         UnmodifiedContacts unmodified,
+                                         ContactChangesReceiver *receiver,
+                                         QContactManager::Error *error)
+{
+    Q_ASSERT(error);
+    Q_ASSERT(receiver);
+    if (batchSize <= 0) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Invalid batch size for contact changes fetch: %1").arg(batchSize));
+        *error = QContactManager::BadArgumentError;
+        return false;
+    }
+
+    *error = writer()->fetchContactChanges(collectionId, batchSize, unmodified, receiver);
+    return (*error == QContactManager::NoError);
+}
+
 bool ContactsEngine::storeChanges(QHash<QContactCollection*, QList<QContact> * /* added contacts */> *addedCollections,
                                   QHash<QContactCollection*, QList<QContact> * /* added/modified/deleted contacts */> *modifiedCollections,
                                   const QList<QContactCollectionId> &deletedCollections,
@@ -1978,6 +2623,26 @@ bool ContactsEngine::storeOOB(const QString &scope, const QMap<QString, QVariant
     return writer()->storeOOB(scope, values);
 }
 
+bool ContactsEngine::storeOOB(const QString &scope, const QString &key, QIODevice *device)
+{
+    return writer()->storeOOB(scope, key, device);
+}
+
+QIODevice *ContactsEngine::openOOB(const QString &scope, const QString &key)
+{
+    return reader()->openOOB(scope, key);
+}
+
+bool ContactsEngine::trainOOBDictionary(const QString &scope)
+{
+    return writer()->trainOOBDictionary(scope);
+}
+
+bool ContactsEngine::fetchOOBStorageSize(const QString &scope, qint64 *size)
+{
+    return reader()->fetchOOBStorageSize(scope, size);
+}
+
 bool ContactsEngine::removeOOB(const QString &scope, const QString &key)
 {
     return writer()->removeOOB(scope, QStringList() << key);
@@ -1998,6 +2663,51 @@ QStringList ContactsEngine::displayLabelGroups()
     return database().displayLabelGroups();
 }
 
+bool ContactsEngine::fetchChangeJournal(quint64 sinceSequence, QList<ChangeJournalEntry> *entries, quint64 *latestSequence, bool *refetchRequired, QContactManager::Error *error)
+{
+    Q_ASSERT(error);
+    *error = reader()->fetchChangeJournal(sinceSequence, entries, latestSequence, refetchRequired);
+    return (*error == QContactManager::NoError);
+}
+
+void ContactsEngine::flushChangeNotifications()
+{
+    // Notifications from synchronous operations are not accumulated
+    if (m_jobThread)
+        m_jobThread->flushNotifications();
+}
+
+void ContactsEngine::flushHeldNotifications()
+{
+    // Notifications of synchronous operations must not precede those of earlier asynchronous requests
+    if (m_jobThread)
+        m_jobThread->flushHeldNotifications();
+}
+
+void ContactsEngine::setRequestExecutionSuspended(bool suspended)
+{
+    // Only available to the auto tests, which invoke it by name
+    if (m_jobThread && m_autoTest)
+        m_jobThread->setHoldingJobs(suspended);
+}
+
+bool ContactsEngine::updatePresence(const QList<PresenceUpdate> &updates, QMap<int, QContactManager::Error> *errorMap, QContactManager::Error *error)
+{
+    Q_ASSERT(error);
+    *error = writer()->updatePresence(updates, errorMap);
+    return (*error == QContactManager::NoError);
+}
+
+int ContactsEngine::transientStoreUtilization()
+{
+    return database().transientStoreUtilization();
+}
+
+int ContactsEngine::transientStoreFragmentation()
+{
+    return database().transientStoreFragmentation();
+}
+
 bool ContactsEngine::setContactDisplayLabel(QContact *contact, const QString &label, const QString &group, int sortOrder)
 {
     QContactDisplayLabel detail(contact->detail<QContactDisplayLabel>());
@@ -2135,17 +2845,41 @@ void ContactsEngine::_q_contactsAdded(const QVector<quint32> &contactIds)
     emit contactsAdded(idList(contactIds, m_managerUri));
 }
 
-void ContactsEngine::_q_contactsChanged(const QVector<quint32> &contactIds)
+void ContactsEngine::_q_contactsChanged(const QVector<quint32> &contactIds, const QDBusMessage &message)
 {
-    // TODO: also emit the detail types..
+    transientStoreChanged();
+
+    // This change has already been reported with its types, unless the sender is an earlier version
+    QHash<QString, QVector<quint32> >::iterator it = m_detailsChangedIds.find(message.service());
+    if (it != m_detailsChangedIds.end() && *it == contactIds) {
+        m_detailsChangedIds.erase(it);
+        return;
+    }
+
     emit contactsChanged(idList(contactIds, m_managerUri), QList<QContactDetail::DetailType>());
 }
 
+void ContactsEngine::_q_contactsDetailsChanged(const QVector<quint32> &contactIds, const QVector<quint32> &types, const QDBusMessage &message)
+{
+    // The sender follows this signal with contactsChanged for the same ids
+    m_detailsChangedIds.insert(message.service(), contactIds);
+
+    QList<QContactDetail::DetailType> detailTypes;
+    foreach (quint32 type, types) {
+        detailTypes.append(static_cast<QContactDetail::DetailType>(type));
+    }
+
+    emit contactsChanged(idList(contactIds, m_managerUri), detailTypes);
+}
+
 void ContactsEngine::_q_contactsPresenceChanged(const QVector<quint32> &contactIds)
 {
+    transientStoreChanged();
     if (m_mergePresenceChanges) {
-        // TODO: also emit the detail types..
-        emit contactsChanged(idList(contactIds, m_managerUri), QList<QContactDetail::DetailType>());
+        static const QList<QContactDetail::DetailType> presenceDetailTypes(QList<QContactDetail::DetailType>()
+                << QContactPresence::Type << QContactGlobalPresence::Type
+                << QContactOnlineAccount::Type << QContactOriginMetadata::Type);
+        emit contactsChanged(idList(contactIds, m_managerUri), presenceDetailTypes);
     } else {
         emit contactsPresenceChanged(idList(contactIds, m_managerUri));
     }
@@ -2163,6 +2897,7 @@ void ContactsEngine::_q_displayLabelGroupsChanged()
 
 void ContactsEngine::_q_contactsRemoved(const QVector<quint32> &contactIds)
 {
+    transientStoreChanged();
     emit contactsRemoved(idList(contactIds, m_managerUri));
 }
 
@@ -35,12 +35,16 @@
 
 #include "contactmanagerengine.h"
 
+#include <QAtomicInt>
+#include <QDBusMessage>
 #include <QScopedPointer>
 #include <QSqlDatabase>
 #include <QObject>
+#include <QHash>
 #include <QList>
 #include <QMap>
 #include <QString>
+#include <QVector>
 
 #include "contactsdatabase.h"
 #include "contactnotifier.h"
@@ -153,7 +157,25 @@ public:
     bool isRelationshipTypeSupported(const QString &relationshipType, QContactType::TypeValues contactType) const override;
     QList<QContactType::TypeValues> supportedContactTypes() const override;
 
+    int unchangedWriteCheckCount() const override;
+    int elidedWriteCount() const override;
+    void resetElidedWriteCounts() override;
+
+    int walSize() const override;
+    int checkpointCount() const override;
+    int lastCheckpointDuration() const override;
+    int maximumCheckpointDuration() const override;
+
+    QList<int> writeLockHoldTimes() const override;
+    WriteLockStatistics writeLockStatistics(WriteLockSite site) const override;
+    void resetWriteLockStatistics() override;
+
     void regenerateDisplayLabel(QContact &contact, bool *emitDisplayLabelGroupChange);
+    void recordUnchangedWriteCheck(bool elided);
+    void recordCheckpoint(qint64 walSize, int duration);
+    void recordWriteLock(WriteLockSite site, qint64 waitUsecs, qint64 holdUsecs);
+    void transactionCommitted();
+    void flushHeldNotifications();
 
     bool clearChangeFlags(const QList<QContactId> &contactIds, QContactManager::Error *error) override;
     bool clearChangeFlags(const QContactCollectionId &collectionId, QContactManager::Error *error) override;
@@ -173,6 +195,12 @@ public:
                              QList<QContact> *unmodifiedContacts,
                              QContactManager::Error *error) override;
 
+    bool fetchContactChanges(const QContactCollectionId &collectionId,
+                             int batchSize,
+                             UnmodifiedContacts unmodified,
+                             ContactChangesReceiver *receiver,
+                             QContactManager::Error *error) override;
+
     bool storeChanges(QHash<QContactCollection*, QList<QContact> * /* added contacts */> *addedCollections,
                       QHash<QContactCollection*, QList<QContact> * /* added/modified/deleted contacts */> *modifiedCollections,
                       const QList<QContactCollectionId> &deletedCollections,
@@ -188,6 +216,12 @@ public:
 
     bool storeOOB(const QString &scope, const QString &key, const QVariant &value) override;
     bool storeOOB(const QString &scope, const QMap<QString, QVariant> &values) override;
+    bool storeOOB(const QString &scope, const QString &key, QIODevice *device) override;
+
+    QIODevice *openOOB(const QString &scope, const QString &key) override;
+
+    bool trainOOBDictionary(const QString &scope) override;
+    bool fetchOOBStorageSize(const QString &scope, qint64 *size) override;
 
     bool removeOOB(const QString &scope, const QString &key) override;
     bool removeOOB(const QString &scope, const QStringList &keys) override;
@@ -195,16 +229,31 @@ public:
 
     QStringList displayLabelGroups() override;
 
+    bool fetchChangeJournal(quint64 sinceSequence, QList<ChangeJournalEntry> *entries, quint64 *latestSequence, bool *refetchRequired, QContactManager::Error *error) override;
+
+    void flushChangeNotifications() override;
+
+    bool updatePresence(const QList<PresenceUpdate> &updates, QMap<int, QContactManager::Error> *errorMap, QContactManager::Error *error) override;
+
+    int transientStoreUtilization() override;
+    int transientStoreFragmentation() override;
+
     QString synthesizedDisplayLabel(const QContact &contact, QContactManager::Error *error) const;
     static bool setContactDisplayLabel(QContact *contact, const QString &label, const QString &group, int sortOrder);
     static QString normalizedPhoneNumber(const QString &input);
 
+private:
+    // While suspended, requests which are started remain queued, and are executed together once
+    // resumed.  Only for use by the auto tests, which invoke it by name.
+    Q_INVOKABLE void setRequestExecutionSuspended(bool suspended);
+
 private slots:
     void _q_collectionsAdded(const QVector<quint32> &collectionIds);
     void _q_collectionsChanged(const QVector<quint32> &collectionIds);
     void _q_collectionsRemoved(const QVector<quint32> &collectionIds);
     void _q_collectionContactsChanged(const QVector<quint32> &collectionIds);
-    void _q_contactsChanged(const QVector<quint32> &contactIds);
+    void _q_contactsChanged(const QVector<quint32> &contactIds, const QDBusMessage &message);
+    void _q_contactsDetailsChanged(const QVector<quint32> &contactIds, const QVector<quint32> &types, const QDBusMessage &message);
     void _q_contactsPresenceChanged(const QVector<quint32> &contactIds);
     void _q_contactsAdded(const QVector<quint32> &contactIds);
     void _q_contactsRemoved(const QVector<quint32> &contactIds);
@@ -216,6 +265,7 @@ private slots:
 private:
     bool regenerateAggregatesIfNeeded();
     QString databaseUuid();
+    void transientStoreChanged();
     ContactsDatabase &database();
 
     ContactReader *reader() const;
@@ -230,6 +280,21 @@ private:
     QScopedPointer<ContactWriter> m_synchronousWriter;
     QScopedPointer<ContactNotifier> m_notifier;
     QScopedPointer<JobThread> m_jobThread;
+    // The ids last reported by each sender of contactsDetailsChanged, which precedes its contactsChanged
+    QHash<QString, QVector<quint32> > m_detailsChangedIds;
+    QAtomicInt m_unchangedWriteChecks;
+    QAtomicInt m_elidedWrites;
+    QAtomicInt m_walSize;
+    QAtomicInt m_checkpointCount;
+    QAtomicInt m_lastCheckpointDuration;
+    QAtomicInt m_maximumCheckpointDuration;
+    QAtomicInt m_writeLockAcquisitions[WriteLockSiteCount];
+    QAtomicInteger<qint64> m_writeLockTotalWaitTime[WriteLockSiteCount];
+    QAtomicInteger<qint64> m_writeLockTotalHoldTime[WriteLockSiteCount];
+    QAtomicInt m_writeLockMaximumWaitTime[WriteLockSiteCount];
+    QAtomicInt m_writeLockMaximumHoldTime[WriteLockSiteCount];
+    QAtomicInt m_writeLockWaitTimes[WriteLockSiteCount][LockHistogramBuckets];
+    QAtomicInt m_writeLockHoldTimes[WriteLockSiteCount][LockHistogramBuckets];
 
     Q_DISABLE_COPY(ContactsEngine);
 };
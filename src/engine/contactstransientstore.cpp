@@ -37,21 +37,29 @@
 #include "trace_p.h"
 
 #include <QContactDetail>
+#include <QContactGlobalPresence>
+#include <QContactManagerEngine>
+#include <QContactPresence>
 
 #include <QByteArray>
 #include <QDataStream>
 #include <QDir>
 #include <QFile>
+#include <QFileInfo>
 #include <QMap>
 #include <QMutex>
+#include <QSaveFile>
 #include <QSharedMemory>
 #include <QSharedPointer>
 #include <QStandardPaths>
 #include <QSystemSemaphore>
+#include <QUrl>
 
 #include <QtDebug>
 
+#include <algorithm>
 #include <cstring>
+#include <limits>
 #include <tr1/functional>
 
 class SharedMemoryManager
@@ -74,6 +82,7 @@ class SharedMemoryManager
 
 public:
     typedef std::tr1::function<void ()> Function;
+    typedef std::tr1::function<void (MemoryTable &)> Initializer;
 
     SharedMemoryManager()
         : m_mutex(QMutex::Recursive)
@@ -112,10 +121,29 @@ public:
         Function m_release;
     };
 
-    bool open(const QString &identifier, bool createIfNecessary, bool reinitialize);
+    // If the data region is created, it is at least initialSize bytes, and the initializer is invoked
+    // to populate the new table before any other process can access it
+    bool open(const QString &identifier, bool createIfNecessary, bool reinitialize,
+              size_t initialSize = 0, Initializer initializer = Initializer());
+
+    enum Reallocation {
+        Expand,
+        Shrink
+    };
 
     TableHandle table(const QString &identifier);
-    TableHandle reallocateTable(const QString &identifier);
+    TableHandle reallocateTable(const QString &identifier, Reallocation reallocation = Expand);
+
+    // Must be called with the data lock held, after items are removed from the table
+    void itemsRemoved(const QString &identifier, int count);
+
+    // Look up a value without acquiring the data lock; returns false if the lookup could not
+    // be completed without interference from writers, in which case the caller must use table()
+    bool readValue(const QString &identifier, quint32 key, QByteArray *value, bool *found);
+
+    // Identify the current content of the table without acquiring the data lock; returns zero
+    // if the attached table has been superseded, in which case the content must be re-read
+    quint64 generation(const QString &identifier);
 
 private:
     // For each database (privileged/nonprivileged), we have a shared memory region that holds the data,
@@ -128,6 +156,8 @@ private:
             : m_keyRegion(keyRegion)
             , m_dataTable(dataTable)
             , m_generation(generation)
+            , m_removals(0)
+            , m_lowUtilizationChecks(0)
         {
         }
         ~TableData()
@@ -137,6 +167,8 @@ private:
         QSharedPointer<QSharedMemory> m_keyRegion;
         QSharedPointer<SharedMemoryTable> m_dataTable;
         quint32 m_generation;
+        int m_removals;
+        int m_lowUtilizationChecks;
     };
 
     struct SemaphoreLock
@@ -161,6 +193,12 @@ private:
 
     static const quint32 keyDataFormatVersion = 1;
     static const quint32 initialGeneration = 1;
+
+    // What size should we use? Using an estimate of 512 bytes per contact, we could store about 2K contacts in a 1M region
+    static const int initialRegionSize = 1024 * 1024;
+
+    // The region is shrunk when its utilization remains below this percentage over consecutive checks
+    enum { ShrinkCheckInterval = 64, ShrinkUtilization = 25, ShrinkChecks = 2 };
     static const int keyIndex = 0;
     static const int dataIndex = 1;
 
@@ -169,10 +207,13 @@ private:
     quint32 getRegionGeneration(QSharedPointer<QSharedMemory> keyRegion) const;
     void setRegionGeneration(QSharedPointer<QSharedMemory> keyRegion, quint32 regionGeneration);
 
-    QSharedPointer<QSharedMemory> getDataRegion(const QString &identifier, quint32 generation, bool createIfNecessary, size_t dataSize = 0, bool reinitialize = false) const;
+    QSharedPointer<QSharedMemory> getDataRegion(const QString &identifier, quint32 generation, bool createIfNecessary, size_t dataSize = 0, bool reinitialize = false, bool *created = 0) const;
 
     enum { DefaultWaitMs = 5000 };
 
+    // Lock-free lookups are repeated this many times before the caller falls back to locking
+    enum { ReadAttempts = 3 };
+
     Function lockKeyRegion() const;
     Function lockDataRegion(int waitMs = DefaultWaitMs) const;
 
@@ -186,7 +227,8 @@ private:
 
 Q_GLOBAL_STATIC(SharedMemoryManager, sharedMemory);
 
-bool SharedMemoryManager::open(const QString &identifier, bool createIfNecessary, bool reinitialize)
+bool SharedMemoryManager::open(const QString &identifier, bool createIfNecessary, bool reinitialize,
+                               size_t initialSize, Initializer initializer)
 {
     QMutexLocker threadLock(&m_mutex);
 
@@ -285,14 +327,17 @@ bool SharedMemoryManager::open(const QString &identifier, bool createIfNecessary
         }
 
         // Try to open the data region
-        // What size should we use? Using an estimate of 512 bytes per contact, we could store about 2K contacts in a 1M region
-        const int memoryRegionSize = 1024 * 1024;
-
-        QSharedPointer<QSharedMemory> dataRegion(getDataRegion(identifier, regionGeneration, true, memoryRegionSize, reinitialize));
+        bool created = false;
+        const size_t dataSize = std::max<size_t>(initialRegionSize, initialSize);
+        QSharedPointer<QSharedMemory> dataRegion(getDataRegion(identifier, regionGeneration, true, dataSize, reinitialize, &created));
         if (!dataRegion || !dataRegion->isAttached())
             return false;
 
         QSharedPointer<SharedMemoryTable> dataTable(new SharedMemoryTable(dataRegion));
+        if (created && initializer) {
+            // We still hold the data lock, so no other process can observe the table until it is populated
+            initializer(dataTable->m_table);
+        }
 
         // Store our handle to this table
         TableData tableData(keyRegion, dataTable, regionGeneration);
@@ -374,7 +419,7 @@ SharedMemoryManager::TableHandle SharedMemoryManager::table(const QString &ident
     }
 }
 
-SharedMemoryManager::TableHandle SharedMemoryManager::reallocateTable(const QString &identifier)
+SharedMemoryManager::TableHandle SharedMemoryManager::reallocateTable(const QString &identifier, Reallocation reallocation)
 {
     QMutexLocker threadLock(&m_mutex);
 
@@ -396,10 +441,17 @@ SharedMemoryManager::TableHandle SharedMemoryManager::reallocateTable(const QStr
     }
 
     quint32 nextGeneration = tableData.m_generation + 1;
-    int nextSize = tableData.m_dataTable->m_region->size() * 2;
+    int nextSize = tableData.m_dataTable->m_region->size();
+    if (reallocation == Expand) {
+        nextSize *= 2;
+    } else {
+        nextSize /= 2;
+        if (nextSize < initialRegionSize)
+            return TableHandle();
+    }
 
-    // We need to create a new, bigger region to migrate the table to
-    QSharedPointer<QSharedMemory> nextRegion(getDataRegion(identifier, nextGeneration, true, nextSize, false));
+    // We need to create a new region to migrate the table to; it must not contain any prior content
+    QSharedPointer<QSharedMemory> nextRegion(getDataRegion(identifier, nextGeneration, true, nextSize, true));
     if (!nextRegion) {
         QTCONTACTS_SQLITE_WARNING(QStringLiteral("Cannot allocate new shared memory region for table: %1 %2 %3")
                 .arg(identifier).arg(nextGeneration).arg(nextSize));
@@ -420,6 +472,9 @@ SharedMemoryManager::TableHandle SharedMemoryManager::reallocateTable(const QStr
     // Update the key region to store the new generation value
     setRegionGeneration(tableData.m_keyRegion, nextGeneration);
 
+    // Readers still attached to the old table must find the new table via the key region
+    tableData.m_dataTable->m_table.retire();
+
     // Replace the old table with the new table
     tableData.m_dataTable = nextDataTable;
     tableData.m_generation = nextGeneration;
@@ -428,6 +483,87 @@ SharedMemoryManager::TableHandle SharedMemoryManager::reallocateTable(const QStr
     return TableHandle(tableData.m_dataTable);
 }
 
+void SharedMemoryManager::itemsRemoved(const QString &identifier, int count)
+{
+    QMutexLocker threadLock(&m_mutex);
+
+    QMap<QString, TableData>::iterator it = m_tables.find(identifier);
+    if (it == m_tables.end())
+        return;
+
+    TableData &tableData(*it);
+
+    // Only assess the utilization periodically, since that requires traversing the free list
+    tableData.m_removals += count;
+    if (tableData.m_removals < ShrinkCheckInterval)
+        return;
+    tableData.m_removals = 0;
+
+    const MemoryTable &table(tableData.m_dataTable->m_table);
+    const size_t used = table.size() - table.freeSpace();
+    if (used * 100 >= table.size() * ShrinkUtilization) {
+        tableData.m_lowUtilizationChecks = 0;
+        return;
+    }
+    if (++tableData.m_lowUtilizationChecks < ShrinkChecks)
+        return;
+    tableData.m_lowUtilizationChecks = 0;
+
+    // Migrate to a smaller region; this has no effect if the region is already of the minimum size
+    if (reallocateTable(identifier, Shrink)) {
+        QTCONTACTS_SQLITE_DEBUG(QStringLiteral("Shrank underutilized shared memory table: %1 (%2 bytes in use)")
+                .arg(identifier).arg(used));
+    }
+}
+
+bool SharedMemoryManager::readValue(const QString &identifier, quint32 key, QByteArray *value, bool *found)
+{
+    QSharedPointer<SharedMemoryTable> dataTable;
+    {
+        QMutexLocker threadLock(&m_mutex);
+
+        QMap<QString, TableData>::const_iterator it = m_tables.constFind(identifier);
+        if (it == m_tables.constEnd())
+            return false;
+
+        dataTable = it->m_dataTable;
+    }
+
+    for (int i = 0; i < ReadAttempts; ++i) {
+        if (dataTable->m_table.readValue(key, value, found))
+            return true;
+
+        // A retired table will not become readable; the caller must attach to its successor
+        if (dataTable->m_table.isRetired())
+            break;
+    }
+
+    return false;
+}
+
+quint64 SharedMemoryManager::generation(const QString &identifier)
+{
+    QSharedPointer<SharedMemoryTable> dataTable;
+    quint32 regionGeneration;
+    {
+        QMutexLocker threadLock(&m_mutex);
+
+        QMap<QString, TableData>::const_iterator it = m_tables.constFind(identifier);
+        if (it == m_tables.constEnd())
+            return 0;
+
+        dataTable = it->m_dataTable;
+        regionGeneration = it->m_generation;
+    }
+
+    // The sequence of a successor table restarts, so it is qualified by the region generation
+    const quint32 sequence = dataTable->m_table.sequence();
+    if (dataTable->m_table.isRetired())
+        return 0;
+
+    return (static_cast<quint64>(regionGeneration) << 32) | sequence;
+}
+
 QString SharedMemoryManager::getNativeIdentifier(const QString &identifier, bool createIfNecessary) const
 {
     // Despite the documentation, QSharedMemory on unix needs the identifier to be the path
@@ -481,7 +617,7 @@ void SharedMemoryManager::setRegionGeneration(QSharedPointer<QSharedMemory> keyR
     std::memcpy(keyRegion->data(), keyData.constData(), keyData.size());
 }
 
-QSharedPointer<QSharedMemory> SharedMemoryManager::getDataRegion(const QString &identifier, quint32 generation, bool createIfNecessary, size_t dataSize, bool reinitialize) const
+QSharedPointer<QSharedMemory> SharedMemoryManager::getDataRegion(const QString &identifier, quint32 generation, bool createIfNecessary, size_t dataSize, bool reinitialize, bool *created) const
 {
     // We must hold the data lock before calling this function
     const QString dataIdentifier(QStringLiteral("%1-data-%2").arg(identifier).arg(generation));
@@ -497,11 +633,14 @@ QSharedPointer<QSharedMemory> SharedMemoryManager::getDataRegion(const QString &
 
     bool attached = memoryRegion->attach();
     if (!attached &&
+        !reinitialize &&
         (memoryRegion->error() == QSharedMemory::NotFound) &&
         (generation > initialGeneration)) {
         // It's possible that the current generation has been destroyed, but the previous generation
         // is still active; try to connect to that.  We could fall back all the way to the initial
         // generation, but the possible benefit rapidly decreases...
+        // A region being initialized must be of the requested generation, since the predecessor
+        // may be the table that is being migrated.
         const QString previousIdentifier(QStringLiteral("%1-data-%2").arg(identifier).arg(generation - 1));
         const QString previousKey(getNativeIdentifier(previousIdentifier, false));
         if (!previousKey.isEmpty()) {
@@ -532,6 +671,8 @@ QSharedPointer<QSharedMemory> SharedMemoryManager::getDataRegion(const QString &
             QTCONTACTS_SQLITE_WARNING(QStringLiteral("Failed to initialize table in data memory region for %1")
                     .arg(dataIdentifier));
             memoryRegion->detach();
+        } else if (created) {
+            *created = true;
         }
     } else {
         // Verify that the region contains a valid memory table, or reinitialize if required
@@ -579,6 +720,599 @@ void SharedMemoryManager::release(int index) const
     }
 }
 
+namespace {
+
+// Entries are stored in a fixed-layout binary encoding, rather than via QDataStream.  The
+// header is fixed-size, so that the timestamp and global presence state can be read without
+// decoding the details that follow it.  All values are in host byte order, since the region
+// is only shared between processes on the same host.
+//
+// Entry:   EntryHeader, followed by detailCount detail records
+// Detail:  quint32 type, quint32 accessConstraints, quint32 fieldCount, followed by field records
+// Field:   quint32 field, quint8 ValueType, followed by the value payload
+//
+// Readers ignore entries whose version they do not recognize; the version must be incremented
+// for any change to the layout.
+enum { EntryMagic = 0xc5, EntryFormatVersion = 1 };
+
+enum EntryFlags {
+    NullTimestamp = 0x01,
+    HasGlobalPresence = 0x02
+};
+
+struct EntryHeader {
+    quint8 magic;
+    quint8 version;
+    quint8 flags;
+    quint8 timeSpec;
+    qint32 presenceState;
+    qint64 timestamp;
+    quint32 detailCount;
+    quint32 reserved;
+};
+
+Q_STATIC_ASSERT(sizeof(EntryHeader) == 24);
+
+enum ValueType {
+    InvalidValue = 0,
+    BoolValue,
+    IntValue,
+    UIntValue,
+    LongLongValue,
+    ULongLongValue,
+    DoubleValue,
+    StringValue,
+    StringListValue,
+    ByteArrayValue,
+    DateTimeValue,
+    DateValue,
+    IntListValue,
+    UrlValue,
+    VariantValue
+};
+
+class EntryEncoder
+{
+public:
+    explicit EntryEncoder(QByteArray *data) : m_data(data) {}
+
+    template<typename T>
+    void write(T value)
+    {
+        m_data->append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    void writeBytes(const char *src, quint32 len)
+    {
+        write<quint32>(len);
+        m_data->append(src, len);
+    }
+
+    void writeString(const QString &s)
+    {
+        writeBytes(reinterpret_cast<const char *>(s.constData()), s.size() * sizeof(QChar));
+    }
+
+    void writeValue(const QVariant &value)
+    {
+        const int type = value.userType();
+        if (!value.isValid()) {
+            write<quint8>(InvalidValue);
+        } else if (type == QMetaType::Bool) {
+            write<quint8>(BoolValue);
+            write<quint8>(value.toBool() ? 1 : 0);
+        } else if (type == QMetaType::Int) {
+            write<quint8>(IntValue);
+            write<qint32>(value.toInt());
+        } else if (type == QMetaType::UInt) {
+            write<quint8>(UIntValue);
+            write<quint32>(value.toUInt());
+        } else if (type == QMetaType::LongLong) {
+            write<quint8>(LongLongValue);
+            write<qint64>(value.toLongLong());
+        } else if (type == QMetaType::ULongLong) {
+            write<quint8>(ULongLongValue);
+            write<quint64>(value.toULongLong());
+        } else if (type == QMetaType::Double) {
+            write<quint8>(DoubleValue);
+            write<double>(value.toDouble());
+        } else if (type == QMetaType::QString) {
+            write<quint8>(StringValue);
+            writeString(value.toString());
+        } else if (type == QMetaType::QStringList) {
+            const QStringList list(value.toStringList());
+            write<quint8>(StringListValue);
+            write<quint32>(list.count());
+            foreach (const QString &s, list) {
+                writeString(s);
+            }
+        } else if (type == QMetaType::QByteArray) {
+            const QByteArray bytes(value.toByteArray());
+            write<quint8>(ByteArrayValue);
+            writeBytes(bytes.constData(), bytes.size());
+        } else if (type == QMetaType::QDateTime && isEncodableDateTime(value.toDateTime())) {
+            write<quint8>(DateTimeValue);
+            writeDateTime(value.toDateTime());
+        } else if (type == QMetaType::QDate) {
+            const QDate date(value.toDate());
+            write<quint8>(DateValue);
+            write<qint64>(date.isValid() ? date.toJulianDay() : std::numeric_limits<qint64>::min());
+        } else if (type == qMetaTypeId<QList<int> >()) {
+            const QList<int> list(value.value<QList<int> >());
+            write<quint8>(IntListValue);
+            write<quint32>(list.count());
+            foreach (int v, list) {
+                write<qint32>(v);
+            }
+        } else if (type == QMetaType::QUrl) {
+            const QByteArray bytes(value.toUrl().toEncoded());
+            write<quint8>(UrlValue);
+            writeBytes(bytes.constData(), bytes.size());
+        } else {
+            // Any other type is stored in its QDataStream form
+            QByteArray bytes;
+            QDataStream os(&bytes, QIODevice::WriteOnly);
+            os << value;
+            write<quint8>(VariantValue);
+            writeBytes(bytes.constData(), bytes.size());
+        }
+    }
+
+    static bool isEncodableDateTime(const QDateTime &dt)
+    {
+        return !dt.isValid() || dt.timeSpec() == Qt::UTC || dt.timeSpec() == Qt::LocalTime;
+    }
+
+    void writeDateTime(const QDateTime &dt)
+    {
+        write<qint64>(dt.isValid() ? dt.toMSecsSinceEpoch() : std::numeric_limits<qint64>::min());
+        write<quint8>(dt.timeSpec() == Qt::LocalTime ? Qt::LocalTime : Qt::UTC);
+    }
+
+private:
+    QByteArray *m_data;
+};
+
+class EntryDecoder
+{
+public:
+    EntryDecoder(const char *data, size_t len) : m_pos(data), m_end(data + len) {}
+
+    template<typename T>
+    bool read(T *value)
+    {
+        if (static_cast<size_t>(m_end - m_pos) < sizeof(T))
+            return false;
+        std::memcpy(value, m_pos, sizeof(T));
+        m_pos += sizeof(T);
+        return true;
+    }
+
+    bool readBytes(const char **src, quint32 *len)
+    {
+        if (!read(len) || static_cast<size_t>(m_end - m_pos) < *len)
+            return false;
+        *src = m_pos;
+        m_pos += *len;
+        return true;
+    }
+
+    bool readString(QString *s)
+    {
+        const char *src;
+        quint32 len;
+        if (!readBytes(&src, &len) || (len % sizeof(QChar)) != 0)
+            return false;
+        *s = QString(len / sizeof(QChar), Qt::Uninitialized);
+        std::memcpy(s->data(), src, len);
+        return true;
+    }
+
+    bool readDateTime(QDateTime *dt)
+    {
+        qint64 msecs;
+        quint8 spec;
+        if (!read(&msecs) || !read(&spec))
+            return false;
+        if (msecs == std::numeric_limits<qint64>::min()) {
+            *dt = QDateTime();
+        } else {
+            *dt = QDateTime::fromMSecsSinceEpoch(msecs, spec == Qt::LocalTime ? Qt::LocalTime : Qt::UTC);
+        }
+        return true;
+    }
+
+    bool readValue(QVariant *value)
+    {
+        quint8 type;
+        if (!read(&type))
+            return false;
+
+        switch (type) {
+        case InvalidValue:
+            *value = QVariant();
+            return true;
+        case BoolValue: {
+            quint8 v;
+            if (!read(&v))
+                return false;
+            *value = QVariant(v != 0);
+            return true;
+        }
+        case IntValue: {
+            qint32 v;
+            if (!read(&v))
+                return false;
+            *value = QVariant(static_cast<int>(v));
+            return true;
+        }
+        case UIntValue: {
+            quint32 v;
+            if (!read(&v))
+                return false;
+            *value = QVariant(static_cast<uint>(v));
+            return true;
+        }
+        case LongLongValue: {
+            qint64 v;
+            if (!read(&v))
+                return false;
+            *value = QVariant(static_cast<qlonglong>(v));
+            return true;
+        }
+        case ULongLongValue: {
+            quint64 v;
+            if (!read(&v))
+                return false;
+            *value = QVariant(static_cast<qulonglong>(v));
+            return true;
+        }
+        case DoubleValue: {
+            double v;
+            if (!read(&v))
+                return false;
+            *value = QVariant(v);
+            return true;
+        }
+        case StringValue: {
+            QString s;
+            if (!readString(&s))
+                return false;
+            *value = QVariant(s);
+            return true;
+        }
+        case StringListValue: {
+            quint32 count;
+            if (!read(&count))
+                return false;
+            QStringList list;
+            list.reserve(qMin<quint32>(count, static_cast<quint32>((m_end - m_pos) / sizeof(quint32))));
+            for (quint32 i = 0; i < count; ++i) {
+                QString s;
+                if (!readString(&s))
+                    return false;
+                list.append(s);
+            }
+            *value = QVariant(list);
+            return true;
+        }
+        case ByteArrayValue: {
+            const char *src;
+            quint32 len;
+            if (!readBytes(&src, &len))
+                return false;
+            *value = QVariant(QByteArray(src, len));
+            return true;
+        }
+        case DateTimeValue: {
+            QDateTime dt;
+            if (!readDateTime(&dt))
+                return false;
+            *value = QVariant(dt);
+            return true;
+        }
+        case DateValue: {
+            qint64 jd;
+            if (!read(&jd))
+                return false;
+            *value = QVariant(jd == std::numeric_limits<qint64>::min() ? QDate() : QDate::fromJulianDay(jd));
+            return true;
+        }
+        case IntListValue: {
+            quint32 count;
+            if (!read(&count) || static_cast<size_t>(m_end - m_pos) / sizeof(qint32) < count)
+                return false;
+            QList<int> list;
+            list.reserve(count);
+            for (quint32 i = 0; i < count; ++i) {
+                qint32 v;
+                read(&v);
+                list.append(v);
+            }
+            *value = QVariant::fromValue(list);
+            return true;
+        }
+        case UrlValue: {
+            const char *src;
+            quint32 len;
+            if (!readBytes(&src, &len))
+                return false;
+            *value = QVariant(QUrl::fromEncoded(QByteArray::fromRawData(src, len)));
+            return true;
+        }
+        case VariantValue: {
+            const char *src;
+            quint32 len;
+            if (!readBytes(&src, &len))
+                return false;
+            QDataStream is(QByteArray::fromRawData(src, len));
+            is >> *value;
+            return is.status() == QDataStream::Ok;
+        }
+        default:
+            return false;
+        }
+    }
+
+private:
+    const char *m_pos;
+    const char *m_end;
+};
+
+QByteArray encodeEntry(const QDateTime &timestamp, const QList<QContactDetail> &details)
+{
+    EntryHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = EntryMagic;
+    header.version = EntryFormatVersion;
+    header.flags = timestamp.isValid() ? 0 : NullTimestamp;
+    header.timeSpec = timestamp.timeSpec() == Qt::LocalTime ? Qt::LocalTime : Qt::UTC;
+    header.timestamp = timestamp.isValid() ? timestamp.toMSecsSinceEpoch() : 0;
+    header.detailCount = details.count();
+
+    foreach (const QContactDetail &detail, details) {
+        if (detail.type() == QContactGlobalPresence::Type) {
+            header.flags |= HasGlobalPresence;
+            header.presenceState = detail.value<int>(QContactGlobalPresence::FieldPresenceState);
+            break;
+        }
+    }
+
+    QByteArray data;
+    data.reserve(sizeof(EntryHeader) + details.count() * 128);
+    data.append(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    EntryEncoder encoder(&data);
+    foreach (const QContactDetail &detail, details) {
+        const QMap<int, QVariant> values(detail.values());
+
+        encoder.write<quint32>(detail.type());
+        encoder.write<quint32>(detail.accessConstraints());
+        encoder.write<quint32>(values.count());
+
+        QMap<int, QVariant>::const_iterator it = values.constBegin(), end = values.constEnd();
+        for ( ; it != end; ++it) {
+            encoder.write<quint32>(it.key());
+            encoder.writeValue(it.value());
+        }
+    }
+
+    return data;
+}
+
+bool decodeHeader(const QByteArray &data, EntryHeader *header)
+{
+    if (static_cast<size_t>(data.size()) < sizeof(EntryHeader))
+        return false;
+
+    std::memcpy(header, data.constData(), sizeof(EntryHeader));
+    if (header->magic != EntryMagic)
+        return false;
+
+    if (header->version != EntryFormatVersion) {
+        // Written by a different version of this library; treat the entry as absent
+        static bool reported = false;
+        if (!reported) {
+            reported = true;
+            QTCONTACTS_SQLITE_WARNING(QStringLiteral("Ignoring transient store entries with unsupported format version: %1")
+                    .arg(header->version));
+        }
+        return false;
+    }
+
+    return true;
+}
+
+QDateTime headerTimestamp(const EntryHeader &header)
+{
+    if (header.flags & NullTimestamp)
+        return QDateTime();
+
+    return QDateTime::fromMSecsSinceEpoch(header.timestamp, header.timeSpec == Qt::LocalTime ? Qt::LocalTime : Qt::UTC);
+}
+
+QPair<QDateTime, QList<QContactDetail> > decodeEntry(const QByteArray &data)
+{
+    EntryHeader header;
+    if (!decodeHeader(data, &header))
+        return qMakePair(QDateTime(), QList<QContactDetail>());
+
+    QList<QContactDetail> details;
+    details.reserve(header.detailCount);
+
+    EntryDecoder decoder(data.constData() + sizeof(EntryHeader), data.size() - sizeof(EntryHeader));
+    for (quint32 i = 0; i < header.detailCount; ++i) {
+        quint32 type, accessConstraints, fieldCount;
+        if (!decoder.read(&type) || !decoder.read(&accessConstraints) || !decoder.read(&fieldCount))
+            break;
+
+        QContactDetail detail(static_cast<QContactDetail::DetailType>(type));
+        QContactManagerEngine::setDetailAccessConstraints(&detail, static_cast<QContactDetail::AccessConstraints>(accessConstraints));
+
+        bool valid = true;
+        for (quint32 j = 0; valid && j < fieldCount; ++j) {
+            quint32 field;
+            QVariant value;
+            if (decoder.read(&field) && decoder.readValue(&value)) {
+                detail.setValue(field, value);
+            } else {
+                valid = false;
+            }
+        }
+        if (!valid)
+            break;
+
+        details.append(detail);
+    }
+
+    if (static_cast<quint32>(details.count()) != header.detailCount) {
+        QTCONTACTS_SQLITE_WARNING(QStringLiteral("Invalid transient store entry: decoded %1 of %2 details")
+                .arg(details.count()).arg(header.detailCount));
+        return qMakePair(QDateTime(), QList<QContactDetail>());
+    }
+
+    return qMakePair(headerTimestamp(header), details);
+}
+
+// A snapshot file holds this header, followed by an image of a MemoryTable of transient entries.
+// Increment SnapshotFormatVersion for any change to the header or to the entry format.
+enum { SnapshotMagic = 0x53544351, SnapshotFormatVersion = 1 };
+
+struct SnapshotHeader {
+    quint32 magic;
+    quint32 version;
+    qint64 created;
+    quint32 tableSize;
+    quint32 checksum;
+    quint32 entryFormatVersion;
+    quint32 reserved;
+};
+
+quint32 snapshotChecksum(const char *data, size_t size)
+{
+    // FNV-1a
+    quint32 hash = 2166136261u;
+    for (const char *end = data + size; data != end; ++data) {
+        hash ^= static_cast<quint8>(*data);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Presence reported before a restart is soon misleading; other transient state remains
+// valid for as long as the snapshot itself
+enum { SnapshotPresenceMaximumAge = 10 * 60 };
+
+int snapshotMaximumAge(QContactDetail::DetailType type, int maximumAge)
+{
+    if (type == QContactPresence::Type || type == QContactGlobalPresence::Type)
+        return qMin<int>(maximumAge, SnapshotPresenceMaximumAge);
+
+    return maximumAge;
+}
+
+// Restores the entries of a snapshot into table, and reports the timestamp of each entry restored.
+// This may run while the store's semaphores are held, so the entries are validated against the
+// stored contacts separately, by supersededEntries()
+int restoreSnapshotEntries(MemoryTable &table, const QString &path, int maximumAge,
+                           QHash<quint32, QDateTime> *restoredTimestamps)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return -1;
+
+    const qint64 fileSize = file.size();
+    if (fileSize < static_cast<qint64>(sizeof(SnapshotHeader)))
+        return -1;
+
+    const uchar *data = file.map(0, fileSize);
+    if (!data) {
+        QTCONTACTS_SQLITE_WARNING(QStringLiteral("Unable to map transient store snapshot: %1").arg(path));
+        return -1;
+    }
+
+    SnapshotHeader header;
+    std::memcpy(&header, data, sizeof(header));
+
+    const qint64 age = (QDateTime::currentMSecsSinceEpoch() - header.created) / 1000;
+    if (header.magic != SnapshotMagic
+            || header.version != SnapshotFormatVersion
+            || header.entryFormatVersion != EntryFormatVersion
+            || static_cast<qint64>(sizeof(SnapshotHeader)) + header.tableSize != fileSize) {
+        QTCONTACTS_SQLITE_WARNING(QStringLiteral("Ignoring invalid transient store snapshot: %1").arg(path));
+        return -1;
+    }
+    if (age < 0 || age > maximumAge) {
+        QTCONTACTS_SQLITE_DEBUG(QStringLiteral("Ignoring stale transient store snapshot: %1 (%2 seconds old)").arg(path).arg(age));
+        return -1;
+    }
+
+    char *tableData = reinterpret_cast<char *>(const_cast<uchar *>(data)) + sizeof(SnapshotHeader);
+    if (snapshotChecksum(tableData, header.tableSize) != header.checksum) {
+        QTCONTACTS_SQLITE_WARNING(QStringLiteral("Ignoring corrupt transient store snapshot: %1").arg(path));
+        return -1;
+    }
+
+    // The mapping is read-only; the table is only read.  A snapshot written by another build
+    // may pass the checksum, so its structure is validated before any offset in it is followed
+    const MemoryTable snapshot(tableData, header.tableSize, false);
+    if (!snapshot.isValid() || !snapshot.isConsistent()) {
+        QTCONTACTS_SQLITE_WARNING(QStringLiteral("Ignoring invalid transient store snapshot table: %1").arg(path));
+        return -1;
+    }
+
+    int restored = 0;
+    for (size_t i = 0, count = snapshot.count(); i < count; ++i) {
+        const MemoryTable::key_type key = snapshot.keyAt(i);
+        const QByteArray value(snapshot.valueAt(i));
+
+        const QPair<QDateTime, QList<QContactDetail> > entry(decodeEntry(value));
+
+        // Discard any details that are too old to be restored
+        QList<QContactDetail> details;
+        foreach (const QContactDetail &detail, entry.second) {
+            if (age <= snapshotMaximumAge(detail.type(), maximumAge)) {
+                details.append(detail);
+            }
+        }
+        if (details.isEmpty())
+            continue;
+
+        const QByteArray restoredValue(details.count() == entry.second.count() ? value : encodeEntry(entry.first, details));
+        if (table.insert(key, restoredValue) != MemoryTable::NoError) {
+            QTCONTACTS_SQLITE_WARNING(QStringLiteral("Insufficient space to restore transient store snapshot: %1").arg(path));
+            break;
+        }
+        ++restored;
+        if (restoredTimestamps) {
+            restoredTimestamps->insert(key, entry.first);
+        }
+    }
+
+    QTCONTACTS_SQLITE_DEBUG(QStringLiteral("Restored %1 transient store entries from snapshot: %2 (%3 seconds old)")
+            .arg(restored).arg(path).arg(age));
+    return restored;
+}
+
+// Returns the restored entries which must be discarded, since their contacts have since been removed,
+// or their durable modification has superseded the transient details
+QList<quint32> supersededEntries(const QHash<quint32, QDateTime> &restoredTimestamps,
+                                 ContactsTransientStore::StoredTimestamps *storedTimestamps)
+{
+    const QHash<quint32, QDateTime> modified(storedTimestamps->modificationTimestamps(restoredTimestamps.keys()));
+
+    QList<quint32> superseded;
+    for (QHash<quint32, QDateTime>::const_iterator it = restoredTimestamps.constBegin(); it != restoredTimestamps.constEnd(); ++it) {
+        QHash<quint32, QDateTime>::const_iterator mit = modified.constFind(it.key());
+        if (mit == modified.constEnd() || (mit->isValid() && *it < *mit)) {
+            superseded.append(it.key());
+        }
+    }
+    return superseded;
+}
+
+}
+
 ContactsTransientStore::const_iterator::const_iterator(const MemoryTable *table, quint32 position)
     : MemoryTable::const_iterator(table, position)
 {
@@ -638,16 +1372,27 @@ ContactsTransientStore::DataLock::operator bool() const
 
 QPair<QDateTime, QList<QContactDetail> > ContactsTransientStore::const_iterator::value()
 {
-    const QByteArray data(MemoryTable::const_iterator::value());
-    if (!data.isEmpty()) {
-        QDataStream is(data);
-        QDateTime dt;
-        QList<QContactDetail> details;
-        is >> dt >> details;
-        return qMakePair(dt, details);
+    return decodeEntry(MemoryTable::const_iterator::value());
+}
+
+QDateTime ContactsTransientStore::const_iterator::timestamp()
+{
+    EntryHeader header;
+    if (decodeHeader(MemoryTable::const_iterator::value(), &header))
+        return headerTimestamp(header);
+
+    return QDateTime();
+}
+
+bool ContactsTransientStore::const_iterator::globalPresenceState(int *state)
+{
+    EntryHeader header;
+    if (decodeHeader(MemoryTable::const_iterator::value(), &header) && (header.flags & HasGlobalPresence)) {
+        *state = header.presenceState;
+        return true;
     }
 
-    return qMakePair(QDateTime(), QList<QContactDetail>());
+    return false;
 }
 
 ContactsTransientStore::ContactsTransientStore()
@@ -658,9 +1403,14 @@ ContactsTransientStore::~ContactsTransientStore()
 {
 }
 
-bool ContactsTransientStore::open(bool nonprivileged, bool createIfNecessary, bool reinitialize)
+bool ContactsTransientStore::open(bool nonprivileged, bool createIfNecessary, bool reinitialize,
+                                  const QString &snapshotPath, int snapshotMaximumAge,
+                                  StoredTimestamps *storedTimestamps)
 {
-    const QString identifier(nonprivileged ? QStringLiteral("qtcontacts-sqlite-np") : QStringLiteral("qtcontacts-sqlite"));
+    // The region name includes the table layout and entry format generation, since processes
+    // using an earlier generation cannot interpret this one; those processes continue to share
+    // their own region, and do not observe transient changes made by processes using this one
+    const QString identifier(nonprivileged ? QStringLiteral("qtcontacts-sqlite-np-t3") : QStringLiteral("qtcontacts-sqlite-t3"));
 
     if (!m_identifier.isNull()) {
         QTCONTACTS_SQLITE_WARNING(QStringLiteral("Cannot re-open active transient store: %1 (%2)")
@@ -668,19 +1418,130 @@ bool ContactsTransientStore::open(bool nonprivileged, bool createIfNecessary, bo
         return false;
     }
 
-    if (sharedMemory()->open(identifier, createIfNecessary, reinitialize)) {
+    // A store created by this process is restored from the snapshot, unless the database is new
+    size_t initialSize = 0;
+    QHash<quint32, QDateTime> restoredTimestamps;
+    SharedMemoryManager::Initializer initializer;
+    if (createIfNecessary && !reinitialize && !snapshotPath.isEmpty() && snapshotMaximumAge > 0) {
+        const QFileInfo snapshotInfo(snapshotPath);
+        if (snapshotInfo.exists()) {
+            initialSize = static_cast<size_t>(snapshotInfo.size());
+            initializer = std::tr1::bind(&restoreSnapshotEntries, std::tr1::placeholders::_1, snapshotPath, snapshotMaximumAge, &restoredTimestamps);
+        }
+    }
+
+    if (sharedMemory()->open(identifier, createIfNecessary, reinitialize, initialSize, initializer)) {
         m_identifier = identifier;
+
+        // The stored contacts are queried once the semaphores held while restoring are released
+        if (storedTimestamps && !restoredTimestamps.isEmpty()) {
+            removeSupersededEntries(restoredTimestamps, supersededEntries(restoredTimestamps, storedTimestamps));
+        }
         return true;
     }
 
     return false;
 }
 
+void ContactsTransientStore::removeSupersededEntries(const QHash<quint32, QDateTime> &restoredTimestamps,
+                                                     const QList<quint32> &contactIds)
+{
+    SharedMemoryManager::TableHandle table(sharedMemory()->table(m_identifier));
+    if (!table)
+        return;
+
+    // An entry is retained if another process has replaced it since it was restored
+    int removed = 0;
+    foreach (quint32 contactId, contactIds) {
+        EntryHeader header;
+        if (decodeHeader(table->value(contactId), &header)
+                && headerTimestamp(header) == restoredTimestamps.value(contactId)
+                && table->remove(contactId)) {
+            ++removed;
+        }
+    }
+    if (removed) {
+        sharedMemory()->itemsRemoved(m_identifier, removed);
+    }
+
+    QTCONTACTS_SQLITE_DEBUG(QStringLiteral("Removed %1 superseded transient store entries restored from snapshot: %2")
+            .arg(removed).arg(m_identifier));
+}
+
+int ContactsTransientStore::restoreSnapshot(MemoryTable &table, const QString &path, int maximumAge,
+                                            StoredTimestamps *storedTimestamps)
+{
+    QHash<quint32, QDateTime> restoredTimestamps;
+    int restored = restoreSnapshotEntries(table, path, maximumAge, &restoredTimestamps);
+    if (storedTimestamps && restored > 0) {
+        foreach (quint32 contactId, supersededEntries(restoredTimestamps, storedTimestamps)) {
+            if (table.remove(contactId))
+                --restored;
+        }
+    }
+    return restored;
+}
+
+bool ContactsTransientStore::saveSnapshot(const QString &path) const
+{
+    QByteArray image;
+    {
+        const SharedMemoryManager::TableHandle table(sharedMemory()->table(m_identifier));
+        if (!table)
+            return false;
+
+        // Migration compacts the entries; try an image with modest free space before the full size
+        const size_t used = table->size() - table->freeSpace();
+        QList<size_t> sizes;
+        sizes << std::min<size_t>(table->size(), used + used / 4 + 4096) << table->size();
+
+        foreach (size_t size, sizes) {
+            image.fill('\0', sizeof(SnapshotHeader) + size);
+
+            MemoryTable copy(image.data() + sizeof(SnapshotHeader), size, true);
+            if (copy.isValid() && table->migrateTo(copy) == MemoryTable::NoError) {
+                // The table may manage slightly less than the space provided
+                image.resize(sizeof(SnapshotHeader) + copy.size());
+                break;
+            }
+            image.clear();
+        }
+    }
+
+    if (image.isEmpty()) {
+        QTCONTACTS_SQLITE_WARNING(QStringLiteral("Unable to copy transient store for snapshot: %1").arg(m_identifier));
+        return false;
+    }
+
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = SnapshotMagic;
+    header.version = SnapshotFormatVersion;
+    header.created = QDateTime::currentMSecsSinceEpoch();
+    header.tableSize = image.size() - sizeof(SnapshotHeader);
+    header.checksum = snapshotChecksum(image.constData() + sizeof(SnapshotHeader), header.tableSize);
+    header.entryFormatVersion = EntryFormatVersion;
+    std::memcpy(image.data(), &header, sizeof(header));
+
+    // Replace any previous snapshot atomically
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)
+            || file.write(image) != image.size()
+            || !file.commit()) {
+        QTCONTACTS_SQLITE_WARNING(QStringLiteral("Unable to write transient store snapshot: %1: %2").arg(path).arg(file.errorString()));
+        return false;
+    }
+
+    return true;
+}
+
 bool ContactsTransientStore::contains(quint32 contactId) const
 {
-    const SharedMemoryManager::TableHandle table(sharedMemory()->table(m_identifier));
-    if (table) {
-        return table->contains(contactId);
+    QByteArray data;
+    if (readEntry(contactId, &data)) {
+        // Entries written in a format we cannot read are not reported
+        EntryHeader header;
+        return decodeHeader(data, &header);
     }
 
     return false;
@@ -688,32 +1549,87 @@ bool ContactsTransientStore::contains(quint32 contactId) const
 
 QPair<QDateTime, QList<QContactDetail> > ContactsTransientStore::contactDetails(quint32 contactId) const
 {
-    const SharedMemoryManager::TableHandle table(sharedMemory()->table(m_identifier));
-    if (table) {
-        const QByteArray data(table->value(contactId));
-        if (!data.isEmpty()) {
-            QDataStream is(data);
-            QDateTime dt;
-            QList<QContactDetail> details;
-            is >> dt >> details;
-            return qMakePair(dt, details);
-        }
+    QByteArray data;
+    if (readEntry(contactId, &data)) {
+        return decodeEntry(data);
     }
 
     return qMakePair(QDateTime(), QList<QContactDetail>());
 }
 
+QHash<quint32, QPair<QDateTime, QList<QContactDetail> > > ContactsTransientStore::contactDetails(const QList<quint32> &contactIds) const
+{
+    QHash<quint32, QPair<QDateTime, QList<QContactDetail> > > rv;
+
+    // Copy the matching entries with the data lock held once, and decode them after releasing it
+    QList<QPair<quint32, QByteArray> > entries;
+    {
+        const SharedMemoryManager::TableHandle table(sharedMemory()->table(m_identifier));
+        if (!table || table->count() == 0)
+            return rv;
+
+        if (table->count() < static_cast<size_t>(contactIds.count())) {
+            // Fewer entries than ids; visit each entry and search the sorted ids for its key
+            for (MemoryTable::const_iterator it = table->constBegin(), end = table->constEnd(); it != end; ++it) {
+                const quint32 contactId = it.key();
+                if (std::binary_search(contactIds.constBegin(), contactIds.constEnd(), contactId)) {
+                    const QByteArray value(it.value());
+                    entries.append(qMakePair(contactId, QByteArray(value.constData(), value.size())));
+                }
+            }
+        } else {
+            foreach (quint32 contactId, contactIds) {
+                const QByteArray value(table->value(contactId));
+                if (!value.isEmpty()) {
+                    entries.append(qMakePair(contactId, QByteArray(value.constData(), value.size())));
+                }
+            }
+        }
+    }
+
+    rv.reserve(entries.count());
+
+    QList<QPair<quint32, QByteArray> >::const_iterator it = entries.constBegin(), end = entries.constEnd();
+    for ( ; it != end; ++it) {
+        EntryHeader header;
+        if (decodeHeader(it->second, &header)) {
+            rv.insert(it->first, decodeEntry(it->second));
+        }
+    }
+
+    return rv;
+}
+
+bool ContactsTransientStore::readEntry(quint32 contactId, QByteArray *data) const
+{
+    // Readers only take the data lock if writers prevent a consistent lock-free lookup
+    bool found = false;
+    if (sharedMemory()->readValue(m_identifier, contactId, data, &found))
+        return found;
+
+    const SharedMemoryManager::TableHandle table(sharedMemory()->table(m_identifier));
+    if (table && table->contains(contactId)) {
+        // Copy the value, since it is decoded after the lock is released
+        const QByteArray value(table->value(contactId));
+        *data = QByteArray(value.constData(), value.size());
+        return true;
+    }
+
+    return false;
+}
+
 bool ContactsTransientStore::setContactDetails(quint32 contactId, const QDateTime &timestamp, const QList<QContactDetail> &details)
 {
     SharedMemoryManager::TableHandle table(sharedMemory()->table(m_identifier));
     if (table) {
-        QByteArray data;
-        QDataStream os(&data, QIODevice::WriteOnly);
-        os << timestamp << details;
+        const QByteArray data(encodeEntry(timestamp, details));
 
         MemoryTable::Error err = table->insert(contactId, data);
-        if (err == MemoryTable::InsufficientSpace) {
-            // Reallocate the table to provide more space
+        // A single entry may exceed the space added by one reallocation
+        const int maximumReallocations = 4;
+
+        for (int i = 0; err == MemoryTable::InsufficientSpace && i < maximumReallocations; ++i) {
+            // The table could not reclaim enough space in place; reallocate the table to provide more space
             SharedMemoryManager::TableHandle newTable(sharedMemory()->reallocateTable(m_identifier));
             if (newTable) {
                 // Perform the write to the new table
@@ -738,7 +1654,10 @@ bool ContactsTransientStore::remove(quint32 contactId)
 {
     SharedMemoryManager::TableHandle table(sharedMemory()->table(m_identifier));
     if (table) {
-        return table->remove(contactId);
+        if (table->remove(contactId)) {
+            sharedMemory()->itemsRemoved(m_identifier, 1);
+            return true;
+        }
     }
 
     return false;
@@ -748,16 +1667,48 @@ bool ContactsTransientStore::remove(const QList<quint32> &contactIds)
 {
     SharedMemoryManager::TableHandle table(sharedMemory()->table(m_identifier));
     if (table) {
-        bool removed(false);
+        int removed = 0;
         foreach (quint32 contactId, contactIds) {
-            removed |= table->remove(contactId);
+            if (table->remove(contactId))
+                ++removed;
         }
-        return removed;
+        if (removed) {
+            sharedMemory()->itemsRemoved(m_identifier, removed);
+        }
+        return removed != 0;
     }
 
     return false;
 }
 
+int ContactsTransientStore::utilization() const
+{
+    const SharedMemoryManager::TableHandle table(sharedMemory()->table(m_identifier));
+    if (table && table->size()) {
+        return static_cast<int>(((table->size() - table->freeSpace()) * 100) / table->size());
+    }
+
+    return 0;
+}
+
+int ContactsTransientStore::fragmentation() const
+{
+    const SharedMemoryManager::TableHandle table(sharedMemory()->table(m_identifier));
+    if (table) {
+        const size_t freeSpace = table->freeSpace();
+        if (freeSpace) {
+            return static_cast<int>((table->fragmentedSpace() * 100) / freeSpace);
+        }
+    }
+
+    return 0;
+}
+
+quint64 ContactsTransientStore::generation() const
+{
+    return sharedMemory()->generation(m_identifier);
+}
+
 ContactsTransientStore::DataLock ContactsTransientStore::dataLock() const
 {
     SharedMemoryManager::TableHandle table(sharedMemory()->table(m_identifier));
@@ -39,6 +39,7 @@
 #include <QContactDetail>
 
 #include <QDateTime>
+#include <QHash>
 #include <QPair>
 #include <QSharedPointer>
 
@@ -61,6 +62,10 @@ public:
 
         quint32 key();
         QPair<QDateTime, QList<QContactDetail> > value();
+
+        // Read from the entry header only, without decoding the details
+        QDateTime timestamp();
+        bool globalPresenceState(int *state);
     };
 
     class DataLock
@@ -81,25 +86,63 @@ public:
         QSharedPointer<DataLockPrivate> lock;
     };
 
+    // Provides the durable state against which the entries of a snapshot are validated
+    class StoredTimestamps
+    {
+    public:
+        virtual ~StoredTimestamps() {}
+
+        // Returns the modification timestamps of those of the contacts which still exist
+        virtual QHash<quint32, QDateTime> modificationTimestamps(const QList<quint32> &contactIds) = 0;
+    };
+
     ContactsTransientStore();
     ~ContactsTransientStore();
 
-    bool open(bool nonprivileged, bool createIfNecessary, bool reinitialize);
+    // If this process creates the store, it is populated from the snapshot at snapshotPath, provided
+    // that the snapshot is at most snapshotMaximumAge seconds old.  The restored entries superseded
+    // according to storedTimestamps are removed once the store is open
+    bool open(bool nonprivileged, bool createIfNecessary, bool reinitialize,
+              const QString &snapshotPath = QString(), int snapshotMaximumAge = 0,
+              StoredTimestamps *storedTimestamps = 0);
+
+    // Write the current content of the store to a file, in a form that open() can restore from
+    bool saveSnapshot(const QString &path) const;
+
+    // Inserts the entries of a snapshot into table, omitting details too old to restore; returns
+    // the number of entries restored, or -1 if the snapshot is missing, invalid or stale.
+    // If storedTimestamps is provided, entries are omitted for contacts which no longer exist, or
+    // which have been modified durably since the entry was written
+    static int restoreSnapshot(MemoryTable &table, const QString &path, int maximumAge,
+                               StoredTimestamps *storedTimestamps = 0);
 
     bool contains(quint32 contactId) const;
 
     QPair<QDateTime, QList<QContactDetail> > contactDetails(quint32 contactId) const;
+
+    // Returns the details of those contacts that have any, for a list of ids sorted in ascending order
+    QHash<quint32, QPair<QDateTime, QList<QContactDetail> > > contactDetails(const QList<quint32> &contactIds) const;
     bool setContactDetails(quint32 contactId, const QDateTime &timestamp, const QList<QContactDetail> &details);
 
     bool remove(quint32 contactId);
     bool remove(const QList<quint32> &contactId);
 
+    // Percentage of the store's space in use, and of its free space that is fragmented
+    int utilization() const;
+    int fragmentation() const;
+
+    // Changes whenever the content of the store changes; zero if the content cannot be identified
+    quint64 generation() const;
+
     DataLock dataLock() const;
 
     const_iterator constBegin(const DataLock &) const;
     const_iterator constEnd(const DataLock &) const;
 
 private:
+    bool readEntry(quint32 contactId, QByteArray *data) const;
+    void removeSupersededEntries(const QHash<quint32, QDateTime> &restoredTimestamps, const QList<quint32> &contactIds);
+
     QString m_identifier;
 };
 
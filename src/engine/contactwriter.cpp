@@ -54,10 +54,12 @@
 #include <QContactVersion>
 
 #include <QSqlError>
+#include <QTemporaryFile>
 #include <QUuid>
 
 #include <algorithm>
 #include <cmath>
+#include <limits>
 
 #include <QtDebug>
 #include <QElapsedTimer>
@@ -94,8 +96,142 @@ namespace {
 
         return entropy / 8;
     }
+
+    double sampleEntropy(const QByteArray &data)
+    {
+        // Sample at most 256 bytes, skipping the first 256 where possible
+        const int offset = qMin(256, qMax(0, data.size() - 256));
+        const int count = qMin(256, data.size() - offset);
+        return count ? entropy(data.constBegin() + offset, data.constBegin() + offset + count, count) : 1.0;
+    }
+
+    OOBCodec::Codec oobCodec(ContactsEngine::OOBCompression compression)
+    {
+        switch (compression) {
+        case ContactsEngine::LZ4Compression:
+            return OOBCodec::LZ4;
+        case ContactsEngine::ZstdCompression:
+            return OOBCodec::Zstd;
+        default:
+            return OOBCodec::Zlib;
+        }
+    }
+
+    // Yields the value to store, compressed if that is worthwhile; dictionaryId may be zero
+    QVariant encodeOOBValue(OOBCodec &codecs, OOBCodec::Codec codec, quint32 dictionaryId, const QVariant &value, quint32 *encoding)
+    {
+        *encoding = ContactsDatabase::OOBUncompressed;
+
+        QByteArray data;
+        ContactsDatabase::OOBEncoding form = ContactsDatabase::OOBUncompressed;
+        bool large = false;
+        if (value.type() == static_cast<QVariant::Type>(QMetaType::QByteArray)) {
+            data = value.value<QByteArray>();
+            form = ContactsDatabase::OOBCompressedBytes;
+            large = data.size() > 512;
+        } else if (value.type() == static_cast<QVariant::Type>(QMetaType::QString)) {
+            const QString uncompressed(value.value<QString>());
+            data = uncompressed.toUtf8();
+            form = ContactsDatabase::OOBCompressedString;
+            large = uncompressed.size() > 256;
+        }
+        if (form == ContactsDatabase::OOBUncompressed)
+            return value;
+
+        // If the data is large, compress it to reduce the IO cost, unless its entropy shows it is
+        // unlikely to compress significantly.  Small values can only be compressed usefully with
+        // a dictionary trained on similar values.
+        OOBCodec::Codec valueCodec = codec;
+        bool compress = false;
+        if (large) {
+            compress = sampleEntropy(data) < 0.85;
+        } else if (dictionaryId != 0 && data.size() >= 32) {
+            valueCodec = OOBCodec::ZstdDictionary;
+            compress = true;
+        }
+
+        if (compress) {
+            const QByteArray compressedData(codecs.compress(valueCodec, data, dictionaryId));
+            if (!compressedData.isEmpty() && compressedData.size() < data.size()) {
+                *encoding = ContactsDatabase::oobEncoding(form, valueCodec);
+                return QVariant(compressedData);
+            }
+        }
+        return value;
+    }
+
+    QList<quint32> journalIds(const QSet<QContactId> &ids)
+    {
+        QList<quint32> rv;
+        rv.reserve(ids.count());
+        foreach (const QContactId &id, ids) {
+            rv.append(ContactId::databaseId(id));
+        }
+        return rv;
+    }
+
+    QList<quint32> journalIds(const QSet<QContactCollectionId> &ids)
+    {
+        QList<quint32> rv;
+        rv.reserve(ids.count());
+        foreach (const QContactCollectionId &id, ids) {
+            rv.append(ContactCollectionId::databaseId(id));
+        }
+        return rv;
+    }
+
+    // The net effect of a sequence of change journal entries, on contacts or on collections
+    struct JournalFold {
+        JournalFold() : typesUnknown(false) {}
+
+        void add(const QList<quint32> &ids)
+        {
+            foreach (quint32 id, ids) {
+                added.insert(id);
+                removed.remove(id);
+            }
+        }
+
+        void change(const QList<quint32> &ids, const QList<quint32> &detailTypes)
+        {
+            // A change following a removal is an undeletion, which clients that saw the
+            // removal must treat as an addition
+            foreach (quint32 id, ids) {
+                if (removed.remove(id)) {
+                    added.insert(id);
+                } else if (!added.contains(id)) {
+                    changed.insert(id);
+                }
+            }
+            if (detailTypes.isEmpty()) {
+                typesUnknown = true;
+            } else {
+                types.unite(detailTypes.toSet());
+            }
+        }
+
+        void remove(const QList<quint32> &ids)
+        {
+            // The removal is retained even if the addition is also folded, as a client
+            // whose cursor lies within the folded range may have seen the addition
+            foreach (quint32 id, ids) {
+                removed.insert(id);
+                added.remove(id);
+                changed.remove(id);
+            }
+        }
+
+        QSet<quint32> added;
+        QSet<quint32> changed;
+        QSet<quint32> removed;
+        QSet<quint32> types;
+        bool typesUnknown;
+    };
 }
 
+// Below this, folding would not reduce the number of journal entries
+static const int minimumChangeJournalLimit = 16;
+
 static const QString aggregateSyncTarget(QStringLiteral("aggregate"));
 static const QString localSyncTarget(QStringLiteral("local"));
 static const QString wasLocalSyncTarget(QStringLiteral("was_local"));
@@ -118,6 +254,9 @@ ContactWriter::ContactWriter(ContactsEngine &engine, ContactsDatabase &database,
     , m_reader(reader)
     , m_managerUri(engine.managerUri())
     , m_displayLabelGroupsChanged(false)
+    , m_changedDetailTypesUnknown(false)
+    , m_constituentUpdate(false)
+    , m_preparedContact(0)
 {
     Q_ASSERT(notifier);
     Q_ASSERT(reader);
@@ -127,19 +266,30 @@ ContactWriter::~ContactWriter()
 {
 }
 
-bool ContactWriter::beginTransaction()
+bool ContactWriter::beginTransaction(ContactsDatabase::WriteLockSite site)
 {
-    return m_database.beginTransaction();
+    return m_database.beginTransaction(site);
 }
 
 bool ContactWriter::commitTransaction()
 {
+    // The journal entries are committed with the changes they describe
+    if (!writeChangeJournal()) {
+        rollbackTransaction();
+        return false;
+    }
+
     if (!m_database.commitTransaction()) {
         QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Commit error: %1").arg(m_database.lastError().text()));
         rollbackTransaction();
         return false;
     }
 
+    if (!m_notifier->coalescing()) {
+        // Notifications held for asynchronous requests are emitted first, preserving their order
+        m_engine.flushHeldNotifications();
+    }
+
     if (m_displayLabelGroupsChanged) {
         m_notifier->displayLabelGroupsChanged();
         m_displayLabelGroupsChanged = false;
@@ -157,9 +307,13 @@ bool ContactWriter::commitTransaction()
         m_addedIds.clear();
     }
     if (!m_changedIds.isEmpty()) {
-        m_notifier->contactsChanged(m_changedIds.toList());
+        // An empty type list indicates that the changed types are unspecified
+        m_notifier->contactsChanged(m_changedIds.toList(),
+                                    m_changedDetailTypesUnknown ? QList<QContactDetail::DetailType>() : m_changedDetailTypes.toList());
         m_changedIds.clear();
     }
+    m_changedDetailTypes.clear();
+    m_changedDetailTypesUnknown = false;
     if (!m_presenceChangedIds.isEmpty()) {
         m_notifier->contactsPresenceChanged(m_presenceChangedIds.toList());
         m_presenceChangedIds.clear();
@@ -195,6 +349,203 @@ bool ContactWriter::commitTransaction()
     return true;
 }
 
+bool ContactWriter::writeChangeJournal()
+{
+    typedef QtContactsSqliteExtensions::ContactManagerEngine::ChangeJournalEntry ChangeJournalEntry;
+
+    // Entries are written in the order in which the changes are reported
+    QList<QPair<ChangeJournalEntry::Kind, QList<quint32> > > changes;
+    if (!m_addedCollectionIds.isEmpty())
+        changes.append(qMakePair(ChangeJournalEntry::CollectionsAdded, journalIds(m_addedCollectionIds)));
+    if (!m_changedCollectionIds.isEmpty())
+        changes.append(qMakePair(ChangeJournalEntry::CollectionsChanged, journalIds(m_changedCollectionIds)));
+    if (!m_addedIds.isEmpty())
+        changes.append(qMakePair(ChangeJournalEntry::ContactsAdded, journalIds(m_addedIds)));
+    if (!m_changedIds.isEmpty())
+        changes.append(qMakePair(ChangeJournalEntry::ContactsChanged, journalIds(m_changedIds)));
+    if (!m_removedIds.isEmpty())
+        changes.append(qMakePair(ChangeJournalEntry::ContactsRemoved, journalIds(m_removedIds)));
+    if (!m_removedCollectionIds.isEmpty())
+        changes.append(qMakePair(ChangeJournalEntry::CollectionsRemoved, journalIds(m_removedCollectionIds)));
+
+    if (changes.isEmpty()) {
+        return true;
+    }
+
+    QList<quint32> changedTypes;
+    if (!m_changedDetailTypesUnknown) {
+        foreach (QContactDetail::DetailType type, m_changedDetailTypes) {
+            changedTypes.append(type);
+        }
+    }
+
+    const QString insertEntry(QStringLiteral(
+        " INSERT INTO ChangeJournal (kind, ids, detailTypes)"
+        " VALUES (:kind, :ids, :detailTypes)"));
+
+    quint64 latestSequence = 0;
+    for (int i = 0; i < changes.count(); ++i) {
+        const ChangeJournalEntry::Kind kind(changes.at(i).first);
+
+        ContactsDatabase::Query query(m_database.prepare(insertEntry));
+        query.bindValue(QStringLiteral(":kind"), static_cast<int>(kind));
+        query.bindValue(QStringLiteral(":ids"), ContactsDatabase::packJournalValues(changes.at(i).second));
+        query.bindValue(QStringLiteral(":detailTypes"), kind == ChangeJournalEntry::ContactsChanged
+                                                            ? ContactsDatabase::packJournalValues(changedTypes)
+                                                            : QByteArray());
+        if (!ContactsDatabase::execute(query)) {
+            query.reportError("Failed to write change journal entry");
+            return false;
+        }
+        latestSequence = query.lastInsertId().toULongLong();
+    }
+
+    return compactChangeJournal(latestSequence);
+}
+
+bool ContactWriter::compactChangeJournal(quint64 latestSequence)
+{
+    typedef QtContactsSqliteExtensions::ContactManagerEngine::ChangeJournalEntry ChangeJournalEntry;
+
+    if (m_engine.changeJournalLimit() <= 0) {
+        return true;
+    }
+    const quint64 limit = qMax(m_engine.changeJournalLimit(), minimumChangeJournalLimit);
+
+    // Sequences are contiguous above the folded entries, which are stored at the top of their range
+    quint64 firstSequence = 0;
+    {
+        ContactsDatabase::Query query(m_database.prepare("SELECT MIN(sequence) FROM ChangeJournal"));
+        if (!ContactsDatabase::execute(query) || !query.next()) {
+            query.reportError("Failed to query change journal extent");
+            return false;
+        }
+        firstSequence = query.value<quint64>(0);
+    }
+    if (latestSequence - firstSequence + 1 <= limit) {
+        return true;
+    }
+
+    // Fold all but the newest half of the permitted entries
+    const quint64 foldSequence = latestSequence - limit / 2;
+
+    // Only the entries folded by the previous compaction are replaced, rather than folded again, so
+    // that the journal does not accumulate every id ever changed.  Cursors preceding the end of
+    // their range can no longer be served, and their clients must refetch.
+    quint64 previousFoldSequence = 0;
+    {
+        ContactsDatabase::Query query(m_database.prepare("SELECT MAX(sequence) FROM ChangeJournal WHERE folded = 1"));
+        if (!ContactsDatabase::execute(query) || !query.next()) {
+            query.reportError("Failed to query folded change journal entries");
+            return false;
+        }
+        previousFoldSequence = query.value<quint64>(0);
+    }
+
+    JournalFold contacts;
+    JournalFold collections;
+    {
+        const QString selectEntries(QStringLiteral(
+            " SELECT kind, ids, detailTypes FROM ChangeJournal"
+            " WHERE sequence <= :foldSequence AND folded = 0"
+            " ORDER BY sequence"));
+
+        ContactsDatabase::Query query(m_database.prepare(selectEntries));
+        query.bindValue(QStringLiteral(":foldSequence"), foldSequence);
+        if (!ContactsDatabase::execute(query)) {
+            query.reportError("Failed to read change journal entries for compaction");
+            return false;
+        }
+        while (query.next()) {
+            const QList<quint32> ids(ContactsDatabase::unpackJournalValues(query.value<QByteArray>(1)));
+            switch (query.value<int>(0)) {
+            case ChangeJournalEntry::ContactsAdded:
+                contacts.add(ids);
+                break;
+            case ChangeJournalEntry::ContactsChanged:
+                contacts.change(ids, ContactsDatabase::unpackJournalValues(query.value<QByteArray>(2)));
+                break;
+            case ChangeJournalEntry::ContactsRemoved:
+                contacts.remove(ids);
+                break;
+            case ChangeJournalEntry::CollectionsAdded:
+                collections.add(ids);
+                break;
+            case ChangeJournalEntry::CollectionsChanged:
+                collections.change(ids, QList<quint32>());
+                break;
+            case ChangeJournalEntry::CollectionsRemoved:
+                collections.remove(ids);
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    {
+        ContactsDatabase::Query query(m_database.prepare("DELETE FROM ChangeJournal WHERE sequence <= :foldSequence"));
+        query.bindValue(QStringLiteral(":foldSequence"), foldSequence);
+        if (!ContactsDatabase::execute(query)) {
+            query.reportError("Failed to remove compacted change journal entries");
+            return false;
+        }
+    }
+
+    if (previousFoldSequence != 0 && !m_database.setChangeJournalHorizon(previousFoldSequence)) {
+        return false;
+    }
+
+    struct FoldedEntry {
+        ChangeJournalEntry::Kind kind;
+        const QSet<quint32> *ids;
+    } foldedEntries[] = {
+        { ChangeJournalEntry::CollectionsAdded, &collections.added },
+        { ChangeJournalEntry::CollectionsChanged, &collections.changed },
+        { ChangeJournalEntry::ContactsAdded, &contacts.added },
+        { ChangeJournalEntry::ContactsChanged, &contacts.changed },
+        { ChangeJournalEntry::ContactsRemoved, &contacts.removed },
+        { ChangeJournalEntry::CollectionsRemoved, &collections.removed },
+    };
+    const int foldedEntryCount = sizeof(foldedEntries) / sizeof(foldedEntries[0]);
+
+    // The folded entries take the highest sequences of the folded range
+    quint64 sequence = foldSequence + 1;
+    for (int i = 0; i < foldedEntryCount; ++i) {
+        if (!foldedEntries[i].ids->isEmpty())
+            --sequence;
+    }
+
+    QList<quint32> changedTypes;
+    if (!contacts.typesUnknown) {
+        changedTypes = contacts.types.toList();
+    }
+
+    const QString insertEntry(QStringLiteral(
+        " INSERT INTO ChangeJournal (sequence, kind, ids, detailTypes, folded)"
+        " VALUES (:sequence, :kind, :ids, :detailTypes, 1)"));
+
+    for (int i = 0; i < foldedEntryCount; ++i) {
+        const FoldedEntry &entry(foldedEntries[i]);
+        if (entry.ids->isEmpty())
+            continue;
+
+        ContactsDatabase::Query query(m_database.prepare(insertEntry));
+        query.bindValue(QStringLiteral(":sequence"), sequence++);
+        query.bindValue(QStringLiteral(":kind"), static_cast<int>(entry.kind));
+        query.bindValue(QStringLiteral(":ids"), ContactsDatabase::packJournalValues(entry.ids->toList()));
+        query.bindValue(QStringLiteral(":detailTypes"), entry.kind == ChangeJournalEntry::ContactsChanged
+                                                            ? ContactsDatabase::packJournalValues(changedTypes)
+                                                            : QByteArray());
+        if (!ContactsDatabase::execute(query)) {
+            query.reportError("Failed to write folded change journal entry");
+            return false;
+        }
+    }
+
+    return true;
+}
+
 void ContactWriter::rollbackTransaction()
 {
     m_database.rollbackTransaction();
@@ -207,10 +558,101 @@ void ContactWriter::rollbackTransaction()
     m_collectionContactsChanged.clear();
     m_presenceChangedIds.clear();
     m_changedIds.clear();
+    m_changedDetailTypes.clear();
+    m_changedDetailTypesUnknown = false;
     m_addedIds.clear();
     m_displayLabelGroupsChanged = false;
 }
 
+static const QString groupedWriteSavepoint(QStringLiteral("GroupedWrite"));
+
+bool ContactWriter::beginGroupTransaction()
+{
+    // The access mutex is held until the group is committed
+    m_database.accessMutex()->lock();
+
+    if (!beginTransaction()) {
+        m_database.accessMutex()->unlock();
+        return false;
+    }
+
+    return true;
+}
+
+bool ContactWriter::commitGroupTransaction()
+{
+    // Notifications accumulated by all writes in the group are emitted together
+    const bool committed = commitTransaction();
+    if (!committed) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to commit grouped writes"));
+    }
+
+    m_database.accessMutex()->unlock();
+    return committed;
+}
+
+bool ContactWriter::beginGroupedWrite()
+{
+    if (!m_database.setSavepoint(groupedWriteSavepoint)) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to set savepoint for grouped write"));
+        return false;
+    }
+
+    m_groupedWriteNotifications = pendingNotifications();
+    return true;
+}
+
+bool ContactWriter::endGroupedWrite(bool success)
+{
+    if (success) {
+        if (m_database.releaseSavepoint(groupedWriteSavepoint)) {
+            return true;
+        }
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to release savepoint for grouped write"));
+    }
+
+    // Discard the changes made by this write, and the notifications it would have caused
+    restorePendingNotifications(m_groupedWriteNotifications);
+    if (!m_database.rollbackToSavepoint(groupedWriteSavepoint)) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to roll back grouped write"));
+    }
+    return false;
+}
+
+ContactWriter::PendingNotifications ContactWriter::pendingNotifications() const
+{
+    PendingNotifications pending;
+    pending.displayLabelGroupsChanged = m_displayLabelGroupsChanged;
+    pending.addedIds = m_addedIds;
+    pending.removedIds = m_removedIds;
+    pending.changedIds = m_changedIds;
+    pending.changedDetailTypes = m_changedDetailTypes;
+    pending.changedDetailTypesUnknown = m_changedDetailTypesUnknown;
+    pending.presenceChangedIds = m_presenceChangedIds;
+    pending.suppressedCollectionIds = m_suppressedCollectionIds;
+    pending.collectionContactsChanged = m_collectionContactsChanged;
+    pending.addedCollectionIds = m_addedCollectionIds;
+    pending.removedCollectionIds = m_removedCollectionIds;
+    pending.changedCollectionIds = m_changedCollectionIds;
+    return pending;
+}
+
+void ContactWriter::restorePendingNotifications(const PendingNotifications &pending)
+{
+    m_displayLabelGroupsChanged = pending.displayLabelGroupsChanged;
+    m_addedIds = pending.addedIds;
+    m_removedIds = pending.removedIds;
+    m_changedIds = pending.changedIds;
+    m_changedDetailTypes = pending.changedDetailTypes;
+    m_changedDetailTypesUnknown = pending.changedDetailTypesUnknown;
+    m_presenceChangedIds = pending.presenceChangedIds;
+    m_suppressedCollectionIds = pending.suppressedCollectionIds;
+    m_collectionContactsChanged = pending.collectionContactsChanged;
+    m_addedCollectionIds = pending.addedCollectionIds;
+    m_removedCollectionIds = pending.removedCollectionIds;
+    m_changedCollectionIds = pending.changedCollectionIds;
+}
+
 QContactManager::Error ContactWriter::setIdentity(ContactsDatabase::Identity identity, QContactId contactId)
 {
     const QString insertIdentity(QStringLiteral("INSERT OR REPLACE INTO Identities (identity, contactId) VALUES (:identity, :contactId)"));
@@ -323,8 +765,8 @@ QContactManager::Error ContactWriter::save(
         if (!withinTransaction) {
             // only rollback if we created a transaction.
             rollbackTransaction();
-            return error;
         }
+        return error;
     }
 
     if (!withinTransaction && !commitTransaction()) {
@@ -484,7 +926,7 @@ QContactManager::Error ContactWriter::remove(
     if (relationships.isEmpty())
         return QContactManager::NoError;
 
-    if (!withinTransaction && !beginTransaction()) {
+    if (!withinTransaction && !beginTransaction(ContactsEngine::RemoveLockSite)) {
         QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while removing relationships"));
         return QContactManager::UnspecifiedError;
     }
@@ -494,8 +936,8 @@ QContactManager::Error ContactWriter::remove(
         if (!withinTransaction) {
             // only rollback if we created a transaction.
             rollbackTransaction();
-            return error;
         }
+        return error;
     }
 
     if (!withinTransaction && !commitTransaction()) {
@@ -768,7 +1210,7 @@ QContactManager::Error ContactWriter::remove(
 {
     QMutexLocker locker(withinTransaction ? nullptr : m_database.accessMutex());
 
-    if (!withinTransaction && !beginTransaction()) {
+    if (!withinTransaction && !beginTransaction(ContactsEngine::RemoveLockSite)) {
         // if we are not already within a transaction, create a transaction.
         QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while removing collections"));
         return QContactManager::UnspecifiedError;
@@ -1041,7 +1483,7 @@ QContactManager::Error ContactWriter::remove(const QList<QContactId> &contactIds
     if (!m_database.aggregating()) {
         // If we don't perform aggregation, we simply need to remove every
         // (valid, non-self) contact specified in the list.
-        if (!withinTransaction && !beginTransaction()) {
+        if (!withinTransaction && !beginTransaction(ContactsEngine::RemoveLockSite)) {
             // if we are not already within a transaction, create a transaction.
             QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while deleting contacts"));
             return QContactManager::UnspecifiedError;
@@ -1095,7 +1537,7 @@ QContactManager::Error ContactWriter::remove(const QList<QContactId> &contactIds
         }
     }
 
-    if (!withinTransaction && !beginTransaction()) {
+    if (!withinTransaction && !beginTransaction(ContactsEngine::RemoveLockSite)) {
         // only create a transaction if we're not already within one
         QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while deleting contacts"));
         return QContactManager::UnspecifiedError;
@@ -1357,7 +1799,7 @@ QContactManager::Error ContactWriter::clearChangeFlags(const QList<QContactId> &
         boundIds.append(ContactId::databaseId(id));
     }
 
-    if (!withinTransaction && !beginTransaction()) {
+    if (!withinTransaction && !beginTransaction(ContactsEngine::ClearChangeFlagsLockSite)) {
         QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while clearing contact change flags"));
         return QContactManager::UnspecifiedError;
     }
@@ -1433,26 +1875,33 @@ QContactManager::Error ContactWriter::clearChangeFlags(const QContactCollectionI
 {
     QMutexLocker locker(withinTransaction ? nullptr : m_database.accessMutex());
 
-    if (!withinTransaction && !beginTransaction()) {
+    if (!withinTransaction && !beginTransaction(ContactsEngine::ClearChangeFlagsLockSite)) {
         QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while clearing collection change flags"));
         return QContactManager::UnspecifiedError;
     }
 
-    const QString statement(QStringLiteral("SELECT contactId FROM Contacts WHERE collectionId = :collectionId"));
-    ContactsDatabase::Query query(m_database.prepare(statement));
-    query.bindValue(QStringLiteral(":collectionId"), ContactCollectionId::databaseId(collectionId));
+    // the flags of every contact and detail in the collection are cleared with one statement each,
+    // rather than per contact, as storeChanges() clears the flags of large collections.
+    const QString statements[] = {
+        QStringLiteral("DELETE FROM Details WHERE contactId IN (SELECT contactId FROM Contacts WHERE collectionId = :collectionId)"
+                       " AND changeFlags >= 4 AND unhandledChangeFlags < 4"), // ChangeFlags::IsDeleted
+        QStringLiteral("DELETE FROM Contacts WHERE collectionId = :collectionId"
+                       " AND changeFlags >= 4 AND unhandledChangeFlags < 4"), // ChangeFlags::IsDeleted
+        QStringLiteral("UPDATE Details SET changeFlags = unhandledChangeFlags, unhandledChangeFlags = 0"
+                       " WHERE contactId IN (SELECT contactId FROM Contacts WHERE collectionId = :collectionId)"),
+        QStringLiteral("UPDATE Contacts SET changeFlags = unhandledChangeFlags, unhandledChangeFlags = 0"
+                       " WHERE collectionId = :collectionId"),
+    };
 
     QContactManager::Error err = QContactManager::NoError;
-    QList<QContactId> contactIds;
-    if (!ContactsDatabase::execute(query)) {
-        query.reportError("Failed to retrieve contacts in collection while clearing change flags");
-        err = QContactManager::UnspecifiedError;
-    } else while (query.next()) {
-        contactIds.append(ContactId::apiId(query.value<quint32>(0), m_managerUri));
-    }
-
-    if (contactIds.size()) {
-        err = clearChangeFlags(contactIds, true);
+    for (const QString &statement : statements) {
+        ContactsDatabase::Query query(m_database.prepare(statement));
+        query.bindValue(QStringLiteral(":collectionId"), ContactCollectionId::databaseId(collectionId));
+        if (!ContactsDatabase::execute(query)) {
+            query.reportError("Failed to clear change flags of contacts in collection");
+            err = QContactManager::UnspecifiedError;
+            break;
+        }
     }
 
     if (err == QContactManager::NoError) {
@@ -1533,12 +1982,109 @@ QContactManager::Error ContactWriter::fetchContactChanges(
 
     QMutexLocker locker(m_database.accessMutex());
 
-    if (!beginTransaction()) {
+    if (!beginTransaction(ContactsEngine::SyncLockSite)) {
         QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while fetching contact changes"));
         error = QContactManager::UnspecifiedError;
     }
 
     if (error == QContactManager::NoError) {
+        error = resetUnhandledChangeFlags(dbColId);
+    }
+
+    if (error == QContactManager::NoError) {
+        // retrieve all contact+detail data.
+        // this fetch should NOT strip out the added/modified/deleted info.
+        error = m_reader->fetchContacts(collectionId, addedContacts, modifiedContacts, deletedContacts, unmodifiedContacts);
+        if (error != QContactManager::NoError) {
+            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to fetch contact changes for collection %1").arg(dbColId));
+        }
+    }
+
+    if (error != QContactManager::NoError) {
+        rollbackTransaction();
+    } else if (!commitTransaction()) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to commit database after sync contacts fetch"));
+        error = QContactManager::UnspecifiedError;
+    }
+
+    return error;
+}
+
+/*
+ Steps:
+ - begin transaction.
+ - set Collection.recordUnhandledChangeFlags, and clear the unhandledChangeFlags as above.
+ - end transaction.
+ - read the contacts of the collection in pages of batchSize, ordered by contactId,
+   and deliver each page to the receiver until the last page is read or the receiver declines.
+
+ The pages are read outside the write transaction, so a large collection does not hold
+ the write lock (or the whole change set in memory) for the duration of the fetch.
+ A contact changed after the flags are reset is reported in its latest state, and
+ its unhandledChangeFlags ensure it is reported again by the next fetch.
+*/
+QContactManager::Error ContactWriter::fetchContactChanges(
+        const QContactCollectionId &collectionId,
+        int batchSize,
+        QtContactsSqliteExtensions::ContactManagerEngine::UnmodifiedContacts unmodified,
+        QtContactsSqliteExtensions::ContactManagerEngine::ContactChangesReceiver *receiver)
+{
+    QContactManager::Error error = QContactManager::NoError;
+    const quint32 dbColId = ContactCollectionId::databaseId(collectionId);
+
+    {
+        QMutexLocker locker(m_database.accessMutex());
+
+        if (!beginTransaction(ContactsEngine::SyncLockSite)) {
+            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while fetching contact changes"));
+            error = QContactManager::UnspecifiedError;
+        }
+
+        if (error == QContactManager::NoError) {
+            error = resetUnhandledChangeFlags(dbColId);
+        }
+
+        if (error != QContactManager::NoError) {
+            rollbackTransaction();
+            return error;
+        } else if (!commitTransaction()) {
+            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to commit database after resetting unhandled change flags"));
+            return QContactManager::UnspecifiedError;
+        }
+    }
+
+    quint32 lastContactId = 0;
+    bool complete = false;
+    while (!complete) {
+        QList<QContact> addedContacts;
+        QList<QContact> modifiedContacts;
+        QList<QContact> deletedContacts;
+        QList<QContact> unmodifiedContacts;
+
+        error = m_reader->fetchContactChanges(collectionId, &lastContactId, batchSize, unmodified,
+                                              &addedContacts, &modifiedContacts, &deletedContacts,
+                                              unmodified == QtContactsSqliteExtensions::ContactManagerEngine::ExcludeUnmodifiedContacts ? 0 : &unmodifiedContacts,
+                                              &complete);
+        if (error != QContactManager::NoError) {
+            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to fetch contact changes for collection %1").arg(dbColId));
+            break;
+        }
+
+        if (addedContacts.isEmpty() && modifiedContacts.isEmpty() && deletedContacts.isEmpty() && unmodifiedContacts.isEmpty()) {
+            continue;
+        }
+
+        if (!receiver->contactChangesAvailable(addedContacts, modifiedContacts, deletedContacts, unmodifiedContacts)) {
+            break;
+        }
+    }
+
+    return error;
+}
+
+QContactManager::Error ContactWriter::resetUnhandledChangeFlags(quint32 collectionId)
+{
+    {
         // set Collection.recordUnhandledChangeFlags = true
         const QString setRecordUnhandledChangeFlags(QStringLiteral(
             " UPDATE Collections SET"
@@ -1547,15 +2093,15 @@ QContactManager::Error ContactWriter::fetchContactChanges(
         ));
 
         ContactsDatabase::Query query(m_database.prepare(setRecordUnhandledChangeFlags));
-        query.bindValue(":collectionId", dbColId);
+        query.bindValue(":collectionId", collectionId);
 
         if (!ContactsDatabase::execute(query)) {
             query.reportError("Failed to set collection.recordUnhandledChangeFlags while fetching contact changes");
-            error = QContactManager::UnspecifiedError;
+            return QContactManager::UnspecifiedError;
         }
     }
 
-    if (error == QContactManager::NoError) {
+    {
         // clear Contact.unhandledChangeFlags
         const QString clearUnhandledChangeFlags(QStringLiteral(
             " UPDATE Contacts SET"
@@ -1564,15 +2110,15 @@ QContactManager::Error ContactWriter::fetchContactChanges(
         ));
 
         ContactsDatabase::Query query(m_database.prepare(clearUnhandledChangeFlags));
-        query.bindValue(":collectionId", dbColId);
+        query.bindValue(":collectionId", collectionId);
 
         if (!ContactsDatabase::execute(query)) {
             query.reportError("Failed to clear contact.unhandledChangeFlags while fetching contact changes");
-            error = QContactManager::UnspecifiedError;
+            return QContactManager::UnspecifiedError;
         }
     }
 
-    if (error == QContactManager::NoError) {
+    {
         // clear Detail.unhandledChangeFlags
         const QString clearUnhandledChangeFlags(QStringLiteral(
             " UPDATE Details SET"
@@ -1585,40 +2131,25 @@ QContactManager::Error ContactWriter::fetchContactChanges(
         ));
 
         ContactsDatabase::Query query(m_database.prepare(clearUnhandledChangeFlags));
-        query.bindValue(":collectionId", dbColId);
+        query.bindValue(":collectionId", collectionId);
 
         if (!ContactsDatabase::execute(query)) {
-            query.reportError("Failed to clear contact.unhandledChangeFlags while fetching contact changes");
-            error = QContactManager::UnspecifiedError;
+            query.reportError("Failed to clear detail.unhandledChangeFlags while fetching contact changes");
+            return QContactManager::UnspecifiedError;
         }
     }
 
-    if (error == QContactManager::NoError) {
-        // retrieve all contact+detail data.
-        // this fetch should NOT strip out the added/modified/deleted info.
-        error = m_reader->fetchContacts(collectionId, addedContacts, modifiedContacts, deletedContacts, unmodifiedContacts);
-        if (error != QContactManager::NoError) {
-            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to fetch contact changes for collection %1").arg(dbColId));
-        }
-    }
-
-    if (error != QContactManager::NoError) {
-        rollbackTransaction();
-    } else if (!commitTransaction()) {
-        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to commit database after sync contacts fetch"));
-        error = QContactManager::UnspecifiedError;
-    }
-
-    return error;
+    return QContactManager::NoError;
 }
 
 /*
  Steps:
  - begin transaction.
- - read the current db state of the contact.  if it's deleted, skip / don't apply.
- - the input contact should contain change flags to specify which details should be added/modified/removed.
-   apply changes as best as possible, but "keep" the unhandled changes.
-   resolve conflicts according to the conflictResolutionPolicy.
+ - read the current db state of every modified and deleted contact of a collection in one query,
+   including the unhandled change flags which identify local changes made since the last fetch.
+ - resolve conflicts between those local changes and the remote changes according to the
+   conflictResolutionPolicy (see resolveConflicts()).
+ - apply the resolved changes, using the stored state read above for delta detection.
  - if clearChangeFlags is true, call clearChangeFlags(collectionId).
  - end transaction.
 */
@@ -1629,11 +2160,9 @@ QContactManager::Error ContactWriter::storeChanges(
         QtContactsSqliteExtensions::ContactManagerEngine::ConflictResolutionPolicy conflictResolutionPolicy,
         bool clearChangeFlags)
 {
-    Q_UNUSED(conflictResolutionPolicy); // TODO.
-
     QMutexLocker locker(m_database.accessMutex());
 
-    if (!beginTransaction()) {
+    if (!beginTransaction(ContactsEngine::SyncLockSite)) {
         QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction for store changes"));
         return QContactManager::UnspecifiedError;
     }
@@ -1710,6 +2239,7 @@ QContactManager::Error ContactWriter::storeChanges(
             QList<QContact> addedContacts;
             QList<QContact> modifiedContacts;
             QList<QContact> deletedContacts;
+            QList<QContact> retainedContacts;
             QList<QContactId> deletedContactIds;
 
             // for every modified contact, determine the change type.
@@ -1719,7 +2249,6 @@ QContactManager::Error ContactWriter::storeChanges(
                     const QContactStatusFlags &flags = mcit->detail<QContactStatusFlags>();
                     if (flags.testFlag(QContactStatusFlags::IsDeleted)) {
                         deletedContacts.append(*mcit);
-                        deletedContactIds.append(mcit->id());
                     } else if (flags.testFlag(QContactStatusFlags::IsAdded)) {
                         addedContacts.append(*mcit);
                     } else if (flags.testFlag(QContactStatusFlags::IsModified)) {
@@ -1732,7 +2261,22 @@ QContactManager::Error ContactWriter::storeChanges(
                 }
             }
 
+            // resolve the conflicts with local changes, before writing anything
+            QHash<quint32, QContact> baselines;
+            QVariantList undeleteIds;
+            QVariantList overriddenIds;
+            error = resolveConflicts(conflictResolutionPolicy, &modifiedContacts, &deletedContacts, &retainedContacts,
+                                     &deletedContactIds, &baselines, &undeleteIds, &overriddenIds);
+            if (error != QContactManager::NoError) {
+                QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to resolve conflicting changes for modified collection %1 within store changes")
+                    .arg(QString::fromLatin1(collection->id().localId())));
+                break;
+            }
+
             // now apply the changes
+            QElapsedTimer writeTimer;
+            writeTimer.start();
+
             // first, contact additions
             if (addedContacts.size()) {
                 QList<QContact>::iterator cit = addedContacts.begin(), cend = addedContacts.end();
@@ -1747,13 +2291,22 @@ QContactManager::Error ContactWriter::storeChanges(
                 }
             }
 
-            // then contact modifications
+            // then contact modifications, restoring any locally deleted contacts which the remote changes supersede
+            if (undeleteIds.size()) {
+                error = undeleteContacts(undeleteIds, false);
+                if (error != QContactManager::NoError) {
+                    QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to restore deleted contacts for modified collection %1 within store changes")
+                        .arg(QString::fromLatin1(collection->id().localId())));
+                    break;
+                }
+            }
+
             if (modifiedContacts.size()) {
                 QList<QContact>::iterator cit = modifiedContacts.begin(), cend = modifiedContacts.end();
                 for ( ; cit != cend; ++cit) {
                     cit->setCollectionId(collection->id());
                 }
-                error = save(&modifiedContacts, QList<QContactDetail::DetailType>(), nullptr, nullptr, true, false, true);
+                error = save(&modifiedContacts, QList<QContactDetail::DetailType>(), nullptr, nullptr, true, false, true, &baselines);
                 if (error != QContactManager::NoError) {
                     QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to save added contacts for modified collection %1 within store changes")
                         .arg(QString::fromLatin1(collection->id().localId())));
@@ -1771,12 +2324,24 @@ QContactManager::Error ContactWriter::storeChanges(
                 }
             }
 
+            // the local changes overwritten by remote changes should not be reported by the next fetch
+            if (overriddenIds.size()) {
+                error = discardUnhandledChangeFlags(overriddenIds);
+                if (error != QContactManager::NoError) {
+                    break;
+                }
+            }
+
+            QTCONTACTS_SQLITE_DEBUG(QString::fromLatin1("Wrote %1 added, %2 modified and %3 deleted contacts in %4 ms")
+                    .arg(addedContacts.size()).arg(modifiedContacts.size()).arg(deletedContactIds.size()).arg(writeTimer.elapsed()));
+
             // update the input parameter with the potentially modified values.
             // this is important primarily for additions, which get updated ids.
             contacts->clear();
             contacts->append(addedContacts);
             contacts->append(modifiedContacts);
             contacts->append(deletedContacts);
+            contacts->append(retainedContacts);
         }
     }
 
@@ -1813,129 +2378,264 @@ bool ContactWriter::storeOOB(const QString &scope, const QMap<QString, QVariant>
     if (values.isEmpty())
         return true;
 
-    if (!beginTransaction()) {
-        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while storing OOB"));
-        return false;
-    }
+    const OOBCodec::Codec codec = oobCodec(m_engine.oobCompression());
+    const quint32 dictionaryId = m_database.oobDictionary(scope);
+    OOBCodec &codecs(m_database.oobCodec());
 
-    QStringList tuples;
-    QVariantList dataValues;
-    const QChar colon(QChar::fromLatin1(':'));
-    const QString bindString(QStringLiteral("(?,?,?)"));
+    // Compress the values before the write lock is taken
+    QList<QVariant> storedValues;
+    QList<quint32> encodings;
 
     QMap<QString, QVariant>::const_iterator it = values.constBegin(), end = values.constEnd();
     for ( ; it != end; ++it) {
-        tuples.append(bindString);
-        dataValues.append(scope + colon + it.key());
-
-        // If the data is large, compress it to reduce the IO cost
-        const QVariant &var(it.value());
-        if (var.type() == static_cast<QVariant::Type>(QMetaType::QByteArray)) {
-            const QByteArray uncompressed(var.value<QByteArray>());
-            if (uncompressed.size() > 512) {
-                // Test the entropy of this data, if it is unlikely to compress significantly, don't try
-                if (entropy(uncompressed.constBegin() + 256, uncompressed.constBegin() + 512, 256) < 0.85) {
-                    dataValues.append(QVariant(qCompress(uncompressed)));
-                    dataValues.append(1);
-                    continue;
+        quint32 encoding = ContactsDatabase::OOBUncompressed;
+        storedValues.append(encodeOOBValue(codecs, codec, dictionaryId, it.value(), &encoding));
+        encodings.append(encoding);
+    }
+
+    if (!beginTransaction(ContactsEngine::OOBLockSite)) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while storing OOB"));
+        return false;
+    }
+
+    // Another process may have replaced the scope's dictionary before the lock was taken, and
+    // removed the previous dictionary as unused; values must not be stored referencing it
+    if (dictionaryId != 0) {
+        const quint32 currentDictionaryId = m_database.oobDictionary(scope);
+        if (currentDictionaryId != dictionaryId) {
+            int index = 0;
+            for (it = values.constBegin(); it != end; ++it, ++index) {
+                if (ContactsDatabase::oobEncodingCodec(encodings.at(index)) == OOBCodec::ZstdDictionary) {
+                    quint32 encoding = ContactsDatabase::OOBUncompressed;
+                    storedValues[index] = encodeOOBValue(codecs, codec, currentDictionaryId, it.value(), &encoding);
+                    encodings[index] = encoding;
                 }
             }
-        } else if (var.type() == static_cast<QVariant::Type>(QMetaType::QString)) {
-            const QString uncompressed(var.value<QString>());
-            if (uncompressed.size() > 256) {
-                dataValues.append(QVariant(qCompress(uncompressed.toUtf8())));
-                dataValues.append(2);
-                continue;
-            }
         }
-
-        // No compression:
-        dataValues.append(var);
-        dataValues.append(0);
     }
 
-    QString statement(QStringLiteral("INSERT OR REPLACE INTO OOB (name, value, compressed) VALUES %1").arg(tuples.join(",")));
+    const QChar colon(QChar::fromLatin1(':'));
 
-    QSqlQuery query(m_database);
-    query.setForwardOnly(true);
-    if (!query.prepare(statement)) {
-        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to prepare OOB insert:\n%1\nQuery:\n%2")
-                .arg(query.lastError().text())
-                .arg(statement));
-    } else {
-        foreach (const QVariant &v, dataValues) {
-            query.addBindValue(v);
-        }
+    ContactsDatabase::Query query(m_database.prepare(
+        " INSERT OR REPLACE INTO OOB (name, value, compressed, scope)"
+        " VALUES (:name, :value, :compressed, :scope)"));
+
+    int index = 0;
+    for (it = values.constBegin(); it != end; ++it, ++index) {
+        query.bindValue(QStringLiteral(":name"), scope + colon + it.key());
+        query.bindValue(QStringLiteral(":value"), storedValues.at(index));
+        query.bindValue(QStringLiteral(":compressed"), encodings.at(index));
+        query.bindValue(QStringLiteral(":scope"), scope);
         if (!ContactsDatabase::execute(query)) {
-            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to insert OOB: %1")
-                    .arg(query.lastError().text()));
-        } else {
-            if (!commitTransaction()) {
-                QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to commit database after storing OOB"));
-                return false;
-            }
-            return true;
+            query.reportError("Failed to insert OOB");
+            rollbackTransaction();
+            return false;
         }
+        query.finish();
     }
 
-    rollbackTransaction();
-
-    return false;
+    if (!commitTransaction()) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to commit database after storing OOB"));
+        return false;
+    }
+    return true;
 }
 
-bool ContactWriter::removeOOB(const QString &scope, const QStringList &keys)
+bool ContactWriter::storeOOB(const QString &scope, const QString &key, QIODevice *device)
 {
+    if (!device || !device->isReadable()) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to store OOB from unreadable device"));
+        return false;
+    }
+
+    // The blob must be allocated at its final size before it can be written incrementally,
+    // so the encoded chunks are spooled to a temporary file outside the write lock
+    QTemporaryFile spool;
+    if (!spool.open()) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to create spool file while storing OOB: %1").arg(spool.errorString()));
+        return false;
+    }
+
+    // The chunks are compressed without the access mutex, so the database's codecs cannot be used
+    const OOBCodec::Codec codec = oobCodec(m_engine.oobCompression());
+    OOBCodec codecs;
+
+    while (true) {
+        const QByteArray data(device->read(ContactsDatabase::OOBChunkSize));
+        if (data.isEmpty()) {
+            if (device->atEnd() || !device->waitForReadyRead(-1))
+                break;
+            continue;
+        }
+
+        // As for stored values, only compress chunks which are likely to compress significantly
+        const bool compress = data.size() > 512 && sampleEntropy(data) < 0.85;
+        const QByteArray chunk(ContactsDatabase::encodeOOBChunk(codecs, data, codec, compress));
+        if (spool.write(chunk) != chunk.size()) {
+            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to spool OOB: %1").arg(spool.errorString()));
+            return false;
+        }
+    }
+
+    const qint64 size = spool.size();
+    if (size > std::numeric_limits<int>::max()) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("OOB value too large to store: %1").arg(size));
+        return false;
+    }
+    spool.seek(0);
+
     QMutexLocker locker(m_database.accessMutex());
 
-    if (!beginTransaction()) {
-        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while removing OOB"));
+    if (!beginTransaction(ContactsEngine::OOBLockSite)) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while storing OOB"));
         return false;
     }
 
-    QVariantList keyNames;
+    const QChar colon(QChar::fromLatin1(':'));
 
-    QString statement(QStringLiteral("DELETE FROM OOB WHERE name "));
+    ContactsDatabase::Query query(m_database.prepare(
+        " INSERT OR REPLACE INTO OOB (name, value, compressed, scope)"
+        " VALUES (:name, zeroblob(:size), :compressed, :scope)"));
+    query.bindValue(QStringLiteral(":name"), scope + colon + key);
+    query.bindValue(QStringLiteral(":size"), size);
+    query.bindValue(QStringLiteral(":compressed"), ContactsDatabase::oobEncoding(ContactsDatabase::OOBChunkedBytes, codec));
+    query.bindValue(QStringLiteral(":scope"), scope);
+    if (!ContactsDatabase::execute(query)) {
+        query.reportError("Failed to insert OOB");
+        rollbackTransaction();
+        return false;
+    }
+    const qint64 rowId = query.lastInsertId().toLongLong();
+    query.finish();
 
-    if (keys.isEmpty()) {
-        statement.append(QStringLiteral("LIKE '%1%%'").arg(scope));
-    } else {
-        const QChar colon(QChar::fromLatin1(':'));
-        QString keyList;
+    ContactsDatabase::Blob blob;
+    if (!m_database.openBlob(&blob, "OOB", "value", rowId, true)) {
+        rollbackTransaction();
+        return false;
+    }
 
-        foreach (const QString &key, keys) {
-            keyNames.append(scope + colon + key);
-            keyList.append(keyList.isEmpty() ? QStringLiteral("?") : QStringLiteral(",?"));
+    qint64 offset = 0;
+    while (offset < size) {
+        const QByteArray data(spool.read(ContactsDatabase::OOBChunkSize));
+        if (data.isEmpty() || !blob.write(data.constData(), data.size(), offset)) {
+            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to write OOB at offset: %1").arg(offset));
+            blob.close();
+            rollbackTransaction();
+            return false;
         }
+        offset += data.size();
+    }
+    blob.close();
 
-        statement.append(QStringLiteral("IN (%1)").arg(keyList));
+    if (!commitTransaction()) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to commit database after storing OOB"));
+        return false;
     }
+    return true;
+}
 
-    QSqlQuery query(m_database);
-    query.setForwardOnly(true);
-    if (!query.prepare(statement)) {
-        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to prepare OOB remove:\n%1\nQuery:\n%2")
-                .arg(query.lastError().text())
-                .arg(statement));
-    } else {
-        foreach (const QVariant &name, keyNames) {
-            query.addBindValue(name);
+bool ContactWriter::trainOOBDictionary(const QString &scope)
+{
+    QMutexLocker locker(m_database.accessMutex());
+
+    if (!OOBCodec::isAvailable(OOBCodec::ZstdDictionary)) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("OOB dictionary compression is not available"));
+        return false;
+    }
+
+    // Only small values are compressed with the dictionary, so only they are sampled
+    QList<QByteArray> samples;
+
+    ContactsDatabase::Query query(m_database.prepare(QStringLiteral("SELECT value, compressed FROM OOB WHERE ")
+                                                     + ContactsDatabase::oobScopeCondition(scope)));
+    ContactsDatabase::bindOOBScope(query, scope);
+    if (!ContactsDatabase::execute(query)) {
+        query.reportError("Failed to query OOB for dictionary");
+        return false;
+    }
+    while (query.next()) {
+        const quint32 compressed = query.value<quint32>(1);
+        QByteArray data;
+        if (compressed == ContactsDatabase::OOBUncompressed) {
+            const QVariant value(query.value(0));
+            data = value.type() == QVariant::String ? value.toString().toUtf8() : value.toByteArray();
+        } else if (!m_database.decodeOOBValue(query.value<QByteArray>(0), compressed, &data)) {
+            continue;
         }
+        if (!data.isEmpty() && data.size() <= 512) {
+            samples.append(data);
+        }
+    }
+    query.finish();
+
+    if (samples.count() < 100) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Too few OOB values to train dictionary: %1").arg(samples.count()));
+        return false;
+    }
+
+    const QByteArray dictionary(OOBCodec::trainDictionary(samples, 16 * 1024));
+    if (dictionary.isEmpty())
+        return false;
+
+    if (!beginTransaction(ContactsEngine::OOBLockSite)) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while storing OOB dictionary"));
+        return false;
+    }
+    if (!m_database.storeOOBDictionary(scope, dictionary)) {
+        rollbackTransaction();
+        return false;
+    }
+    if (!commitTransaction()) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to commit database after storing OOB dictionary"));
+        return false;
+    }
+    return true;
+}
+
+bool ContactWriter::removeOOB(const QString &scope, const QStringList &keys)
+{
+    QMutexLocker locker(m_database.accessMutex());
+
+    if (!beginTransaction(ContactsEngine::OOBLockSite)) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while removing OOB"));
+        return false;
+    }
 
+    if (keys.isEmpty()) {
+        ContactsDatabase::Query query(m_database.prepare(QStringLiteral("DELETE FROM OOB WHERE ")
+                                                         + ContactsDatabase::oobScopeCondition(scope)));
+        ContactsDatabase::bindOOBScope(query, scope);
         if (!ContactsDatabase::execute(query)) {
-            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to query OOB: %1")
-                    .arg(query.lastError().text()));
-        } else {
-            if (!commitTransaction()) {
-                QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to commit database after removing OOB"));
+            query.reportError("Failed to remove OOB scope");
+            rollbackTransaction();
+            return false;
+        }
+        query.finish();
+
+        if (!m_database.removeOOBScopeDictionary(scope)) {
+            rollbackTransaction();
+            return false;
+        }
+    } else {
+        const QChar colon(QChar::fromLatin1(':'));
+
+        ContactsDatabase::Query query(m_database.prepare("DELETE FROM OOB WHERE name = :name"));
+        foreach (const QString &key, keys) {
+            query.bindValue(QStringLiteral(":name"), scope + colon + key);
+            if (!ContactsDatabase::execute(query)) {
+                query.reportError("Failed to remove OOB");
+                rollbackTransaction();
                 return false;
             }
-            return true;
+            query.finish();
         }
     }
 
-    rollbackTransaction();
-
-    return false;
+    if (!commitTransaction()) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to commit database after removing OOB"));
+        return false;
+    }
+    return true;
 }
 
 QMap<int, QString> contextTypes()
@@ -1987,6 +2687,7 @@ quint32 writeCommonDetails(ContactsDatabase &db, quint32 contactId, quint32 deta
             "  provenance,"
             "  modifiable,"
             "  nonexportable,"
+            "  contentHash,"
             "  changeFlags,"
             "  unhandledChangeFlags)"
             " VALUES ("
@@ -1999,6 +2700,7 @@ quint32 writeCommonDetails(ContactsDatabase &db, quint32 contactId, quint32 deta
             "  :provenance,"
             "  :modifiable,"
             "  :nonexportable,"
+            "  :contentHash,"
             "  %1,"
             "  %2)").arg(aggregateContact ? QStringLiteral("0") : QStringLiteral("1"))  // ChangeFlags::IsAdded
                     .arg((aggregateContact || !recordUnhandledChangeFlags) ? QStringLiteral("0") : QStringLiteral("1"))
@@ -2011,7 +2713,8 @@ quint32 writeCommonDetails(ContactsDatabase &db, quint32 contactId, quint32 deta
             "  accessConstraints = :accessConstraints,"
             "  provenance = :provenance,"
             "  modifiable = :modifiable,"
-            "  nonexportable = :nonexportable"
+            "  nonexportable = :nonexportable,"
+            "  contentHash = :contentHash"
             " %1 %2"
             " WHERE contactId = :contactId AND detailId = :detailId")
                 .arg(aggregateContact ? QString() : QStringLiteral(", ChangeFlags = ChangeFlags | 2")) // ChangeFlags::IsModified
@@ -2028,6 +2731,7 @@ quint32 writeCommonDetails(ContactsDatabase &db, quint32 contactId, quint32 deta
                                                    ? detailValue(detail, QContactDetail__FieldModifiable)
                                                    : QVariant());
     const QVariant nonexportable = detailValue(detail, QContactDetail__FieldNonexportable);
+    const QVariant contentHash = static_cast<qint64>(QtContactsSqliteExtensions::detailContentHash(detail));
 
     if (detailId > 0) {
         query.bindValue(":detailId", detailId);
@@ -2042,6 +2746,7 @@ quint32 writeCommonDetails(ContactsDatabase &db, quint32 contactId, quint32 deta
     query.bindValue(":provenance", provenance);
     query.bindValue(":modifiable", modifiable);
     query.bindValue(":nonexportable", nonexportable);
+    query.bindValue(":contentHash", contentHash);
 
     if (!ContactsDatabase::execute(query)) {
         query.reportError(QStringLiteral("Failed to write common details for %1\ndetailUri: %2, linkedDetailUris: %3")
@@ -3440,7 +4145,8 @@ QContactManager::Error ContactWriter::save(
             QMap<int, QContactManager::Error> *errorMap,
             bool withinTransaction,
             bool withinAggregateUpdate,
-            bool withinSyncUpdate)
+            bool withinSyncUpdate,
+            const QHash<quint32, QContact> *baselines)
 {
     QMutexLocker locker(withinTransaction ? nullptr : m_database.accessMutex());
 
@@ -3491,12 +4197,6 @@ QContactManager::Error ContactWriter::save(
         return QContactManager::UnspecifiedError;
     }
 
-    if (!withinTransaction && !beginTransaction()) {
-        // only create a transaction if we're not within one already
-        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while saving contacts"));
-        return QContactManager::UnspecifiedError;
-    }
-
     static const DetailList presenceUpdateDetailTypes(getPresenceUpdateDetailTypes());
 
     bool presenceOnlyUpdate = false;
@@ -3512,6 +4212,29 @@ QContactManager::Error ContactWriter::save(
         }
     }
 
+    // Perform the work which does not depend on the stored data before taking the write lock.
+    // Presence-only updates are written to the transient store, without delta detection.
+    // If the caller has already read the stored contacts within its transaction, use those.
+    QVector<PreparedContact> preparedContacts;
+    ContactsDatabase::DataRevision preparedRevision;
+    if (!withinAggregateUpdate && (baselines || (!withinTransaction && m_engine.prepareWrites()))) {
+        preparedRevision = prepareContacts(contacts, definitionMask, !presenceOnlyUpdate, &preparedContacts, baselines);
+    }
+
+    if (!withinTransaction && !beginTransaction()) {
+        // only create a transaction if we're not within one already
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while saving contacts"));
+        return QContactManager::UnspecifiedError;
+    }
+
+    if (preparedRevision.dataVersion != -1 && m_database.dataRevision() != preparedRevision) {
+        // The stored contacts may have been modified since they were read
+        for (int i = 0; i < preparedContacts.count(); ++i) {
+            preparedContacts[i].baseline = QContact();
+            preparedContacts[i].hasBaseline = false;
+        }
+    }
+
     bool possibleReactivation = false;
     QContactManager::Error worstError = QContactManager::NoError;
     QContactManager::Error err = QContactManager::NoError;
@@ -3521,6 +4244,8 @@ QContactManager::Error ContactWriter::save(
         quint32 dbId = ContactId::databaseId(contactId);
 
         bool aggregateUpdated = false;
+        bool unchanged = false;
+        m_preparedContact = preparedContacts.isEmpty() ? 0 : &preparedContacts.at(i);
         if (dbId == 0) {
             err = create(&contact, definitionMask, true, withinAggregateUpdate, withinSyncUpdate, recordUnhandledChangeFlags);
             if (err == QContactManager::NoError) {
@@ -3532,18 +4257,23 @@ QContactManager::Error ContactWriter::save(
                                           .arg(err).arg(ContactCollectionId::toString(contact.collectionId())));
             }
         } else {
-            err = update(&contact, definitionMask, &aggregateUpdated, true, withinAggregateUpdate, withinSyncUpdate, recordUnhandledChangeFlags, presenceOnlyUpdate);
+            err = update(&contact, definitionMask, &aggregateUpdated, &unchanged, true, withinAggregateUpdate, withinSyncUpdate, recordUnhandledChangeFlags, presenceOnlyUpdate);
             if (err == QContactManager::NoError) {
                 if (presenceOnlyUpdate) {
                     m_presenceChangedIds.insert(contactId);
-                } else {
+                } else if (!unchanged) {
                     possibleReactivation = true;
                     m_changedIds.insert(contactId);
+                    if (withinAggregateUpdate && !m_constituentUpdate) {
+                        // Aggregates regenerated for other reasons are written without delta detection
+                        m_changedDetailTypesUnknown = true;
+                    }
                 }
             } else {
                 QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Error updating contact %1: %2").arg(ContactId::toString(contactId)).arg(err));
             }
         }
+        m_preparedContact = 0;
         if (err == QContactManager::NoError) {
             if (aggregatesUpdated) {
                 aggregatesUpdated->insert(i, aggregateUpdated);
@@ -3554,7 +4284,8 @@ QContactManager::Error ContactWriter::save(
                     : contact.collectionId();
 
             if (ContactCollectionId::databaseId(currCollectionId) != ContactsDatabase::AggregateAddressbookCollectionId
-                    && !m_suppressedCollectionIds.contains(currCollectionId)) {
+                    && !m_suppressedCollectionIds.contains(currCollectionId)
+                    && !unchanged) {
                 m_collectionContactsChanged.insert(currCollectionId);
             }
         } else {
@@ -3716,48 +4447,257 @@ static QContactManager::Error enforceDetailConstraints(QContact *contact)
     return QContactManager::NoError;
 }
 
-static bool promoteDetailType(QContactDetail::DetailType type, const ContactWriter::DetailList &definitionMask, bool forcePromotion)
+static QContact storedContact(const QContact &contact)
 {
-    static const ContactWriter::DetailList unpromotedDetailTypes(getUnpromotedDetailTypes());
-    static const ContactWriter::DetailList absolutelyUnpromotedDetailTypes(getAbsolutelyUnpromotedDetailTypes());
+    // Reduce a contact read with its change flags to the form read for delta detection
+    QContact stored(contact);
+    foreach (QContactDetail detail, stored.details()) {
+        if (!detail.hasValue(QContactDetail__FieldChangeFlags)) {
+            continue;
+        }
+        if (detail.value(QContactDetail__FieldChangeFlags).toInt() & QContactDetail__ChangeFlag_IsDeleted) {
+            stored.removeDetail(&detail, QContact::IgnoreAccessConstraints);
+        } else {
+            detail.removeValue(QContactDetail__FieldChangeFlags);
+            stored.saveDetail(&detail, QContact::IgnoreAccessConstraints);
+        }
+    }
+    return stored;
+}
 
-    // Timestamp is promoted in every update
-    if (type == QContactTimestamp::Type)
-        return true;
+static bool hasUnhandledDetailChanges(const QContact &contact, const QHash<quint32, int> &unhandledDetailFlags)
+{
+    foreach (const QContactDetail &detail, contact.details()) {
+        if (unhandledDetailFlags.contains(detail.value(QContactDetail__FieldDatabaseId).toUInt())) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    if (!definitionMask.isEmpty() && !detailListContains(definitionMask, type))
-        return false;
+static void applyUnhandledDetailChanges(QContact *remote, const QContact &local, const QHash<quint32, int> &unhandledDetailFlags)
+{
+    static const ContactWriter::DetailList singular(allSingularDetails());
 
-    // Some detail types are not promoted even if promotion is forced
-    const ContactWriter::DetailList &unpromotedTypes(forcePromotion ? absolutelyUnpromotedDetailTypes : unpromotedDetailTypes);
-    return !detailListContains(unpromotedTypes, type);
+    foreach (const QContactDetail &localDetail, local.details()) {
+        const quint32 detailId = localDetail.value(QContactDetail__FieldDatabaseId).toUInt();
+        const int flags = unhandledDetailFlags.value(detailId);
+        if (detailId == 0 || flags == 0) {
+            continue;
+        }
+
+        // Find the remote version of this detail, or the remote detail it must replace
+        QContactDetail remoteDetail;
+        bool found = false;
+        foreach (const QContactDetail &detail, remote->details(localDetail.type())) {
+            if (detail.value(QContactDetail__FieldDatabaseId).toUInt() == detailId) {
+                remoteDetail = detail;
+                found = true;
+                break;
+            }
+        }
+        if (!found && detailListContains(singular, localDetail.type()) && !remote->details(localDetail.type()).isEmpty()) {
+            remoteDetail = remote->detail(localDetail.type());
+            found = true;
+        }
+
+        if (found) {
+            remote->removeDetail(&remoteDetail, QContact::IgnoreAccessConstraints);
+        }
+        if ((flags & QContactDetail__ChangeFlag_IsDeleted) == 0) {
+            QContactDetail resolved(localDetail);
+            resolved.removeValue(QContactDetail__FieldChangeFlags);
+            remote->saveDetail(&resolved, QContact::IgnoreAccessConstraints);
+        }
+    }
 }
 
 /*
-    For every detail in a contact \a c, this function will check to see if an
-    identical detail already exists in the \a aggregate contact.  If not, the
-    detail from \a c will be "promoted" (saved in) the \a aggregate contact.
-
-    Note that QContactSyncTarget and QContactGuid details will NOT be promoted,
-    nor will QContactDisplayLabel or QContactType details.
+ A remote change conflicts with the local changes made to a contact since the changes of its
+ collection were last fetched, which are identified by their unhandled change flags.  Changes
+ reported by the fetch are not conflicts, as the caller has already reconciled them.
+ - PreserveLocalChanges: a remote modification is applied, except to details changed locally;
+   a remote modification of a locally deleted contact, or a remote deletion of a locally modified
+   contact, is not applied.  The local changes remain flagged for the next fetch.
+ - PreserveRemoteChanges: the remote changes are applied, restoring locally deleted contacts;
+   the overwritten local changes are no longer flagged.
+ Remote deletions of contacts which are already deleted locally are ignored.
+ The stored contacts are returned in baselines, for delta detection when the changes are written.
 */
-static void promoteDetailsToAggregate(const QContact &contact, QContact *aggregate, const ContactWriter::DetailList &definitionMask, bool forcePromotion)
+QContactManager::Error ContactWriter::resolveConflicts(
+        QtContactsSqliteExtensions::ContactManagerEngine::ConflictResolutionPolicy conflictResolutionPolicy,
+        QList<QContact> *modifiedContacts,
+        QList<QContact> *deletedContacts,
+        QList<QContact> *retainedContacts,
+        QList<QContactId> *deletedContactIds,
+        QHash<quint32, QContact> *baselines,
+        QVariantList *undeleteIds,
+        QVariantList *overriddenIds)
 {
-    foreach (const QContactDetail &original, contact.details()) {
-        if (!promoteDetailType(original.type(), definitionMask, forcePromotion)) {
-            // skip this detail
+    const bool preserveLocalChanges = (conflictResolutionPolicy == QtContactsSqliteExtensions::ContactManagerEngine::PreserveLocalChanges);
+
+    QList<quint32> databaseIds;
+    foreach (const QContact &contact, *modifiedContacts) {
+        databaseIds.append(ContactId::databaseId(contact.id()));
+    }
+    foreach (const QContact &contact, *deletedContacts) {
+        databaseIds.append(ContactId::databaseId(contact.id()));
+    }
+    if (databaseIds.isEmpty()) {
+        return QContactManager::NoError;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QList<QContact> storedContacts;
+    QHash<quint32, int> unhandledContactFlags;
+    QHash<quint32, int> unhandledDetailFlags;
+    QContactManager::Error error = m_reader->readContactChanges(QStringLiteral("StoreChanges"), databaseIds, &storedContacts,
+                                                                &unhandledContactFlags, &unhandledDetailFlags);
+    if (error != QContactManager::NoError) {
+        return error;
+    }
+    const qint64 readTime = timer.restart();
+
+    QHash<quint32, QContact> localContacts;
+    foreach (const QContact &contact, storedContacts) {
+        localContacts.insert(ContactId::databaseId(contact.id()), contact);
+    }
+
+    QList<QContact> appliedModifications;
+    for (QList<QContact>::iterator it = modifiedContacts->begin(); it != modifiedContacts->end(); ++it) {
+        const quint32 dbId = ContactId::databaseId(it->id());
+        QHash<quint32, QContact>::const_iterator lit = localContacts.constFind(dbId);
+        if (lit == localContacts.constEnd()) {
+            // Reported as an error when written
+            appliedModifications.append(*it);
             continue;
         }
 
-        // promote this detail to the aggregate.  Depending on uniqueness,
-        // this consists either of composition or duplication.
-        // Note: Composed (unique) details won't have any detailUri!
-        if (detailType(original) == detailType<QContactName>()) {
-            // name involves composition
-            QContactName cname(original);
-            QContactName aname(aggregate->detail<QContactName>());
-            if (!cname.prefix().isEmpty() && aname.prefix().isEmpty())
-                aname.setPrefix(cname.prefix());
+        const QContact &local(*lit);
+        if (local.detail<QContactStatusFlags>().testFlag(QContactStatusFlags::IsDeleted)) {
+            if (preserveLocalChanges) {
+                retainedContacts->append(*it);
+                continue;
+            }
+            undeleteIds->append(dbId);
+            overriddenIds->append(dbId);
+        } else if (unhandledContactFlags.contains(dbId) || hasUnhandledDetailChanges(local, unhandledDetailFlags)) {
+            if (preserveLocalChanges) {
+                applyUnhandledDetailChanges(&*it, local, unhandledDetailFlags);
+            } else {
+                overriddenIds->append(dbId);
+            }
+        }
+
+        baselines->insert(dbId, storedContact(local));
+        appliedModifications.append(*it);
+    }
+    *modifiedContacts = appliedModifications;
+
+    QList<QContact> appliedDeletions;
+    foreach (const QContact &contact, *deletedContacts) {
+        const quint32 dbId = ContactId::databaseId(contact.id());
+        QHash<quint32, QContact>::const_iterator lit = localContacts.constFind(dbId);
+        if (lit != localContacts.constEnd()) {
+            const QContact &local(*lit);
+            if (local.detail<QContactStatusFlags>().testFlag(QContactStatusFlags::IsDeleted)) {
+                // Already deleted locally
+                appliedDeletions.append(contact);
+                continue;
+            }
+            if (unhandledContactFlags.contains(dbId) || hasUnhandledDetailChanges(local, unhandledDetailFlags)) {
+                if (preserveLocalChanges) {
+                    retainedContacts->append(contact);
+                    continue;
+                }
+                overriddenIds->append(dbId);
+            }
+        }
+
+        appliedDeletions.append(contact);
+        deletedContactIds->append(contact.id());
+    }
+    *deletedContacts = appliedDeletions;
+
+    QTCONTACTS_SQLITE_DEBUG(QString::fromLatin1("Read %1 stored contacts in %2 ms, resolved conflicts in %3 ms")
+            .arg(storedContacts.size()).arg(readTime).arg(timer.elapsed()));
+    return QContactManager::NoError;
+}
+
+QContactManager::Error ContactWriter::discardUnhandledChangeFlags(const QVariantList &contactIds)
+{
+    // Reuse the table filled by resolveConflicts(), restricted to the overridden contacts
+    const QString table(QStringLiteral("StoreChanges"));
+    m_database.clearTemporaryContactIdsTable(table);
+    if (!m_database.createTemporaryContactIdsTable(table, contactIds)) {
+        return QContactManager::UnspecifiedError;
+    }
+
+    const QString contactStatement(QStringLiteral(
+        "UPDATE Contacts SET unhandledChangeFlags = 0 WHERE contactId IN (SELECT contactId FROM temp.%1)").arg(table));
+    ContactsDatabase::Query query(m_database.prepare(contactStatement));
+    if (!ContactsDatabase::execute(query)) {
+        query.reportError("Failed to discard unhandled contact change flags");
+        return QContactManager::UnspecifiedError;
+    }
+    query.finish();
+
+    const QString detailStatement(QStringLiteral(
+        "UPDATE Details SET unhandledChangeFlags = 0 WHERE contactId IN (SELECT contactId FROM temp.%1)").arg(table));
+    ContactsDatabase::Query detquery(m_database.prepare(detailStatement));
+    if (!ContactsDatabase::execute(detquery)) {
+        detquery.reportError("Failed to discard unhandled detail change flags");
+        return QContactManager::UnspecifiedError;
+    }
+    detquery.finish();
+
+    return QContactManager::NoError;
+}
+
+static bool promoteDetailType(QContactDetail::DetailType type, const ContactWriter::DetailList &definitionMask, bool forcePromotion)
+{
+    static const ContactWriter::DetailList unpromotedDetailTypes(getUnpromotedDetailTypes());
+    static const ContactWriter::DetailList absolutelyUnpromotedDetailTypes(getAbsolutelyUnpromotedDetailTypes());
+
+    // Timestamp is promoted in every update
+    if (type == QContactTimestamp::Type)
+        return true;
+
+    if (!definitionMask.isEmpty() && !detailListContains(definitionMask, type))
+        return false;
+
+    // Some detail types are not promoted even if promotion is forced
+    const ContactWriter::DetailList &unpromotedTypes(forcePromotion ? absolutelyUnpromotedDetailTypes : unpromotedDetailTypes);
+    return !detailListContains(unpromotedTypes, type);
+}
+
+/*
+    For every detail in a contact \a c, this function will check to see if an
+    identical detail already exists in the \a aggregate contact.  If not, the
+    detail from \a c will be "promoted" (saved in) the \a aggregate contact.
+
+    Note that QContactSyncTarget and QContactGuid details will NOT be promoted,
+    nor will QContactDisplayLabel or QContactType details.
+*/
+static void promoteDetailsToAggregate(const QContact &contact, QContact *aggregate, const ContactWriter::DetailList &definitionMask, bool forcePromotion)
+{
+    foreach (const QContactDetail &original, contact.details()) {
+        if (!promoteDetailType(original.type(), definitionMask, forcePromotion)) {
+            // skip this detail
+            continue;
+        }
+
+        // promote this detail to the aggregate.  Depending on uniqueness,
+        // this consists either of composition or duplication.
+        // Note: Composed (unique) details won't have any detailUri!
+        if (detailType(original) == detailType<QContactName>()) {
+            // name involves composition
+            QContactName cname(original);
+            QContactName aname(aggregate->detail<QContactName>());
+            if (!cname.prefix().isEmpty() && aname.prefix().isEmpty())
+                aname.setPrefix(cname.prefix());
             if (!cname.firstName().isEmpty() && aname.firstName().isEmpty())
                 aname.setFirstName(cname.firstName());
             if (!cname.middleName().isEmpty() && aname.middleName().isEmpty())
@@ -4425,8 +5365,91 @@ static bool updateTimestamp(QContact *contact, bool setCreationTimestamp)
     return contact->saveDetail(&timestamp, QContact::IgnoreAccessConstraints);
 }
 
+ContactsDatabase::DataRevision ContactWriter::prepareContacts(QList<QContact> *contacts, const DetailList &definitionMask, bool readBaselines, QVector<PreparedContact> *prepared, const QHash<quint32, QContact> *baselines)
+{
+    prepared->resize(contacts->count());
+
+    QList<quint32> updatedIds;
+    QSet<quint32> seenIds;
+    QSet<quint32> repeatedIds;
+    for (int i = 0; i < contacts->count(); ++i) {
+        QContact &contact = (*contacts)[i];
+        PreparedContact &preparation((*prepared)[i]);
+
+        if (definitionMask.isEmpty()
+                || detailListContains<QContactPresence>(definitionMask)
+                || detailListContains<QContactGlobalPresence>(definitionMask)) {
+            // update the global presence (display label may be derived from it)
+            updateGlobalPresence(&contact);
+        }
+
+        m_engine.regenerateDisplayLabel(contact, &preparation.displayLabelGroupsChanged);
+        preparation.constraintError = enforceDetailConstraints(&contact);
+
+        const quint32 dbId = ContactId::databaseId(contact);
+        if (dbId != 0) {
+            if (seenIds.contains(dbId)) {
+                // Later updates of this contact must compare against the earlier update
+                repeatedIds.insert(dbId);
+            } else {
+                seenIds.insert(dbId);
+                updatedIds.append(dbId);
+            }
+        }
+    }
+
+    if (!readBaselines || updatedIds.isEmpty()) {
+        return ContactsDatabase::DataRevision();
+    }
+
+    if (baselines) {
+        // These were read within the caller's transaction, so cannot be outdated
+        for (int i = 0; i < contacts->count(); ++i) {
+            const quint32 dbId = ContactId::databaseId(contacts->at(i));
+            QHash<quint32, QContact>::const_iterator it = baselines->constFind(dbId);
+            if (it != baselines->constEnd() && !repeatedIds.contains(dbId)) {
+                (*prepared)[i].baseline = *it;
+                (*prepared)[i].hasBaseline = true;
+            }
+        }
+        return ContactsDatabase::DataRevision();
+    }
+
+    // The revision is determined before reading, so that any change during the read is detected
+    const ContactsDatabase::DataRevision revision(m_database.dataRevision());
+    if (revision.dataVersion == -1) {
+        return revision;
+    }
+
+    QList<QContact> baselines;
+    m_reader->readContacts(QStringLiteral("PrepareContacts"), &baselines, updatedIds, QContactFetchHint());
+
+    // Contacts which do not exist are represented by empty placeholders
+    QHash<quint32, QContact> storedContacts;
+    foreach (const QContact &baseline, baselines) {
+        const quint32 dbId = ContactId::databaseId(baseline);
+        if (dbId != 0 && !repeatedIds.contains(dbId)) {
+            storedContacts.insert(dbId, baseline);
+        }
+    }
+
+    for (int i = 0; i < contacts->count(); ++i) {
+        QHash<quint32, QContact>::iterator it = storedContacts.find(ContactId::databaseId(contacts->at(i)));
+        if (it != storedContacts.end()) {
+            (*prepared)[i].baseline = *it;
+            (*prepared)[i].hasBaseline = true;
+            storedContacts.erase(it);
+        }
+    }
+
+    return revision;
+}
+
 QContactManager::Error ContactWriter::create(QContact *contact, const DetailList &definitionMask, bool withinTransaction, bool withinAggregateUpdate, bool withinSyncUpdate, bool recordUnhandledChangeFlags)
 {
+    const PreparedContact *prepared = m_preparedContact;
+    m_preparedContact = 0;
+
     // If not specified, this contact is a "local device" contact
     bool contactIsLocal = false;
     const QContactCollectionId localAddressbookId(ContactCollectionId::apiId(ContactsDatabase::LocalAddressbookCollectionId, m_managerUri));
@@ -4444,15 +5467,20 @@ QContactManager::Error ContactWriter::create(QContact *contact, const DetailList
         }
     }
 
-    if (definitionMask.isEmpty()
-            || detailListContains<QContactPresence>(definitionMask)
-            || detailListContains<QContactGlobalPresence>(definitionMask)) {
-        // update the global presence (display label may be derived from it)
-        updateGlobalPresence(contact);
-    }
+    if (prepared) {
+        // the global presence and display label were updated before the write lock was taken
+        m_displayLabelGroupsChanged |= prepared->displayLabelGroupsChanged;
+    } else {
+        if (definitionMask.isEmpty()
+                || detailListContains<QContactPresence>(definitionMask)
+                || detailListContains<QContactGlobalPresence>(definitionMask)) {
+            // update the global presence (display label may be derived from it)
+            updateGlobalPresence(contact);
+        }
 
-    // update the display label for this contact
-    m_engine.regenerateDisplayLabel(*contact, &m_displayLabelGroupsChanged);
+        // update the display label for this contact
+        m_engine.regenerateDisplayLabel(*contact, &m_displayLabelGroupsChanged);
+    }
 
     // update the timestamp if necessary (aggregate contacts should have a composed timestamp value)
     if (!m_database.aggregating() || (contact->collectionId() != ContactCollectionId::apiId(ContactsDatabase::AggregateAddressbookCollectionId, m_managerUri))) {
@@ -4463,7 +5491,7 @@ QContactManager::Error ContactWriter::create(QContact *contact, const DetailList
         }
     }
 
-    QContactManager::Error writeErr = enforceDetailConstraints(contact);
+    QContactManager::Error writeErr = prepared ? prepared->constraintError : enforceDetailConstraints(contact);
     if (writeErr != QContactManager::NoError) {
         QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Contact failed detail constraints"));
         return writeErr;
@@ -4521,9 +5549,136 @@ QContactManager::Error ContactWriter::create(QContact *contact, const DetailList
     return writeErr;
 }
 
-QContactManager::Error ContactWriter::update(QContact *contact, const DetailList &definitionMask, bool *aggregateUpdated, bool withinTransaction, bool withinAggregateUpdate, bool withinSyncUpdate, bool recordUnhandledChangeFlags, bool transientUpdate)
+static ContactWriter::DetailList allStoredDetails()
+{
+    // The list of types for details which are recorded in the Details table by write()
+    ContactWriter::DetailList details;
+
+    appendDetailType<QContactAddress>(&details);
+    appendDetailType<QContactAnniversary>(&details);
+    appendDetailType<QContactAvatar>(&details);
+    appendDetailType<QContactBirthday>(&details);
+    appendDetailType<QContactDisplayLabel>(&details);
+    appendDetailType<QContactEmailAddress>(&details);
+    appendDetailType<QContactExtendedDetail>(&details);
+    appendDetailType<QContactFamily>(&details);
+    appendDetailType<QContactFavorite>(&details);
+    appendDetailType<QContactGender>(&details);
+    appendDetailType<QContactGeoLocation>(&details);
+    appendDetailType<QContactGlobalPresence>(&details);
+    appendDetailType<QContactGuid>(&details);
+    appendDetailType<QContactHobby>(&details);
+    appendDetailType<QContactName>(&details);
+    appendDetailType<QContactNickname>(&details);
+    appendDetailType<QContactNote>(&details);
+    appendDetailType<QContactOnlineAccount>(&details);
+    appendDetailType<QContactOrganization>(&details);
+    appendDetailType<QContactOriginMetadata>(&details);
+    appendDetailType<QContactPhoneNumber>(&details);
+    appendDetailType<QContactPresence>(&details);
+    appendDetailType<QContactRingtone>(&details);
+    appendDetailType<QContactSyncTarget>(&details);
+    appendDetailType<QContactTag>(&details);
+    appendDetailType<QContactUrl>(&details);
+
+    return details;
+}
+
+QContactManager::Error ContactWriter::contactIsUnchanged(quint32 contactId, const QContact &contact, const DetailList &definitionMask, bool compareModified, bool *unchanged)
+{
+    static const DetailList storedDetailTypes(allStoredDetails());
+
+    *unchanged = false;
+
+    // Only the detail types which would be written by this update are compared
+    QSet<QString> comparedTypeNames;
+    foreach (const DetailList::value_type &type, storedDetailTypes) {
+        if (definitionMask.isEmpty()
+                || definitionMask.contains(type)
+                || definitionMask.contains(generatorType(type))) {
+            comparedTypeNames.insert(QString::fromLatin1(detailTypeName(type)));
+        }
+    }
+
+    {
+        const QString selectContactState(QStringLiteral(
+            " SELECT created, modified, isDeactivated FROM Contacts WHERE contactId = :contactId"
+        ));
+
+        ContactsDatabase::Query query(m_database.prepare(selectContactState));
+        query.bindValue(":contactId", contactId);
+        if (!ContactsDatabase::execute(query) || !query.next()) {
+            query.reportError("Failed to select contact state for unchanged write detection");
+            return QContactManager::UnspecifiedError;
+        }
+
+        const QContactTimestamp timestamp = contact.detail<QContactTimestamp>();
+        if (query.value<QString>(0) != ContactsDatabase::dateTimeString(timestamp.value<QDateTime>(QContactTimestamp::FieldCreationTimestamp).toUTC())) {
+            return QContactManager::NoError;
+        }
+        if (compareModified
+                && query.value<QString>(1) != ContactsDatabase::dateTimeString(timestamp.value<QDateTime>(QContactTimestamp::FieldModificationTimestamp).toUTC())) {
+            return QContactManager::NoError;
+        }
+        if ((definitionMask.isEmpty() || detailListContains<QContactDeactivated>(definitionMask))
+                && query.value<bool>(2) == contact.details<QContactDeactivated>().isEmpty()) {
+            return QContactManager::NoError;
+        }
+    }
+
+    // Count the content hashes of the stored details, then remove those of the incoming details
+    QHash<quint64, int> hashCounts;
+    {
+        const QString selectDetailHashes(QStringLiteral(
+            " SELECT detail, contentHash FROM Details"
+            " WHERE contactId = :contactId AND changeFlags < 4" // ChangeFlags::IsDeleted
+        ));
+
+        ContactsDatabase::Query query(m_database.prepare(selectDetailHashes));
+        query.bindValue(":contactId", contactId);
+        if (!ContactsDatabase::execute(query)) {
+            query.reportError("Failed to select detail hashes for unchanged write detection");
+            return QContactManager::UnspecifiedError;
+        }
+
+        while (query.next()) {
+            if (!comparedTypeNames.contains(query.value<QString>(0))) {
+                continue;
+            }
+            const QVariant hash(query.value<QVariant>(1));
+            if (hash.isNull()) {
+                // Written before content hashes were recorded; cannot be compared
+                return QContactManager::NoError;
+            }
+            ++hashCounts[static_cast<quint64>(hash.toLongLong())];
+        }
+    }
+
+    foreach (const QContactDetail &detail, contact.details()) {
+        const char *typeName = detailTypeName(detail.type());
+        if (!typeName || !comparedTypeNames.contains(QString::fromLatin1(typeName))) {
+            continue;
+        }
+        QHash<quint64, int>::iterator it = hashCounts.find(QtContactsSqliteExtensions::detailContentHash(detail));
+        if (it == hashCounts.end()) {
+            return QContactManager::NoError;
+        }
+        if (--(*it) == 0) {
+            hashCounts.erase(it);
+        }
+    }
+
+    *unchanged = hashCounts.isEmpty();
+    return QContactManager::NoError;
+}
+
+QContactManager::Error ContactWriter::update(QContact *contact, const DetailList &definitionMask, bool *aggregateUpdated, bool *unchanged, bool withinTransaction, bool withinAggregateUpdate, bool withinSyncUpdate, bool recordUnhandledChangeFlags, bool transientUpdate)
 {
+    const PreparedContact *prepared = m_preparedContact;
+    m_preparedContact = 0;
+
     *aggregateUpdated = false;
+    *unchanged = false;
 
     quint32 contactId = ContactId::databaseId(*contact);
     int exists = 0;
@@ -4589,6 +5744,7 @@ QContactManager::Error ContactWriter::update(QContact *contact, const DetailList
             return QContactManager::UnspecifiedError;
         }
         *contact = undeletedList.first();
+        m_changedDetailTypesUnknown = true;
 
         // if the database is aggregating, fall through, as we may need to
         // recreate or regenerate the aggregate, below.
@@ -4596,22 +5752,12 @@ QContactManager::Error ContactWriter::update(QContact *contact, const DetailList
             return writeError;
         }
     } else {
-        writeError = enforceDetailConstraints(contact);
+        writeError = prepared ? prepared->constraintError : enforceDetailConstraints(contact);
         if (writeError != QContactManager::NoError) {
             QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Contact failed detail constraints"));
             return writeError;
         }
 
-        // update the modification timestamp (aggregate contacts should have a composed timestamp value)
-        if (!m_database.aggregating()
-                || (contact->collectionId() != ContactCollectionId::apiId(ContactsDatabase::AggregateAddressbookCollectionId, m_managerUri))) {
-            // only update the timestamp for "normal" modifications, not updates caused by sync,
-            // as we should retain the revision timestamp for synced contacts.
-            if (!withinSyncUpdate) {
-                updateTimestamp(contact, false);
-            }
-        }
-
         if (m_database.aggregating()
                 && (!withinAggregateUpdate
                     && oldCollectionId == ContactCollectionId::apiId(ContactsDatabase::AggregateAddressbookCollectionId, m_managerUri))) {
@@ -4622,15 +5768,49 @@ QContactManager::Error ContactWriter::update(QContact *contact, const DetailList
             return QContactManager::UnspecifiedError;
         }
 
-        if (definitionMask.isEmpty()
-                || detailListContains<QContactPresence>(definitionMask)
-                || detailListContains<QContactGlobalPresence>(definitionMask)) {
-            // update the global presence (display label may be derived from it)
-            updateGlobalPresence(contact);
+        if (prepared) {
+            // the global presence and display label were updated before the write lock was taken
+            m_displayLabelGroupsChanged |= prepared->displayLabelGroupsChanged;
+        } else {
+            if (definitionMask.isEmpty()
+                    || detailListContains<QContactPresence>(definitionMask)
+                    || detailListContains<QContactGlobalPresence>(definitionMask)) {
+                // update the global presence (display label may be derived from it)
+                updateGlobalPresence(contact);
+            }
+
+            // update the display label for this contact
+            m_engine.regenerateDisplayLabel(*contact, &m_displayLabelGroupsChanged);
         }
 
-        // update the display label for this contact
-        m_engine.regenerateDisplayLabel(*contact, &m_displayLabelGroupsChanged);
+        // If the stored content of this contact already matches, the write can be elided
+        // entirely; this must be determined before the modification timestamp is updated.
+        // Transient details supersede the stored ones, so a write must still remove them.
+        if (m_engine.skipUnchangedWrites()
+                && !transientUpdate
+                && !withinAggregateUpdate
+                && oldCollectionId != ContactCollectionId::apiId(ContactsDatabase::AggregateAddressbookCollectionId, m_managerUri)
+                && !m_database.hasTransientDetails(contactId)) {
+            writeError = contactIsUnchanged(contactId, *contact, definitionMask, withinSyncUpdate, unchanged);
+            if (writeError != QContactManager::NoError) {
+                return writeError;
+            }
+
+            m_engine.recordUnchangedWriteCheck(*unchanged);
+            if (*unchanged) {
+                return QContactManager::NoError;
+            }
+        }
+
+        // update the modification timestamp (aggregate contacts should have a composed timestamp value)
+        if (!m_database.aggregating()
+                || (contact->collectionId() != ContactCollectionId::apiId(ContactsDatabase::AggregateAddressbookCollectionId, m_managerUri))) {
+            // only update the timestamp for "normal" modifications, not updates caused by sync,
+            // as we should retain the revision timestamp for synced contacts.
+            if (!withinSyncUpdate) {
+                updateTimestamp(contact, false);
+            }
+        }
 
         // Can this update be transient, or does it need to be durable?
         if (transientUpdate) {
@@ -4661,7 +5841,10 @@ QContactManager::Error ContactWriter::update(QContact *contact, const DetailList
 
         if (!transientUpdate) {
             QList<QContact> oldContacts;
-            if (!withinAggregateUpdate) {
+            if (prepared && prepared->hasBaseline) {
+                // the existing contact data was read before the write lock was taken, and is unchanged
+                oldContacts.append(prepared->baseline);
+            } else if (!withinAggregateUpdate) {
                 // read the existing contact data from the database, to perform delta detection.
                 QContactManager::Error readOldContactError = m_reader->readContacts(QStringLiteral("UpdateContact"), &oldContacts, QList<quint32>() << contactId, QContactFetchHint());
                 if (readOldContactError != QContactManager::NoError || oldContacts.size() != 1) {
@@ -4712,11 +5895,15 @@ QContactManager::Error ContactWriter::update(QContact *contact, const DetailList
                     aggregatesOfUpdated.append(query.value<quint32>(0));
                 }
 
+                // The aggregates change only in the detail types changed by this update
+                const bool constituentUpdate = m_constituentUpdate;
+                m_constituentUpdate = true;
                 if (aggregatesOfUpdated.size() > 0) {
                     writeError = regenerateAggregates(aggregatesOfUpdated, definitionMask, withinTransaction);
                 } else if (oldCollectionId == ContactCollectionId::apiId(ContactsDatabase::LocalAddressbookCollectionId, m_managerUri)) {
                     writeError = setAggregate(contact, contactId, true, definitionMask, withinTransaction, withinSyncUpdate);
                 }
+                m_constituentUpdate = constituentUpdate;
                 if (writeError != QContactManager::NoError) {
                     return writeError;
                 }
@@ -4729,6 +5916,332 @@ QContactManager::Error ContactWriter::update(QContact *contact, const DetailList
     return writeError;
 }
 
+static QList<QContactDetail> mergedPresenceDetails(const QList<QContactDetail> &existing, const QContact &contact)
+{
+    // Retain any other transient details, but replace the presence state
+    QList<QContactDetail> rv;
+    for (const QContactDetail &detail : existing) {
+        if (detail.type() != QContactPresence::Type && detail.type() != QContactGlobalPresence::Type) {
+            rv.append(detail);
+        }
+    }
+    for (const QContactPresence &presence : contact.details<QContactPresence>()) {
+        rv.append(presence);
+    }
+    const QContactGlobalPresence globalPresence(contact.detail<QContactGlobalPresence>());
+    if (!globalPresence.isEmpty()) {
+        rv.append(globalPresence);
+    }
+    return rv;
+}
+
+QContactManager::Error ContactWriter::updatePresence(
+        const QList<QtContactsSqliteExtensions::ContactManagerEngine::PresenceUpdate> &updates,
+        QMap<int, QContactManager::Error> *errorMap)
+{
+    QMutexLocker locker(m_database.accessMutex());
+
+    if (updates.isEmpty()) {
+        return QContactManager::NoError;
+    }
+
+    // Group the updates by contact, preserving the order of their first appearance
+    QList<quint32> contactIds;
+    QHash<quint32, QList<int> > contactUpdates;
+    QContactManager::Error worstError = QContactManager::NoError;
+    for (int i = 0; i < updates.count(); ++i) {
+        const quint32 dbId = ContactId::databaseId(updates.at(i).contactId);
+        if (dbId == 0 || updates.at(i).accountUri.isEmpty()) {
+            worstError = QContactManager::BadArgumentError;
+            if (errorMap) {
+                errorMap->insert(i, worstError);
+            }
+            continue;
+        }
+
+        QHash<quint32, QList<int> >::iterator it = contactUpdates.find(dbId);
+        if (it == contactUpdates.end()) {
+            contactIds.append(dbId);
+            it = contactUpdates.insert(dbId, QList<int>());
+        }
+        it->append(i);
+    }
+    if (worstError != QContactManager::NoError) {
+        return worstError;
+    }
+
+    if (!beginTransaction(ContactsEngine::PresenceLockSite)) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to begin database transaction while updating presence"));
+        return QContactManager::UnspecifiedError;
+    }
+
+    static const DetailList presenceDetailTypes(DetailList() << detailType<QContactPresence>()
+                                                              << detailType<QContactGlobalPresence>()
+                                                              << detailType<QContactOnlineAccount>());
+
+    QContactFetchHint hint;
+    hint.setOptimizationHints(QContactFetchHint::NoRelationships);
+    hint.setDetailTypesHint(presenceDetailTypes);
+
+    // Read all of the affected contacts at once; missing contacts yield empty placeholders
+    QList<QContact> contacts;
+    QContactManager::Error readError = m_reader->readContacts(QStringLiteral("UpdatePresence"), &contacts, contactIds, hint);
+    if ((readError != QContactManager::NoError && readError != QContactManager::DoesNotExistError)
+            || contacts.size() != contactIds.size()) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to read contacts for presence update"));
+        rollbackTransaction();
+        return QContactManager::UnspecifiedError;
+    }
+
+    // Resolve every update before modifying anything, so that a failed batch leaves no changes
+    const QContactCollectionId aggregateCollectionId(ContactCollectionId::apiId(ContactsDatabase::AggregateAddressbookCollectionId, m_managerUri));
+    const QDateTime now(QDateTime::currentDateTimeUtc());
+
+    QList<int> changedIndices;
+    QSet<quint32> regenerateConstituentIds;
+    for (int c = 0; c < contacts.count(); ++c) {
+        QContact &contact(contacts[c]);
+        const quint32 dbId = contactIds.at(c);
+        const QList<int> &indices(contactUpdates[dbId]);
+
+        QContactManager::Error contactError = QContactManager::NoError;
+        if (ContactId::databaseId(contact.id()) != dbId) {
+            contactError = QContactManager::DoesNotExistError;
+        } else if (contact.collectionId() == aggregateCollectionId) {
+            // Aggregate presence is derived from the constituents
+            contactError = QContactManager::BadArgumentError;
+        }
+        if (contactError != QContactManager::NoError) {
+            worstError = contactError;
+            if (errorMap) {
+                for (int index : indices) {
+                    errorMap->insert(index, contactError);
+                }
+            }
+            continue;
+        }
+
+        const QList<QContactOnlineAccount> accounts(contact.details<QContactOnlineAccount>());
+
+        bool changed = false;
+        for (int index : indices) {
+            const QtContactsSqliteExtensions::ContactManagerEngine::PresenceUpdate &update(updates.at(index));
+
+            QString accountDetailUri;
+            bool accountFound = false;
+            for (const QContactOnlineAccount &account : accounts) {
+                if (account.accountUri() == update.accountUri) {
+                    accountDetailUri = account.detailUri();
+                    accountFound = true;
+                    break;
+                }
+            }
+            if (!accountFound) {
+                worstError = QContactManager::DoesNotExistError;
+                if (errorMap) {
+                    errorMap->insert(index, worstError);
+                }
+                continue;
+            }
+
+            QContactPresence presence;
+            bool presenceFound = false;
+            if (!accountDetailUri.isEmpty()) {
+                for (const QContactPresence &existing : contact.details<QContactPresence>()) {
+                    if (existing.linkedDetailUris().contains(accountDetailUri)) {
+                        presence = existing;
+                        presenceFound = true;
+                        break;
+                    }
+                }
+            }
+
+            if (presenceFound
+                    && presence.presenceState() == update.presenceState
+                    && presence.customMessage() == update.customMessage) {
+                // Nothing to change
+                continue;
+            }
+
+            if (!presenceFound) {
+                if (!accountDetailUri.isEmpty()) {
+                    presence.setLinkedDetailUris(accountDetailUri);
+                }
+                // The aggregate has no counterpart for this detail to update incrementally
+                regenerateConstituentIds.insert(dbId);
+            } else if (presence.detailUri().isEmpty()) {
+                regenerateConstituentIds.insert(dbId);
+            }
+
+            presence.setPresenceState(update.presenceState);
+            presence.setCustomMessage(update.customMessage);
+            presence.setTimestamp(now);
+            contact.saveDetail(&presence, QContact::IgnoreAccessConstraints);
+            changed = true;
+        }
+
+        if (changed) {
+            changedIndices.append(c);
+        }
+    }
+
+    if (worstError != QContactManager::NoError) {
+        rollbackTransaction();
+        return worstError;
+    }
+
+    if (changedIndices.isEmpty()) {
+        rollbackTransaction();
+        return QContactManager::NoError;
+    }
+
+    // Write the updated presence of each contact to the transient store
+    QList<quint32> changedIds;
+    for (int c : changedIndices) {
+        changedIds.append(contactIds.at(c));
+    }
+    std::sort(changedIds.begin(), changedIds.end());
+    const QHash<quint32, QPair<QDateTime, QList<QContactDetail> > > existingDetails(m_database.transientDetails(changedIds));
+
+    QHash<quint32, int> changedContacts;
+    for (int c : changedIndices) {
+        QContact &contact(contacts[c]);
+        const quint32 dbId = contactIds.at(c);
+
+        updateGlobalPresence(&contact);
+
+        const QList<QContactDetail> transientDetails(mergedPresenceDetails(existingDetails.value(dbId).second, contact));
+        if (!m_database.setTransientDetails(dbId, now, transientDetails)) {
+            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to store transient presence for contact: %1").arg(dbId));
+            rollbackTransaction();
+            return QContactManager::UnspecifiedError;
+        }
+
+        changedContacts.insert(dbId, c);
+        m_presenceChangedIds.insert(contact.id());
+        if (!m_suppressedCollectionIds.contains(contact.collectionId())) {
+            m_collectionContactsChanged.insert(contact.collectionId());
+        }
+    }
+
+    if (m_database.aggregating()) {
+        // Find the aggregates of all the updated contacts in a single query
+        QStringList boundIds;
+        for (quint32 dbId : changedIds) {
+            boundIds.append(QString::number(dbId));
+        }
+        const QString findAggregates(QStringLiteral(
+            " SELECT firstId, secondId FROM Relationships"
+            " WHERE type = 'Aggregates' AND secondId IN (%1)"
+        ).arg(boundIds.join(QStringLiteral(","))));
+
+        ContactsDatabase::Query query(m_database.prepare(findAggregates));
+        if (!ContactsDatabase::execute(query)) {
+            query.reportError("Failed to fetch aggregator contact ids during presence update");
+            rollbackTransaction();
+            return QContactManager::UnspecifiedError;
+        }
+
+        QList<quint32> aggregateIds;
+        QHash<quint32, QList<quint32> > aggregateConstituents;
+        while (query.next()) {
+            const quint32 aggregateId = query.value<quint32>(0);
+            const quint32 constituentId = query.value<quint32>(1);
+            if (!aggregateConstituents.contains(aggregateId)) {
+                aggregateIds.append(aggregateId);
+            }
+            aggregateConstituents[aggregateId].append(constituentId);
+        }
+        query.finish();
+
+        QList<quint32> regenerateIds;
+        if (!aggregateIds.isEmpty()) {
+            QList<QContact> aggregates;
+            readError = m_reader->readContacts(QStringLiteral("UpdateAggregatePresence"), &aggregates, aggregateIds, hint);
+            if (readError != QContactManager::NoError || aggregates.size() != aggregateIds.size()) {
+                QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to read aggregate contacts for presence update"));
+                rollbackTransaction();
+                return QContactManager::UnspecifiedError;
+            }
+
+            QList<quint32> sortedAggregateIds(aggregateIds);
+            std::sort(sortedAggregateIds.begin(), sortedAggregateIds.end());
+            const QHash<quint32, QPair<QDateTime, QList<QContactDetail> > > existingAggregateDetails(m_database.transientDetails(sortedAggregateIds));
+
+            for (int a = 0; a < aggregates.count(); ++a) {
+                QContact &aggregate(aggregates[a]);
+                const quint32 aggregateId = aggregateIds.at(a);
+
+                // Apply each constituent's presence to the aggregate's copy of that detail
+                bool incremental = true;
+                for (quint32 constituentId : aggregateConstituents.value(aggregateId)) {
+                    if (regenerateConstituentIds.contains(constituentId)) {
+                        incremental = false;
+                        break;
+                    }
+
+                    const QContact &constituent(contacts.at(changedContacts.value(constituentId)));
+                    for (const QContactPresence &presence : constituent.details<QContactPresence>()) {
+                        QContactPresence aggregatePresence(presence);
+                        adjustAggregateDetailProperties(aggregatePresence);
+
+                        bool found = false;
+                        for (QContactPresence existing : aggregate.details<QContactPresence>()) {
+                            if (existing.detailUri() == aggregatePresence.detailUri()) {
+                                existing.setPresenceState(presence.presenceState());
+                                existing.setCustomMessage(presence.customMessage());
+                                existing.setTimestamp(presence.timestamp());
+                                aggregate.saveDetail(&existing, QContact::IgnoreAccessConstraints);
+                                found = true;
+                                break;
+                            }
+                        }
+                        if (!found) {
+                            incremental = false;
+                            break;
+                        }
+                    }
+                    if (!incremental) {
+                        break;
+                    }
+                }
+
+                if (!incremental) {
+                    regenerateIds.append(aggregateId);
+                    continue;
+                }
+
+                updateGlobalPresence(&aggregate);
+
+                const QList<QContactDetail> transientDetails(mergedPresenceDetails(existingAggregateDetails.value(aggregateId).second, aggregate));
+                if (!m_database.setTransientDetails(aggregateId, now, transientDetails)) {
+                    QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to store transient presence for aggregate: %1").arg(aggregateId));
+                    rollbackTransaction();
+                    return QContactManager::UnspecifiedError;
+                }
+                m_presenceChangedIds.insert(aggregate.id());
+            }
+        }
+
+        if (!regenerateIds.isEmpty()) {
+            // Fall back to regenerating those aggregates whose details could not be matched
+            const DetailList presenceMask(DetailList() << detailType<QContactPresence>());
+            QContactManager::Error regenerateError = regenerateAggregates(regenerateIds, presenceMask, true);
+            if (regenerateError != QContactManager::NoError) {
+                rollbackTransaction();
+                return regenerateError;
+            }
+        }
+    }
+
+    if (!commitTransaction()) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to commit presence update"));
+        return QContactManager::UnspecifiedError;
+    }
+
+    return QContactManager::NoError;
+}
+
 QContactManager::Error ContactWriter::collectionIsAggregable(const QContactCollectionId &collectionId, bool *aggregable)
 {
     *aggregable = false;
@@ -4792,6 +6305,21 @@ QContactManager::Error ContactWriter::write(
                         oldContact.details(), contact->details())
             : QtContactsSqliteExtensions::ContactDetailDelta();
 
+    if (performDeltaDetection) {
+        // Record the types changed by this update, for reporting in the change notification
+        if (delta.isValid) {
+            foreach (const QList<QContactDetail> *details, QList<const QList<QContactDetail> *>() << &delta.deletions << &delta.modifications << &delta.additions) {
+                foreach (const QContactDetail &detail, *details) {
+                    if (definitionMask.isEmpty() || definitionMask.contains(detail.type())) {
+                        m_changedDetailTypes.insert(detail.type());
+                    }
+                }
+            }
+        } else {
+            m_changedDetailTypesUnknown = true;
+        }
+    }
+
     QContactManager::Error error = QContactManager::NoError;
     if (writeDetails<QContactAddress>(contactId, delta, contact, definitionMask, collectionId, syncable, wasLocal, false, recordUnhandledChangeFlags, &error)
             && writeDetails<QContactAnniversary>(contactId, delta, contact, definitionMask, collectionId, syncable, wasLocal, false, recordUnhandledChangeFlags, &error)
@@ -77,6 +77,14 @@ public:
     ContactWriter(ContactsEngine &engine, ContactsDatabase &database, ContactNotifier *notifier, ContactReader *reader);
     ~ContactWriter();
 
+    // Writes performed between beginGroupTransaction() and commitGroupTransaction() must be
+    // invoked with withinTransaction set; each should be bracketed by beginGroupedWrite() and
+    // endGroupedWrite(), so that a failed write is discarded without affecting the others.
+    bool beginGroupTransaction();
+    bool commitGroupTransaction();
+    bool beginGroupedWrite();
+    bool endGroupedWrite(bool success);
+
     QContactManager::Error save(
             QList<QContact> *contacts,
             const DetailList &definitionMask,
@@ -84,7 +92,8 @@ public:
             QMap<int, QContactManager::Error> *errorMap,
             bool withinTransaction,
             bool withinAggregateUpdate,
-            bool withinSyncUpdate);
+            bool withinSyncUpdate,
+            const QHash<quint32, QContact> *baselines = 0);
     QContactManager::Error remove(const QList<QContactId> &contactIds,
                                   QMap<int, QContactManager::Error> *errorMap,
                                   bool withinTransaction,
@@ -117,6 +126,10 @@ public:
     bool storeTransientDetails(quint32 contactId, const QList<QContactDetail> &details);
     void removeTransientDetails(quint32 contactId);
 
+    QContactManager::Error updatePresence(
+            const QList<QtContactsSqliteExtensions::ContactManagerEngine::PresenceUpdate> &updates,
+            QMap<int, QContactManager::Error> *errorMap);
+
     QContactManager::Error clearChangeFlags(const QList<QContactId> &contactIds, bool withinTransaction);
     QContactManager::Error clearChangeFlags(const QContactCollectionId &collectionId, bool withinTransaction);
     QContactManager::Error fetchCollectionChanges(
@@ -132,6 +145,11 @@ public:
             QList<QContact> *modifiedContacts,
             QList<QContact> *deletedContacts,
             QList<QContact> *unmodifiedContacts);
+    QContactManager::Error fetchContactChanges(
+            const QContactCollectionId &collectionId,
+            int batchSize,
+            QtContactsSqliteExtensions::ContactManagerEngine::UnmodifiedContacts unmodified,
+            QtContactsSqliteExtensions::ContactManagerEngine::ContactChangesReceiver *receiver);
     QContactManager::Error storeChanges(
             QHash<QContactCollection*, QList<QContact> * /* added contacts */> *addedCollections,
             QHash<QContactCollection*, QList<QContact> * /* added/modified/deleted contacts */> *modifiedCollections,
@@ -140,17 +158,37 @@ public:
             bool clearChangeFlags);
 
     bool storeOOB(const QString &scope, const QMap<QString, QVariant> &values);
+    bool storeOOB(const QString &scope, const QString &key, QIODevice *device);
+    bool trainOOBDictionary(const QString &scope);
     bool removeOOB(const QString &scope, const QStringList &keys);
 
 private:
-    bool beginTransaction();
+    bool beginTransaction(ContactsDatabase::WriteLockSite site = QtContactsSqliteExtensions::ContactManagerEngine::SaveLockSite);
     bool commitTransaction();
     void rollbackTransaction();
 
+    bool writeChangeJournal();
+    bool compactChangeJournal(quint64 latestSequence);
+
+    // The work of saving a contact which is performed before the write lock is taken
+    struct PreparedContact {
+        PreparedContact() : constraintError(QContactManager::NoError), displayLabelGroupsChanged(false), hasBaseline(false) {}
+
+        QContactManager::Error constraintError;
+        bool displayLabelGroupsChanged;
+        // The stored content of the contact, for delta detection; discarded if the database changes
+        QContact baseline;
+        bool hasBaseline;
+    };
+
+    ContactsDatabase::DataRevision prepareContacts(QList<QContact> *contacts, const DetailList &definitionMask, bool readBaselines, QVector<PreparedContact> *prepared, const QHash<quint32, QContact> *baselines = 0);
+
     QContactManager::Error create(QContact *contact, const DetailList &definitionMask, bool withinTransaction, bool withinAggregateUpdate, bool withinSyncUpdate, bool recordUnhandledChangeFlags);
-    QContactManager::Error update(QContact *contact, const DetailList &definitionMask, bool *aggregateUpdated, bool withinTransaction, bool withinAggregateUpdate, bool withinSyncUpdate, bool recordUnhandledChangeFlags, bool transientUpdate);
+    QContactManager::Error update(QContact *contact, const DetailList &definitionMask, bool *aggregateUpdated, bool *unchanged, bool withinTransaction, bool withinAggregateUpdate, bool withinSyncUpdate, bool recordUnhandledChangeFlags, bool transientUpdate);
     QContactManager::Error write(quint32 contactId, const QContact &oldContact, QContact *contact, const DetailList &definitionMask, bool recordUnhandledChangeFlags);
 
+    QContactManager::Error contactIsUnchanged(quint32 contactId, const QContact &contact, const DetailList &definitionMask, bool compareModified, bool *unchanged);
+
     QContactManager::Error saveRelationships(const QList<QContactRelationship> &relationships, QMap<int, QContactManager::Error> *errorMap, bool withinAggregateUpdate);
     QContactManager::Error removeRelationships(const QList<QContactRelationship> &relationships, QMap<int, QContactManager::Error> *errorMap);
 
@@ -167,6 +205,18 @@ private:
     QContactManager::Error setAggregate(QContact *contact, quint32 contactId, bool update, const DetailList &definitionMask, bool withinTransaction, bool withinSyncUpdate);
     QContactManager::Error updateOrCreateAggregate(QContact *contact, const DetailList &definitionMask, bool withinTransaction, bool withinSyncUpdate, bool createOnly = false, quint32 *aggregateContactId = 0);
 
+    QContactManager::Error resetUnhandledChangeFlags(quint32 collectionId);
+    QContactManager::Error discardUnhandledChangeFlags(const QVariantList &contactIds);
+    QContactManager::Error resolveConflicts(
+            QtContactsSqliteExtensions::ContactManagerEngine::ConflictResolutionPolicy conflictResolutionPolicy,
+            QList<QContact> *modifiedContacts,
+            QList<QContact> *deletedContacts,
+            QList<QContact> *retainedContacts,
+            QList<QContactId> *deletedContactIds,
+            QHash<quint32, QContact> *baselines,
+            QVariantList *undeleteIds,
+            QVariantList *overriddenIds);
+
     QContactManager::Error regenerateAggregates(const QList<quint32> &aggregateIds, const DetailList &definitionMask, bool withinTransaction);
     QContactManager::Error removeChildlessAggregates(QList<QContactId> *realRemoveIds);
     QContactManager::Error aggregateOrphanedContacts(bool withinTransaction, bool withinSyncUpdate);
@@ -199,6 +249,24 @@ private:
 
     template <typename T> bool removeCommonDetails(quint32 contactId, QContactManager::Error *error);
 
+    struct PendingNotifications {
+        bool displayLabelGroupsChanged = false;
+        QSet<QContactId> addedIds;
+        QSet<QContactId> removedIds;
+        QSet<QContactId> changedIds;
+        QSet<QContactDetail::DetailType> changedDetailTypes;
+        bool changedDetailTypesUnknown = false;
+        QSet<QContactId> presenceChangedIds;
+        QSet<QContactCollectionId> suppressedCollectionIds;
+        QSet<QContactCollectionId> collectionContactsChanged;
+        QSet<QContactCollectionId> addedCollectionIds;
+        QSet<QContactCollectionId> removedCollectionIds;
+        QSet<QContactCollectionId> changedCollectionIds;
+    };
+
+    PendingNotifications pendingNotifications() const;
+    void restorePendingNotifications(const PendingNotifications &pending);
+
     ContactsEngine &m_engine;
     ContactsDatabase &m_database;
     ContactNotifier *m_notifier;
@@ -210,12 +278,20 @@ private:
     QSet<QContactId> m_addedIds;
     QSet<QContactId> m_removedIds;
     QSet<QContactId> m_changedIds;
+    // The types of the details changed in m_changedIds, unless some change could not be characterized
+    QSet<QContactDetail::DetailType> m_changedDetailTypes;
+    bool m_changedDetailTypesUnknown;
+    // Set while regenerating aggregates for a constituent update, whose changed types they share
+    bool m_constituentUpdate;
+    // The prepared work for the contact about to be created or updated, consumed on entry
+    const PreparedContact *m_preparedContact;
     QSet<QContactId> m_presenceChangedIds;
     QSet<QContactCollectionId> m_suppressedCollectionIds;
     QSet<QContactCollectionId> m_collectionContactsChanged;
     QSet<QContactCollectionId> m_addedCollectionIds;
     QSet<QContactCollectionId> m_removedCollectionIds;
     QSet<QContactCollectionId> m_changedCollectionIds;
+    PendingNotifications m_groupedWriteNotifications;
 };
 
 
@@ -25,11 +25,32 @@ isEmpty(PKGCONFIG_LIB) {
     message("PKGCONFIG_LIB is unset, assuming $$PKGCONFIG_LIB")
 }
 
+# Incremental blob I/O requires direct access to the SQLite API
+PKGCONFIG += sqlite3
+
 CONFIG(load_icu) {
-    PKGCONFIG += sqlite3
     DEFINES += QTCONTACTS_SQLITE_LOAD_ICU
 }
 
+# Use a robust shared-memory mutex in place of SysV semaphores for cross-process locking
+CONFIG(futex_semaphore) {
+    DEFINES += QTCONTACTS_SQLITE_FUTEX_SEMAPHORE
+    SOURCES += semaphore_futex.cpp
+    LIBS += -lrt -lpthread
+} else {
+    SOURCES += semaphore_p.cpp
+}
+
+# Optional codecs for OOB values, in addition to zlib
+CONFIG(lz4) {
+    DEFINES += QTCONTACTS_SQLITE_LZ4
+    PKGCONFIG += liblz4
+}
+CONFIG(zstd) {
+    DEFINES += QTCONTACTS_SQLITE_ZSTD
+    PKGCONFIG += libzstd
+}
+
 # we hardcode this for Qt4 as there's no GenericDataLocation offered by QDesktopServices
 DEFINES += 'QTCONTACTS_SQLITE_PRIVILEGED_DIR=\'\"privileged\"\''
 DEFINES += 'QTCONTACTS_SQLITE_DATABASE_DIR=\'\"Contacts/qtcontacts-sqlite\"\''
@@ -48,6 +69,7 @@ HEADERS += \
         semaphore_p.h \
         trace_p.h \
         conversion_p.h \
+        oobcodec_p.h \
         contactid_p.h \
         contactsdatabase.h \
         contactsengine.h \
@@ -60,8 +82,8 @@ HEADERS += \
 SOURCES += \
         defaultdlggenerator.cpp \
         memorytable.cpp \
-        semaphore_p.cpp \
         conversion.cpp \
+        oobcodec.cpp \
         contactid.cpp \
         contactsdatabase.cpp \
         contactsengine.cpp \
@@ -32,24 +32,52 @@
 
 #include "memorytable_p.h"
 
+#include <QAtomicInt>
 #include <QtDebug>
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstring>
+#include <functional>
 #include <limits>
+#include <utility>
+#include <vector>
 
 // Class to manage a table of key/value pairs in a memory buffer, using offsets rather
 // than addresses, to be suitable for placement in shared memory.
 //
-// The lower end of the available space holds a sorted index of keys to offsets; the
-// upper end of the space holds a heap allocated into variable sized blocks, growing
-// down toward the index.
+// The lower end of the available space holds an index of keys to offsets; the upper end
+// of the space holds a heap allocated into variable sized blocks, growing down toward the
+// index.
 //
-// Deallocated blocks are added to a free list, from which they can be reallocated.
-// No defragmentation is currently performed; when allocation fails, it is required
-// that the content be migrated to a new memory buffer. No compaction is currently
-// performed.
+// The index is a dense array of key/offset elements, preceded by an open-addressing hash
+// table (linear probing) whose slots refer to positions in the dense array.  While the table
+// holds few items the hash table is omitted, and the dense array is searched linearly.  When
+// the hash table is resized, the dense array is moved to follow it, and the slots are rebuilt
+// from the dense array.
+//
+// Iteration (and keyAt/valueAt) follows the order of the dense array: items are appended
+// in insertion order, and removing an item moves the last item into the vacated position.
+// Replacing the value of an existing key does not change its position.
+//
+// Deallocated blocks are added to a free list, from which they can be reallocated; a
+// block adjoining the free space is returned to the free space instead.  When allocation
+// fails, adjacent free blocks are coalesced; if that is insufficient but the total free
+// space would satisfy the allocation, the heap is compacted in place, moving all live
+// blocks to the upper end of the space.  Only when that fails is it required that the
+// content be migrated to a larger memory buffer.
+//
+// Blocks no larger than 64 KiB use a compact header with 16-bit sizes; larger blocks are
+// marked by a zero in the compact size field, and use an extended header with 32-bit sizes.
+// The representation of a block is determined by its size alone.
+//
+// Writers must be serialized by the caller.  Each modification increments a sequence counter
+// before and after the change, so that the counter is odd while a change is in progress.
+// Readers that do not hold the writers' lock can use readValue(), which validates every
+// offset it follows, and discards its result if the sequence changed during the read.  A
+// table whose content has been migrated elsewhere is retired, which also causes readValue()
+// to fail, so that the reader can locate the successor table.
 //
 // Key and value types are currently fixed as quint32/QByteArray, but could be changed
 // without much difficulty.
@@ -66,6 +94,17 @@ void insertData(char *dst, size_t len, const QByteArray &data) { std::memcpy(dst
 template<>
 QByteArray extractData<QByteArray>(const char *src, size_t len) { return QByteArray::fromRawData(src, len); }
 
+// Unlike extractData, the result must not refer to the source memory
+template<typename T>
+T copyData(const char *src, size_t len);
+
+template<>
+QByteArray copyData<QByteArray>(const char *src, size_t len) { return QByteArray(src, len); }
+
+// Read a value that may be concurrently modified, exactly once
+template<typename T>
+T readOnce(const T &value) { return *static_cast<const volatile T *>(&value); }
+
 // Structures used in the table management
 struct IndexElement {
     MemoryTable::key_type key;
@@ -73,8 +112,19 @@ struct IndexElement {
 };
 
 struct Allocation {
-    quint16 size;           // size of the allocated block
-    quint16 dataSize;       // size of the stored data, when in use, or FreeBlock
+    quint16 size;           // size of the allocated block, or zero for a LargeAllocation
+    quint16 dataSize;       // size of the stored data, when in use, or FreeBlockMarker
+    union {
+        char data[1];
+        quint32 nextOffset; // offset of the next free block, when on the free list
+    };
+};
+
+struct LargeAllocation {
+    quint16 marker;         // zero
+    quint16 state;          // zero when in use, or FreeBlockMarker
+    quint32 size;           // size of the allocated block
+    quint32 dataSize;       // size of the stored data, when in use
     union {
         char data[1];
         quint32 nextOffset; // offset of the next free block, when on the free list
@@ -86,12 +136,115 @@ struct TableMetadata {
     quint32 count;          // number of items
     quint32 freeOffset;     // position of the free space
     quint32 freeList;       // offset of the first free block
-    IndexElement index[1];
+    QBasicAtomicInt sequence;   // incremented before and after each modification
+    QBasicAtomicInt retired;    // nonzero once the content has been migrated to another table
+    quint32 capacity;       // number of hash slots, or zero if the index is not hashed
+    quint32 slots[1];       // hash slots (index position + 1, or zero if empty), followed by the index
 };
 
-bool operator<(const IndexElement &lhs, const MemoryTable::key_type &rhs)
+const quint16 FreeBlockMarker = std::numeric_limits<quint16>::max();
+
+// Largest block size using the compact Allocation header
+const quint32 MaximumSmallBlockSize = std::numeric_limits<quint16>::max() & ~3u;
+
+bool isLarge(const Allocation *allocation) { return allocation->size == 0; }
+LargeAllocation *large(Allocation *allocation) { return reinterpret_cast<LargeAllocation *>(allocation); }
+const LargeAllocation *large(const Allocation *allocation) { return reinterpret_cast<const LargeAllocation *>(allocation); }
+
+quint32 headerSize(quint32 size)
+{
+    return size > MaximumSmallBlockSize ? offsetof(LargeAllocation, data) : offsetof(Allocation, data);
+}
+
+quint32 blockSize(const Allocation *allocation)
+{
+    return isLarge(allocation) ? large(allocation)->size : allocation->size;
+}
+
+quint32 blockCapacity(const Allocation *allocation)
+{
+    const quint32 size = blockSize(allocation);
+    return size - headerSize(size);
+}
+
+quint32 blockDataSize(const Allocation *allocation)
+{
+    return isLarge(allocation) ? large(allocation)->dataSize : allocation->dataSize;
+}
+
+char *blockData(Allocation *allocation)
+{
+    return isLarge(allocation) ? large(allocation)->data : allocation->data;
+}
+
+const char *blockData(const Allocation *allocation)
+{
+    return isLarge(allocation) ? large(allocation)->data : allocation->data;
+}
+
+bool isFree(const Allocation *allocation)
+{
+    // The state field of LargeAllocation coincides with dataSize
+    return allocation->dataSize == FreeBlockMarker;
+}
+
+quint32 &nextFree(Allocation *allocation)
+{
+    return isLarge(allocation) ? large(allocation)->nextOffset : allocation->nextOffset;
+}
+
+quint32 nextFree(const Allocation *allocation)
+{
+    return isLarge(allocation) ? large(allocation)->nextOffset : allocation->nextOffset;
+}
+
+void setBlockSize(Allocation *allocation, quint32 size)
+{
+    if (size > MaximumSmallBlockSize) {
+        allocation->size = 0;
+        large(allocation)->size = size;
+    } else {
+        allocation->size = size;
+    }
+}
+
+void setBlockDataSize(Allocation *allocation, quint32 dataSize)
+{
+    if (isLarge(allocation)) {
+        large(allocation)->state = 0;
+        large(allocation)->dataSize = dataSize;
+    } else {
+        allocation->dataSize = dataSize;
+    }
+}
+
+void setFree(Allocation *allocation, quint32 nextOffset)
 {
-    return lhs.key < rhs;
+    allocation->dataSize = FreeBlockMarker;
+    nextFree(allocation) = nextOffset;
+}
+
+// Tables with no more than this many items are searched without hashing
+const quint32 LinearScanLimit = 16;
+const quint32 MinimumCapacity = 32;
+
+quint32 slotFor(MemoryTable::key_type key, quint32 capacity)
+{
+    quint32 h = key * 2654435769u;
+    h ^= (h >> 16);
+    return h & (capacity - 1);
+}
+
+quint32 requiredCapacity(quint32 count)
+{
+    if (count <= LinearScanLimit)
+        return 0;
+
+    // Maintain a load factor no greater than 0.75
+    quint32 capacity = MinimumCapacity;
+    while (static_cast<quint64>(count) * 4 > static_cast<quint64>(capacity) * 3)
+        capacity *= 2;
+    return capacity;
 }
 
 template<typename T>
@@ -107,6 +260,28 @@ T roundDown(T n, T m)
     return n - (n % m);
 }
 
+// Mark a table as being modified, for the lifetime of this object
+class WriteSequence
+{
+public:
+    explicit WriteSequence(TableMetadata *table)
+        : m_sequence(table->sequence)
+    {
+        // The counter may be odd if a previous writer did not complete
+        m_value = m_sequence.load() | 1;
+        m_sequence.store(m_value);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+    ~WriteSequence()
+    {
+        m_sequence.storeRelease(m_value + 1);
+    }
+
+private:
+    QBasicAtomicInt &m_sequence;
+    int m_value;
+};
+
 }
 
 class MemoryTablePrivate
@@ -116,7 +291,7 @@ public:
     typedef MemoryTable::value_type value_type;
     typedef MemoryTable::Error Error;
 
-    enum { FreeBlock = UINT_MAX };
+    enum { NotFound = UINT_MAX };
 
     static TableMetadata *metadata(MemoryTable *table);
     static const TableMetadata *metadata(const MemoryTable *table);
@@ -127,8 +302,18 @@ public:
     static Error insert(const key_type &key, const value_type &value, TableMetadata *table);
     static bool remove(const key_type &key, TableMetadata *table);
 
+    static bool readValue(const key_type &key, value_type *value, bool *found, const TableMetadata *table);
+
+    static bool isConsistent(const TableMetadata *table);
+    static bool isConsistentBlock(quint64 offset, quint64 heapOffset, bool free, const TableMetadata *table);
+
     static Error migrateTo(TableMetadata *other, const TableMetadata *table);
 
+    static quint32 position(const key_type &key, const TableMetadata *table);
+    static quint32 *slot(const key_type &key, TableMetadata *table);
+    static void removeSlot(quint32 *slot, TableMetadata *table);
+    static bool resizeIndex(quint32 capacity, TableMetadata *table);
+
     static IndexElement *begin(TableMetadata *table);
     static IndexElement *end(TableMetadata *table);
 
@@ -144,11 +329,17 @@ public:
     static const value_type valueAtIndex(size_t index, const TableMetadata *table);
 
     static size_t freeSpace(const TableMetadata *table);
-    static size_t requiredSpace(quint32 size);
+    static size_t fragmentedSpace(const TableMetadata *table);
+    static size_t requiredSpace(size_t size);
 
     static quint32 allocate(quint32 size, TableMetadata *table, bool indexRequired);
+    static quint32 allocateBlock(quint32 allocationSize, quint32 dataSize, TableMetadata *table, bool indexRequired);
     static void deallocate(quint32 offset, TableMetadata *table);
 
+    static bool reclaimSpace(size_t required, TableMetadata *table);
+    static void coalesce(TableMetadata *table);
+    static void compact(TableMetadata *table);
+
     static void updateValue(const value_type &value, quint32 valueSize, quint32 offset, TableMetadata *table);
 };
 
@@ -169,38 +360,38 @@ size_t MemoryTablePrivate::count(const TableMetadata *table)
 
 bool MemoryTablePrivate::contains(const key_type &key, const TableMetadata *table)
 {
-    const IndexElement *tableEnd = end(table);
-    const IndexElement *position = std::lower_bound(begin(table), tableEnd, key);
-    return (position != tableEnd && position->key == key);
+    return position(key, table) != NotFound;
 }
 
 const MemoryTablePrivate::value_type MemoryTablePrivate::value(const key_type &key, const TableMetadata *table)
 {
-    const IndexElement *tableEnd = end(table);
-    const IndexElement *position = std::lower_bound(begin(table), tableEnd, key);
-    if (position == tableEnd || position->key != key)
+    const quint32 index = position(key, table);
+    if (index == NotFound)
         return value_type();
 
-    return valueAt(position->offset, table);
+    return valueAt(begin(table)[index].offset, table);
 }
 
 MemoryTablePrivate::Error MemoryTablePrivate::insert(const key_type &key, const value_type &value, TableMetadata *table)
 {
     const quint32 valueSize = dataSize(value);
 
-    IndexElement *tableEnd = end(table);
-    IndexElement *position = std::lower_bound(begin(table), tableEnd, key);
-    if (position != tableEnd && position->key == key) {
+    IndexElement *element;
+
+    const quint32 index = position(key, table);
+    if (index != NotFound) {
         // This is a replacement - the item has an allocation already
-        Allocation *allocation = allocationAt(position->offset, table);
-        if (allocation->size < requiredSpace(valueSize)) {
+        element = begin(table) + index;
+
+        Allocation *allocation = allocationAt(element->offset, table);
+        if (blockCapacity(allocation) < valueSize) {
             // Replace the existing allocation with a bigger one
             quint32 newOffset = allocate(valueSize, table, false);
             if (!newOffset)
                 return MemoryTable::InsufficientSpace;
 
-            deallocate(position->offset, table);
-            position->offset = newOffset;
+            deallocate(element->offset, table);
+            element->offset = newOffset;
         } else {
             // Reuse this allocation
             // TODO: swap with a better fit from the free list?
@@ -210,17 +401,26 @@ MemoryTablePrivate::Error MemoryTablePrivate::insert(const key_type &key, const
         if (table->count == std::numeric_limits<quint32>::max())
             return MemoryTable::InsufficientSpace;
 
+        // Expand the hash table first, if the additional item requires it
+        const quint32 capacity = requiredCapacity(table->count + 1);
+        if (capacity > table->capacity && !resizeIndex(capacity, table))
+            return MemoryTable::InsufficientSpace;
+
         quint32 offset = allocate(valueSize, table, true);
         if (!offset)
             return MemoryTable::InsufficientSpace;
 
-        // For index insertion, move the displaced elements of the index
-        if (position != tableEnd)
-            std::memmove(position + 1, position, (tableEnd - position) * sizeof(IndexElement));
-
+        // Append the item to the index
+        element = end(table);
+        element->key = key;
+        element->offset = offset;
         ++(table->count);
-        position->key = key;
-        position->offset = offset;
+
+        if (table->capacity) {
+            quint32 *itemSlot = slot(key, table);
+            Q_ASSERT(*itemSlot == 0);
+            *itemSlot = table->count;
+        }
     }
 
     Q_ASSERT(contains(key, table));
@@ -229,29 +429,199 @@ MemoryTablePrivate::Error MemoryTablePrivate::insert(const key_type &key, const
     Q_ASSERT((reinterpret_cast<char *>(table) + table->freeOffset) >= reinterpret_cast<char *>(end(table)));
 
     // Update the value stored at the position
-    updateValue(value, valueSize, position->offset, table);
+    updateValue(value, valueSize, element->offset, table);
 
     return MemoryTable::NoError;
 }
 
 bool MemoryTablePrivate::remove(const key_type &key, TableMetadata *table)
 {
-    IndexElement *tableEnd = end(table);
-    IndexElement *position = std::lower_bound(begin(table), tableEnd, key);
-    if (position == tableEnd || position->key != key)
+    const quint32 index = position(key, table);
+    if (index == NotFound)
         return false;
 
-    deallocate(position->offset, table);
+    IndexElement *element = begin(table) + index;
+    deallocate(element->offset, table);
+
+    if (table->capacity)
+        removeSlot(slot(key, table), table);
 
-    std::memmove(position, position + 1, (tableEnd - position - 1) * sizeof(IndexElement));
+    // Move the last element into the vacated position
+    const quint32 last = table->count - 1;
+    if (index != last) {
+        *element = begin(table)[last];
+        if (table->capacity) {
+            quint32 *movedSlot = slot(element->key, table);
+            Q_ASSERT(*movedSlot == last + 1);
+            *movedSlot = index + 1;
+        }
+    }
     --(table->count);
 
+    // Release hash table space once it is well beyond requirements
+    if (table->capacity && requiredCapacity(table->count * 2) < table->capacity)
+        resizeIndex(requiredCapacity(table->count), table);
+
     Q_ASSERT(!contains(key, table));
     return true;
 }
 
+bool MemoryTablePrivate::readValue(const key_type &key, value_type *value, bool *found, const TableMetadata *table)
+{
+    // A writer may be modifying the table concurrently, so no field can be trusted to be consistent
+    // with any other; each value is read once and validated before use
+    const int sequence = table->sequence.loadAcquire();
+    if ((sequence & 1) || table->retired.loadAcquire())
+        return false;
+
+    const quint64 size = table->size;
+    const quint32 count = readOnce(table->count);
+    const quint32 capacity = readOnce(table->capacity);
+    const quint64 indexEnd = offsetof(TableMetadata, slots) + static_cast<quint64>(capacity) * sizeof(quint32) + static_cast<quint64>(count) * sizeof(IndexElement);
+    if ((capacity & (capacity - 1)) != 0 || indexEnd > size)
+        return false;
+
+    const IndexElement *tableBegin = reinterpret_cast<const IndexElement *>(&table->slots[capacity]);
+
+    quint32 index = NotFound;
+    if (!capacity) {
+        for (quint32 i = 0; i < count; ++i) {
+            if (readOnce(tableBegin[i].key) == key) {
+                index = i;
+                break;
+            }
+        }
+    } else {
+        const quint32 mask = capacity - 1;
+        quint32 i = slotFor(key, capacity);
+        for (quint32 probes = 0; index == NotFound; ++probes, i = (i + 1) & mask) {
+            // A consistent table always contains an empty slot
+            if (probes == capacity)
+                return false;
+
+            const quint32 itemSlot = readOnce(table->slots[i]);
+            if (!itemSlot)
+                break;
+            if (itemSlot > count)
+                return false;
+            if (readOnce(tableBegin[itemSlot - 1].key) == key)
+                index = itemSlot - 1;
+        }
+    }
+
+    value_type result;
+    if (index != NotFound) {
+        const quint64 offset = readOnce(tableBegin[index].offset);
+        if (offset < indexEnd || (offset % sizeof(quint32)) != 0 || offset + offsetof(Allocation, data) > size)
+            return false;
+
+        const Allocation *allocation = allocationAt(offset, table);
+        quint64 allocationSize = readOnce(allocation->size);
+        quint64 allocationDataSize;
+        const char *data;
+        if (allocationSize == 0) {
+            if (offset + offsetof(LargeAllocation, data) > size)
+                return false;
+
+            const LargeAllocation *largeAllocation = large(allocation);
+            if (readOnce(largeAllocation->state) == FreeBlockMarker)
+                return false;
+            allocationSize = readOnce(largeAllocation->size);
+            allocationDataSize = readOnce(largeAllocation->dataSize);
+            data = largeAllocation->data;
+        } else {
+            allocationDataSize = readOnce(allocation->dataSize);
+            if (allocationDataSize == FreeBlockMarker)
+                return false;
+            data = allocation->data;
+        }
+        const quint64 header = data - reinterpret_cast<const char *>(allocation);
+        if (allocationSize < header || allocationSize > size - offset || allocationDataSize > allocationSize - header)
+            return false;
+
+        result = copyData<value_type>(data, allocationDataSize);
+    }
+
+    // The result is valid only if no modification began during the read
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (table->sequence.load() != sequence)
+        return false;
+
+    *value = result;
+    *found = (index != NotFound);
+    return true;
+}
+
+bool MemoryTablePrivate::isConsistent(const TableMetadata *table)
+{
+    // The content is not trusted; every offset is validated against the table size before it is followed
+    const quint64 size = table->size;
+    const quint64 count = table->count;
+    const quint64 capacity = table->capacity;
+    const quint64 freeOffset = table->freeOffset;
+    const quint64 indexEnd = offsetof(TableMetadata, slots) + capacity * sizeof(quint32) + count * sizeof(IndexElement);
+    if ((capacity & (capacity - 1)) != 0 || indexEnd > freeOffset || freeOffset > size || (freeOffset % sizeof(quint32)) != 0)
+        return false;
+
+    // Hash probing relies on there being an empty slot
+    quint64 occupiedSlots = 0;
+    for (quint64 i = 0; i < capacity; ++i) {
+        if (table->slots[i] > count)
+            return false;
+        if (table->slots[i])
+            ++occupiedSlots;
+    }
+    if (capacity && occupiedSlots >= capacity)
+        return false;
+
+    const IndexElement *tableBegin = begin(table);
+    for (quint64 i = 0; i < count; ++i) {
+        if (!isConsistentBlock(tableBegin[i].offset, freeOffset, false, table))
+            return false;
+    }
+
+    // Bound the length of the free list, so that a cycle is detected
+    const quint64 maximumFreeBlocks = (size - freeOffset) / sizeof(Allocation);
+    quint64 freeBlocks = 0;
+    for (quint64 offset = table->freeList; offset; offset = nextFree(allocationAt(offset, table))) {
+        if (++freeBlocks > maximumFreeBlocks || !isConsistentBlock(offset, freeOffset, true, table))
+            return false;
+    }
+
+    return true;
+}
+
+bool MemoryTablePrivate::isConsistentBlock(quint64 offset, quint64 heapOffset, bool free, const TableMetadata *table)
+{
+    const quint64 size = table->size;
+    if (offset < heapOffset || (offset % sizeof(quint32)) != 0 || offset + sizeof(Allocation) > size)
+        return false;
+
+    const Allocation *allocation = allocationAt(offset, table);
+    if (isLarge(allocation) && offset + sizeof(LargeAllocation) > size)
+        return false;
+    if (isFree(allocation) != free)
+        return false;
+
+    // The representation of a block is determined by its size
+    const quint64 allocationSize = blockSize(allocation);
+    if (isLarge(allocation) != (allocationSize > MaximumSmallBlockSize))
+        return false;
+
+    const quint64 header = headerSize(allocationSize);
+    if (allocationSize < header || allocationSize > size - offset)
+        return false;
+
+    return free || blockDataSize(allocation) <= allocationSize - header;
+}
+
 MemoryTablePrivate::Error MemoryTablePrivate::migrateTo(TableMetadata *other, const TableMetadata *table)
 {
+    // Size the hash table of the other table for all elements, before allocating any values
+    const quint32 capacity = requiredCapacity(other->count + table->count);
+    if (capacity > other->capacity && !resizeIndex(capacity, other))
+        return MemoryTable::InsufficientSpace;
+
     // Copy all live elements to the other table
     const IndexElement *tableEnd(end(table));
     for (const IndexElement *it = begin(table); it != tableEnd; ++it) {
@@ -263,24 +633,109 @@ MemoryTablePrivate::Error MemoryTablePrivate::migrateTo(TableMetadata *other, co
     return MemoryTable::NoError;
 }
 
+quint32 MemoryTablePrivate::position(const key_type &key, const TableMetadata *table)
+{
+    const IndexElement *tableBegin = begin(table);
+
+    if (!table->capacity) {
+        const IndexElement *tableEnd = end(table);
+        for (const IndexElement *it = tableBegin; it != tableEnd; ++it) {
+            if (it->key == key)
+                return it - tableBegin;
+        }
+        return NotFound;
+    }
+
+    const quint32 mask = table->capacity - 1;
+    for (quint32 i = slotFor(key, table->capacity); table->slots[i]; i = (i + 1) & mask) {
+        const quint32 index = table->slots[i] - 1;
+        if (tableBegin[index].key == key)
+            return index;
+    }
+    return NotFound;
+}
+
+quint32 *MemoryTablePrivate::slot(const key_type &key, TableMetadata *table)
+{
+    // Find the slot referring to this key, or the empty slot where it should be inserted
+    const IndexElement *tableBegin = begin(table);
+    const quint32 mask = table->capacity - 1;
+
+    quint32 i = slotFor(key, table->capacity);
+    while (table->slots[i] && tableBegin[table->slots[i] - 1].key != key)
+        i = (i + 1) & mask;
+
+    return &table->slots[i];
+}
+
+void MemoryTablePrivate::removeSlot(quint32 *slot, TableMetadata *table)
+{
+    // Shift any subsequent slots in the probe sequence back, so that no tombstone is required
+    const IndexElement *tableBegin = begin(table);
+    const quint32 mask = table->capacity - 1;
+
+    quint32 i = slot - table->slots;
+    for (quint32 j = (i + 1) & mask; table->slots[j]; j = (j + 1) & mask) {
+        const quint32 home = slotFor(tableBegin[table->slots[j] - 1].key, table->capacity);
+
+        // The element at j can fill the vacancy at i, unless its home lies cyclically in (i, j]
+        const bool movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+    table->slots[i] = 0;
+}
+
+bool MemoryTablePrivate::resizeIndex(quint32 capacity, TableMetadata *table)
+{
+    if (capacity > table->capacity) {
+        const size_t additional = (capacity - table->capacity) * sizeof(quint32);
+        if (freeSpace(table) < additional && !reclaimSpace(additional, table))
+            return false;
+    }
+
+    // Move the index elements to follow the resized hash table
+    IndexElement *source = begin(table);
+    table->capacity = capacity;
+    std::memmove(begin(table), source, table->count * sizeof(IndexElement));
+
+    // Rebuild the hash slots from the index
+    if (capacity) {
+        std::memset(table->slots, 0, capacity * sizeof(quint32));
+
+        const IndexElement *tableBegin = begin(table);
+        const quint32 mask = capacity - 1;
+        for (quint32 index = 0; index < table->count; ++index) {
+            quint32 i = slotFor(tableBegin[index].key, capacity);
+            while (table->slots[i])
+                i = (i + 1) & mask;
+            table->slots[i] = index + 1;
+        }
+    }
+
+    return true;
+}
+
 IndexElement *MemoryTablePrivate::begin(TableMetadata *table)
 {
-    return &table->index[0];
+    return reinterpret_cast<IndexElement *>(&table->slots[table->capacity]);
 }
 
 IndexElement *MemoryTablePrivate::end(TableMetadata *table)
 {
-    return &table->index[table->count];
+    return begin(table) + table->count;
 }
 
 const IndexElement *MemoryTablePrivate::begin(const TableMetadata *table)
 {
-    return &table->index[0];
+    return reinterpret_cast<const IndexElement *>(&table->slots[table->capacity]);
 }
 
 const IndexElement *MemoryTablePrivate::end(const TableMetadata *table)
 {
-    return &table->index[table->count];
+    return begin(table) + table->count;
 }
 
 Allocation *MemoryTablePrivate::allocationAt(quint32 offset, TableMetadata *table)
@@ -296,7 +751,7 @@ const Allocation *MemoryTablePrivate::allocationAt(quint32 offset, const TableMe
 const MemoryTablePrivate::value_type MemoryTablePrivate::valueAt(quint32 offset, const TableMetadata *table)
 {
     const Allocation *allocation = allocationAt(offset, table);
-    return extractData<value_type>(allocation->data, allocation->dataSize);
+    return extractData<value_type>(blockData(allocation), blockDataSize(allocation));
 }
 
 MemoryTablePrivate::key_type MemoryTablePrivate::keyAtIndex(size_t index, const TableMetadata *table)
@@ -304,7 +759,7 @@ MemoryTablePrivate::key_type MemoryTablePrivate::keyAtIndex(size_t index, const
     if (index >= table->count)
         return key_type();
 
-    return table->index[index].key;
+    return begin(table)[index].key;
 }
 
 const MemoryTablePrivate::value_type MemoryTablePrivate::valueAtIndex(size_t index, const TableMetadata *table)
@@ -312,21 +767,55 @@ const MemoryTablePrivate::value_type MemoryTablePrivate::valueAtIndex(size_t ind
     if (index >= table->count)
         return key_type();
 
-    return valueAt(table->index[index].offset, table);
+    return valueAt(begin(table)[index].offset, table);
 }
 
 size_t MemoryTablePrivate::freeSpace(const TableMetadata *table)
 {
     // Free space lies between the index and the allocated blocks
-    return table->freeOffset - ((table->count * sizeof(IndexElement)) + offsetof(TableMetadata, index));
+    return table->freeOffset - (reinterpret_cast<const char *>(end(table)) - reinterpret_cast<const char *>(table));
+}
+
+size_t MemoryTablePrivate::fragmentedSpace(const TableMetadata *table)
+{
+    // Fragmented space is held in blocks on the free list
+    size_t total = 0;
+    for (quint32 offset = table->freeList; offset; offset = nextFree(allocationAt(offset, table))) {
+        total += blockSize(allocationAt(offset, table));
+    }
+    return total;
 }
 
-size_t MemoryTablePrivate::requiredSpace(quint32 size)
+size_t MemoryTablePrivate::requiredSpace(size_t size)
 {
-    return std::max<size_t>(sizeof(Allocation), offsetof(Allocation, data) + size); // overhead of Allocation + size
+    // overhead of Allocation + size, unless the block requires a LargeAllocation
+    const size_t smallSize = std::max<size_t>(sizeof(Allocation), offsetof(Allocation, data) + size);
+    if (roundUp(smallSize, sizeof(quint32)) <= MaximumSmallBlockSize)
+        return smallSize;
+
+    return offsetof(LargeAllocation, data) + size;
 }
 
 quint32 MemoryTablePrivate::allocate(quint32 size, TableMetadata *table, bool indexRequired)
+{
+    // Align the allocation so that the header is directly accessible
+    const size_t requiredSize = roundUp(requiredSpace(size), sizeof(quint32));
+    if (requiredSize >= table->size)
+        return 0;
+
+    const quint32 allocationSize = static_cast<quint32>(requiredSize);
+
+    quint32 offset = allocateBlock(allocationSize, size, table, indexRequired);
+    if (!offset) {
+        // Reclaim fragmented space and retry; coalesced blocks may suffice even if compaction is not possible
+        reclaimSpace(allocationSize + (indexRequired ? sizeof(IndexElement) : 0), table);
+        offset = allocateBlock(allocationSize, size, table, indexRequired);
+    }
+
+    return offset;
+}
+
+quint32 MemoryTablePrivate::allocateBlock(quint32 allocationSize, quint32 dataSize, TableMetadata *table, bool indexRequired)
 {
     const quint32 availableSpace = freeSpace(table);
     if (indexRequired) {
@@ -336,10 +825,6 @@ quint32 MemoryTablePrivate::allocate(quint32 size, TableMetadata *table, bool in
         }
     }
 
-    // Align the allocation so that the header is directly accessible
-    quint32 allocationSize = static_cast<quint32>(requiredSpace(size));
-    allocationSize = roundUp(allocationSize, static_cast<quint32>(sizeof(quint32)));
-
     if (table->freeList) {
         // Try to reuse a freed block
         quint32 *bestOffset = 0;
@@ -348,22 +833,35 @@ quint32 MemoryTablePrivate::allocate(quint32 size, TableMetadata *table, bool in
         quint32 *freeOffset = &table->freeList;
         while (*freeOffset) {
             Allocation *freeBlock = allocationAt(*freeOffset, table);
-            if (freeBlock->size >= allocationSize) {
+            if (blockCapacity(freeBlock) >= dataSize) {
                 // This block is large enough
-                if (!bestBlock || bestBlock->size > freeBlock->size) {
+                if (!bestBlock || blockSize(bestBlock) > blockSize(freeBlock)) {
                     // It's our best fit so far
                     bestBlock = freeBlock;
                     bestOffset = freeOffset;
                 }
             }
 
-            freeOffset = &freeBlock->nextOffset;
+            freeOffset = &nextFree(freeBlock);
         }
 
         if (bestOffset) {
-            // TODO: if this block is too large, should it be partitioned?
+            const quint32 bestSize = blockSize(bestBlock);
+            if (bestSize > MaximumSmallBlockSize && bestSize - allocationSize >= sizeof(Allocation)) {
+                // Partition this large block; the remainder stays on the free list, in the same position
+                const quint32 remainder = bestSize - allocationSize;
+                const quint32 next = nextFree(bestBlock);
+                setBlockSize(bestBlock, remainder);
+                setFree(bestBlock, next);
+
+                const quint32 rv = *bestOffset + remainder;
+                setBlockSize(allocationAt(rv, table), allocationSize);
+                return rv;
+            }
+
+            // TODO: if this small block is too large, should it be partitioned?
             quint32 rv = *bestOffset;
-            *bestOffset = bestBlock->nextOffset;
+            *bestOffset = nextFree(bestBlock);
             return rv;
         }
     }
@@ -377,7 +875,7 @@ quint32 MemoryTablePrivate::allocate(quint32 size, TableMetadata *table, bool in
     table->freeOffset -= allocationSize;
 
     Allocation *allocation = allocationAt(table->freeOffset, table);
-    allocation->size = allocationSize;
+    setBlockSize(allocation, allocationSize);
 
     return table->freeOffset;
 }
@@ -386,21 +884,119 @@ void MemoryTablePrivate::deallocate(quint32 offset, TableMetadata *table)
 {
     Allocation *allocation = allocationAt(offset, table);
 
-    // TODO: attempt merge with adjoining blocks?
+    if (offset == table->freeOffset) {
+        // This block adjoins the free space; return it there
+        table->freeOffset += blockSize(allocation);
+        return;
+    }
 
-    // Add this block to the free list
-    allocation->dataSize = static_cast<quint16>(FreeBlock);
-    allocation->nextOffset = table->freeList;
+    // Add this block to the free list; adjoining blocks are merged when space is required
+    setFree(allocation, table->freeList);
     table->freeList = offset;
 }
 
+bool MemoryTablePrivate::reclaimSpace(size_t required, TableMetadata *table)
+{
+    // Merging adjacent free blocks is cheap, since no data is moved
+    coalesce(table);
+    if (freeSpace(table) >= required)
+        return true;
+
+    // Compaction only helps if the total free space is sufficient
+    const size_t fragmented = fragmentedSpace(table);
+    if (fragmented == 0 || freeSpace(table) + fragmented < required)
+        return false;
+
+    compact(table);
+    return true;
+}
+
+void MemoryTablePrivate::coalesce(TableMetadata *table)
+{
+    // Rebuild the free list in address order, merging runs of adjacent free blocks
+    quint32 *tail = &table->freeList;
+    bool adjoiningFreeSpace = true;
+
+    quint32 offset = table->freeOffset;
+    while (offset < table->size) {
+        Allocation *allocation = allocationAt(offset, table);
+        if (!isFree(allocation)) {
+            adjoiningFreeSpace = false;
+            offset += blockSize(allocation);
+            continue;
+        }
+
+        quint32 size = blockSize(allocation);
+        while (offset + size < table->size) {
+            const Allocation *next = allocationAt(offset + size, table);
+            if (!isFree(next))
+                break;
+            size += blockSize(next);
+        }
+
+        if (adjoiningFreeSpace) {
+            // Return this run to the free space
+            table->freeOffset = offset + size;
+        } else {
+            setBlockSize(allocation, size);
+            setFree(allocation, 0);
+            *tail = offset;
+            tail = &nextFree(allocation);
+        }
+        offset += size;
+    }
+
+    *tail = 0;
+}
+
+void MemoryTablePrivate::compact(TableMetadata *table)
+{
+    // Order the live blocks from the highest address downward
+    std::vector<std::pair<quint32, quint32> > blocks;
+    blocks.reserve(table->count);
+
+    IndexElement *tableBegin = begin(table);
+    for (quint32 index = 0; index < table->count; ++index) {
+        blocks.push_back(std::make_pair(tableBegin[index].offset, index));
+    }
+    std::sort(blocks.begin(), blocks.end(), std::greater<std::pair<quint32, quint32> >());
+
+    // Move each block to the top of the remaining space, trimming any excess allocation;
+    // since blocks only move upward, the destination never overlaps an unmoved block
+    quint32 position = table->size;
+    std::vector<std::pair<quint32, quint32> >::const_iterator it = blocks.begin(), end = blocks.end();
+    for ( ; it != end; ++it) {
+        const Allocation *allocation = allocationAt(it->first, table);
+        const quint32 dataSize = blockDataSize(allocation);
+        const char *data = blockData(allocation);
+        const quint32 allocationSize = roundUp(static_cast<quint32>(requiredSpace(dataSize)), static_cast<quint32>(sizeof(quint32)));
+        Q_ASSERT(allocationSize <= blockSize(allocation));
+
+        position -= allocationSize;
+        Q_ASSERT(position >= it->first);
+
+        // The header representation may change, so move the data before writing the header
+        Allocation *moved = allocationAt(position, table);
+        char *movedData = reinterpret_cast<char *>(moved) + headerSize(allocationSize);
+        if (movedData != data) {
+            std::memmove(movedData, data, dataSize);
+        }
+        setBlockSize(moved, allocationSize);
+        setBlockDataSize(moved, dataSize);
+        tableBegin[it->second].offset = position;
+    }
+
+    table->freeOffset = position;
+    table->freeList = 0;
+}
+
 void MemoryTablePrivate::updateValue(const value_type &value, quint32 valueSize, quint32 offset, TableMetadata *table)
 {
     Allocation *allocation = allocationAt(offset, table);
-    Q_ASSERT(allocation->size >= requiredSpace(valueSize));
+    Q_ASSERT(blockCapacity(allocation) >= valueSize);
 
-    allocation->dataSize = valueSize;
-    insertData(allocation->data, allocation->dataSize, value);
+    setBlockDataSize(allocation, valueSize);
+    insertData(blockData(allocation), valueSize, value);
 }
 
 MemoryTable::MemoryTable(void *base, size_t size, bool initialize)
@@ -434,6 +1030,9 @@ MemoryTable::MemoryTable(void *base, size_t size, bool initialize)
         table->count = 0;
         table->freeOffset = table->size;
         table->freeList = 0;
+        table->sequence.store(0);
+        table->retired.store(0);
+        table->capacity = 0;
     } else {
         if (table->size != managedSize) {
             qWarning() << "Invalid size for initialized table:" << table->size << "!=" << managedSize;
@@ -454,6 +1053,28 @@ bool MemoryTable::isValid() const
     return mBase != 0;
 }
 
+size_t MemoryTable::size() const
+{
+    return mSize;
+}
+
+size_t MemoryTable::freeSpace() const
+{
+    if (!mBase)
+        return 0u;
+
+    const TableMetadata *table(MemoryTablePrivate::metadata(this));
+    return MemoryTablePrivate::freeSpace(table) + MemoryTablePrivate::fragmentedSpace(table);
+}
+
+size_t MemoryTable::fragmentedSpace() const
+{
+    if (!mBase)
+        return 0u;
+
+    return MemoryTablePrivate::fragmentedSpace(MemoryTablePrivate::metadata(this));
+}
+
 size_t MemoryTable::count() const
 {
     if (!mBase)
@@ -483,7 +1104,9 @@ MemoryTable::Error MemoryTable::insert(const key_type &key, const value_type &va
     if (!mBase)
         return NotAttached;
 
-    return MemoryTablePrivate::insert(key, value, MemoryTablePrivate::metadata(this));
+    TableMetadata *table(MemoryTablePrivate::metadata(this));
+    WriteSequence sequence(table);
+    return MemoryTablePrivate::insert(key, value, table);
 }
 
 bool MemoryTable::remove(const key_type &key)
@@ -491,7 +1114,25 @@ bool MemoryTable::remove(const key_type &key)
     if (!mBase)
         return false;
 
-    return MemoryTablePrivate::remove(key, MemoryTablePrivate::metadata(this));
+    TableMetadata *table(MemoryTablePrivate::metadata(this));
+    WriteSequence sequence(table);
+    return MemoryTablePrivate::remove(key, table);
+}
+
+bool MemoryTable::readValue(const key_type &key, value_type *value, bool *found) const
+{
+    if (!mBase)
+        return false;
+
+    return MemoryTablePrivate::readValue(key, value, found, MemoryTablePrivate::metadata(this));
+}
+
+bool MemoryTable::isConsistent() const
+{
+    if (!mBase)
+        return false;
+
+    return MemoryTablePrivate::isConsistent(MemoryTablePrivate::metadata(this));
 }
 
 MemoryTable::key_type MemoryTable::keyAt(size_t index) const
@@ -525,7 +1166,33 @@ MemoryTable::Error MemoryTable::migrateTo(MemoryTable &other) const
     if (!mBase || !other.mBase)
         return NotAttached;
 
-    return MemoryTablePrivate::migrateTo(MemoryTablePrivate::metadata(&other), MemoryTablePrivate::metadata(this));
+    TableMetadata *otherTable(MemoryTablePrivate::metadata(&other));
+    WriteSequence sequence(otherTable);
+    return MemoryTablePrivate::migrateTo(otherTable, MemoryTablePrivate::metadata(this));
+}
+
+void MemoryTable::retire()
+{
+    if (!mBase)
+        return;
+
+    MemoryTablePrivate::metadata(this)->retired.storeRelease(1);
+}
+
+bool MemoryTable::isRetired() const
+{
+    if (!mBase)
+        return false;
+
+    return MemoryTablePrivate::metadata(this)->retired.loadAcquire() != 0;
+}
+
+quint32 MemoryTable::sequence() const
+{
+    if (!mBase)
+        return 0;
+
+    return static_cast<quint32>(MemoryTablePrivate::metadata(this)->sequence.loadAcquire());
 }
 
 MemoryTable::const_iterator::const_iterator(const MemoryTable *table, quint32 position)
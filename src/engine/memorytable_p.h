@@ -80,12 +80,29 @@ public:
 
     bool isValid() const;
 
+    // Validates the structure of a table whose content is not trusted, such as an image read
+    // from a file: the index, and every block it or the free list refers to, lie within the table
+    bool isConsistent() const;
+
+    // The managed size of the table, the space available for further allocations, and the
+    // portion of the available space held in free blocks rather than in a contiguous region
+    size_t size() const;
+    size_t freeSpace() const;
+    size_t fragmentedSpace() const;
+
     size_t count() const;
     bool contains(const key_type &key) const;
     value_type value(const key_type &key) const;
     Error insert(const key_type &key, const value_type &value);
     bool remove(const key_type &key);
 
+    // Look up a value without holding the lock that serializes writers.  Returns false if the
+    // lookup was disrupted by a concurrent modification, or the table has been retired; the
+    // lookup can then be retried, or performed with the lock held
+    bool readValue(const key_type &key, value_type *value, bool *found) const;
+
+    // Positional access and iteration follow insertion order, except that removing an
+    // item moves the last item into its position; removal invalidates iterators
     key_type keyAt(size_t index) const;
     value_type valueAt(size_t index) const;
 
@@ -94,6 +111,13 @@ public:
 
     Error migrateTo(MemoryTable &other) const;
 
+    // A retired table has been superseded by the table its content was migrated to
+    void retire();
+    bool isRetired() const;
+
+    // Advances with every modification of the table content; odd while a modification is in progress
+    quint32 sequence() const;
+
 private:
     MemoryTable(const MemoryTable &);
     MemoryTable &operator=(const MemoryTable &);
@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2013 Jolla Ltd. <matthew.vogt@jollamobile.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+
+#include "oobcodec_p.h"
+#include "trace_p.h"
+
+#include <QVector>
+#include <QtEndian>
+
+#ifdef QTCONTACTS_SQLITE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef QTCONTACTS_SQLITE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+namespace {
+
+#ifdef QTCONTACTS_SQLITE_ZSTD
+const int zstdLevel = 3;
+#endif
+
+// Decompressed values larger than this are rejected as corrupt, rather than allocated
+const quint32 maximumLength = 1024 * 1024 * 1024;
+
+}
+
+struct OOBCodec::Dictionary
+{
+#ifdef QTCONTACTS_SQLITE_ZSTD
+    ZSTD_CDict *compression;
+    ZSTD_DDict *decompression;
+#endif
+};
+
+OOBCodec::OOBCodec()
+    : m_compressionContext(0)
+    , m_decompressionContext(0)
+{
+}
+
+OOBCodec::~OOBCodec()
+{
+#ifdef QTCONTACTS_SQLITE_ZSTD
+    foreach (Dictionary *dictionary, m_dictionaries) {
+        ZSTD_freeCDict(dictionary->compression);
+        ZSTD_freeDDict(dictionary->decompression);
+        delete dictionary;
+    }
+    ZSTD_freeCCtx(static_cast<ZSTD_CCtx *>(m_compressionContext));
+    ZSTD_freeDCtx(static_cast<ZSTD_DCtx *>(m_decompressionContext));
+#endif
+}
+
+bool OOBCodec::isAvailable(Codec codec)
+{
+    switch (codec) {
+    case Zlib:
+        return true;
+#ifdef QTCONTACTS_SQLITE_LZ4
+    case LZ4:
+        return true;
+#endif
+#ifdef QTCONTACTS_SQLITE_ZSTD
+    case Zstd:
+    case ZstdDictionary:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+QByteArray OOBCodec::compress(Codec codec, const QByteArray &data, quint32 dictionaryId)
+{
+    Q_UNUSED(dictionaryId)
+
+    if (codec == Zlib) {
+        return qCompress(data);
+    }
+
+#ifdef QTCONTACTS_SQLITE_LZ4
+    if (codec == LZ4) {
+        // LZ4 blocks do not record their length, so prefix it as qCompress does
+        QByteArray result(sizeof(quint32) + LZ4_compressBound(data.size()), Qt::Uninitialized);
+        qToBigEndian<quint32>(data.size(), reinterpret_cast<uchar *>(result.data()));
+        const int size = LZ4_compress_default(data.constData(), result.data() + sizeof(quint32),
+                                              data.size(), result.size() - sizeof(quint32));
+        if (size <= 0) {
+            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to compress OOB data with LZ4"));
+            return QByteArray();
+        }
+        result.resize(sizeof(quint32) + size);
+        return result;
+    }
+#endif
+
+#ifdef QTCONTACTS_SQLITE_ZSTD
+    if (codec == Zstd || codec == ZstdDictionary) {
+        const Dictionary *dictionary = 0;
+        if (codec == ZstdDictionary) {
+            dictionary = m_dictionaries.value(dictionaryId);
+            if (!dictionary) {
+                QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("No OOB compression dictionary: %1").arg(dictionaryId));
+                return QByteArray();
+            }
+        }
+        if (!m_compressionContext) {
+            m_compressionContext = ZSTD_createCCtx();
+        }
+
+        ZSTD_CCtx *context = static_cast<ZSTD_CCtx *>(m_compressionContext);
+        QByteArray result(ZSTD_compressBound(data.size()), Qt::Uninitialized);
+        const size_t size = dictionary
+                ? ZSTD_compress_usingCDict(context, result.data(), result.size(), data.constData(), data.size(), dictionary->compression)
+                : ZSTD_compressCCtx(context, result.data(), result.size(), data.constData(), data.size(), zstdLevel);
+        if (ZSTD_isError(size)) {
+            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to compress OOB data with zstd: %1").arg(QString::fromLatin1(ZSTD_getErrorName(size))));
+            return QByteArray();
+        }
+        result.resize(size);
+        return result;
+    }
+#endif
+
+    QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("OOB compression codec not available: %1").arg(codec));
+    return QByteArray();
+}
+
+bool OOBCodec::decompress(Codec codec, const QByteArray &data, QByteArray *result)
+{
+    if (codec == Zlib) {
+        *result = qUncompress(data);
+        // An empty result is an error, unless the uncompressed data was empty
+        return !result->isEmpty()
+            || (data.size() >= static_cast<int>(sizeof(quint32))
+                && qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(data.constData())) == 0);
+    }
+
+#ifdef QTCONTACTS_SQLITE_LZ4
+    if (codec == LZ4) {
+        if (data.size() < static_cast<int>(sizeof(quint32)))
+            return false;
+
+        const quint32 length = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(data.constData()));
+        if (length > maximumLength)
+            return false;
+
+        result->resize(length);
+        const int size = LZ4_decompress_safe(data.constData() + sizeof(quint32), result->data(),
+                                             data.size() - sizeof(quint32), length);
+        if (size != static_cast<int>(length)) {
+            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to decompress OOB data with LZ4"));
+            result->clear();
+            return false;
+        }
+        return true;
+    }
+#endif
+
+#ifdef QTCONTACTS_SQLITE_ZSTD
+    if (codec == Zstd || codec == ZstdDictionary) {
+        const unsigned long long length = ZSTD_getFrameContentSize(data.constData(), data.size());
+        if (length == ZSTD_CONTENTSIZE_UNKNOWN || length == ZSTD_CONTENTSIZE_ERROR || length > maximumLength)
+            return false;
+
+        const Dictionary *dictionary = 0;
+        if (codec == ZstdDictionary) {
+            const quint32 id = frameDictionaryId(data);
+            dictionary = m_dictionaries.value(id);
+            if (!dictionary) {
+                QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("No OOB compression dictionary: %1").arg(id));
+                return false;
+            }
+        }
+        if (!m_decompressionContext) {
+            m_decompressionContext = ZSTD_createDCtx();
+        }
+
+        ZSTD_DCtx *context = static_cast<ZSTD_DCtx *>(m_decompressionContext);
+        result->resize(length);
+        const size_t size = dictionary
+                ? ZSTD_decompress_usingDDict(context, result->data(), result->size(), data.constData(), data.size(), dictionary->decompression)
+                : ZSTD_decompressDCtx(context, result->data(), result->size(), data.constData(), data.size());
+        if (ZSTD_isError(size) || size != length) {
+            QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Failed to decompress OOB data with zstd"));
+            result->clear();
+            return false;
+        }
+        return true;
+    }
+#endif
+
+    QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("OOB compression codec not available: %1").arg(codec));
+    return false;
+}
+
+QByteArray OOBCodec::trainDictionary(const QList<QByteArray> &samples, int capacity)
+{
+#ifdef QTCONTACTS_SQLITE_ZSTD
+    QByteArray buffer;
+    QVector<size_t> sizes;
+    sizes.reserve(samples.count());
+    foreach (const QByteArray &sample, samples) {
+        buffer.append(sample);
+        sizes.append(sample.size());
+    }
+
+    QByteArray dictionary(capacity, Qt::Uninitialized);
+    const size_t size = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(),
+                                              buffer.constData(), sizes.constData(), sizes.count());
+    if (ZDICT_isError(size)) {
+        QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("Unable to train OOB compression dictionary: %1").arg(QString::fromLatin1(ZDICT_getErrorName(size))));
+        return QByteArray();
+    }
+    dictionary.resize(size);
+    return dictionary;
+#else
+    Q_UNUSED(samples)
+    Q_UNUSED(capacity)
+    return QByteArray();
+#endif
+}
+
+quint32 OOBCodec::dictionaryId(const QByteArray &dictionary)
+{
+#ifdef QTCONTACTS_SQLITE_ZSTD
+    return ZDICT_getDictID(dictionary.constData(), dictionary.size());
+#else
+    Q_UNUSED(dictionary)
+    return 0;
+#endif
+}
+
+quint32 OOBCodec::frameDictionaryId(const QByteArray &data)
+{
+#ifdef QTCONTACTS_SQLITE_ZSTD
+    return ZSTD_getDictID_fromFrame(data.constData(), data.size());
+#else
+    Q_UNUSED(data)
+    return 0;
+#endif
+}
+
+bool OOBCodec::hasDictionary(quint32 id) const
+{
+    return m_dictionaries.contains(id);
+}
+
+bool OOBCodec::addDictionary(const QByteArray &dictionary)
+{
+#ifdef QTCONTACTS_SQLITE_ZSTD
+    const quint32 id = dictionaryId(dictionary);
+    if (id == 0)
+        return false;
+    if (m_dictionaries.contains(id))
+        return true;
+
+    Dictionary *entry = new Dictionary;
+    entry->compression = ZSTD_createCDict(dictionary.constData(), dictionary.size(), zstdLevel);
+    entry->decompression = ZSTD_createDDict(dictionary.constData(), dictionary.size());
+    if (!entry->compression || !entry->decompression) {
+        ZSTD_freeCDict(entry->compression);
+        ZSTD_freeDDict(entry->decompression);
+        delete entry;
+        return false;
+    }
+    m_dictionaries.insert(id, entry);
+    return true;
+#else
+    Q_UNUSED(dictionary)
+    return false;
+#endif
+}
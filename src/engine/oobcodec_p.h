@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2013 Jolla Ltd. <matthew.vogt@jollamobile.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+
+#ifndef QTCONTACTSSQLITE_OOBCODEC_P_H
+#define QTCONTACTSSQLITE_OOBCODEC_P_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+
+// Compresses OOB values.  zlib is always available; LZ4 and zstd are available when the
+// engine is built with CONFIG+=lz4 and CONFIG+=zstd respectively.
+class OOBCodec
+{
+public:
+    // Recorded with each compressed value, so these must not be renumbered
+    enum Codec {
+        Zlib = 0,
+        LZ4 = 1,
+        Zstd = 2,
+        // zstd with a dictionary trained from the values of a scope
+        ZstdDictionary = 3
+    };
+
+    OOBCodec();
+    ~OOBCodec();
+
+    static bool isAvailable(Codec codec);
+
+    // Returns an empty array if the data cannot be compressed
+    QByteArray compress(Codec codec, const QByteArray &data, quint32 dictionaryId = 0);
+    bool decompress(Codec codec, const QByteArray &data, QByteArray *result);
+
+    // Dictionaries are identified by the id they contain, which is recorded in each compressed frame
+    static QByteArray trainDictionary(const QList<QByteArray> &samples, int capacity);
+    static quint32 dictionaryId(const QByteArray &dictionary);
+    static quint32 frameDictionaryId(const QByteArray &data);
+
+    bool hasDictionary(quint32 id) const;
+    bool addDictionary(const QByteArray &dictionary);
+
+private:
+    struct Dictionary;
+
+    QHash<quint32, Dictionary *> m_dictionaries;
+    void *m_compressionContext;
+    void *m_decompressionContext;
+
+    Q_DISABLE_COPY(OOBCodec)
+};
+
+#endif
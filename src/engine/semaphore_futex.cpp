@@ -0,0 +1,506 @@
+/*
+ * Copyright (C) 2013 Jolla Ltd. <matthew.vogt@jollamobile.com>
+ *
+ * You may use this file under the terms of the BSD license as follows:
+ *
+ * "Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Nemo Mobile nor the names of its contributors
+ *     may be used to endorse or promote products derived from this
+ *     software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
+ */
+
+
+#include "semaphore_p.h"
+#include "trace_p.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutex>
+
+// An implementation of the Semaphore interface in a shared memory segment, which
+// avoids the system calls made by every SysV semaphore operation.
+//
+// The segment contains a robust process-shared mutex guarding a table of the
+// adjustments made to each semaphore by each attached process; the value of a
+// semaphore is its initial value less the adjustments of all processes.  An
+// uncontended operation takes and releases the guard mutex, and updates the
+// table, without leaving user space.  Waiters sleep on a futex word which is
+// advanced when a semaphore is incremented.
+//
+// Each attached process holds a file lock on the byte of the segment which
+// corresponds to its row of the table.  The kernel releases the lock when the
+// process exits, so a process which finds a semaphore unavailable can discard
+// the adjustments of processes which have died, as SEM_UNDO would have done.
+
+namespace {
+
+enum {
+    MaxSemaphores = 8,
+    MaxProcesses = 128,
+    SegmentMagic = 0x51435346,
+    // Interval at which a waiter checks whether the holders of a semaphore have died
+    RecoveryIntervalMs = 100
+};
+
+struct SharedState
+{
+    int magic;
+    int count;
+    int initialValues[MaxSemaphores];
+    int waiters;
+    int wakeSequence;
+    // The number of rows of the process table which have been used
+    int processLimit;
+    pthread_mutex_t guard;
+
+    struct Process {
+        pid_t pid;
+        int adjustments[MaxSemaphores];
+    } processes[MaxProcesses];
+};
+
+}
+
+struct SemaphoreSegment
+{
+    pid_t pid;
+    int fd;
+    int process;
+    SharedState *state;
+};
+
+namespace {
+
+void semaphoreError(const char *msg, const char *id, int error)
+{
+    QTCONTACTS_SQLITE_WARNING(QString::fromLatin1("%1 %2: %3 (%4)").arg(msg).arg(id).arg(::strerror(error)).arg(error));
+}
+
+int futexWait(int *address, int expected, int timeoutMs)
+{
+    struct timespec timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (timeoutMs % 1000) * 1000 * 1000;
+
+    return ::syscall(SYS_futex, address, FUTEX_WAIT, expected, &timeout, 0, 0);
+}
+
+void futexWake(int *address)
+{
+    ::syscall(SYS_futex, address, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+}
+
+bool processAlive(SemaphoreSegment *segment, int process)
+{
+    if (process == segment->process)
+        return true;
+
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = process;
+    lock.l_len = 1;
+
+    // If the lock state cannot be determined, assume that the process is alive
+    if (::fcntl(segment->fd, F_GETLK, &lock) == -1)
+        return true;
+
+    return lock.l_type != F_UNLCK;
+}
+
+// Discards the adjustments of processes which have died, for the semaphore at index,
+// or for all semaphores if index is negative.  Requires the guard mutex.
+bool recoverDeadProcesses(SemaphoreSegment *segment, int index)
+{
+    SharedState *state = segment->state;
+
+    bool recovered = false;
+    for (int i = 0; i < state->processLimit; ++i) {
+        SharedState::Process &process(state->processes[i]);
+        if (process.pid == 0 || (index >= 0 && process.adjustments[index] == 0))
+            continue;
+
+        if (!processAlive(segment, i)) {
+            process.pid = 0;
+            memset(process.adjustments, 0, sizeof(process.adjustments));
+            recovered = true;
+        }
+    }
+
+    if (recovered && state->waiters > 0) {
+        ++state->wakeSequence;
+        return true;
+    }
+    return false;
+}
+
+bool lockGuard(SemaphoreSegment *segment)
+{
+    const int rv = ::pthread_mutex_lock(&segment->state->guard);
+    if (rv == EOWNERDEAD) {
+        // A process died while holding the guard.  Each operation is a single store to
+        // the process table, so the table is consistent
+        ::pthread_mutex_consistent(&segment->state->guard);
+        recoverDeadProcesses(segment, -1);
+        return true;
+    }
+
+    errno = rv;
+    return rv == 0;
+}
+
+void unlockGuard(SemaphoreSegment *segment, bool wake = false)
+{
+    ::pthread_mutex_unlock(&segment->state->guard);
+    if (wake) {
+        futexWake(&segment->state->wakeSequence);
+    }
+}
+
+int semaphoreValue(SharedState *state, int index)
+{
+    int value = state->initialValues[index];
+    for (int i = 0; i < state->processLimit; ++i) {
+        value -= state->processes[i].adjustments[index];
+    }
+    return value;
+}
+
+SharedState *mapSegment(int fd, bool create, size_t count, const int *initialValues)
+{
+    if (create && ::ftruncate(fd, sizeof(SharedState)) == -1)
+        return 0;
+
+    if (!create) {
+        // Wait for the creator to size the segment
+        struct stat status;
+        for (int i = 0; ; ++i) {
+            if (::fstat(fd, &status) == -1)
+                return 0;
+            if (status.st_size >= static_cast<off_t>(sizeof(SharedState)))
+                break;
+            if (i == 1000) {
+                errno = ETIMEDOUT;
+                return 0;
+            }
+            ::usleep(1000);
+        }
+    }
+
+    void *address = ::mmap(0, sizeof(SharedState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+        return 0;
+
+    SharedState *state = static_cast<SharedState *>(address);
+    if (create) {
+        state->count = count;
+        for (size_t i = 0; i < count; ++i) {
+            state->initialValues[i] = initialValues[i];
+        }
+
+        pthread_mutexattr_t attributes;
+        ::pthread_mutexattr_init(&attributes);
+        ::pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        ::pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+        const int rv = ::pthread_mutex_init(&state->guard, &attributes);
+        ::pthread_mutexattr_destroy(&attributes);
+        if (rv != 0) {
+            ::munmap(address, sizeof(SharedState));
+            errno = rv;
+            return 0;
+        }
+
+        __atomic_store_n(&state->magic, static_cast<int>(SegmentMagic), __ATOMIC_RELEASE);
+    } else {
+        // Wait for the creator to initialize the segment
+        for (int i = 0; __atomic_load_n(&state->magic, __ATOMIC_ACQUIRE) != SegmentMagic; ++i) {
+            if (i == 1000) {
+                ::munmap(address, sizeof(SharedState));
+                errno = ETIMEDOUT;
+                return 0;
+            }
+            ::usleep(1000);
+        }
+    }
+
+    return state;
+}
+
+bool attachProcess(SemaphoreSegment *segment)
+{
+    if (!lockGuard(segment))
+        return false;
+
+    SharedState *state = segment->state;
+    recoverDeadProcesses(segment, -1);
+
+    for (int i = 0; i < MaxProcesses; ++i) {
+        if (state->processes[i].pid != 0)
+            continue;
+
+        // Hold the lock identifying this process's row until the process exits
+        struct flock lock;
+        memset(&lock, 0, sizeof(lock));
+        lock.l_type = F_WRLCK;
+        lock.l_whence = SEEK_SET;
+        lock.l_start = i;
+        lock.l_len = 1;
+        if (::fcntl(segment->fd, F_SETLK, &lock) == -1)
+            continue;
+
+        memset(state->processes[i].adjustments, 0, sizeof(state->processes[i].adjustments));
+        state->processes[i].pid = segment->pid;
+        state->processLimit = qMax(state->processLimit, i + 1);
+        segment->process = i;
+        unlockGuard(segment);
+        return true;
+    }
+
+    unlockGuard(segment);
+    errno = EUSERS;
+    return false;
+}
+
+// Segments are attached once per process, as SEM_UNDO adjustments are per process,
+// and remain attached until the process exits
+QMutex segmentsMutex;
+QHash<QByteArray, SemaphoreSegment *> segments;
+
+SemaphoreSegment *semaphoreInit(const char *id, size_t count, const int *initialValues)
+{
+    if (count > MaxSemaphores) {
+        semaphoreError("Too many semaphores requested for", id, EINVAL);
+        return 0;
+    }
+
+    // As for the SysV implementation, derive the segment from the identifying path
+    const key_t key = ::ftok(id, 1);
+    if (key == -1) {
+        semaphoreError("Unable to get semaphore key", id, errno);
+        return 0;
+    }
+    const QByteArray name(QByteArray("/qtcontacts-sqlite-") + QByteArray::number(static_cast<uint>(key), 16));
+
+    QMutexLocker locker(&segmentsMutex);
+
+    const pid_t pid = ::getpid();
+    SemaphoreSegment *segment = segments.value(name);
+    if (segment && segment->pid == pid) {
+        if (segment->state->count != static_cast<int>(count)) {
+            semaphoreError("Mismatched semaphore count for", id, EINVAL);
+            return 0;
+        }
+        return segment;
+    }
+
+    // Any segment inherited across fork belongs to the parent process
+    bool create = true;
+    int fd = ::shm_open(name.constData(), O_RDWR | O_CREAT | O_EXCL, S_IRWXO | S_IRWXG | S_IRWXU);
+    if (fd == -1 && errno == EEXIST) {
+        create = false;
+        fd = ::shm_open(name.constData(), O_RDWR, 0);
+    }
+    if (fd == -1) {
+        semaphoreError("Unable to open semaphore segment", id, errno);
+        return 0;
+    }
+    if (create) {
+        // Allow other users to attach, regardless of umask
+        ::fchmod(fd, S_IRWXO | S_IRWXG | S_IRWXU);
+    }
+
+    SharedState *state = mapSegment(fd, create, count, initialValues);
+    if (!state) {
+        semaphoreError("Unable to map semaphore segment", id, errno);
+        ::close(fd);
+        return 0;
+    }
+    if (state->count != static_cast<int>(count)) {
+        semaphoreError("Mismatched semaphore count for", id, EINVAL);
+        ::munmap(state, sizeof(SharedState));
+        ::close(fd);
+        return 0;
+    }
+
+    segment = new SemaphoreSegment;
+    segment->pid = pid;
+    segment->fd = fd;
+    segment->process = -1;
+    segment->state = state;
+    if (!attachProcess(segment)) {
+        semaphoreError("Unable to attach to semaphore segment", id, errno);
+        ::munmap(state, sizeof(SharedState));
+        ::close(fd);
+        delete segment;
+        return 0;
+    }
+
+    segments.insert(name, segment);
+    return segment;
+}
+
+bool semaphoreIncrement(SemaphoreSegment *segment, size_t index, bool wait, size_t ms, int value)
+{
+    if (!segment) {
+        errno = 0;
+        return false;
+    }
+
+    SharedState *state = segment->state;
+    if (static_cast<int>(index) >= state->count) {
+        errno = EFBIG;
+        return false;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    bool waiting = false;
+    while (true) {
+        if (!lockGuard(segment))
+            return false;
+
+        if (waiting) {
+            --state->waiters;
+            waiting = false;
+        }
+
+        bool wake = false;
+        int current = semaphoreValue(state, index);
+        if (current + value < 0) {
+            // The semaphore is unavailable; release it from any holder which has died
+            wake = recoverDeadProcesses(segment, index);
+            current = semaphoreValue(state, index);
+        }
+
+        if (current + value >= 0) {
+            state->processes[segment->process].adjustments[index] -= value;
+            if (value > 0 && state->waiters > 0) {
+                ++state->wakeSequence;
+                wake = true;
+            }
+            unlockGuard(segment, wake);
+            return true;
+        }
+
+        int timeoutMs = RecoveryIntervalMs;
+        if (wait && ms > 0) {
+            timeoutMs = qMin<qint64>(timeoutMs, static_cast<qint64>(ms) - timer.elapsed());
+        }
+        if (!wait || timeoutMs <= 0) {
+            unlockGuard(segment, wake);
+            errno = EAGAIN;
+            return false;
+        }
+
+        const int sequence = state->wakeSequence;
+        ++state->waiters;
+        waiting = true;
+        unlockGuard(segment, wake);
+
+        futexWait(&state->wakeSequence, sequence, timeoutMs);
+    }
+}
+
+}
+
+Semaphore::Semaphore(const char *id, int initial)
+    : m_identifier(id)
+    , m_segment(0)
+{
+    m_segment = semaphoreInit(m_identifier.toUtf8().constData(), 1, &initial);
+}
+
+Semaphore::Semaphore(const char *id, size_t count, const int *initialValues)
+    : m_identifier(id)
+    , m_segment(0)
+{
+    m_segment = semaphoreInit(m_identifier.toUtf8().constData(), count, initialValues);
+}
+
+Semaphore::~Semaphore()
+{
+}
+
+bool Semaphore::isValid() const
+{
+    return (m_segment != 0);
+}
+
+bool Semaphore::decrement(size_t index, bool wait, size_t timeoutMs)
+{
+    if (!semaphoreIncrement(m_segment, index, wait, timeoutMs, -1)) {
+        if (errno != EAGAIN || wait) {
+            error("Unable to decrement semaphore", errno);
+        }
+        return false;
+    }
+    return true;
+}
+
+bool Semaphore::increment(size_t index, bool wait, size_t timeoutMs)
+{
+    if (!semaphoreIncrement(m_segment, index, wait, timeoutMs, 1)) {
+        if (errno != EAGAIN || wait) {
+            error("Unable to increment semaphore", errno);
+        }
+        return false;
+    }
+    return true;
+}
+
+int Semaphore::value(size_t index) const
+{
+    if (!m_segment || static_cast<int>(index) >= m_segment->state->count)
+        return -1;
+
+    if (!lockGuard(m_segment))
+        return -1;
+
+    // Any adjustments by processes which have died are undone
+    const bool wake = recoverDeadProcesses(m_segment, index);
+    const int value = semaphoreValue(m_segment->state, index);
+    unlockGuard(m_segment, wake);
+    return value;
+}
+
+void Semaphore::error(const char *msg, int error)
+{
+    semaphoreError(msg, m_identifier.toUtf8().constData(), error);
+}
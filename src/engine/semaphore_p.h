@@ -34,6 +34,10 @@
 
 #include <QString>
 
+#ifdef QTCONTACTS_SQLITE_FUTEX_SEMAPHORE
+struct SemaphoreSegment;
+#endif
+
 class Semaphore
 {
 public:
@@ -52,7 +56,11 @@ private:
     void error(const char *msg, int error);
 
     QString m_identifier;
+#ifdef QTCONTACTS_SQLITE_FUTEX_SEMAPHORE
+    SemaphoreSegment *m_segment;
+#else
     int m_id;
+#endif
 };
 
 #endif
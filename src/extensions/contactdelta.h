@@ -99,6 +99,24 @@ namespace QtContactsSqliteExtensions {
             const QHash<QContactDetail::DetailType, QSet<int> > &ignorableDetailFields = defaultIgnorableDetailFields(),
             const QSet<int> &ignorableCommonFields = defaultIgnorableCommonFields());
 
+    // Stable 64-bit fingerprints of detail and contact content.
+    // Details (or contacts) with identical values have equal fingerprints,
+    // so equal fingerprints identify the likely exact matches.  Values are
+    // hashed in a canonical form, so values which compare as equal despite
+    // differing types (such as a QUrl and its string form) have equal
+    // fingerprints, and unequal fingerprints prove the content differs.
+    // The values are stable across processes and may be persisted.
+    quint64 detailContentHash(
+            const QContactDetail &detail,
+            const QHash<QContactDetail::DetailType, QSet<int> > &ignorableDetailFields = defaultIgnorableDetailFields(),
+            const QSet<int> &ignorableCommonFields = defaultIgnorableCommonFields());
+
+    quint64 contactContentHash(
+            const QContact &contact,
+            const QSet<QContactDetail::DetailType> &ignorableDetailTypes = defaultIgnorableDetailTypes(),
+            const QHash<QContactDetail::DetailType, QSet<int> > &ignorableDetailFields = defaultIgnorableDetailFields(),
+            const QSet<int> &ignorableCommonFields = defaultIgnorableCommonFields());
+
     int exactContactMatchExistsInList(
             const QContact &aContact,
             const QList<QContact> &list,
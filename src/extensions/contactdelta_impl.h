@@ -37,7 +37,19 @@
 #include <qtcontacts-extensions.h>
 #include <contactmanagerengine.h>
 
+#include <QBitArray>
+#include <QDataStream>
+#include <QDateTime>
 #include <QDebug>
+#include <QMultiHash>
+#include <QUrl>
+#include <QVector>
+#include <QtNumeric>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
 
 #define QTCONTACTS_SQLITE_DELTA_DEBUG_LOG(msg)                           \
     do {                                                                 \
@@ -123,6 +135,198 @@ void removeDatabaseIdsFromList(QList<QContactDetail> *dets)
 }
 
 
+// 64-bit FNV-1a; used rather than qHash() since the result is persisted
+// and so must not depend on the per-process hash seed.
+const quint64 ContentHashOffsetBasis = Q_UINT64_C(14695981039346656037);
+const quint64 ContentHashPrime = Q_UINT64_C(1099511628211);
+
+void contentHashAppend(quint64 *hash, const char *data, int length)
+{
+    for (int i = 0; i < length; ++i) {
+        *hash ^= static_cast<quint8>(data[i]);
+        *hash *= ContentHashPrime;
+    }
+}
+
+void contentHashAppend(quint64 *hash, quint64 value)
+{
+    // always feed the value in little-endian order, for stability across devices
+    char bytes[sizeof(quint64)];
+    for (unsigned i = 0; i < sizeof(quint64); ++i) {
+        bytes[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+    contentHashAppend(hash, bytes, sizeof(bytes));
+}
+
+void contentHashAppend(quint64 *hash, const QString &value)
+{
+    contentHashAppend(hash, static_cast<quint64>(value.size()));
+    const ushort *data = value.utf16();
+    for (int i = 0; i < value.size(); ++i) {
+        const char bytes[2] = { static_cast<char>(data[i] & 0xff), static_cast<char>(data[i] >> 8) };
+        contentHashAppend(hash, bytes, 2);
+    }
+}
+
+bool contentHashIgnoresValue(const QVariant &value)
+{
+    // these values are considered equivalent to a missing value by detailPairExactlyMatches()
+    return value.type() == QVariant::Invalid
+        || (value.type() == QVariant::String && value.toString().isEmpty())
+        || (value.userType() == QMetaType::type("QList<int>") && value.value<QList<int> >() == QList<int>());
+}
+
+QVariant canonicalStringValue(const QString &value)
+{
+    // the sync adaptor might return numeric or date data as a string.  Only strings
+    // which are the exact canonical representation of such a value are converted,
+    // so that distinct strings never have the same canonical form.
+    if (value.isEmpty() || (!value.at(0).isDigit() && value.at(0) != QLatin1Char('-'))) {
+        return QVariant(value);
+    }
+
+    bool ok = false;
+    const qlonglong number = value.toLongLong(&ok);
+    if (ok && QString::number(number) == value) {
+        return QVariant(number);
+    }
+
+    if (value.size() >= 10 && value.at(4) == QLatin1Char('-') && value.at(7) == QLatin1Char('-')) {
+        if (value.size() == 10) {
+            const QDate date(QDate::fromString(value, Qt::ISODate));
+            if (date.isValid() && date.toString(Qt::ISODate) == value) {
+                return QVariant(date);
+            }
+        } else {
+            const QDateTime dateTime(QDateTime::fromString(value, Qt::ISODate).toUTC());
+            if (dateTime.isValid() && dateTime.toString(Qt::ISODate) == value) {
+                return QVariant(dateTime);
+            }
+        }
+    }
+
+    return QVariant(value);
+}
+
+QVariant canonicalValue(const QVariant &value)
+{
+    // Reduce a value to a canonical form, so that the representations of a value which
+    // scoreForValuePair() considers equal are identical, and so also hash identically.
+    switch (value.userType()) {
+    case QMetaType::Bool:
+        return QVariant(static_cast<qlonglong>(value.toBool() ? 1 : 0));
+    case QMetaType::Int:
+    case QMetaType::UInt:
+    case QMetaType::LongLong:
+    case QMetaType::Long:
+    case QMetaType::ULong:
+    case QMetaType::Short:
+    case QMetaType::UShort:
+    case QMetaType::Char:
+    case QMetaType::SChar:
+    case QMetaType::UChar:
+        return QVariant(value.toLongLong());
+    case QMetaType::ULongLong:
+        if (value.toULongLong() <= static_cast<qulonglong>(std::numeric_limits<qlonglong>::max())) {
+            return QVariant(value.toLongLong());
+        }
+        return value;
+    case QMetaType::Double:
+    case QMetaType::Float: {
+        const double number = value.toDouble();
+        if (qIsFinite(number) && std::floor(number) == number && std::fabs(number) < 9.0e15) {
+            return QVariant(static_cast<qlonglong>(number));
+        }
+        return QVariant(number);
+    }
+    case QMetaType::QUrl:
+        return QVariant(value.toUrl().toString());
+    case QMetaType::QDateTime: {
+        const QDateTime dateTime(value.toDateTime());
+        return QVariant(dateTime.isValid() ? dateTime.toUTC() : QDateTime());
+    }
+    case QMetaType::QString:
+        return canonicalStringValue(value.toString());
+    default:
+        return value;
+    }
+}
+
+// Tags distinguishing the canonical value types in a content hash.
+enum ContentHashValueTag {
+    ContentHashOtherValue = 0,
+    ContentHashIntegerValue,
+    ContentHashDoubleValue,
+    ContentHashStringValue,
+    ContentHashDateValue,
+    ContentHashDateTimeValue,
+    ContentHashIntListValue,
+    ContentHashStringListValue,
+    ContentHashByteArrayValue
+};
+
+void contentHashAppend(quint64 *hash, const QVariant &value)
+{
+    // Hash the canonical form of the value, so that values which scoreForValuePair()
+    // considers equal always produce the same hash, and differing hashes prove
+    // differing values.
+    static const int QListIntType = QMetaType::type("QList<int>");
+
+    const QVariant canonical(canonicalValue(value));
+    const int type = canonical.userType();
+    if (type == QMetaType::LongLong) {
+        contentHashAppend(hash, static_cast<quint64>(ContentHashIntegerValue));
+        contentHashAppend(hash, static_cast<quint64>(canonical.toLongLong()));
+    } else if (type == QMetaType::Double) {
+        const double number = canonical.toDouble();
+        quint64 bits;
+        memcpy(&bits, &number, sizeof(bits));
+        contentHashAppend(hash, static_cast<quint64>(ContentHashDoubleValue));
+        contentHashAppend(hash, bits);
+    } else if (type == QMetaType::QString) {
+        contentHashAppend(hash, static_cast<quint64>(ContentHashStringValue));
+        contentHashAppend(hash, canonical.toString());
+    } else if (type == QMetaType::QDate) {
+        const QDate date(canonical.toDate());
+        contentHashAppend(hash, static_cast<quint64>(ContentHashDateValue));
+        contentHashAppend(hash, static_cast<quint64>(date.isValid() ? date.toJulianDay() : 0));
+    } else if (type == QMetaType::QDateTime) {
+        const QDateTime dateTime(canonical.toDateTime());
+        contentHashAppend(hash, static_cast<quint64>(ContentHashDateTimeValue));
+        contentHashAppend(hash, static_cast<quint64>(dateTime.isValid() ? dateTime.toMSecsSinceEpoch() : 0));
+    } else if (type == QListIntType) {
+        const QList<int> list(canonical.value<QList<int> >());
+        contentHashAppend(hash, static_cast<quint64>(ContentHashIntListValue));
+        contentHashAppend(hash, static_cast<quint64>(list.size()));
+        for (int v : list) {
+            contentHashAppend(hash, static_cast<quint64>(static_cast<qint64>(v)));
+        }
+    } else if (type == QMetaType::QStringList) {
+        const QStringList list(canonical.toStringList());
+        contentHashAppend(hash, static_cast<quint64>(ContentHashStringListValue));
+        contentHashAppend(hash, static_cast<quint64>(list.size()));
+        for (const QString &v : list) {
+            contentHashAppend(hash, v);
+        }
+    } else if (type == QMetaType::QByteArray) {
+        const QByteArray data(canonical.toByteArray());
+        contentHashAppend(hash, static_cast<quint64>(ContentHashByteArrayValue));
+        contentHashAppend(hash, static_cast<quint64>(data.size()));
+        contentHashAppend(hash, data.constData(), data.size());
+    } else {
+        // no canonical form; hash the serialized value
+        QByteArray data;
+        {
+            QDataStream ds(&data, QIODevice::WriteOnly);
+            ds.setVersion(QDataStream::Qt_5_1);
+            ds << canonical;
+        }
+        contentHashAppend(hash, static_cast<quint64>(ContentHashOtherValue));
+        contentHashAppend(hash, static_cast<quint64>(data.size()));
+        contentHashAppend(hash, data.constData(), data.size());
+    }
+}
+
 void dumpContactDetail(const QContactDetail &d)
 {
     qWarning() << "++ ---------" << d.type();
@@ -144,27 +348,25 @@ int scoreForValuePair(const QVariant &removal, const QVariant &addition)
         return 0;
     }
 
-    if (removal.canConvert<QList<int> >() && addition.canConvert<QList<int> >()) {
+    // the sync adaptor might return url, numeric or date data as a string,
+    // or boolean data as an integer, so compare the canonical forms.
+    static const int QListIntType = QMetaType::type("QList<int>");
+    const QVariant rvalue(canonicalValue(removal));
+    const QVariant avalue(canonicalValue(addition));
+    if (rvalue.userType() != avalue.userType()) {
+        return 1;
+    }
+
+    if (rvalue.userType() == QListIntType) {
         // direct comparison of QVariant::fromValue<QList<int> > doesn't work
         // so instead, do the conversion and compare them manually.
-        QList<int> rlist = removal.value<QList<int> >();
-        QList<int> llist = addition.value<QList<int> >();
+        QList<int> rlist = rvalue.value<QList<int> >();
+        QList<int> llist = avalue.value<QList<int> >();
         return rlist == llist ? 0 : 1;
     }
 
-    // the sync adaptor might return url data as a string.
-    if (removal.type() == QVariant::Url && addition.type() == QVariant::String) {
-        QUrl rurl = removal.toUrl();
-        QUrl aurl = QUrl(addition.toString());
-        return rurl == aurl ? 0 : 1;
-    } else if (removal.type() == QVariant::String && addition.type() == QVariant::Url) {
-        QUrl rurl = QUrl(removal.toString());
-        QUrl aurl = addition.toUrl();
-        return rurl == aurl ? 0 : 1;
-    }
-
     // normal case.  if they're different, increase the distance.
-    return removal == addition ? 0 : 1;
+    return rvalue == avalue ? 0 : 1;
 }
 
 // Given two details of the same type, determine a similarity score for them.
@@ -175,26 +377,38 @@ int scoreForDetailPair(
         const QSet<int> &ignorableCommonFields)
 {
     int score = 0; // distance
-    QMap<int, QVariant> rvalues = removal.values();
-    QMap<int, QVariant> avalues = addition.values();
-
-    QList<int> seenFields;
-    foreach (int field, rvalues.keys()) {
-        if (ignorableCommonFields.contains(field)
-                || ignorableDetailFields.value(removal.type()).contains(field)) {
-            continue;
+    const QMap<int, QVariant> rvalues = removal.values();
+    const QMap<int, QVariant> avalues = addition.values();
+    const QSet<int> ignorableFields = ignorableDetailFields.value(removal.type());
+
+    // both maps are ordered by field, so walk them together rather than
+    // looking up each field of one detail in the other.
+    QMap<int, QVariant>::const_iterator rit = rvalues.constBegin(), rend = rvalues.constEnd();
+    QMap<int, QVariant>::const_iterator ait = avalues.constBegin(), aend = avalues.constEnd();
+    while (rit != rend || ait != aend) {
+        int field;
+        QVariant rvalue;
+        QVariant avalue;
+        if (ait == aend || (rit != rend && rit.key() < ait.key())) {
+            field = rit.key();
+            rvalue = rit.value();
+            ++rit;
+        } else if (rit == rend || ait.key() < rit.key()) {
+            field = ait.key();
+            avalue = ait.value();
+            ++ait;
+        } else {
+            field = rit.key();
+            rvalue = rit.value();
+            avalue = ait.value();
+            ++rit;
+            ++ait;
         }
-        seenFields.append(field);
-        score += scoreForValuePair(rvalues.value(field), avalues.value(field));
-    }
 
-    foreach (int field, avalues.keys()) {
-        if (seenFields.contains(field)
-                || ignorableCommonFields.contains(field)
-                || ignorableDetailFields.value(addition.type()).contains(field)) {
+        if (ignorableCommonFields.contains(field) || ignorableFields.contains(field)) {
             continue;
         }
-        score += scoreForValuePair(rvalues.value(field), avalues.value(field));
+        score += scoreForValuePair(rvalue, avalue);
     }
 
     return score;
@@ -276,22 +490,6 @@ bool detailPairExactlyMatches(
     return true;
 }
 
-int exactDetailMatchExistsInList(
-        const QContactDetail &det,
-        const QList<QContactDetail> &list,
-        const QHash<QContactDetail::DetailType, QSet<int> > &ignorableDetailFields,
-        QSet<int> ignorableCommonFields,
-        bool printDifferences)
-{
-    for (int i = 0; i < list.size(); ++i) {
-        if (detailPairExactlyMatches(det, list[i], ignorableDetailFields, ignorableCommonFields, printDifferences)) {
-            return i; // exact match at this index.
-        }
-    }
-
-    return -1;
-}
-
 bool contactDetailsMatchExactly(
         const QList<QContactDetail> &aDetails,
         const QList<QContactDetail> &bDetails,
@@ -312,13 +510,28 @@ bool contactDetailsMatchExactly(
         }
     }
 
+    // bucket the B details by content hash, so that each A detail is only
+    // compared against B details with identical content hashes; details
+    // with differing hashes cannot match.
+    QMultiHash<quint64, int> bDetailIndexes;
+    for (int i = 0; i < bDetails.size(); ++i) {
+        bDetailIndexes.insert(detailContentHash(bDetails.at(i), ignorableDetailFields, ignorableCommonFields), i);
+    }
+
     QList<QContactDetail> nonMatchedADetails;
-    QList<QContactDetail> nonMatchedBDetails = bDetails;
+    QBitArray matchedBDetails(bDetails.size());
     bool allADetailsHaveMatches = true;
     foreach (const QContactDetail &aDetail, aDetails) {
-        int exactMatchIndex = exactDetailMatchExistsInList(
-                aDetail, nonMatchedBDetails, ignorableDetailFields,
-                ignorableCommonFields, false);
+        int exactMatchIndex = -1;
+        const quint64 aHash = detailContentHash(aDetail, ignorableDetailFields, ignorableCommonFields);
+        QMultiHash<quint64, int>::iterator it = bDetailIndexes.find(aHash);
+        for ( ; it != bDetailIndexes.end() && it.key() == aHash; ++it) {
+            if (!matchedBDetails.testBit(it.value())
+                    && detailPairExactlyMatches(aDetail, bDetails.at(it.value()), ignorableDetailFields, ignorableCommonFields)) {
+                exactMatchIndex = it.value();
+                break;
+            }
+        }
         if (exactMatchIndex == -1) {
             // no exact match for this detail.
             allADetailsHaveMatches = false;
@@ -331,17 +544,24 @@ bool contactDetailsMatchExactly(
             }
         } else {
             // found a match for this detail.
-            // remove it from ldets so that duplicates in cdets
+            // mark it as matched so that duplicates in aDetails
             // don't mess up our detection.
-            nonMatchedBDetails.removeAt(exactMatchIndex);
+            matchedBDetails.setBit(exactMatchIndex);
         }
     }
 
-    if (allADetailsHaveMatches && nonMatchedBDetails.size() == 0) {
+    if (allADetailsHaveMatches && matchedBDetails.count(true) == bDetails.size()) {
         return true; // exact match
     }
 
     if (Q_UNLIKELY(printDifferences)) {
+        QList<QContactDetail> nonMatchedBDetails;
+        for (int i = 0; i < bDetails.size(); ++i) {
+            if (!matchedBDetails.testBit(i)) {
+                nonMatchedBDetails.append(bDetails.at(i));
+            }
+        }
+
         Q_FOREACH (const QContactDetail &ad, nonMatchedADetails) {
             bool foundMatch = false;
             for (int i = 0; i < nonMatchedBDetails.size(); ++i) {
@@ -386,6 +606,24 @@ void constructModification(const QContactDetail &old, QContactDetail *update)
     }
 }
 
+struct DetailPairScore
+{
+    int score;
+    int removalIndex;
+    int additionIndex;
+
+    bool operator<(const DetailPairScore &other) const
+    {
+        // ties are broken by permutation order (removal-major) so that
+        // the result is deterministic regardless of the sort algorithm.
+        if (score != other.score)
+            return score < other.score;
+        if (removalIndex != other.removalIndex)
+            return removalIndex < other.removalIndex;
+        return additionIndex < other.additionIndex;
+    }
+};
+
 // Note: this implementation can be overridden if the sync adapter knows
 // more about how to determine modifications (eg persistent detail ids)
 QList<QContactDetail> determineModifications(
@@ -398,67 +636,62 @@ QList<QContactDetail> determineModifications(
     QList<QContactDetail> finalRemovals;
     QList<QContactDetail> finalAdditions;
 
-    QList<QPair<int, int> > permutationsOfIndexes;
-    QHash<int, int> scoresForPermutations;
-
-    QList<int> remainingRemovals;
-    QList<int> remainingAdditions;
-    for (int i = 0; i < additionsOfThisType->size(); ++i) {
-        remainingAdditions.append(i);
-    }
+    const int removalsCount = removalsOfThisType->size();
+    const int additionsCount = additionsOfThisType->size();
 
     QTCONTACTS_SQLITE_DELTA_DEBUG_LOG("determining modifications from the given list of additions/removals for details of a particular type");
 
     // for each possible permutation, determine its score.
     // lower is a closer match (ie, score == distance).
-    for (int i = 0; i < removalsOfThisType->size(); ++i) {
-        remainingRemovals.append(i);
-        for (int j = 0; j < additionsOfThisType->size(); ++j) {
+    QVector<DetailPairScore> scores;
+    scores.reserve(removalsCount * additionsCount);
+    for (int i = 0; i < removalsCount; ++i) {
+        for (int j = 0; j < additionsCount; ++j) {
             // determine the score for the permutation
-            int score = scoreForDetailPair(removalsOfThisType->at(i),
-                                           additionsOfThisType->at(j),
-                                           ignorableDetailFields,
-                                           ignorableCommonFields);
-            scoresForPermutations.insert(permutationsOfIndexes.size(), score);
-            permutationsOfIndexes.append(QPair<int, int>(i, j));
+            const int score = scoreForDetailPair(removalsOfThisType->at(i),
+                                                 additionsOfThisType->at(j),
+                                                 ignorableDetailFields,
+                                                 ignorableCommonFields);
+            scores.append(DetailPairScore { score, i, j });
             QTCONTACTS_SQLITE_DELTA_DEBUG_LOG("score for permutation" << i << "," << j << "=" << score);
         }
     }
 
-    while (remainingRemovals.size() > 0 && remainingAdditions.size() > 0) {
-        int lowScore = 1000;
-        int lowScorePermutationIdx = -1;
-
-        foreach (int permutationIdx, scoresForPermutations.keys()) {
-            QPair<int, int> permutation = permutationsOfIndexes.at(permutationIdx);
-            if (remainingRemovals.contains(permutation.first)
-                    && remainingAdditions.contains(permutation.second)) {
-                // this permutation is still "possible".
-                if (scoresForPermutations.value(permutationIdx) < lowScore) {
-                    lowScorePermutationIdx = permutationIdx;
-                    lowScore = scoresForPermutations.value(permutationIdx);
-                }
-            }
+    // Greedily select the lowest-scoring permutation whose removal and addition
+    // are both still unmatched.  Sorting once up front gives the same selection
+    // order as repeatedly scanning for the minimum, in O(n log n) of the pairs.
+    std::sort(scores.begin(), scores.end());
+
+    QBitArray matchedRemovals(removalsCount);
+    QBitArray matchedAdditions(additionsCount);
+    int remainingPairs = qMin(removalsCount, additionsCount);
+    for (QVector<DetailPairScore>::const_iterator it = scores.constBegin(); it != scores.constEnd() && remainingPairs > 0; ++it) {
+        if (matchedRemovals.testBit(it->removalIndex) || matchedAdditions.testBit(it->additionIndex)) {
+            // this permutation is no longer "possible".
+            continue;
         }
 
-        if (lowScorePermutationIdx != -1) {
-            // we have a valid permutation which should be treated as a modification.
-            QPair<int, int> bestPermutation = permutationsOfIndexes.at(lowScorePermutationIdx);
-            QTCONTACTS_SQLITE_DELTA_DEBUG_LOG("have determined that permutation" << bestPermutation.first << "," << bestPermutation.second << "is a modification");
-            remainingRemovals.removeAll(bestPermutation.first);
-            remainingAdditions.removeAll(bestPermutation.second);
-            const QContactDetail old = removalsOfThisType->at(bestPermutation.first);
-            QContactDetail update = additionsOfThisType->at(bestPermutation.second);
-            constructModification(old, &update);
-            modifications.append(update);
-        }
+        // we have a valid permutation which should be treated as a modification.
+        QTCONTACTS_SQLITE_DELTA_DEBUG_LOG("have determined that permutation" << it->removalIndex << "," << it->additionIndex << "is a modification");
+        matchedRemovals.setBit(it->removalIndex);
+        matchedAdditions.setBit(it->additionIndex);
+        --remainingPairs;
+
+        const QContactDetail &old = removalsOfThisType->at(it->removalIndex);
+        QContactDetail update = additionsOfThisType->at(it->additionIndex);
+        constructModification(old, &update);
+        modifications.append(update);
     }
 
     // rebuild the return values, removing the permutations which were applied as modifications.
-    foreach (int idx, remainingRemovals)
-        finalRemovals.append(removalsOfThisType->at(idx));
-    foreach (int idx, remainingAdditions)
-        finalAdditions.append(additionsOfThisType->at(idx));
+    for (int i = 0; i < removalsCount; ++i) {
+        if (!matchedRemovals.testBit(i))
+            finalRemovals.append(removalsOfThisType->at(i));
+    }
+    for (int j = 0; j < additionsCount; ++j) {
+        if (!matchedAdditions.testBit(j))
+            finalAdditions.append(additionsOfThisType->at(j));
+    }
 
     // and return.
     *removalsOfThisType = finalRemovals;
@@ -672,6 +905,56 @@ ContactDetailDelta QtContactsSqliteExtensions::determineContactDetailDelta(
     return delta;
 }
 
+quint64 QtContactsSqliteExtensions::detailContentHash(
+        const QContactDetail &detail,
+        const QHash<QContactDetail::DetailType, QSet<int> > &ignorableDetailFields,
+        const QSet<int> &ignorableCommonFields)
+{
+    quint64 hash = ContentHashOffsetBasis;
+    contentHashAppend(&hash, static_cast<quint64>(detail.type()));
+
+    const QSet<int> ignorableFields(ignorableDetailFields.value(detail.type()));
+    const QMap<int, QVariant> values(detail.values());
+    for (QMap<int, QVariant>::const_iterator it = values.constBegin(); it != values.constEnd(); ++it) {
+        if (ignorableCommonFields.contains(it.key())
+                || ignorableFields.contains(it.key())
+                || contentHashIgnoresValue(it.value())) {
+            continue;
+        }
+        contentHashAppend(&hash, static_cast<quint64>(it.key()));
+        contentHashAppend(&hash, it.value());
+    }
+
+    return hash;
+}
+
+quint64 QtContactsSqliteExtensions::contactContentHash(
+        const QContact &contact,
+        const QSet<QContactDetail::DetailType> &ignorableDetailTypes,
+        const QHash<QContactDetail::DetailType, QSet<int> > &ignorableDetailFields,
+        const QSet<int> &ignorableCommonFields)
+{
+    QVector<quint64> detailHashes;
+    const QList<QContactDetail> details(contact.details());
+    detailHashes.reserve(details.size());
+    for (const QContactDetail &detail : details) {
+        if (!ignorableDetailTypes.contains(detail.type())) {
+            detailHashes.append(detailContentHash(detail, ignorableDetailFields, ignorableCommonFields));
+        }
+    }
+
+    // the order of details within a contact is not significant
+    std::sort(detailHashes.begin(), detailHashes.end());
+
+    quint64 hash = ContentHashOffsetBasis;
+    contentHashAppend(&hash, static_cast<quint64>(detailHashes.size()));
+    for (quint64 detailHash : detailHashes) {
+        contentHashAppend(&hash, detailHash);
+    }
+
+    return hash;
+}
+
 int QtContactsSqliteExtensions::exactContactMatchExistsInList(
         const QContact &aContact,
         const QList<QContact> &list,
@@ -682,7 +965,15 @@ int QtContactsSqliteExtensions::exactContactMatchExistsInList(
 {
     QList<QContactDetail> aDetails = aContact.details();
     removeIgnorableDetailsFromList(&aDetails, ignorableDetailTypes);
+
+    // Contacts with differing content hashes cannot match, so only deep-compare the
+    // contacts whose hash is identical (unless the differences are to be reported).
+    const quint64 aHash = contactContentHash(aContact, ignorableDetailTypes, ignorableDetailFields, ignorableCommonFields);
     for (int i = 0; i < list.size(); ++i) {
+        if (!printDifferences
+                && contactContentHash(list[i], ignorableDetailTypes, ignorableDetailFields, ignorableCommonFields) != aHash) {
+            continue;
+        }
         QList<QContactDetail> bDetails = list[i].details();
         removeIgnorableDetailsFromList(&bDetails, ignorableDetailTypes);
         if (contactDetailsMatchExactly(aDetails, bDetails, ignorableDetailFields, ignorableCommonFields, printDifferences)) {
@@ -34,6 +34,11 @@
 #define CONTACTMANAGERENGINE_H
 
 #include <QContactManagerEngine>
+#include <QContactPresence>
+
+QT_BEGIN_NAMESPACE
+class QIODevice;
+QT_END_NAMESPACE
 
 QT_BEGIN_NAMESPACE_CONTACTS
 class QContactDetailFetchRequest;
@@ -58,6 +63,51 @@ namespace QtContactsSqliteExtensions {
  *                           the privileged database will be preferred if accessible.
  *  'autoTest'             - if true, an alternate database path is accessed, separate to the
  *                           path used by non-auto-test applications
+ *  'skipUnchangedWrites'  - if true, an update to a contact whose stored details have identical
+ *                           content to the details being saved is elided: nothing is written, the
+ *                           modification timestamp and change flags are retained, and no change
+ *                           notification is emitted. The number of elided writes is reported by
+ *                           elidedWriteCount().
+ *  'durability'           - 'full' (the default) synchronizes the write-ahead log on every commit.
+ *                           'normal' synchronizes it only when checkpointed, so that a power loss
+ *                           may lose commits made within the last 'checkpointInterval'.
+ *  'checkpointInterval'   - the time in milliseconds for which the engine must be idle before the
+ *                           write-ahead log is checkpointed; with 'normal' durability, also the
+ *                           longest time a commit may remain unsynchronized. Defaults to 1000.
+ *  'walSizeLimit'         - the size in bytes above which the write-ahead log is truncated when
+ *                           checkpointed. Defaults to 4 MiB.
+ *  'transientSnapshotInterval' - the time in milliseconds between snapshots of the transient
+ *                           store (presence and other transient details) written to disk. When the
+ *                           store is recreated after a reboot, it is restored from the snapshot,
+ *                           omitting entries superseded by durable changes made since. A snapshot
+ *                           is only written once the store has been modified. Defaults to 0, which
+ *                           disables snapshots.
+ *  'transientSnapshotMaximumAge' - the age in seconds beyond which a snapshot is not restored.
+ *                           Presence details are only restored from snapshots less than ten minutes
+ *                           old. Defaults to 86400.
+ *  'notificationInterval' - the time in milliseconds for which change notifications resulting from
+ *                           asynchronous requests are accumulated, so that the changes made by many
+ *                           commits are reported together, with each id reported once per signal.
+ *                           They are emitted before the notifications of any synchronous operation.
+ *                           Defaults to 0, which reports changes as each commit completes.
+ *  'notificationLimit'    - the number of accumulated ids above which notifications are emitted
+ *                           before the interval has elapsed. Defaults to 1000.
+ *  'changeJournalLimit'   - the number of change journal entries above which the oldest entries are
+ *                           folded into a summary of their net changes, replacing the summary of the
+ *                           previous compaction; clients whose cursors precede it must refetch.
+ *                           Defaults to 1000; 0 disables compaction.
+ *  'prepareWrites'        - if true (the default), the work of saving contacts which does not depend
+ *                           on the stored data, and the reading of the stored contacts for comparison,
+ *                           is performed before the cross-process write lock is taken. The stored
+ *                           contacts are read again under the lock if the database has been changed
+ *                           in the interim. If false, all of the work is performed under the lock.
+ *  'lockWarningThreshold' - the time in milliseconds above which waiting for, or holding, the
+ *                           cross-process write lock is reported as a warning, with the operation
+ *                           which took the lock. Defaults to 0, which disables the warnings.
+ *  'oobCompression'       - the codec with which large OOB values are compressed: 'zlib' (the
+ *                           default), 'lz4' for lower latency, or 'zstd' for smaller values. Codecs
+ *                           other than zlib must be enabled when the engine is built; if not, zlib
+ *                           is used. Values compressed with any codec remain readable.
  */
 
 class Q_DECL_EXPORT ContactManagerEngine
@@ -71,11 +121,139 @@ public:
         PreserveRemoteChanges
     };
 
-    ContactManagerEngine() : m_nonprivileged(false), m_mergePresenceChanges(false), m_autoTest(false) {}
+    enum DurabilityProfile {
+        FullDurability,
+        NormalDurability
+    };
+
+    enum OOBCompression {
+        ZlibCompression,
+        LZ4Compression,
+        ZstdCompression
+    };
+
+    // Bucket i of a lock time histogram counts durations below (250 << i) microseconds;
+    // the last bucket counts the remainder
+    enum { LockHistogramBuckets = 14 };
+
+    // The operations for which the cross-process write lock is taken
+    enum WriteLockSite {
+        SaveLockSite,
+        RemoveLockSite,
+        OOBLockSite,
+        ClearChangeFlagsLockSite,
+        SyncLockSite,
+        PresenceLockSite,
+        UpgradeLockSite,
+        CheckpointLockSite,
+        WriteLockSiteCount
+    };
+
+    // Times in microseconds taken by this process to acquire, and held, the write lock
+    struct WriteLockStatistics {
+        WriteLockStatistics()
+            : acquisitions(0), totalWaitTime(0), totalHoldTime(0), maximumWaitTime(0), maximumHoldTime(0) {}
+
+        int acquisitions;
+        qint64 totalWaitTime;
+        qint64 totalHoldTime;
+        int maximumWaitTime;
+        int maximumHoldTime;
+        QList<int> waitTimes;
+        QList<int> holdTimes;
+    };
+
+    // The presence of one online account (identified by accountUri) of a contact
+    struct PresenceUpdate {
+        PresenceUpdate() : presenceState(QContactPresence::PresenceUnknown) {}
+
+        QContactId contactId;
+        QString accountUri;
+        QContactPresence::PresenceState presenceState;
+        QString customMessage;
+    };
+
+    // An entry of the change journal, which is written in the transaction making the change.
+    // Presence changes are transient, and are not journaled.
+    struct ChangeJournalEntry {
+        enum Kind {
+            ContactsAdded = 1,
+            ContactsChanged,
+            ContactsRemoved,
+            CollectionsAdded,
+            CollectionsChanged,
+            CollectionsRemoved
+        };
+
+        ChangeJournalEntry() : sequence(0), kind(ContactsChanged), folded(false) {}
+
+        quint64 sequence;
+        Kind kind;
+        QList<QContactId> contactIds;
+        QList<QContactCollectionId> collectionIds;
+        // For ContactsChanged, the types of the changed details; empty if unspecified
+        QList<QContactDetail::DetailType> detailTypes;
+        // Set if the entry summarizes compacted entries
+        bool folded;
+    };
+
+    // The content returned for unmodified contacts by a paged fetch of contact changes
+    enum UnmodifiedContacts {
+        ExcludeUnmodifiedContacts,
+        // The id, timestamp and status flags, with the guid, origin metadata, sync target and extended details
+        UnmodifiedContactMetadata,
+        IncludeUnmodifiedContacts
+    };
+
+    // Receives the batches of a paged fetch of contact changes
+    class ContactChangesReceiver
+    {
+    public:
+        virtual ~ContactChangesReceiver() {}
+
+        // Return false to end the fetch without receiving the remaining batches
+        virtual bool contactChangesAvailable(const QList<QContact> &addedContacts,
+                                             const QList<QContact> &modifiedContacts,
+                                             const QList<QContact> &deletedContacts,
+                                             const QList<QContact> &unmodifiedContacts) = 0;
+    };
+
+    ContactManagerEngine()
+        : m_nonprivileged(false), m_mergePresenceChanges(false), m_autoTest(false), m_skipUnchangedWrites(false)
+        , m_durabilityProfile(FullDurability), m_checkpointInterval(1000), m_walSizeLimit(4 * 1024 * 1024)
+        , m_transientSnapshotInterval(0), m_transientSnapshotMaximumAge(24 * 60 * 60)
+        , m_notificationInterval(0), m_notificationLimit(1000), m_changeJournalLimit(1000)
+        , m_prepareWrites(true), m_lockWarningThreshold(0), m_oobCompression(ZlibCompression) {}
 
     void setNonprivileged(bool b) { m_nonprivileged = b; }
     void setMergePresenceChanges(bool b) { m_mergePresenceChanges = b; }
     void setAutoTest(bool b) { m_autoTest = b; }
+    void setSkipUnchangedWrites(bool b) { m_skipUnchangedWrites = b; }
+    void setDurabilityProfile(DurabilityProfile profile) { m_durabilityProfile = profile; }
+    void setCheckpointInterval(int msecs) { m_checkpointInterval = msecs; }
+    void setWalSizeLimit(int bytes) { m_walSizeLimit = bytes; }
+    void setTransientSnapshotInterval(int msecs) { m_transientSnapshotInterval = msecs; }
+    void setTransientSnapshotMaximumAge(int secs) { m_transientSnapshotMaximumAge = secs; }
+    void setNotificationInterval(int msecs) { m_notificationInterval = msecs; }
+    void setNotificationLimit(int ids) { m_notificationLimit = ids; }
+    void setChangeJournalLimit(int entries) { m_changeJournalLimit = entries; }
+    void setPrepareWrites(bool b) { m_prepareWrites = b; }
+    void setLockWarningThreshold(int msecs) { m_lockWarningThreshold = msecs; }
+    void setOOBCompression(OOBCompression compression) { m_oobCompression = compression; }
+
+    DurabilityProfile durabilityProfile() const { return m_durabilityProfile; }
+    int checkpointInterval() const { return m_checkpointInterval; }
+    int walSizeLimit() const { return m_walSizeLimit; }
+    int transientSnapshotInterval() const { return m_transientSnapshotInterval; }
+    int transientSnapshotMaximumAge() const { return m_transientSnapshotMaximumAge; }
+    int notificationInterval() const { return m_notificationInterval; }
+    int notificationLimit() const { return m_notificationLimit; }
+    int changeJournalLimit() const { return m_changeJournalLimit; }
+    bool prepareWrites() const { return m_prepareWrites; }
+    int lockWarningThreshold() const { return m_lockWarningThreshold; }
+    OOBCompression oobCompression() const { return m_oobCompression; }
+
+    bool skipUnchangedWrites() const { return m_skipUnchangedWrites; }
 
 
     virtual bool clearChangeFlags(const QList<QContactId> &contactIds, QContactManager::Error *error) = 0;
@@ -130,6 +308,80 @@ public:
     virtual bool cancelRequest(QObject* request) = 0;
     virtual bool waitForRequestFinished(QObject* req, int msecs) = 0;
 
+    // Functions added after the above are appended here, to preserve the layout of the vtable.
+
+    // counts of contact updates compared against stored content, and of those elided as unchanged
+    virtual int unchangedWriteCheckCount() const = 0;
+    virtual int elidedWriteCount() const = 0;
+    virtual void resetElidedWriteCounts() = 0;
+
+    // write-ahead log size in bytes observed before the most recent checkpoint, and checkpoint latencies in milliseconds
+    virtual int walSize() const = 0;
+    virtual int checkpointCount() const = 0;
+    virtual int lastCheckpointDuration() const = 0;
+    virtual int maximumCheckpointDuration() const = 0;
+
+    // percentage of the shared transient detail store in use, and of its free space that is fragmented
+    virtual int transientStoreUtilization() = 0;
+    virtual int transientStoreFragmentation() = 0;
+
+    // Updates the presence details linked to the specified accounts, and the global presence of the
+    // affected contacts and their aggregates, in the transient store only.  The affected contacts are
+    // reported in a single contactsPresenceChanged signal.  Per-update errors are reported by index.
+    // The changes become visible only once the whole batch has been committed.
+    virtual bool updatePresence(const QList<PresenceUpdate> &updates, QMap<int, QContactManager::Error> *errorMap, QContactManager::Error *error) = 0;
+
+    // Emits any change notifications accumulated within the 'notificationInterval', once the
+    // asynchronous requests already started have been executed
+    virtual void flushChangeNotifications() = 0;
+
+    // Returns the change journal entries with sequence numbers greater than sinceSequence, in order,
+    // and the sequence of the last entry returned (sinceSequence if there are none).  A client that
+    // stores the latest sequence may apply these entries rather than refetching all contacts after
+    // missing change signals.  If sinceSequence precedes the end of the folded entries, all folded
+    // entries are returned; they may repeat changes already applied.  If refetchRequired is set, the
+    // changes following sinceSequence have been discarded by compaction, or the database has been
+    // recreated; no entries are returned, and the client must refetch all contacts.
+    virtual bool fetchChangeJournal(quint64 sinceSequence,
+                                    QList<ChangeJournalEntry> *entries,
+                                    quint64 *latestSequence,
+                                    bool *refetchRequired,
+                                    QContactManager::Error *error) = 0;
+
+    // histogram of the durations for which this process has held the cross-process write lock
+    virtual QList<int> writeLockHoldTimes() const = 0;
+
+    // statistics of the write lock acquisitions made by this process for an operation
+    virtual WriteLockStatistics writeLockStatistics(WriteLockSite site) const = 0;
+    virtual void resetWriteLockStatistics() = 0;
+
+    // Stores the remaining content of the device as a QByteArray value, without holding it in
+    // memory; the value is stored in chunks and can be read from openOOB() incrementally
+    virtual bool storeOOB(const QString &scope, const QString &key, QIODevice *device) = 0;
+
+    // Returns a read-only device for the value, or null if it does not exist.  The caller owns
+    // the device; reads fail once the manager is destroyed, or if the value is replaced.
+    // String values are read as UTF-8.
+    virtual QIODevice *openOOB(const QString &scope, const QString &key) = 0;
+
+    // Trains a compression dictionary from the values stored in the scope, with which small values
+    // subsequently stored in the scope are compressed.  Suited to scopes holding many similar values,
+    // such as per-contact sync metadata.  Returns false if there are too few values, or if the engine
+    // is built without zstd.
+    virtual bool trainOOBDictionary(const QString &scope) = 0;
+
+    // The total size in bytes of the values stored in the scope, after compression
+    virtual bool fetchOOBStorageSize(const QString &scope, qint64 *size) = 0;
+
+    // as the fetchContactChanges() above, but delivers the contacts to the receiver in batches of at most
+    // batchSize, in contactId order.  the batches are read after the transaction ends; contacts changed
+    // meanwhile are reported again by the next fetch
+    virtual bool fetchContactChanges(const QContactCollectionId &collectionId,
+                                     int batchSize,
+                                     UnmodifiedContacts unmodified,
+                                     ContactChangesReceiver *receiver,
+                                     QContactManager::Error *error) = 0;
+
 Q_SIGNALS:
     void contactsPresenceChanged(const QList<QContactId> &contactsIds);
     void collectionContactsChanged(const QList<QContactCollectionId> &collectionIds);
@@ -139,6 +391,18 @@ protected:
     bool m_nonprivileged;
     bool m_mergePresenceChanges;
     bool m_autoTest;
+    bool m_skipUnchangedWrites;
+    DurabilityProfile m_durabilityProfile;
+    int m_checkpointInterval;
+    int m_walSizeLimit;
+    int m_transientSnapshotInterval;
+    int m_transientSnapshotMaximumAge;
+    int m_notificationInterval;
+    int m_notificationLimit;
+    int m_changeJournalLimit;
+    bool m_prepareWrites;
+    int m_lockWarningThreshold;
+    OOBCompression m_oobCompression;
 };
 
 }
@@ -56,6 +56,10 @@ public:
     QContactCollectionId collectionId() const;
     void setCollectionId(const QContactCollectionId &id);
 
+    // If set, unmodified contacts contain only their sync metadata rather than all details
+    bool unmodifiedContactsMetadataOnly() const;
+    void setUnmodifiedContactsMetadataOnly(bool metadataOnly);
+
     QContactAbstractRequest::State state() const;
     QContactManager::Error error() const;
 
@@ -72,6 +72,16 @@ void QContactChangesFetchRequest::setCollectionId(const QContactCollectionId &id
     d_ptr->collectionId = id;
 }
 
+bool QContactChangesFetchRequest::unmodifiedContactsMetadataOnly() const
+{
+    return d_ptr->unmodifiedContactsMetadataOnly;
+}
+
+void QContactChangesFetchRequest::setUnmodifiedContactsMetadataOnly(bool metadataOnly)
+{
+    d_ptr->unmodifiedContactsMetadataOnly = metadataOnly;
+}
+
 QContactAbstractRequest::State QContactChangesFetchRequest::state() const
 {
     return d_ptr->state;
@@ -59,6 +59,7 @@ public:
 
     QPointer<QContactManager> manager;
     QContactCollectionId collectionId;
+    bool unmodifiedContactsMetadataOnly = false;
     QContactAbstractRequest::State state = QContactAbstractRequest::InactiveState;
     QContactManager::Error error = QContactManager::NoError;
     QList<QContact> addedContacts;
@@ -35,6 +35,7 @@
 #include "../../util.h"
 #include "qtcontacts-extensions.h"
 
+#include <QBuffer>
 #include <QLocale>
 
 static const QString aggregatesRelationship(relationshipString(QContactRelationship::Aggregates));
@@ -130,6 +131,9 @@ private slots:
 */
 
     void testOOB();
+    void testOOBStreaming();
+    void testOOBCompression_data();
+    void testOOBCompression();
 
 private:
     void waitForSignalPropagation();
@@ -4659,6 +4663,225 @@ void tst_Aggregation::testOOB()
     keys.clear();
     QVERIFY(cme->fetchOOBKeys(scope, &keys));
     QCOMPARE(keys, QStringList());
+
+    // Scopes are matched exactly, not as prefixes or patterns
+    const QString prefixedScope(scope + QStringLiteral("_extended"));
+    const QString patternScope(QStringLiteral("%"));
+    QVERIFY(cme->storeOOB(scope, "data", 100));
+    QVERIFY(cme->storeOOB(prefixedScope, "data", 200));
+    QVERIFY(cme->storeOOB(patternScope, "data", 300));
+
+    values.clear();
+    QVERIFY(cme->fetchOOB(scope, &values));
+    QCOMPARE(values.count(), 1);
+    QCOMPARE(values["data"].toInt(), 100);
+
+    keys.clear();
+    QVERIFY(cme->fetchOOBKeys(patternScope, &keys));
+    QCOMPARE(keys, QStringList() << "data");
+
+    QVERIFY(cme->removeOOB(scope));
+    values.clear();
+    QVERIFY(cme->fetchOOB(prefixedScope, &values));
+    QCOMPARE(values.count(), 1);
+    QCOMPARE(values["data"].toInt(), 200);
+
+    QVERIFY(cme->removeOOB(prefixedScope));
+    QVERIFY(cme->removeOOB(patternScope));
+    keys.clear();
+    QVERIFY(cme->fetchOOBKeys(prefixedScope, &keys));
+    QCOMPARE(keys, QStringList());
+}
+
+void tst_Aggregation::testOOBStreaming()
+{
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(*m_cm);
+
+    const QString &scope(QString::fromLatin1("tst_Aggregation_streaming"));
+    QVERIFY(cme->removeOOB(scope));
+
+    QScopedPointer<QIODevice> device(cme->openOOB(scope, "nonexistentData"));
+    QVERIFY(device.isNull());
+
+    // Several chunks of compressible data, followed by incompressible data and a partial chunk
+    QByteArray data;
+    for (int i = 0; i < 20000; ++i) {
+        data.append(QByteArray::number(i)).append(' ');
+    }
+    qsrand(1);
+    for (int i = 0; i < 150000; ++i) {
+        data.append(static_cast<char>(qrand() & 0xff));
+    }
+
+    QBuffer buffer(&data);
+    QVERIFY(buffer.open(QIODevice::ReadOnly));
+    QVERIFY(cme->storeOOB(scope, "data", &buffer));
+
+    device.reset(cme->openOOB(scope, "data"));
+    QVERIFY(!device.isNull());
+    QVERIFY(device->isOpen());
+    QVERIFY(!device->isSequential());
+    QCOMPARE(device->size(), static_cast<qint64>(data.size()));
+    QCOMPARE(device->readAll(), data);
+
+    // Partial reads, within and across chunk boundaries
+    const int chunkSize = 64 * 1024;
+    const QList<int> offsets(QList<int>() << 10 << chunkSize - 5 << 2 * chunkSize + 100 << data.size() - 10);
+    foreach (int offset, offsets) {
+        QVERIFY(device->seek(offset));
+        QCOMPARE(device->read(20), data.mid(offset, 20));
+    }
+    QVERIFY(device->seek(chunkSize / 2));
+    QCOMPARE(device->read(chunkSize), data.mid(chunkSize / 2, chunkSize));
+    device.reset();
+
+    // Streamed values are also returned by fetchOOB
+    QVariant value;
+    QVERIFY(cme->fetchOOB(scope, "data", &value));
+    QCOMPARE(value.toByteArray(), data);
+
+    // Values stored without streaming can also be opened as devices
+    const QByteArray small("small value");
+    QVERIFY(cme->storeOOB(scope, "small", QVariant(small)));
+    device.reset(cme->openOOB(scope, "small"));
+    QVERIFY(!device.isNull());
+    QVERIFY(device->seek(6));
+    QCOMPARE(device->readAll(), QByteArray("value"));
+
+    const QString text(QString::fromLatin1("compressed text ").repeated(100));
+    QVERIFY(cme->storeOOB(scope, "text", QVariant(text)));
+    device.reset(cme->openOOB(scope, "text"));
+    QVERIFY(!device.isNull());
+    QCOMPARE(QString::fromUtf8(device->readAll()), text);
+    device.reset();
+
+    // An empty stream yields an empty value
+    QBuffer empty;
+    QVERIFY(empty.open(QIODevice::ReadOnly));
+    QVERIFY(cme->storeOOB(scope, "empty", &empty));
+    device.reset(cme->openOOB(scope, "empty"));
+    QVERIFY(!device.isNull());
+    QCOMPARE(device->size(), static_cast<qint64>(0));
+    QVERIFY(device->atEnd());
+    device.reset();
+
+    // Devices remain valid objects after their manager is destroyed, but can no longer be read
+    {
+        QMap<QString, QString> parameters;
+        parameters.insert(QString::fromLatin1("autoTest"), QString::fromLatin1("true"));
+        QScopedPointer<QContactManager> cm(new QContactManager(QString::fromLatin1("org.nemomobile.contacts.sqlite"), parameters));
+        device.reset(QtContactsSqliteExtensions::contactManagerEngine(*cm)->openOOB(scope, "data"));
+        QVERIFY(!device.isNull());
+        QCOMPARE(device->read(20), data.left(20));
+
+        // The device holds no read transaction between reads, so writes are unaffected
+        QVERIFY(cme->storeOOB(scope, "small", QVariant(small)));
+
+        // Seek beyond the data buffered by the device by the first read
+        cm.reset();
+        QVERIFY(device->seek(data.size() - 10));
+        char remainder[10];
+        QCOMPARE(device->read(remainder, sizeof(remainder)), static_cast<qint64>(-1));
+        device.reset();
+    }
+
+    QVERIFY(cme->removeOOB(scope));
+    device.reset(cme->openOOB(scope, "data"));
+    QVERIFY(device.isNull());
+}
+
+void tst_Aggregation::testOOBCompression_data()
+{
+    QTest::addColumn<QString>("compression");
+
+    QTest::newRow("zlib") << QString::fromLatin1("zlib");
+    QTest::newRow("lz4") << QString::fromLatin1("lz4");
+    QTest::newRow("zstd") << QString::fromLatin1("zstd");
+}
+
+void tst_Aggregation::testOOBCompression()
+{
+    QFETCH(QString, compression);
+
+    QMap<QString, QString> parameters;
+    parameters.insert(QString::fromLatin1("autoTest"), QString::fromLatin1("true"));
+    parameters.insert(QString::fromLatin1("oobCompression"), compression);
+    QContactManager cm(QString::fromLatin1("org.nemomobile.contacts.sqlite"), parameters);
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(cm);
+
+    // Codecs not built into the engine fall back to zlib, which would not test the requested codec
+    const bool zstd = (compression == QLatin1String("zstd"));
+    if (compression == QLatin1String("lz4")
+            && cme->oobCompression() != QtContactsSqliteExtensions::ContactManagerEngine::LZ4Compression) {
+        QSKIP("The engine is built without lz4 (CONFIG+=lz4)");
+    }
+    if (zstd && cme->oobCompression() != QtContactsSqliteExtensions::ContactManagerEngine::ZstdCompression) {
+        QSKIP("The engine is built without zstd (CONFIG+=zstd)");
+    }
+
+    const QString &scope(QString::fromLatin1("tst_Aggregation_compression"));
+    QVERIFY(cme->removeOOB(scope));
+
+    QByteArray compressible;
+    for (int i = 0; i < 2000; ++i) {
+        compressible.append("BEGIN:VCARD\r\nVERSION:3.0\r\nUID:").append(QByteArray::number(i)).append("\r\nEND:VCARD\r\n");
+    }
+    QByteArray incompressible;
+    qsrand(2);
+    for (int i = 0; i < 4096; ++i) {
+        incompressible.append(static_cast<char>(qrand() & 0xff));
+    }
+
+    QMap<QString, QVariant> values;
+    values.insert(QString::fromLatin1("compressible"), compressible);
+    values.insert(QString::fromLatin1("incompressible"), incompressible);
+    values.insert(QString::fromLatin1("text"), QString::fromUtf8(compressible));
+    values.insert(QString::fromLatin1("short"), QString::fromLatin1("\"etag-1\""));
+    values.insert(QString::fromLatin1("number"), 42);
+    QVERIFY(cme->storeOOB(scope, values));
+
+    qint64 size = 0;
+    QVERIFY(cme->fetchOOBStorageSize(scope, &size));
+    QVERIFY(size > 0);
+    QVERIFY(size < 2 * compressible.size() + incompressible.size());
+
+    // Values are readable whichever codec the reader is configured with
+    QtContactsSqliteExtensions::ContactManagerEngine *otherCme = QtContactsSqliteExtensions::contactManagerEngine(*m_cm);
+    QMap<QString, QVariant> fetched;
+    QVERIFY(otherCme->fetchOOB(scope, &fetched));
+    QCOMPARE(fetched.count(), values.count());
+    QCOMPARE(fetched.value("compressible").toByteArray(), compressible);
+    QCOMPARE(fetched.value("incompressible").toByteArray(), incompressible);
+    QCOMPARE(fetched.value("text").toString(), QString::fromUtf8(compressible));
+    QCOMPARE(fetched.value("short").toString(), QString::fromLatin1("\"etag-1\""));
+    QCOMPARE(fetched.value("number").toInt(), 42);
+
+    // Small, similar values can be compressed with a trained dictionary
+    values.clear();
+    for (int i = 0; i < 500; ++i) {
+        values.insert(QString::fromLatin1("contact-%1").arg(i),
+                      QString::fromLatin1("{\"etag\":\"%1\",\"href\":\"/carddav/user/contacts/%2.vcf\",\"modified\":\"2020-01-01T00:00:%3Z\"}")
+                              .arg(qrand()).arg(i).arg(i % 60, 2, 10, QChar('0')));
+    }
+    QVERIFY(cme->storeOOB(scope, values));
+
+    qint64 uncompressedSize = 0;
+    QVERIFY(cme->fetchOOBStorageSize(scope, &uncompressedSize));
+
+    // Dictionaries require zstd, which the zstd row has verified is built
+    if (zstd) {
+        QVERIFY(cme->trainOOBDictionary(scope));
+        QVERIFY(cme->storeOOB(scope, values));
+
+        QVERIFY(cme->fetchOOBStorageSize(scope, &size));
+        QVERIFY(size < uncompressedSize);
+    }
+
+    fetched.clear();
+    QVERIFY(otherCme->fetchOOB(scope, values.keys(), &fetched));
+    QCOMPARE(fetched, values);
+
+    QVERIFY(cme->removeOOB(scope));
 }
 
 QTEST_GUILESS_MAIN(tst_Aggregation)
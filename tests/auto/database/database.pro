@@ -4,6 +4,8 @@ include(../../common.pri)
 
 QT += sql
 
+PKGCONFIG += sqlite3
+
 # copied from src/engine/engine.pro, modified for test db
 DEFINES += 'QTCONTACTS_SQLITE_PRIVILEGED_DIR=\'\"privileged\"\''
 DEFINES += 'QTCONTACTS_SQLITE_DATABASE_DIR=\'\"Contacts/qtcontacts-sqlite\"\''
@@ -17,7 +19,13 @@ HEADERS += ../../../src/engine/contactsdatabase.h
 SOURCES += ../../../src/engine/contactsdatabase.cpp
 
 HEADERS += ../../../src/engine/semaphore_p.h
-SOURCES += ../../../src/engine/semaphore_p.cpp
+CONFIG(futex_semaphore) {
+    DEFINES += QTCONTACTS_SQLITE_FUTEX_SEMAPHORE
+    SOURCES += ../../../src/engine/semaphore_futex.cpp
+    LIBS += -lrt -lpthread
+} else {
+    SOURCES += ../../../src/engine/semaphore_p.cpp
+}
 
 HEADERS += ../../../src/engine/contactstransientstore.h
 SOURCES += ../../../src/engine/contactstransientstore.cpp
@@ -28,6 +36,17 @@ SOURCES += ../../../src/engine/memorytable.cpp
 HEADERS += ../../../src/engine/conversion_p.h
 SOURCES += ../../../src/engine/conversion.cpp
 
+HEADERS += ../../../src/engine/oobcodec_p.h
+SOURCES += ../../../src/engine/oobcodec.cpp
+CONFIG(lz4) {
+    DEFINES += QTCONTACTS_SQLITE_LZ4
+    PKGCONFIG += liblz4
+}
+CONFIG(zstd) {
+    DEFINES += QTCONTACTS_SQLITE_ZSTD
+    PKGCONFIG += libzstd
+}
+
 HEADERS += ../../../src/engine/defaultdlggenerator.h
 SOURCES += ../../../src/engine/defaultdlggenerator.cpp
 
@@ -36,3 +36,11 @@
 QString ContactsEngine::normalizedPhoneNumber(QString const& number) {
     return number;
 }
+
+void ContactsEngine::transactionCommitted()
+{
+}
+
+void ContactsEngine::recordWriteLock(WriteLockSite, qint64, qint64)
+{
+}
@@ -33,6 +33,20 @@
 
 #include <QtTest/QtTest>
 #include "../../../src/engine/contactsdatabase.h"
+#include "../../../src/engine/contactstransientstore.h"
+#include "../../../src/engine/semaphore_p.h"
+
+#include <QContactGlobalPresence>
+#include <QContactManagerEngine>
+#include <QContactOnlineAccount>
+#include <QContactPresence>
+
+#include <QSqlQuery>
+#include <QStandardPaths>
+#include <QTemporaryDir>
+
+#include <sys/wait.h>
+#include <unistd.h>
 
 class tst_Database  : public QObject
 {
@@ -48,6 +62,13 @@ private slots:
     void fromDateTimeString_speed();
     void fromDateTimeString_tz_speed();
     void fromDateTimeString_isodate_speed();
+    void transientStoreEncoding();
+    void transientStoreBatchLookup();
+    void transientStoreSnapshot();
+    void oobScopeUpgrade();
+    void oobDictionaryRemoval();
+    void semaphoreOwnerDeath();
+    void semaphoreRoundTrip_speed();
 
 private:
     char *old_TZ;
@@ -173,5 +194,461 @@ void tst_Database::fromDateTimeString_isodate_speed()
     }
 }
 
+void tst_Database::transientStoreEncoding()
+{
+    ContactsTransientStore store;
+    QVERIFY(store.open(true, true, false));
+
+    const quint32 contactId = 0x7fff0001;
+    const QDateTime timestamp(QDateTime::currentDateTimeUtc());
+
+    QContactGlobalPresence globalPresence;
+    globalPresence.setPresenceState(QContactPresence::PresenceBusy);
+    globalPresence.setTimestamp(timestamp);
+    globalPresence.setNickname(QStringLiteral("Nick"));
+    globalPresence.setCustomMessage(QString());
+    globalPresence.setContexts(QList<int>() << QContactDetail::ContextWork << QContactDetail::ContextHome);
+
+    QContactOnlineAccount account;
+    account.setAccountUri(QStringLiteral("account@example.org"));
+    account.setCapabilities(QStringList() << QStringLiteral("chat") << QStringLiteral("voice"));
+    account.setSubTypes(QList<int>() << QContactOnlineAccount::SubTypeSip);
+    account.setValue(QContactOnlineAccount::FieldServiceProvider, QVariant::fromValue<QUrl>(QUrl(QStringLiteral("http://example.org/"))));
+    QContactManagerEngine::setDetailAccessConstraints(&account, QContactDetail::ReadOnly);
+
+    const QList<QContactDetail> details(QList<QContactDetail>() << globalPresence << account);
+    QVERIFY(store.setContactDetails(contactId, timestamp, details));
+    QVERIFY(store.contains(contactId));
+
+    QVERIFY(store.utilization() > 0 && store.utilization() <= 100);
+    QVERIFY(store.fragmentation() >= 0 && store.fragmentation() <= 100);
+
+    const QPair<QDateTime, QList<QContactDetail> > stored(store.contactDetails(contactId));
+    QCOMPARE(stored.first, timestamp);
+    QCOMPARE(stored.second.count(), details.count());
+    for (int i = 0; i < details.count(); ++i) {
+        QCOMPARE(stored.second.at(i).type(), details.at(i).type());
+        QCOMPARE(stored.second.at(i).accessConstraints(), details.at(i).accessConstraints());
+        QCOMPARE(stored.second.at(i).values(), details.at(i).values());
+    }
+
+    // The header fields are available without decoding the details
+    {
+        ContactsTransientStore::DataLock lock(store.dataLock());
+        QVERIFY(lock);
+
+        bool found = false;
+        ContactsTransientStore::const_iterator it = store.constBegin(lock), end = store.constEnd(lock);
+        for ( ; it != end; ++it) {
+            if (it.key() == contactId) {
+                found = true;
+                QCOMPARE(it.timestamp(), timestamp);
+
+                int presenceState = -1;
+                QVERIFY(it.globalPresenceState(&presenceState));
+                QCOMPARE(presenceState, static_cast<int>(QContactPresence::PresenceBusy));
+            }
+        }
+        QVERIFY(found);
+    }
+
+    // An entry without global presence or timestamp
+    QVERIFY(store.setContactDetails(contactId, QDateTime(), QList<QContactDetail>() << account));
+    {
+        ContactsTransientStore::DataLock lock(store.dataLock());
+        ContactsTransientStore::const_iterator it = store.constBegin(lock), end = store.constEnd(lock);
+        for ( ; it != end; ++it) {
+            if (it.key() == contactId) {
+                int presenceState = -1;
+                QVERIFY(it.timestamp().isNull());
+                QVERIFY(!it.globalPresenceState(&presenceState));
+            }
+        }
+    }
+
+    QVERIFY(store.remove(contactId));
+    QVERIFY(!store.contains(contactId));
+}
+
+void tst_Database::transientStoreBatchLookup()
+{
+    ContactsTransientStore store;
+    QVERIFY(store.open(true, true, false));
+
+    const QDateTime timestamp(QDateTime::currentDateTimeUtc());
+
+    // Store entries for alternate ids
+    QList<quint32> storedIds;
+    for (quint32 contactId = 0x7fff0100; contactId < 0x7fff0120; contactId += 2) {
+        QContactGlobalPresence globalPresence;
+        globalPresence.setPresenceState(QContactPresence::PresenceAvailable);
+        globalPresence.setNickname(QString::number(contactId));
+        QVERIFY(store.setContactDetails(contactId, timestamp.addSecs(contactId - 0x7fff0100), QList<QContactDetail>() << globalPresence));
+        storedIds.append(contactId);
+    }
+
+    // Request both fewer and more ids than the store contains, so that the table is both probed and scanned
+    QList<QList<quint32> > requests;
+    requests << (QList<quint32>() << 0x7fff0101 << 0x7fff0102 << 0x7fff0104);
+    {
+        QList<quint32> ids;
+        for (quint32 contactId = 0x7fff0000; contactId < 0x7fff1000; ++contactId) {
+            ids.append(contactId);
+        }
+        requests << ids;
+    }
+
+    foreach (const QList<quint32> &ids, requests) {
+        const QHash<quint32, QPair<QDateTime, QList<QContactDetail> > > details(store.contactDetails(ids));
+        foreach (quint32 contactId, ids) {
+            QCOMPARE(details.contains(contactId), storedIds.contains(contactId));
+            if (details.contains(contactId)) {
+                const QPair<QDateTime, QList<QContactDetail> > expected(store.contactDetails(contactId));
+                const QPair<QDateTime, QList<QContactDetail> > &batched(details[contactId]);
+                QCOMPARE(batched.first, expected.first);
+                QCOMPARE(batched.second.count(), 1);
+                QCOMPARE(batched.second.first().values(), expected.second.first().values());
+            }
+        }
+    }
+
+    QVERIFY(store.remove(storedIds));
+    QCOMPARE(store.contactDetails(storedIds).count(), 0);
+}
+
+class TestStoredTimestamps : public ContactsTransientStore::StoredTimestamps
+{
+public:
+    QHash<quint32, QDateTime> modificationTimestamps(const QList<quint32> &contactIds) override
+    {
+        requestedIds.append(contactIds);
+
+        QHash<quint32, QDateTime> result;
+        foreach (quint32 contactId, contactIds) {
+            if (timestamps.contains(contactId)) {
+                result.insert(contactId, timestamps.value(contactId));
+            }
+        }
+        return result;
+    }
+
+    QHash<quint32, QDateTime> timestamps;
+    QList<quint32> requestedIds;
+};
+
+void tst_Database::transientStoreSnapshot()
+{
+    ContactsTransientStore store;
+    QVERIFY(store.open(true, true, false));
+
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path(dir.path() + QStringLiteral("/transient-snapshot"));
+
+    const quint32 presenceId = 0x7fff0201;
+    const quint32 accountId = 0x7fff0202;
+    const QDateTime timestamp(QDateTime::currentDateTimeUtc());
+
+    QContactGlobalPresence globalPresence;
+    globalPresence.setPresenceState(QContactPresence::PresenceAvailable);
+    QContactOnlineAccount account;
+    account.setAccountUri(QStringLiteral("snapshot@example.org"));
+
+    QVERIFY(store.setContactDetails(presenceId, timestamp, QList<QContactDetail>() << globalPresence));
+    QVERIFY(store.setContactDetails(accountId, timestamp, QList<QContactDetail>() << globalPresence << account));
+    QVERIFY(store.saveSnapshot(path));
+
+    QByteArray buffer(1024 * 1024, '\0');
+    int accountEntrySize = 0;
+
+    // A recent snapshot restores every entry intact
+    {
+        MemoryTable table(buffer.data(), buffer.size(), true);
+        QVERIFY(ContactsTransientStore::restoreSnapshot(table, path, 60) >= 2);
+        QVERIFY(table.contains(presenceId));
+        QVERIFY(table.contains(accountId));
+        accountEntrySize = table.value(accountId).size();
+    }
+
+    // Entries are not restored for contacts which have been removed, or modified durably since
+    {
+        TestStoredTimestamps stored;
+        stored.timestamps.insert(accountId, timestamp.addMSecs(1000));
+
+        MemoryTable table(buffer.data(), buffer.size(), true);
+        QCOMPARE(ContactsTransientStore::restoreSnapshot(table, path, 60, &stored), 0);
+        QVERIFY(!table.contains(presenceId));
+        QVERIFY(!table.contains(accountId));
+    }
+    {
+        TestStoredTimestamps stored;
+        stored.timestamps.insert(presenceId, timestamp.addMSecs(-1000));
+        stored.timestamps.insert(accountId, timestamp);
+
+        MemoryTable table(buffer.data(), buffer.size(), true);
+        QCOMPARE(ContactsTransientStore::restoreSnapshot(table, path, 60, &stored), 2);
+        QVERIFY(table.contains(presenceId));
+        QVERIFY(table.contains(accountId));
+        QCOMPARE(stored.requestedIds.count(presenceId), 1);
+        QCOMPARE(stored.requestedIds.count(accountId), 1);
+    }
+
+    QFile file(path);
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QByteArray image(file.readAll());
+
+    // Age the snapshot by rewriting its creation time, which follows the magic and version fields
+    const qint64 created = QDateTime::currentMSecsSinceEpoch() - 20 * 60 * 1000;
+    memcpy(image.data() + 2 * sizeof(quint32), &created, sizeof(created));
+    QVERIFY(file.seek(0));
+    QCOMPARE(file.write(image), static_cast<qint64>(image.size()));
+    QVERIFY(file.flush());
+
+    // Presence is too old to restore, but other transient details are retained
+    {
+        MemoryTable table(buffer.data(), buffer.size(), true);
+        QVERIFY(ContactsTransientStore::restoreSnapshot(table, path, 60 * 60) >= 1);
+        QVERIFY(!table.contains(presenceId));
+        QVERIFY(table.contains(accountId));
+        QVERIFY(table.value(accountId).size() < accountEntrySize);
+    }
+
+    // The snapshot is stale
+    {
+        MemoryTable table(buffer.data(), buffer.size(), true);
+        QCOMPARE(ContactsTransientStore::restoreSnapshot(table, path, 60), -1);
+        QCOMPARE(table.count(), static_cast<size_t>(0));
+    }
+
+    // A snapshot with a valid checksum but an inconsistent table is ignored; the table follows the
+    // 32-byte snapshot header, and its item count follows its size field
+    {
+        QByteArray inconsistent(image);
+        const quint32 count = 0x00ffffff;
+        memcpy(inconsistent.data() + 32 + sizeof(quint32), &count, sizeof(count));
+
+        quint32 checksum = 2166136261u;
+        for (int i = 32; i < inconsistent.size(); ++i) {
+            checksum ^= static_cast<quint8>(inconsistent.at(i));
+            checksum *= 16777619u;
+        }
+        memcpy(inconsistent.data() + 5 * sizeof(quint32), &checksum, sizeof(checksum));
+
+        const QString inconsistentPath(dir.path() + QStringLiteral("/transient-snapshot-inconsistent"));
+        QFile inconsistentFile(inconsistentPath);
+        QVERIFY(inconsistentFile.open(QIODevice::WriteOnly));
+        QCOMPARE(inconsistentFile.write(inconsistent), static_cast<qint64>(inconsistent.size()));
+        inconsistentFile.close();
+
+        MemoryTable table(buffer.data(), buffer.size(), true);
+        QCOMPARE(ContactsTransientStore::restoreSnapshot(table, inconsistentPath, 60 * 60), -1);
+        QCOMPARE(table.count(), static_cast<size_t>(0));
+    }
+
+    // A corrupt snapshot is ignored
+    image[image.size() - 1] = ~image.at(image.size() - 1);
+    QVERIFY(file.seek(0));
+    QCOMPARE(file.write(image), static_cast<qint64>(image.size()));
+    file.close();
+    {
+        MemoryTable table(buffer.data(), buffer.size(), true);
+        QCOMPARE(ContactsTransientStore::restoreSnapshot(table, path, 60 * 60), -1);
+    }
+
+    QVERIFY(store.remove(QList<quint32>() << presenceId << accountId));
+}
+
+void tst_Database::oobScopeUpgrade()
+{
+    QStandardPaths::setTestModeEnabled(true);
+    QDir databaseDir(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation)
+                     + QStringLiteral("/system/" QTCONTACTS_SQLITE_DATABASE_DIR "-test"));
+    databaseDir.removeRecursively();
+
+    // Create a database, and revert its OOB table to the form preceding the scope column
+    {
+        ContactsDatabase database(0);
+        QVERIFY(database.open(QStringLiteral("tst_database_oob_create"), true, true));
+
+        QSqlQuery query(database);
+        QVERIFY(query.exec(QStringLiteral("DROP TABLE OOB")));
+        QVERIFY(query.exec(QStringLiteral("CREATE TABLE OOB (name TEXT PRIMARY KEY, value BLOB, compressed INTEGER DEFAULT 0)")));
+        QVERIFY(query.exec(QStringLiteral("INSERT INTO OOB (name, value) VALUES ('sync:account:first', 'one')")));
+        QVERIFY(query.exec(QStringLiteral("INSERT INTO OOB (name, value) VALUES ('sync:account:second', 'two')")));
+        QVERIFY(query.exec(QStringLiteral("INSERT INTO OOB (name, value) VALUES ('plain:third', 'three')")));
+        QVERIFY(query.exec(QStringLiteral("PRAGMA user_version=24")));
+    }
+    QSqlDatabase::removeDatabase(QStringLiteral("tst_database_oob_create"));
+
+    {
+        ContactsDatabase database(0);
+        QVERIFY(database.open(QStringLiteral("tst_database_oob_upgrade"), true, true));
+
+        // The upgrade cannot tell where a scope containing ':' ends
+        QSqlQuery query(database);
+        QVERIFY(query.exec(QStringLiteral("SELECT scope FROM OOB WHERE name = 'sync:account:first'")));
+        QVERIFY(query.next());
+        QCOMPARE(query.value(0).toString(), QStringLiteral("sync"));
+        query.finish();
+
+        // The rows of such a scope are still selected, with those of a scope written since the upgrade
+        QVERIFY(query.exec(QStringLiteral("INSERT INTO OOB (name, value, scope) VALUES ('sync:account:fourth', 'four', 'sync:account')")));
+
+        const QStringList scopes(QStringList() << QStringLiteral("sync:account") << QStringLiteral("plain"));
+        const QList<QStringList> expectedNames(QList<QStringList>()
+                << (QStringList() << QStringLiteral("sync:account:first") << QStringLiteral("sync:account:fourth") << QStringLiteral("sync:account:second"))
+                << (QStringList() << QStringLiteral("plain:third")));
+        for (int i = 0; i < scopes.count(); ++i) {
+            ContactsDatabase::Query scopeQuery(database.prepare(QStringLiteral("SELECT name FROM OOB WHERE ")
+                                                                + ContactsDatabase::oobScopeCondition(scopes.at(i))
+                                                                + QStringLiteral(" ORDER BY name")));
+            ContactsDatabase::bindOOBScope(scopeQuery, scopes.at(i));
+            QVERIFY(ContactsDatabase::execute(scopeQuery));
+
+            QStringList names;
+            while (scopeQuery.next()) {
+                names.append(scopeQuery.value<QString>(0));
+            }
+            scopeQuery.finish();
+            QCOMPARE(names, expectedNames.at(i));
+        }
+    }
+    QSqlDatabase::removeDatabase(QStringLiteral("tst_database_oob_upgrade"));
+
+    databaseDir.removeRecursively();
+    QStandardPaths::setTestModeEnabled(false);
+}
+
+void tst_Database::oobDictionaryRemoval()
+{
+    if (!OOBCodec::isAvailable(OOBCodec::ZstdDictionary))
+        QSKIP("The engine is built without zstd (CONFIG+=zstd)");
+
+    QStandardPaths::setTestModeEnabled(true);
+    QDir databaseDir(QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation)
+                     + QStringLiteral("/system/" QTCONTACTS_SQLITE_DATABASE_DIR "-test"));
+    databaseDir.removeRecursively();
+
+    {
+        ContactsDatabase database(0);
+        QVERIFY(database.open(QStringLiteral("tst_database_oob_dictionary"), true, true));
+
+        QList<QByteArray> firstSamples;
+        QList<QByteArray> secondSamples;
+        for (int i = 0; i < 500; ++i) {
+            firstSamples.append(QStringLiteral("{\"etag\":\"%1\",\"href\":\"/carddav/contacts/%2.vcf\"}").arg(i * 7919).arg(i).toUtf8());
+            secondSamples.append(QStringLiteral("BEGIN:VCARD\r\nUID:%1\r\nREV:2020-01-01T00:00:%2Z\r\nEND:VCARD").arg(i * 104729).arg(i % 60).toUtf8());
+        }
+        const QByteArray first(OOBCodec::trainDictionary(firstSamples, 4096));
+        const QByteArray second(OOBCodec::trainDictionary(secondSamples, 4096));
+        QVERIFY(!first.isEmpty());
+        QVERIFY(!second.isEmpty());
+        const quint32 firstId = OOBCodec::dictionaryId(first);
+        const quint32 secondId = OOBCodec::dictionaryId(second);
+        QVERIFY(firstId != secondId);
+
+        auto storedDictionaries = [&database]() {
+            QSet<quint32> ids;
+            QSqlQuery query(database);
+            if (query.exec(QStringLiteral("SELECT name FROM DbSettings WHERE name LIKE 'OOBDictionary:%'"))) {
+                while (query.next()) {
+                    ids.insert(query.value(0).toString().mid(14).toUInt());
+                }
+            }
+            return ids;
+        };
+
+        // A value compressed with the dictionary keeps it after it is replaced
+        QVERIFY(database.storeOOBDictionary(QStringLiteral("sync"), first));
+        QCOMPARE(database.oobDictionary(QStringLiteral("sync")), firstId);
+
+        const QByteArray compressed(database.oobCodec().compress(OOBCodec::ZstdDictionary, firstSamples.first(), firstId));
+        QVERIFY(!compressed.isEmpty());
+        QSqlQuery query(database);
+        QVERIFY(query.prepare(QStringLiteral("INSERT INTO OOB (name, value, compressed, scope) VALUES ('sync:key', :value, :compressed, 'sync')")));
+        query.bindValue(QStringLiteral(":value"), compressed);
+        query.bindValue(QStringLiteral(":compressed"), ContactsDatabase::oobEncoding(ContactsDatabase::OOBCompressedString, OOBCodec::ZstdDictionary));
+        QVERIFY(query.exec());
+        query.finish();
+
+        QVERIFY(database.storeOOBDictionary(QStringLiteral("sync"), second));
+        QCOMPARE(database.oobDictionary(QStringLiteral("sync")), secondId);
+        QCOMPARE(storedDictionaries(), QSet<quint32>() << firstId << secondId);
+
+        // Once the value is gone, the replaced dictionary is removed
+        QVERIFY(query.exec(QStringLiteral("DELETE FROM OOB WHERE name = 'sync:key'")));
+        QVERIFY(database.removeUnusedOOBDictionaries());
+        QCOMPARE(storedDictionaries(), QSet<quint32>() << secondId);
+
+        // Removing the scope's dictionary removes the dictionary itself
+        QVERIFY(database.removeOOBScopeDictionary(QStringLiteral("sync")));
+        QCOMPARE(database.oobDictionary(QStringLiteral("sync")), 0u);
+        QCOMPARE(storedDictionaries(), QSet<quint32>());
+    }
+    QSqlDatabase::removeDatabase(QStringLiteral("tst_database_oob_dictionary"));
+
+    databaseDir.removeRecursively();
+    QStandardPaths::setTestModeEnabled(false);
+}
+
+void tst_Database::semaphoreOwnerDeath()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QByteArray path(QFile::encodeName(dir.path() + QStringLiteral("/semaphore")));
+    QFile token(QFile::decodeName(path));
+    QVERIFY(token.open(QIODevice::WriteOnly));
+    token.close();
+
+    const int initialValues[] = { 1, 0 };
+    Semaphore semaphore(path.constData(), 2, initialValues);
+    QVERIFY(semaphore.isValid());
+    QCOMPARE(semaphore.value(0), 1);
+    QCOMPARE(semaphore.value(1), 0);
+
+    // A process which exits while holding the semaphore, or counted in it, is undone
+    const pid_t child = fork();
+    if (child == 0) {
+        Semaphore childSemaphore(path.constData(), 2, initialValues);
+        const bool counted = childSemaphore.decrement(0) && childSemaphore.increment(1);
+        _exit(counted ? 0 : 1);
+    }
+    QVERIFY(child > 0);
+    int status = 0;
+    QCOMPARE(waitpid(child, &status, 0), child);
+    QVERIFY(WIFEXITED(status));
+    QCOMPARE(WEXITSTATUS(status), 0);
+
+    QCOMPARE(semaphore.value(1), 0);
+    QVERIFY(semaphore.decrement(0, true, 1000));
+    QCOMPARE(semaphore.value(0), 0);
+    QVERIFY(!semaphore.decrement(0, false));
+    QVERIFY(semaphore.increment(0));
+    QCOMPARE(semaphore.value(0), 1);
+}
+
+void tst_Database::semaphoreRoundTrip_speed()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QByteArray path(QFile::encodeName(dir.path() + QStringLiteral("/semaphore")));
+    QFile token(QFile::decodeName(path));
+    QVERIFY(token.open(QIODevice::WriteOnly));
+    token.close();
+
+    Semaphore semaphore(path.constData(), 1);
+    QVERIFY(semaphore.isValid());
+
+#ifdef QTCONTACTS_SQLITE_FUTEX_SEMAPHORE
+    qDebug() << "Uncontended lock round trip for the shared memory semaphore";
+#else
+    qDebug() << "Uncontended lock round trip for the SysV semaphore";
+#endif
+    QBENCHMARK {
+        semaphore.decrement();
+        semaphore.increment();
+    }
+}
+
 QTEST_GUILESS_MAIN(tst_Database)
 #include "tst_database.moc"
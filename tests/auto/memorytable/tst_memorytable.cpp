@@ -33,10 +33,19 @@
 #include "../../util.h"
 #include "../../../src/engine/memorytable_p.h"
 
+#include <QAtomicInt>
 #include <QDateTime>
+#include <QHash>
+#include <QMap>
+#include <QSet>
+#include <QVector>
 
 #include <cstring>
 
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 class tst_MemoryTable : public QObject
 {
 Q_OBJECT
@@ -62,7 +71,13 @@ private slots:
     void orderedReinsertion();
     void replacement();
     void migration();
+    void sequence();
+    void compaction();
+    void largeValues();
+    void concurrentReaders();
     void iteration();
+    void randomOperations_speed();
+    void smallValues_speed();
 
 private:
     char *testBuffer(size_t length);
@@ -501,11 +516,11 @@ void tst_MemoryTable::replacement()
     QCOMPARE(mt.contains(2), true);
     QCOMPARE(mt.value(2), QByteArray(10, 'y'));
 
-    // Replacement with a larger value requires a new allocation (68 bytes consumes all available space)
-    QCOMPARE(mt.insert(2, QByteArray(68, 'y')), MemoryTable::NoError);
+    // Replacement with a larger value requires a new allocation (56 bytes consumes all available space)
+    QCOMPARE(mt.insert(2, QByteArray(56, 'y')), MemoryTable::NoError);
     QCOMPARE(mt.count(), static_cast<size_t>(2u));
     QCOMPARE(mt.contains(2), true);
-    QCOMPARE(mt.value(2), QByteArray(68, 'y'));
+    QCOMPARE(mt.value(2), QByteArray(56, 'y'));
 
     // Replacement with a smaller value uses the same allocation
     QCOMPARE(mt.insert(2, QByteArray(40, 'y')), MemoryTable::NoError);
@@ -513,19 +528,19 @@ void tst_MemoryTable::replacement()
     QCOMPARE(mt.contains(2), true);
     QCOMPARE(mt.value(2), QByteArray(40, 'y'));
 
-    QCOMPARE(mt.insert(2, QByteArray(60, 'y')), MemoryTable::NoError);
+    QCOMPARE(mt.insert(2, QByteArray(52, 'y')), MemoryTable::NoError);
     QCOMPARE(mt.count(), static_cast<size_t>(2u));
     QCOMPARE(mt.contains(2), true);
-    QCOMPARE(mt.value(2), QByteArray(60, 'y'));
+    QCOMPARE(mt.value(2), QByteArray(52, 'y'));
 
     // Replacement with a larger value still fits
-    QCOMPARE(mt.insert(2, QByteArray(68, 'y')), MemoryTable::NoError);
+    QCOMPARE(mt.insert(2, QByteArray(56, 'y')), MemoryTable::NoError);
     QCOMPARE(mt.count(), static_cast<size_t>(2u));
     QCOMPARE(mt.contains(2), true);
-    QCOMPARE(mt.value(2), QByteArray(68, 'y'));
+    QCOMPARE(mt.value(2), QByteArray(56, 'y'));
 
     // Replacement may fail because we can't allocate more space
-    QCOMPARE(mt.insert(2, QByteArray(69, 'y')), MemoryTable::InsufficientSpace);
+    QCOMPARE(mt.insert(2, QByteArray(57, 'y')), MemoryTable::InsufficientSpace);
 
     // Insertion may fail because we can't expand the index, even though we have a
     // large enough free block from the earlier replacement
@@ -555,8 +570,9 @@ void tst_MemoryTable::replacement()
     QCOMPARE(mt.contains(2), false);
     QCOMPARE(mt.contains(3), false);
 
-    // Free list space remains fragmented after removing all items
-    QCOMPARE(mt.insert(1, QByteArray(69, 'x')), MemoryTable::InsufficientSpace);
+    // Freed space is reclaimed after removing all items
+    QCOMPARE(mt.insert(1, QByteArray(65, 'x')), MemoryTable::NoError);
+    QCOMPARE(mt.value(1), QByteArray(65, 'x'));
 }
 
 void tst_MemoryTable::migration()
@@ -594,6 +610,318 @@ void tst_MemoryTable::migration()
     }
 }
 
+void tst_MemoryTable::sequence()
+{
+    QScopedArrayPointer<char> buf(testBuffer(256));
+
+    MemoryTable mt(buf.data(), 256, true);
+    QCOMPARE(mt.isValid(), true);
+    QCOMPARE(mt.sequence(), 0u);
+
+    // Each modification advances the sequence, leaving it even when complete
+    QCOMPARE(mt.insert(1, QByteArray("one")), MemoryTable::NoError);
+    const quint32 first = mt.sequence();
+    QVERIFY(first > 0u);
+    QCOMPARE(first % 2, 0u);
+
+    QCOMPARE(mt.insert(1, QByteArray("uno")), MemoryTable::NoError);
+    const quint32 second = mt.sequence();
+    QVERIFY(second > first);
+    QCOMPARE(second % 2, 0u);
+
+    QCOMPARE(mt.remove(1), true);
+    QVERIFY(mt.sequence() > second);
+
+    // Lookups do not affect the sequence
+    const quint32 third = mt.sequence();
+    QCOMPARE(mt.contains(1), false);
+    QCOMPARE(mt.value(1), QByteArray());
+    QCOMPARE(mt.sequence(), third);
+
+    // The sequence of a table attached to existing content is preserved
+    MemoryTable attached(buf.data(), 256, false);
+    QCOMPARE(attached.sequence(), third);
+}
+
+void tst_MemoryTable::compaction()
+{
+    QScopedArrayPointer<char> buf(testBuffer(1024));
+
+    MemoryTable mt(buf.data(), 1024, true);
+    QCOMPARE(mt.isValid(), true);
+    QCOMPARE(mt.fragmentedSpace(), static_cast<size_t>(0u));
+
+    // Fill the table with small items
+    quint32 key = 0u;
+    while (mt.insert(key, QByteArray(12, 'a' + (key % 26))) == MemoryTable::NoError) {
+        ++key;
+    }
+    const quint32 itemCount = key;
+    QVERIFY(itemCount > 2);
+    QVERIFY(mt.freeSpace() < mt.size());
+
+    // Removing two adjacent items leaves two free blocks, neither of which can satisfy a larger item
+    QCOMPARE(mt.remove(1), true);
+    QCOMPARE(mt.remove(2), true);
+    QVERIFY(mt.fragmentedSpace() > 0);
+    QVERIFY(mt.fragmentedSpace() <= mt.freeSpace());
+
+    // The adjacent blocks are coalesced to satisfy the allocation
+    QCOMPARE(mt.insert(itemCount, QByteArray(28, 'y')), MemoryTable::NoError);
+    QCOMPARE(mt.value(itemCount), QByteArray(28, 'y'));
+
+    // Remove alternate items, leaving the free space fragmented
+    for (key = 0u; key < itemCount; key += 2) {
+        if (key != 2u) {
+            QCOMPARE(mt.remove(key), true);
+        }
+    }
+    const size_t freeSpace = mt.freeSpace();
+    QVERIFY(mt.fragmentedSpace() > 0);
+
+    // An item larger than any free block requires the table to be compacted
+    QByteArray large(freeSpace / 2, 'z');
+    QCOMPARE(mt.insert(itemCount + 1, large), MemoryTable::NoError);
+    QCOMPARE(mt.fragmentedSpace(), static_cast<size_t>(0u));
+    QVERIFY(mt.freeSpace() < freeSpace);
+
+    // All remaining items are intact
+    QCOMPARE(mt.value(itemCount), QByteArray(28, 'y'));
+    QCOMPARE(mt.value(itemCount + 1), large);
+    for (key = 3u; key < itemCount; key += 2) {
+        QCOMPARE(mt.contains(key), true);
+        QCOMPARE(mt.value(key), QByteArray(12, 'a' + (key % 26)));
+    }
+
+    // Space that cannot be reclaimed does not disrupt the table
+    QCOMPARE(mt.insert(itemCount + 2, QByteArray(mt.size(), 'x')), MemoryTable::InsufficientSpace);
+    QCOMPARE(mt.value(itemCount + 1), large);
+}
+
+void tst_MemoryTable::largeValues()
+{
+    const size_t bufferSize = 16 * 1024 * 1024;
+    QScopedArrayPointer<char> buf(testBuffer(bufferSize));
+    QScopedArrayPointer<char> buf2(testBuffer(bufferSize));
+
+    MemoryTable mt(buf.data(), bufferSize, true);
+    QCOMPARE(mt.isValid(), true);
+
+    // Small values retain the compact block header: 4 bytes, plus 8 bytes of index
+    size_t available = mt.freeSpace();
+    QCOMPARE(mt.insert(0, QByteArray(100, 'a')), MemoryTable::NoError);
+    QCOMPARE(available - mt.freeSpace(), static_cast<size_t>(112u));
+
+    // Values either side of the compact header limit, and up to several megabytes
+    QList<int> sizes;
+    sizes << 65527 << 65528 << 65529 << 65535 << 65536 << 65537 << 100000 << (1024 * 1024) << (4 * 1024 * 1024 + 3);
+
+    QMap<quint32, QByteArray> values;
+    values.insert(0, QByteArray(100, 'a'));
+    for (int i = 0; i < sizes.count(); ++i) {
+        const quint32 key = i + 1;
+        QByteArray value(sizes.at(i), Qt::Uninitialized);
+        for (int j = 0; j < value.size(); ++j) {
+            value[j] = static_cast<char>(qrand());
+        }
+        QCOMPARE(mt.insert(key, value), MemoryTable::NoError);
+        QCOMPARE(mt.value(key).size(), value.size());
+        QCOMPARE(mt.value(key), value);
+        values.insert(key, value);
+    }
+
+    // Replace a large value with a small one, and a small value with a large one
+    values[sizes.count()] = QByteArray(10, 'b');
+    QCOMPARE(mt.insert(sizes.count(), values[sizes.count()]), MemoryTable::NoError);
+    values[0] = QByteArray(3 * 1024 * 1024, 'c');
+    QCOMPARE(mt.insert(0, values[0]), MemoryTable::NoError);
+
+    // Small values can be allocated from the space freed by large values
+    QCOMPARE(mt.remove(sizes.count() - 1), true);
+    values.remove(sizes.count() - 1);
+    for (quint32 key = 100; key < 400; ++key) {
+        values.insert(key, QByteArray(key, 'd'));
+        QCOMPARE(mt.insert(key, values[key]), MemoryTable::NoError);
+    }
+
+    QCOMPARE(mt.count(), static_cast<size_t>(values.count()));
+    QMap<quint32, QByteArray>::const_iterator it = values.constBegin(), end = values.constEnd();
+    for ( ; it != end; ++it) {
+        QCOMPARE(mt.value(it.key()), it.value());
+    }
+
+    // Large values can be migrated
+    MemoryTable mt2(buf2.data(), bufferSize, true);
+    QCOMPARE(mt.migrateTo(mt2), MemoryTable::NoError);
+    for (it = values.constBegin(); it != end; ++it) {
+        QCOMPARE(mt2.value(it.key()), it.value());
+    }
+
+    // A value larger than the table cannot be stored
+    QCOMPARE(mt.insert(1000, QByteArray(bufferSize, 'x')), MemoryTable::InsufficientSpace);
+    QCOMPARE(mt.value(0), values[0]);
+}
+
+namespace {
+
+// The key and version are encoded in the value, so that a reader can verify any value it obtains
+QByteArray versionedValue(quint32 key, quint32 version)
+{
+    QByteArray value(8 + ((key * 37 + version * 13) % 2000), static_cast<char>(key + version));
+    std::memcpy(value.data(), &key, sizeof(quint32));
+    std::memcpy(value.data() + sizeof(quint32), &version, sizeof(quint32));
+    return value;
+}
+
+bool validVersionedValue(quint32 key, const QByteArray &value)
+{
+    if (value.size() < 8)
+        return false;
+
+    quint32 valueKey, version;
+    std::memcpy(&valueKey, value.constData(), sizeof(quint32));
+    std::memcpy(&version, value.constData() + sizeof(quint32), sizeof(quint32));
+    return valueKey == key && value == versionedValue(key, version);
+}
+
+struct ReaderControl {
+    QBasicAtomicInt ready;
+    QBasicAtomicInt finished;
+};
+
+enum ReaderStatus {
+    ReaderSucceeded = 0,
+    ReaderInconsistentValue,
+    ReaderNoLookups,
+    ReaderNotMigrated
+};
+
+int readerProcess(char *first, char *second, size_t tableSize, quint32 keyCount, ReaderControl *control)
+{
+    qsrand(static_cast<uint>(getpid()));
+
+    MemoryTable firstTable(first, tableSize, false);
+    QScopedPointer<MemoryTable> secondTable;
+    const MemoryTable *table = &firstTable;
+
+    int lookups = 0;
+    control->ready.fetchAndAddOrdered(1);
+    while (!control->finished.loadAcquire()) {
+        const quint32 key = qrand() % keyCount;
+
+        QByteArray value;
+        bool found;
+        if (table->readValue(key, &value, &found)) {
+            if (found && !validVersionedValue(key, value))
+                return ReaderInconsistentValue;
+            ++lookups;
+        } else if (table == &firstTable && firstTable.isRetired()) {
+            // The content has been migrated to the second table
+            secondTable.reset(new MemoryTable(second, tableSize, false));
+            table = secondTable.data();
+        }
+    }
+
+    if (lookups == 0)
+        return ReaderNoLookups;
+    if (table == &firstTable)
+        return ReaderNotMigrated;
+    return ReaderSucceeded;
+}
+
+}
+
+void tst_MemoryTable::concurrentReaders()
+{
+    // Reader processes look up values without locking, while this process modifies the table
+    const size_t tableSize = 1024 * 1024;
+    const int readerCount = 4;
+    const quint32 keyCount = 512;
+    const int operationCount = 200000;
+
+    // Both tables and the control structure are shared with the readers
+    const size_t regionSize = 2 * tableSize + sizeof(ReaderControl);
+    void *region = mmap(0, regionSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    QVERIFY(region != MAP_FAILED);
+
+    char *first = static_cast<char *>(region);
+    char *second = first + tableSize;
+    ReaderControl *control = reinterpret_cast<ReaderControl *>(second + tableSize);
+    control->ready.store(0);
+    control->finished.store(0);
+
+    MemoryTable firstTable(first, tableSize, true);
+    QCOMPARE(firstTable.isValid(), true);
+
+    // Ensure that the readers terminate, even if this test fails
+    struct Finish {
+        ReaderControl *control;
+        ~Finish() { control->finished.storeRelease(1); }
+    } finish = { control };
+
+    QList<pid_t> readers;
+    for (int i = 0; i < readerCount; ++i) {
+        const pid_t pid = fork();
+        if (pid == 0) {
+            _exit(readerProcess(first, second, tableSize, keyCount, control));
+        }
+        QVERIFY(pid > 0);
+        readers.append(pid);
+    }
+    while (control->ready.loadAcquire() < readerCount) {
+        usleep(1000);
+    }
+
+    quint32 seed = static_cast<quint32>(QDateTime::currentDateTime().toMSecsSinceEpoch());
+    qDebug() << "Randomized test - seed:" << seed;
+    qsrand(seed);
+
+    // Replace (three quarters) and remove random keys, migrating to the second table half way
+    QHash<quint32, quint32> versions;
+    QScopedPointer<MemoryTable> secondTable;
+    MemoryTable *table = &firstTable;
+    for (int i = 0; i < operationCount; ++i) {
+        if (i == operationCount / 2) {
+            secondTable.reset(new MemoryTable(second, tableSize, true));
+            QCOMPARE(firstTable.migrateTo(*secondTable), MemoryTable::NoError);
+            firstTable.retire();
+            table = secondTable.data();
+        }
+
+        const quint32 key = qrand() % keyCount;
+        if ((qrand() % 4) == 0) {
+            table->remove(key);
+            versions.remove(key);
+        } else {
+            const quint32 version = ++versions[key];
+            QCOMPARE(table->insert(key, versionedValue(key, version)), MemoryTable::NoError);
+        }
+    }
+    control->finished.storeRelease(1);
+
+    foreach (pid_t pid, readers) {
+        int status = 0;
+        QCOMPARE(waitpid(pid, &status, 0), pid);
+        QVERIFY(WIFEXITED(status));
+        QCOMPARE(WEXITSTATUS(status), static_cast<int>(ReaderSucceeded));
+    }
+
+    // Without concurrent modification, lookups succeed and reflect the final content
+    QCOMPARE(firstTable.isRetired(), true);
+    QCOMPARE(secondTable->isRetired(), false);
+    for (quint32 key = 0; key < keyCount; ++key) {
+        QByteArray value;
+        bool found;
+        QCOMPARE(secondTable->readValue(key, &value, &found), true);
+        QCOMPARE(found, versions.contains(key));
+        if (found) {
+            QCOMPARE(value, versionedValue(key, versions.value(key)));
+        }
+    }
+
+    munmap(region, regionSize);
+}
+
 void tst_MemoryTable::iteration()
 {
     QScopedArrayPointer<char> buf(testBuffer(128));
@@ -669,21 +997,131 @@ void tst_MemoryTable::iteration()
     QCOMPARE(mt.insert(1, QByteArray(1, 'z')), MemoryTable::NoError);
     QCOMPARE(mt.count(), static_cast<size_t>(2u));
 
+    // Iteration follows insertion order
     it = mt.constBegin();
     end = mt.constEnd();
     QVERIFY(it != end);
-    QCOMPARE(static_cast<int>(it.key()), 1);
-    QCOMPARE(it.value(), QByteArray(1, 'z'));
+    QCOMPARE(static_cast<int>(it.key()), 3);
+    QCOMPARE(it.value(), QByteArray(1, 'x'));
     QCOMPARE(std::distance(it, end), static_cast<std::ptrdiff_t>(2));
     ++it;
     QVERIFY(it != end);
     QCOMPARE(std::distance(it, end), static_cast<std::ptrdiff_t>(1));
-    QCOMPARE(static_cast<int>(it.key()), 3);
-    QCOMPARE(it.value(), QByteArray(1, 'x'));
+    QCOMPARE(static_cast<int>(it.key()), 1);
+    QCOMPARE(it.value(), QByteArray(1, 'z'));
     ++it;
     QVERIFY(it == end);
     QCOMPARE(std::distance(it, end), static_cast<std::ptrdiff_t>(0));
 }
 
+void tst_MemoryTable::randomOperations_speed()
+{
+    const int operationCount = 50000;
+    const size_t bufferSize = 4 * 1024 * 1024;
+
+    QScopedArrayPointer<char> buf(testBuffer(bufferSize));
+    QScopedArrayPointer<char> buf2(testBuffer(bufferSize));
+
+    quint32 seed = static_cast<quint32>(QDateTime::currentDateTime().toMSecsSinceEpoch());
+    qDebug() << "Randomized test - seed:" << seed;
+    qsrand(seed);
+
+    // Generate a sequence of insertions (two thirds) and removals of random keys
+    QVector<quint32> keys;
+    QVector<bool> insertions;
+    QVector<QByteArray> values;
+    keys.reserve(operationCount);
+    insertions.reserve(operationCount);
+    values.reserve(operationCount);
+    for (int i = 0; i < operationCount; ++i) {
+        const quint32 key = static_cast<quint32>(qrand()) % operationCount;
+        keys.append(key);
+        insertions.append((qrand() % 3) != 0);
+        values.append(QByteArray::number(i).leftJustified(16, '.'));
+    }
+
+    int failures = 0;
+    QBENCHMARK {
+        MemoryTable mt(buf.data(), bufferSize, true);
+        for (int i = 0; i < operationCount; ++i) {
+            if (insertions.at(i)) {
+                if (mt.insert(keys.at(i), values.at(i)) != MemoryTable::NoError)
+                    ++failures;
+            } else {
+                mt.remove(keys.at(i));
+            }
+        }
+    }
+    QCOMPARE(failures, 0);
+
+    // Verify the final content against the same operations applied to a QHash
+    QHash<quint32, QByteArray> expected;
+    for (int i = 0; i < operationCount; ++i) {
+        if (insertions.at(i)) {
+            expected.insert(keys.at(i), values.at(i));
+        } else {
+            expected.remove(keys.at(i));
+        }
+    }
+
+    MemoryTable mt(buf.data(), bufferSize, false);
+    QCOMPARE(mt.count(), static_cast<size_t>(expected.count()));
+    for (quint32 key = 0; key < static_cast<quint32>(operationCount); ++key) {
+        QCOMPARE(mt.contains(key), expected.contains(key));
+        QCOMPARE(mt.value(key), expected.value(key));
+    }
+
+    QSet<quint32> iterated;
+    for (MemoryTable::const_iterator it = mt.constBegin(), end = mt.constEnd(); it != end; ++it) {
+        QVERIFY(expected.contains(it.key()));
+        QCOMPARE(it.value(), expected.value(it.key()));
+        iterated.insert(it.key());
+    }
+    QCOMPARE(iterated.count(), expected.count());
+
+    // The hashed index must survive migration
+    MemoryTable mt2(buf2.data(), bufferSize, true);
+    QCOMPARE(mt.migrateTo(mt2), MemoryTable::NoError);
+    QCOMPARE(mt2.count(), mt.count());
+    QHash<quint32, QByteArray>::const_iterator it = expected.constBegin(), end = expected.constEnd();
+    for ( ; it != end; ++it) {
+        QCOMPARE(mt2.value(it.key()), it.value());
+    }
+}
+
+void tst_MemoryTable::smallValues_speed()
+{
+    // Typical transient entries are a few hundred bytes
+    const int itemCount = 10000;
+    const size_t bufferSize = 4 * 1024 * 1024;
+
+    QScopedArrayPointer<char> buf(testBuffer(bufferSize));
+
+    QVector<QByteArray> values;
+    values.reserve(itemCount);
+    for (int i = 0; i < itemCount; ++i) {
+        values.append(QByteArray::number(i).leftJustified(160 + (i % 128), '.'));
+    }
+
+    int failures = 0;
+    QBENCHMARK {
+        MemoryTable mt(buf.data(), bufferSize, true);
+        for (int i = 0; i < itemCount; ++i) {
+            if (mt.insert(i, values.at(i)) != MemoryTable::NoError)
+                ++failures;
+        }
+        // Replace each value with that of a different size
+        for (int i = 0; i < itemCount; ++i) {
+            if (mt.insert(i, values.at(itemCount - 1 - i)) != MemoryTable::NoError)
+                ++failures;
+        }
+        for (int i = 0; i < itemCount; ++i) {
+            if (mt.value(i).size() != values.at(itemCount - 1 - i).size())
+                ++failures;
+        }
+    }
+    QCOMPARE(failures, 0);
+}
+
 QTEST_GUILESS_MAIN(tst_MemoryTable)
 #include "tst_memorytable.moc"
@@ -2,6 +2,8 @@ TARGET = tst_qcontactmanager
 
 include(../../common.pri)
 
+QT += dbus
+
 INCLUDEPATH += \
     ../../../src/engine/
 
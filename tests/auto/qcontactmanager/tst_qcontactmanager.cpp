@@ -53,6 +53,9 @@
 #include "../../util.h"
 #include "../../qcontactmanagerdataholder.h"
 
+#include <QDBusConnection>
+#include <QDBusMessage>
+
 #define SQLITE_MANAGER "org.nemomobile.contacts.sqlite"
 
 //TESTED_COMPONENT=src/contacts
@@ -143,6 +146,12 @@ static bool detailsSuperset(const QContactDetail &lhs, const QContactDetail &rhs
     return detailValuesSuperset(lhs, rhs);
 }
 
+static bool setRequestExecutionSuspended(QtContactsSqliteExtensions::ContactManagerEngine *cme, bool suspended)
+{
+    // Requests started while suspended are executed together once resumed
+    return QMetaObject::invokeMethod(cme, "setRequestExecutionSuspended", Qt::DirectConnection, Q_ARG(bool, suspended));
+}
+
 class tst_QContactManager : public QObject
 {
 Q_OBJECT
@@ -199,6 +208,30 @@ private slots:
     void presenceAccumulation();
     void presenceAccumulation_data() {addManagers();}
 
+    /* Sorting on transient presence state */
+    void presenceSorting();
+    void presenceSorting_data() {addManagers();}
+
+    /* Batch presence update API */
+    void presenceUpdateApi();
+    void presenceUpdateApi_data() {addManagers();}
+
+    /* Coalesced change notifications */
+    void notificationCoalescing();
+
+    /* Detail types reported in change notifications */
+    void changedDetailTypes();
+    void changedDetailTypes_data() {addManagers();}
+
+    /* Persistent change journal */
+    void changeJournal();
+
+    /* Writes prepared before the write lock is taken */
+    void preparedWrites();
+
+    /* Write lock wait and hold statistics */
+    void writeLockStatistics();
+
     /* Nonprivileged DB variant */
     void nonprivileged();
 
@@ -209,6 +242,7 @@ private slots:
     void update();
     void remove();
     void removeAsync();
+    void groupedWrites();
     void batch();
     void observerDeletion();
     void signalEmission();
@@ -274,6 +308,7 @@ private slots:
     void update_data() {addManagers();}
     void remove_data() {addManagers();}
     void removeAsync_data() {addManagers();}
+    void groupedWrites_data() {addManagers();}
     void batch_data() {addManagers();}
     void signalEmission_data() {addManagers();}
     void detailDefinitions_data() {addManagers();}
@@ -317,6 +352,46 @@ private:
     const char * const mSignal;
 };
 
+// Receives the engine's change signals through a separate bus connection, as another process would
+class ChangeSignalListener : public QObject {
+    Q_OBJECT
+public:
+    explicit ChangeSignalListener(const QString &name)
+        : mConnection(QDBusConnection::connectToBus(QDBusConnection::SessionBus, name))
+    {
+        const QString path(QStringLiteral("/org/nemomobile/contacts/sqlite"));
+        mConnection.connect(QString(), path, QString(), QStringLiteral("contactsChanged"), QStringLiteral("au"),
+                            this, SLOT(contactsChanged(QDBusMessage)));
+        mConnection.connect(QString(), path, QString(), QStringLiteral("contactsDetailsChanged"), QStringLiteral("auau"),
+                            this, SLOT(contactsDetailsChanged(QDBusMessage)));
+    }
+
+    ~ChangeSignalListener()
+    {
+        QDBusConnection::disconnectFromBus(mConnection.name());
+    }
+
+    bool isConnected() const { return mConnection.isConnected(); }
+
+    QList<QList<quint32> > changedIds;
+    QList<QPair<QList<quint32>, QList<quint32> > > detailsChanged;
+
+public slots:
+    void contactsChanged(const QDBusMessage &message)
+    {
+        changedIds.append(qdbus_cast<QList<quint32> >(message.arguments().at(0)));
+    }
+
+    void contactsDetailsChanged(const QDBusMessage &message)
+    {
+        detailsChanged.append(qMakePair(qdbus_cast<QList<quint32> >(message.arguments().at(0)),
+                                        qdbus_cast<QList<quint32> >(message.arguments().at(1))));
+    }
+
+private:
+    QDBusConnection mConnection;
+};
+
 
 static bool managerSupportsFeature(const QContactManager &m, const char *feature)
 {
@@ -1257,6 +1332,108 @@ void tst_QContactManager::removeAsync()
     QVERIFY(addedSpy.count() == 0);
 }
 
+void tst_QContactManager::groupedWrites()
+{
+    QFETCH(QString, uri);
+    QScopedPointer<QContactManager> cm(QContactManager::fromUri(uri));
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(*cm.data());
+
+    /* A contact which has been removed cannot be updated */
+    QContact removed = createContact("RemovedGrouped", "inWonderlandGrouped", "111111111");
+    QVERIFY(cm->saveContact(&removed));
+    QVERIFY(cm->removeContact(removalId(removed)));
+
+    QTest::qWait(500); // wait for signal coalescing.
+    QSignalSpy addedSpy(cm.data(), contactsAddedSignal);
+
+    /* Consecutive write requests may be committed within a single transaction */
+    QContactSaveRequest aliceRequest;
+    aliceRequest.setContact(createContact("AliceGrouped", "inWonderlandGrouped", "222222222"));
+    aliceRequest.setManager(cm.data());
+
+    QContactSaveRequest removedRequest;
+    removedRequest.setContact(removed);
+    removedRequest.setManager(cm.data());
+
+    QContactSaveRequest bobRequest;
+    bobRequest.setContact(createContact("BobGrouped", "inWonderlandGrouped", "333333333"));
+    bobRequest.setManager(cm.data());
+
+    /* Queue the requests together, so that they are executed as a group */
+    QVERIFY(setRequestExecutionSuspended(cme, true));
+    QVERIFY(aliceRequest.start());
+    QVERIFY(removedRequest.start());
+    QVERIFY(bobRequest.start());
+    QVERIFY(setRequestExecutionSuspended(cme, false));
+
+    QVERIFY(aliceRequest.waitForFinished());
+    QVERIFY(removedRequest.waitForFinished());
+    QVERIFY(bobRequest.waitForFinished());
+
+    /* The failure of one request does not affect the others */
+    QCOMPARE(aliceRequest.error(), QContactManager::NoError);
+    QVERIFY(removedRequest.error() != QContactManager::NoError);
+    QCOMPARE(bobRequest.error(), QContactManager::NoError);
+
+    const QContact alice = aliceRequest.contacts().first();
+    const QContact bob = bobRequest.contacts().first();
+    QVERIFY(alice.id() != QContactId());
+    QVERIFY(bob.id() != QContactId());
+    QVERIFY(!cm->contact(retrievalId(alice)).isEmpty());
+    QVERIFY(!cm->contact(retrievalId(bob)).isEmpty());
+    QVERIFY(cm->contact(retrievalId(removed)).isEmpty());
+
+    QTRY_VERIFY(addedSpy.count() > 0);
+    QSet<QContactId> addedIds;
+    foreach (const QList<QVariant> &args, addedSpy) {
+        foreach (const QContactId &id, args.first().value<QList<QContactId> >()) {
+            addedIds.insert(id);
+        }
+    }
+    QVERIFY(addedIds.contains(alice.id()));
+    QVERIFY(addedIds.contains(bob.id()));
+
+    /* The transient changes of a failed request in the group are discarded with it */
+    QContact busyAlice = cm->contact(retrievalId(alice));
+    QContactPresence presence;
+    presence.setPresenceState(QContactPresence::PresenceBusy);
+    presence.setDetailUri(QStringLiteral("alicegrouped@account"));
+    QVERIFY(busyAlice.saveDetail(&presence));
+
+    QList<QContactDetail::DetailType> presenceMask;
+    presenceMask << QContactPresence::Type;
+
+    QContactSaveRequest presenceRequest;
+    presenceRequest.setContacts(QList<QContact>() << busyAlice << removed);
+    presenceRequest.setTypeMask(presenceMask);
+    presenceRequest.setManager(cm.data());
+
+    QContact updatedBob = cm->contact(retrievalId(bob));
+    QContactNickname nickname;
+    nickname.setNickname(QStringLiteral("BobbyGrouped"));
+    QVERIFY(updatedBob.saveDetail(&nickname));
+
+    QContactSaveRequest updateRequest;
+    updateRequest.setContact(updatedBob);
+    updateRequest.setManager(cm.data());
+
+    QVERIFY(setRequestExecutionSuspended(cme, true));
+    QVERIFY(presenceRequest.start());
+    QVERIFY(updateRequest.start());
+    QVERIFY(setRequestExecutionSuspended(cme, false));
+
+    QVERIFY(presenceRequest.waitForFinished());
+    QVERIFY(updateRequest.waitForFinished());
+    QVERIFY(presenceRequest.error() != QContactManager::NoError);
+    QCOMPARE(updateRequest.error(), QContactManager::NoError);
+
+    QVERIFY(cm->contact(retrievalId(alice)).details<QContactPresence>().isEmpty());
+    QCOMPARE(cm->contact(retrievalId(bob)).detail<QContactNickname>().nickname(), QStringLiteral("BobbyGrouped"));
+
+    QVERIFY(cm->removeContact(removalId(alice)));
+    QVERIFY(cm->removeContact(removalId(bob)));
+}
+
 void tst_QContactManager::batch()
 {
     QFETCH(QString, uri);
@@ -1948,6 +2125,642 @@ void tst_QContactManager::presenceAccumulation()
     QVERIFY(cm->removeContact(retrievalId(a)));
 }
 
+void tst_QContactManager::presenceSorting()
+{
+    QFETCH(QString, uri);
+    QScopedPointer<QContactManager> cm(QContactManager::fromUri(uri));
+
+    QList<QContact> contacts;
+    for (int i = 0; i < 2; ++i) {
+        QContact c;
+
+        QContactName n;
+        n.setFirstName(QString::fromLatin1("Sorted%1").arg(i));
+        n.setLastName("Presence-Sorting");
+        c.saveDetail(&n);
+
+        QContactPresence p;
+        p.setPresenceState(i == 0 ? QContactPresence::PresenceAvailable : QContactPresence::PresenceAway);
+        QVERIFY(c.saveDetail(&p));
+
+        contacts.append(c);
+    }
+    QVERIFY(cm->saveContacts(&contacts));
+
+    QContactIdFilter idFilter;
+    idFilter.setIds(QList<QContactId>() << contacts.at(0).id() << contacts.at(1).id());
+
+    QContactSortOrder presenceOrder;
+    setSortDetail<QContactGlobalPresence>(presenceOrder, QContactGlobalPresence::FieldPresenceState);
+    const QList<QContactSortOrder> sortOrders(QList<QContactSortOrder>() << presenceOrder);
+
+    QCOMPARE(cm->contactIds(idFilter, sortOrders), QList<QContactId>() << contacts.at(0).id() << contacts.at(1).id());
+
+    // Repeating the query without any presence change yields the same result
+    QCOMPARE(cm->contactIds(idFilter, sortOrders), QList<QContactId>() << contacts.at(0).id() << contacts.at(1).id());
+
+    // Transient presence updates must be reflected by subsequent queries
+    const QList<QContactPresence::PresenceState> states(QList<QContactPresence::PresenceState>()
+            << QContactPresence::PresenceOffline << QContactPresence::PresenceAvailable << QContactPresence::PresenceBusy);
+    for (int i = 0; i < states.count(); ++i) {
+        QContact c = cm->contact(retrievalId(contacts.at(0)));
+        QContactPresence p = c.detail<QContactPresence>();
+        p.setPresenceState(states.at(i));
+        QVERIFY(c.saveDetail(&p));
+
+        QList<QContact> updated;
+        updated.append(c);
+        QVERIFY(cm->saveContacts(&updated, DetailList() << detailType<QContactPresence>()));
+
+        const QList<QContactId> expected(states.at(i) < QContactPresence::PresenceAway
+                ? QList<QContactId>() << contacts.at(0).id() << contacts.at(1).id()
+                : QList<QContactId>() << contacts.at(1).id() << contacts.at(0).id());
+        QCOMPARE(cm->contactIds(idFilter, sortOrders), expected);
+    }
+
+    QVERIFY(cm->removeContacts(QList<QContactId>() << contacts.at(0).id() << contacts.at(1).id()));
+}
+
+void tst_QContactManager::presenceUpdateApi()
+{
+    QFETCH(QString, uri);
+    QScopedPointer<QContactManager> cm(QContactManager::fromUri(uri));
+
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(*cm.data());
+    QSignalSpy changedSpy(cm.data(), contactsChangedSignal);
+    QSignalSpy presenceChangedSpy(cme, contactsPresenceChangedSignal);
+
+    QList<QContact> contacts;
+    for (int i = 0; i < 2; ++i) {
+        QContact c;
+
+        QContactName n;
+        n.setFirstName(QString::fromLatin1("Presence%1").arg(i));
+        n.setLastName("Update-Api");
+        c.saveDetail(&n);
+
+        for (int j = 0; j < 2; ++j) {
+            const QString accountUri(QString::fromLatin1("presence%1@account%2").arg(i).arg(j));
+
+            QContactOnlineAccount oa;
+            oa.setAccountUri(accountUri);
+            oa.setDetailUri(accountUri);
+            QVERIFY(c.saveDetail(&oa));
+
+            QContactPresence p;
+            p.setPresenceState(QContactPresence::PresenceOffline);
+            p.setDetailUri(accountUri + QStringLiteral(":presence"));
+            p.setLinkedDetailUris(accountUri);
+            QVERIFY(c.saveDetail(&p));
+        }
+
+        contacts.append(c);
+    }
+    QVERIFY(cm->saveContacts(&contacts));
+
+    QTest::qWait(500); // wait for signal coalescing.
+    changedSpy.clear();
+    presenceChangedSpy.clear();
+
+    QList<QtContactsSqliteExtensions::ContactManagerEngine::PresenceUpdate> updates;
+    for (int i = 0; i < 2; ++i) {
+        QtContactsSqliteExtensions::ContactManagerEngine::PresenceUpdate update;
+        update.contactId = contacts.at(i).id();
+        update.accountUri = QString::fromLatin1("presence%1@account1").arg(i);
+        update.presenceState = QContactPresence::PresenceAvailable;
+        update.customMessage = QString::fromLatin1("Available %1").arg(i);
+        updates.append(update);
+    }
+
+    QMap<int, QContactManager::Error> errorMap;
+    QContactManager::Error error = QContactManager::NoError;
+    QVERIFY(cme->updatePresence(updates, &errorMap, &error));
+    QCOMPARE(error, QContactManager::NoError);
+    QVERIFY(errorMap.isEmpty());
+
+    // A single presence change is reported, and no durable change
+    QTRY_COMPARE(presenceChangedSpy.count(), 1);
+    QSet<QContactId> reportedIds;
+    for (const QContactId &id : presenceChangedSpy.first().at(0).value<QList<QContactId> >()) {
+        reportedIds.insert(id);
+    }
+    QVERIFY(reportedIds.contains(contacts.at(0).id()));
+    QVERIFY(reportedIds.contains(contacts.at(1).id()));
+    QCOMPARE(changedSpy.count(), 0);
+
+    for (int i = 0; i < 2; ++i) {
+        const QContact c = cm->contact(retrievalId(contacts.at(i)));
+        const QString accountUri(QString::fromLatin1("presence%1@account1").arg(i));
+
+        bool found = false;
+        for (const QContactPresence &p : c.details<QContactPresence>()) {
+            if (p.linkedDetailUris().contains(accountUri)) {
+                QCOMPARE(p.presenceState(), QContactPresence::PresenceAvailable);
+                QCOMPARE(p.customMessage(), QString::fromLatin1("Available %1").arg(i));
+                found = true;
+            } else {
+                QCOMPARE(p.presenceState(), QContactPresence::PresenceOffline);
+            }
+        }
+        QVERIFY(found);
+        QCOMPARE(c.detail<QContactGlobalPresence>().presenceState(), QContactPresence::PresenceAvailable);
+        QCOMPARE(c.detail<QContactGlobalPresence>().customMessage(), QString::fromLatin1("Available %1").arg(i));
+
+        // The aggregate reflects the constituent's presence
+        const QList<QContactId> aggregateIds(c.relatedContacts(relationshipString(QContactRelationship::Aggregates), QContactRelationship::First));
+        if (!aggregateIds.isEmpty()) {
+            const QContact aggregate = cm->contact(aggregateIds.first());
+            QCOMPARE(aggregate.detail<QContactGlobalPresence>().presenceState(), QContactPresence::PresenceAvailable);
+            QCOMPARE(aggregate.detail<QContactGlobalPresence>().customMessage(), QString::fromLatin1("Available %1").arg(i));
+        }
+    }
+
+    // An update for an unknown account fails without modifying anything
+    presenceChangedSpy.clear();
+    updates.first().presenceState = QContactPresence::PresenceBusy;
+    updates.last().accountUri = QStringLiteral("unknown@account");
+    errorMap.clear();
+    QVERIFY(!cme->updatePresence(updates, &errorMap, &error));
+    QCOMPARE(error, QContactManager::DoesNotExistError);
+    QCOMPARE(errorMap.count(), 1);
+    QCOMPARE(errorMap.value(1), QContactManager::DoesNotExistError);
+    QCOMPARE(cm->contact(retrievalId(contacts.at(0))).detail<QContactGlobalPresence>().presenceState(), QContactPresence::PresenceAvailable);
+
+    // A presence update which fails partway leaves none of its transient changes visible
+    QContact doomed;
+    QContactName dn;
+    dn.setFirstName(QStringLiteral("Doomed"));
+    dn.setLastName("Update-Api");
+    doomed.saveDetail(&dn);
+    QVERIFY(cm->saveContact(&doomed));
+    QVERIFY(cm->removeContact(removalId(doomed)));
+
+    QList<QContact> presenceContacts;
+    presenceContacts.append(cm->contact(retrievalId(contacts.at(0))));
+    for (QContactPresence p : presenceContacts.first().details<QContactPresence>()) {
+        p.setPresenceState(QContactPresence::PresenceBusy);
+        QVERIFY(presenceContacts.first().saveDetail(&p));
+    }
+    presenceContacts.append(doomed);
+    QList<QContactDetail::DetailType> presenceMask;
+    presenceMask << QContactPresence::Type;
+    QVERIFY(!cm->saveContacts(&presenceContacts, presenceMask));
+    for (const QContactPresence &p : cm->contact(retrievalId(contacts.at(0))).details<QContactPresence>()) {
+        QVERIFY(p.presenceState() != QContactPresence::PresenceBusy);
+    }
+    QCOMPARE(cm->contact(retrievalId(contacts.at(0))).detail<QContactGlobalPresence>().presenceState(), QContactPresence::PresenceAvailable);
+
+    QTest::qWait(500);
+    QCOMPARE(presenceChangedSpy.count(), 0);
+
+    QVERIFY(cm->removeContacts(QList<QContactId>() << contacts.at(0).id() << contacts.at(1).id()));
+}
+
+void tst_QContactManager::notificationCoalescing()
+{
+    // Accumulate notifications for longer than the test will take
+    QMap<QString, QString> params;
+    params.insert("autoTest", "true");
+    params.insert("notificationInterval", "60000");
+    QScopedPointer<QContactManager> cm(QContactManager::fromUri(QContactManager::buildUri(QLatin1String(SQLITE_MANAGER), params)));
+
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(*cm.data());
+    QCOMPARE(cme->notificationInterval(), 60000);
+
+    QTest::qWait(500); // wait for signal coalescing.
+    QSignalSpy addedSpy(cm.data(), contactsAddedSignal);
+    QSignalSpy changedSpy(cm.data(), contactsChangedSignal);
+
+    // Each asynchronous request is committed separately
+    QList<QContactId> savedIds;
+    for (int i = 0; i < 3; ++i) {
+        QContactSaveRequest saveRequest;
+        saveRequest.setContact(createContact(QString::fromLatin1("Coalesced%1").arg(i), "Notification", "5550100"));
+        saveRequest.setManager(cm.data());
+        saveRequest.start();
+        QVERIFY(saveRequest.waitForFinished());
+        QCOMPARE(saveRequest.error(), QContactManager::NoError);
+
+        // Modify the first contact after it has been added
+        QContact saved(saveRequest.contacts().first());
+        savedIds.append(saved.id());
+        if (i == 0) {
+            QContactNickname nickname;
+            nickname.setNickname(QString::fromLatin1("Coalesced"));
+            saved.saveDetail(&nickname);
+            saveRequest.setContact(saved);
+            saveRequest.start();
+            QVERIFY(saveRequest.waitForFinished());
+            QCOMPARE(saveRequest.error(), QContactManager::NoError);
+        }
+    }
+
+    // Nothing is reported until the notifications are flushed
+    QTest::qWait(500);
+    QCOMPARE(addedSpy.count(), 0);
+    QCOMPARE(changedSpy.count(), 0);
+
+    cme->flushChangeNotifications();
+    QTRY_VERIFY(addedSpy.count() > 0);
+
+    QList<QContactId> addedIds;
+    for (const QList<QVariant> &arguments : addedSpy) {
+        addedIds.append(arguments.at(0).value<QList<QContactId> >());
+    }
+    QCOMPARE(addedIds.count(), savedIds.count());
+    for (const QContactId &id : savedIds) {
+        QVERIFY(addedIds.contains(id));
+    }
+
+    // The change to a contact added within the same interval is not reported separately
+    QTest::qWait(500);
+    for (const QList<QVariant> &arguments : changedSpy) {
+        QVERIFY(!arguments.at(0).value<QList<QContactId> >().contains(savedIds.first()));
+    }
+
+    // A flush follows the requests started before it
+    addedSpy.clear();
+    QContactSaveRequest queuedRequest;
+    queuedRequest.setContact(createContact("CoalescedQueued", "Notification", "5550100"));
+    queuedRequest.setManager(cm.data());
+
+    QVERIFY(setRequestExecutionSuspended(cme, true));
+    QVERIFY(queuedRequest.start());
+    cme->flushChangeNotifications();
+    QVERIFY(setRequestExecutionSuspended(cme, false));
+
+    QVERIFY(queuedRequest.waitForFinished());
+    QCOMPARE(queuedRequest.error(), QContactManager::NoError);
+    savedIds.append(queuedRequest.contacts().first().id());
+    QTRY_VERIFY(addedSpy.count() > 0);
+    QVERIFY(addedSpy.last().at(0).value<QList<QContactId> >().contains(savedIds.last()));
+
+    // Notifications held for asynchronous requests are emitted before those of a synchronous write
+    QContactSaveRequest orderedRequest;
+    orderedRequest.setContact(createContact("CoalescedOrdered", "Notification", "5550100"));
+    orderedRequest.setManager(cm.data());
+    QVERIFY(orderedRequest.start());
+    QVERIFY(orderedRequest.waitForFinished());
+    QCOMPARE(orderedRequest.error(), QContactManager::NoError);
+    const QContactId orderedId(orderedRequest.contacts().first().id());
+
+    QStringList events;
+    QMetaObject::Connection addedConnection = QObject::connect(cm.data(), &QContactManager::contactsAdded,
+            [&events, orderedId](const QList<QContactId> &ids) { if (ids.contains(orderedId)) events.append(QStringLiteral("added")); });
+    QMetaObject::Connection removedConnection = QObject::connect(cm.data(), &QContactManager::contactsRemoved,
+            [&events, orderedId](const QList<QContactId> &ids) { if (ids.contains(orderedId)) events.append(QStringLiteral("removed")); });
+
+    QVERIFY(cm->removeContact(orderedId));
+    QTRY_COMPARE(events, QStringList() << QStringLiteral("added") << QStringLiteral("removed"));
+    QObject::disconnect(addedConnection);
+    QObject::disconnect(removedConnection);
+
+    QVERIFY(cm->removeContacts(savedIds));
+}
+
+void tst_QContactManager::changedDetailTypes()
+{
+    QFETCH(QString, uri);
+    QScopedPointer<QContactManager> cm(QContactManager::fromUri(uri));
+
+    QContact c = createContact("Changed", "DetailTypes", "5550111");
+    QVERIFY(cm->saveContact(&c));
+
+    QTest::qWait(500); // wait for signal coalescing.
+    qRegisterMetaType<QList<QContactDetail::DetailType> >("QList<QContactDetail::DetailType>");
+    QSignalSpy changedSpy(cm.data(), contactsChangedSignal);
+
+    // Collect the types reported for the changes to our contact
+    auto reportedTypes = [&changedSpy, &c]() {
+        QSet<QContactDetail::DetailType> types;
+        bool reported = false;
+        for (const QList<QVariant> &arguments : changedSpy) {
+            if (arguments.at(0).value<QList<QContactId> >().contains(c.id())) {
+                reported = true;
+                for (QContactDetail::DetailType type : arguments.at(1).value<QList<QContactDetail::DetailType> >()) {
+                    types.insert(type);
+                }
+            }
+        }
+        return reported ? types : QSet<QContactDetail::DetailType>() << QContactDetail::TypeUndefined;
+    };
+
+    QContactRingtone ringtone;
+    ringtone.setAudioRingtoneUrl(QUrl(QStringLiteral("file:///ringtones/changed.ogg")));
+    QVERIFY(c.saveDetail(&ringtone));
+    QVERIFY(cm->saveContact(&c));
+
+    QTRY_VERIFY(!reportedTypes().contains(QContactDetail::TypeUndefined));
+    QSet<QContactDetail::DetailType> types(reportedTypes());
+    QVERIFY(types.contains(QContactRingtone::Type));
+    QVERIFY(!types.contains(QContactName::Type));
+    QVERIFY(!types.contains(QContactPhoneNumber::Type));
+
+    QTest::qWait(500);
+    changedSpy.clear();
+
+    c = cm->contact(c.id());
+    QContactName name = c.detail<QContactName>();
+    name.setFirstName("Renamed");
+    QVERIFY(c.saveDetail(&name));
+    QVERIFY(cm->saveContact(&c));
+
+    QTRY_VERIFY(!reportedTypes().contains(QContactDetail::TypeUndefined));
+    types = reportedTypes();
+    QVERIFY(types.contains(QContactName::Type));
+    QVERIFY(!types.contains(QContactRingtone::Type));
+
+    // Each change is reported to this engine once, although it is sent in two signals
+    QTest::qWait(500);
+    int reportCount = 0;
+    for (const QList<QVariant> &arguments : changedSpy) {
+        if (arguments.at(0).value<QList<QContactId> >().contains(c.id()))
+            ++reportCount;
+    }
+    QCOMPARE(reportCount, 1);
+
+    // Receivers in other processes connected with the original signature still receive the ids,
+    // and those connected to contactsDetailsChanged receive the types as well
+    ChangeSignalListener listener(QStringLiteral("tst_qcontactmanager_changedDetailTypes"));
+    QVERIFY(listener.isConnected());
+
+    c = cm->contact(c.id());
+    QContactRingtone relayed = c.detail<QContactRingtone>();
+    relayed.setAudioRingtoneUrl(QUrl(QStringLiteral("file:///ringtones/relayed.ogg")));
+    QVERIFY(c.saveDetail(&relayed));
+    QVERIFY(cm->saveContact(&c));
+
+    const quint32 dbId(ContactId::databaseId(c.id()));
+    QTRY_VERIFY(!listener.changedIds.isEmpty() && listener.changedIds.last().contains(dbId));
+    QTRY_VERIFY(!listener.detailsChanged.isEmpty() && listener.detailsChanged.last().first.contains(dbId));
+    QVERIFY(listener.detailsChanged.last().second.contains(static_cast<quint32>(QContactRingtone::Type)));
+    QVERIFY(!listener.detailsChanged.last().second.contains(static_cast<quint32>(QContactName::Type)));
+
+    QVERIFY(cm->removeContact(c.id()));
+}
+
+void tst_QContactManager::changeJournal()
+{
+    typedef QtContactsSqliteExtensions::ContactManagerEngine::ChangeJournalEntry ChangeJournalEntry;
+
+    QMap<QString, QString> params;
+    params.insert("autoTest", "true");
+    params.insert("changeJournalLimit", "16");
+    QScopedPointer<QContactManager> cm(QContactManager::fromUri(QContactManager::buildUri(QLatin1String(SQLITE_MANAGER), params)));
+
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(*cm.data());
+    QCOMPARE(cme->changeJournalLimit(), 16);
+
+    QList<ChangeJournalEntry> entries;
+    QContactManager::Error error = QContactManager::NoError;
+    bool refetch = false;
+    quint64 cursor = 0;
+    QVERIFY(cme->fetchChangeJournal(0, &entries, &cursor, &refetch, &error));
+    QCOMPARE(error, QContactManager::NoError);
+
+    // Return the ids reported by entries of the given kind
+    auto journaled = [&entries](ChangeJournalEntry::Kind kind) {
+        QSet<QContactId> ids;
+        for (const ChangeJournalEntry &entry : entries) {
+            if (entry.kind == kind) {
+                ids.unite(entry.contactIds.toSet());
+            }
+        }
+        return ids;
+    };
+
+    QContact c = createContact("Change", "Journal", "5550112");
+    QVERIFY(cm->saveContact(&c));
+
+    quint64 latest = 0;
+    QVERIFY(cme->fetchChangeJournal(cursor, &entries, &latest, &refetch, &error));
+    QVERIFY(!refetch);
+    QVERIFY(latest > cursor);
+    QCOMPARE(entries.last().sequence, latest);
+    QVERIFY(journaled(ChangeJournalEntry::ContactsAdded).contains(c.id()));
+    cursor = latest;
+
+    // A cursor at the latest sequence yields no entries
+    QVERIFY(cme->fetchChangeJournal(cursor, &entries, &latest, &refetch, &error));
+    QVERIFY(!refetch);
+    QVERIFY(entries.isEmpty());
+    QCOMPARE(latest, cursor);
+
+    QContactName name = c.detail<QContactName>();
+    name.setFirstName("Changed");
+    QVERIFY(c.saveDetail(&name));
+    QVERIFY(cm->saveContact(&c));
+
+    QVERIFY(cme->fetchChangeJournal(cursor, &entries, &latest, &refetch, &error));
+    QVERIFY(journaled(ChangeJournalEntry::ContactsChanged).contains(c.id()));
+    for (const ChangeJournalEntry &entry : entries) {
+        QVERIFY(!entry.folded);
+        if (entry.kind == ChangeJournalEntry::ContactsChanged && entry.contactIds.contains(c.id())) {
+            QVERIFY(entry.detailTypes.contains(QContactName::Type));
+            QVERIFY(!entry.detailTypes.contains(QContactPhoneNumber::Type));
+        }
+    }
+
+    // Save the contact until the journal is compacted, returning true once fetching from the
+    // cursor yields folded entries
+    int saves = 0;
+    auto saveUntilFolded = [&](quint64 since) {
+        for (int i = 0; i < 20; ++i) {
+            name.setFirstName(QString::fromLatin1("Changed%1").arg(saves++));
+            if (!c.saveDetail(&name) || !cm->saveContact(&c)
+                    || !cme->fetchChangeJournal(since, &entries, &latest, &refetch, &error) || refetch) {
+                return false;
+            }
+            if (!entries.isEmpty() && entries.first().folded) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // Exceeding the limit folds the oldest entries; a cursor within the folded range receives
+    // all folded entries
+    const quint64 foldedCursor = cursor;
+    QVERIFY(saveUntilFolded(foldedCursor + 1));
+    QVERIFY(entries.count() <= 16);
+    QCOMPARE(entries.last().sequence, latest);
+    QVERIFY(journaled(ChangeJournalEntry::ContactsChanged).contains(c.id()));
+    cursor = latest;
+
+    // The folded entries are replaced by the next compaction, after which cursors preceding
+    // them must refetch
+    for (int i = 0; i < 40 && !refetch; ++i) {
+        name.setFirstName(QString::fromLatin1("Changed%1").arg(saves++));
+        QVERIFY(c.saveDetail(&name));
+        QVERIFY(cm->saveContact(&c));
+        QVERIFY(cme->fetchChangeJournal(foldedCursor, &entries, &latest, &refetch, &error));
+    }
+    QVERIFY(refetch);
+    QVERIFY(entries.isEmpty());
+
+    // The client resumes from the latest sequence after refetching
+    quint64 resumed = 0;
+    QVERIFY(cme->fetchChangeJournal(latest, &entries, &resumed, &refetch, &error));
+    QVERIFY(!refetch);
+    QVERIFY(entries.isEmpty());
+    QCOMPARE(resumed, latest);
+    cursor = latest;
+
+    QVERIFY(cm->removeContact(c.id()));
+
+    QVERIFY(cme->fetchChangeJournal(cursor, &entries, &latest, &refetch, &error));
+    QVERIFY(journaled(ChangeJournalEntry::ContactsRemoved).contains(c.id()));
+    const quint64 removedCursor = cursor;
+
+    // A contact undeleted after its removal is reported as added, not removed, once folded
+    QContact undeleted;
+    QContactUndelete undelete;
+    undeleted.saveDetail(&undelete, QContact::IgnoreAccessConstraints);
+    undeleted.setId(c.id());
+    QVERIFY(cm->saveContact(&undeleted));
+
+    c = cm->contact(c.id());
+    QVERIFY(c.id() != QContactId());
+    name = c.detail<QContactName>();
+    QVERIFY(saveUntilFolded(removedCursor));
+    QVERIFY(journaled(ChangeJournalEntry::ContactsAdded).contains(c.id()));
+    QVERIFY(!journaled(ChangeJournalEntry::ContactsRemoved).contains(c.id()));
+
+    // A cursor beyond the latest sequence reports the latest sequence, as the database was recreated
+    QVERIFY(cme->fetchChangeJournal(latest + 100, &entries, &cursor, &refetch, &error));
+    QVERIFY(refetch);
+    QVERIFY(entries.isEmpty());
+    QCOMPARE(cursor, latest);
+
+    QVERIFY(cm->removeContact(c.id()));
+}
+
+void tst_QContactManager::preparedWrites()
+{
+    QMap<QString, QString> params;
+    params.insert("autoTest", "true");
+    QScopedPointer<QContactManager> cm(QContactManager::fromUri(QContactManager::buildUri(QLatin1String(SQLITE_MANAGER), params)));
+    params.insert("prepareWrites", "false");
+    QScopedPointer<QContactManager> unpreparedCm(QContactManager::fromUri(QContactManager::buildUri(QLatin1String(SQLITE_MANAGER), params)));
+
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(*cm.data());
+    QtContactsSqliteExtensions::ContactManagerEngine *unpreparedCme = QtContactsSqliteExtensions::contactManagerEngine(*unpreparedCm.data());
+    QVERIFY(cme->prepareWrites());
+    QVERIFY(!unpreparedCme->prepareWrites());
+
+    auto lockHolds = [](QtContactsSqliteExtensions::ContactManagerEngine *engine) {
+        int total = 0;
+        for (int count : engine->writeLockHoldTimes()) {
+            total += count;
+        }
+        return total;
+    };
+
+    cme->resetWriteLockStatistics();
+    QCOMPARE(lockHolds(cme), 0);
+    QCOMPARE(cme->writeLockHoldTimes().count(), static_cast<int>(QtContactsSqliteExtensions::ContactManagerEngine::LockHistogramBuckets));
+
+    QContact c = createContact("Prepared", "Writes", "5550113");
+    QVERIFY(cm->saveContact(&c));
+    QVERIFY(lockHolds(cme) > 0);
+    QVERIFY(cm->contact(c.id()).detail<QContactDisplayLabel>().label().contains(QStringLiteral("Prepared")));
+
+    // Updates written by either engine are compared against the stored contact
+    QContactName name = c.detail<QContactName>();
+    name.setFirstName("Unprepared");
+    QVERIFY(c.saveDetail(&name));
+    QVERIFY(unpreparedCm->saveContact(&c));
+
+    c = cm->contact(c.id());
+    QVERIFY(c.detail<QContactDisplayLabel>().label().contains(QStringLiteral("Unprepared")));
+    QCOMPARE(c.details<QContactPhoneNumber>().count(), 1);
+
+    // The stored contact was changed by the other connection since this engine last read it
+    name = c.detail<QContactName>();
+    name.setFirstName("Reprepared");
+    QVERIFY(c.saveDetail(&name));
+    QContactPhoneNumber phone;
+    phone.setNumber("5550114");
+    QVERIFY(c.saveDetail(&phone));
+    QVERIFY(cm->saveContact(&c));
+
+    c = unpreparedCm->contact(c.id());
+    QVERIFY(c.detail<QContactDisplayLabel>().label().contains(QStringLiteral("Reprepared")));
+    QCOMPARE(c.details<QContactPhoneNumber>().count(), 2);
+
+    // Detail constraints are enforced by prepared writes
+    QContact invalid = createContact("Invalid", "Prepared", "5550115");
+    QContactName secondName;
+    secondName.setFirstName("Second");
+    invalid.saveDetail(&secondName);
+    QVERIFY(!cm->saveContact(&invalid));
+    QCOMPARE(cm->error(), QContactManager::LimitReachedError);
+
+    QVERIFY(cm->removeContact(c.id()));
+}
+
+void tst_QContactManager::writeLockStatistics()
+{
+    typedef QtContactsSqliteExtensions::ContactManagerEngine Engine;
+
+    QMap<QString, QString> params;
+    params.insert("autoTest", "true");
+    params.insert("lockWarningThreshold", "250");
+    QScopedPointer<QContactManager> cm(QContactManager::fromUri(QContactManager::buildUri(QLatin1String(SQLITE_MANAGER), params)));
+
+    Engine *cme = QtContactsSqliteExtensions::contactManagerEngine(*cm.data());
+    QCOMPARE(cme->lockWarningThreshold(), 250);
+
+    cme->resetWriteLockStatistics();
+    for (int site = 0; site < Engine::WriteLockSiteCount; ++site) {
+        const Engine::WriteLockStatistics statistics = cme->writeLockStatistics(static_cast<Engine::WriteLockSite>(site));
+        QCOMPARE(statistics.acquisitions, 0);
+        QCOMPARE(statistics.totalHoldTime, Q_INT64_C(0));
+        QCOMPARE(statistics.waitTimes.count(), static_cast<int>(Engine::LockHistogramBuckets));
+        QCOMPARE(statistics.holdTimes.count(), static_cast<int>(Engine::LockHistogramBuckets));
+    }
+
+    // Return the number of samples in a histogram
+    auto samples = [](const QList<int> &histogram) {
+        int total = 0;
+        for (int count : histogram) {
+            total += count;
+        }
+        return total;
+    };
+
+    QContact c = createContact("Lock", "Statistics", "5550116");
+    QVERIFY(cm->saveContact(&c));
+
+    Engine::WriteLockStatistics saves = cme->writeLockStatistics(Engine::SaveLockSite);
+    QVERIFY(saves.acquisitions > 0);
+    QCOMPARE(samples(saves.waitTimes), saves.acquisitions);
+    QCOMPARE(samples(saves.holdTimes), saves.acquisitions);
+    QVERIFY(saves.totalHoldTime >= saves.maximumHoldTime);
+    QVERIFY(saves.totalWaitTime >= saves.maximumWaitTime);
+    QCOMPARE(cme->writeLockStatistics(Engine::RemoveLockSite).acquisitions, 0);
+
+    QVERIFY(cme->storeOOB(QStringLiteral("tst_qcontactmanager"), QStringLiteral("lockStatistics"), QVariant(1)));
+    QCOMPARE(cme->writeLockStatistics(Engine::OOBLockSite).acquisitions, 1);
+
+    QContactManager::Error error = QContactManager::NoError;
+    QVERIFY(cme->clearChangeFlags(QList<QContactId>() << c.id(), &error));
+    QCOMPARE(cme->writeLockStatistics(Engine::ClearChangeFlagsLockSite).acquisitions, 1);
+
+    QVERIFY(cm->removeContact(c.id()));
+    QVERIFY(cme->writeLockStatistics(Engine::RemoveLockSite).acquisitions > 0);
+    QCOMPARE(cme->writeLockStatistics(Engine::SaveLockSite).acquisitions, saves.acquisitions);
+
+    // The combined hold time histogram covers every site
+    int acquisitions = 0;
+    for (int site = 0; site < Engine::WriteLockSiteCount; ++site) {
+        acquisitions += cme->writeLockStatistics(static_cast<Engine::WriteLockSite>(site)).acquisitions;
+    }
+    QCOMPARE(samples(cme->writeLockHoldTimes()), acquisitions);
+
+    QVERIFY(cme->removeOOB(QStringLiteral("tst_qcontactmanager")));
+}
+
 void tst_QContactManager::nonprivileged()
 {
     const QString managerName(QString::fromLatin1(SQLITE_MANAGER));
@@ -36,6 +36,7 @@
 #include "../../util.h"
 #include "testsyncadaptor.h"
 #include "qtcontacts-extensions.h"
+#include "contactdelta.h"
 
 #include "qcontactcollectionchangesfetchrequest.h"
 #include "qcontactcollectionchangesfetchrequest_impl.h"
@@ -46,6 +47,57 @@
 #include "qcontactclearchangeflagsrequest.h"
 #include "qcontactclearchangeflagsrequest_impl.h"
 
+namespace {
+
+class ContactChangesAccumulator : public QtContactsSqliteExtensions::ContactManagerEngine::ContactChangesReceiver
+{
+public:
+    ContactChangesAccumulator(int maximumBatches = -1) : batches(0), maximumBatches(maximumBatches) {}
+
+    bool contactChangesAvailable(const QList<QContact> &addedContacts,
+                                 const QList<QContact> &modifiedContacts,
+                                 const QList<QContact> &deletedContacts,
+                                 const QList<QContact> &unmodifiedContacts) override
+    {
+        ++batches;
+        batchSizes.append(addedContacts.size() + modifiedContacts.size() + deletedContacts.size() + unmodifiedContacts.size());
+        added.append(addedContacts);
+        modified.append(modifiedContacts);
+        deleted.append(deletedContacts);
+        unmodified.append(unmodifiedContacts);
+        return maximumBatches < 0 || batches < maximumBatches;
+    }
+
+    int batches;
+    int maximumBatches;
+    QList<int> batchSizes;
+    QList<QContact> added;
+    QList<QContact> modified;
+    QList<QContact> deleted;
+    QList<QContact> unmodified;
+};
+
+void setRemoteChangeFlag(QContact *contact, QContactStatusFlags::Flag flag)
+{
+    QContactStatusFlags flags = contact->detail<QContactStatusFlags>();
+    flags.setFlag(QContactStatusFlags::IsAdded, false);
+    flags.setFlag(QContactStatusFlags::IsModified, false);
+    flags.setFlag(QContactStatusFlags::IsDeleted, false);
+    flags.setFlag(flag, true);
+    contact->saveDetail(&flags, QContact::IgnoreAccessConstraints);
+}
+
+QSet<QContactId> contactIdSet(const QList<QContact> &contacts)
+{
+    QSet<QContactId> ids;
+    for (const QContact &contact : contacts) {
+        ids.insert(contact.id());
+    }
+    return ids;
+}
+
+}
+
 class tst_synctransactions : public QObject
 {
     Q_OBJECT
@@ -72,11 +124,20 @@ private slots:
     void multipleCollections();
 
     void syncRequests();
+    void pagedContactChanges();
+    void storeChangesConflicts_data();
+    void storeChangesConflicts();
+    void storeChangesLargeVolume_data();
+    void storeChangesLargeVolume();
 
     void twcsa_nodelta();
     void twcsa_delta();
     void twcsa_oneway();
 
+    void contentHash();
+    void skipUnchangedWrites();
+    void checkpointScheduler();
+
 private:
     void waitForSignalPropagation();
 
@@ -1388,6 +1449,542 @@ bool haveExpectedContent(const QContact &c, const QString &phone, TestSyncAdapto
         && c.detail<QContactEmailAddress>().emailAddress() == email;
 }
 
+void tst_synctransactions::pagedContactChanges()
+{
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(*m_cm);
+    QContactManager::Error err = QContactManager::NoError;
+
+    // populate a remote addressbook, whose contacts are initially unmodified.
+    const int remoteCount = 25;
+    QContactCollection remoteAddressbook;
+    remoteAddressbook.setMetaData(QContactCollection::KeyName, QStringLiteral("test"));
+    remoteAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_APPLICATIONNAME, "tst_synctransactions");
+    remoteAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_ACCOUNTID, 5);
+    remoteAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_REMOTEPATH, "/addressbooks/test");
+    QList<QContact> remoteContacts;
+    for (int i = 0; i < remoteCount; ++i) {
+        QContact contact;
+        QContactGuid guid;
+        guid.setGuid(QStringLiteral("paged-%1").arg(i));
+        contact.saveDetail(&guid);
+        QContactName name;
+        name.setFirstName(QStringLiteral("Paged"));
+        name.setLastName(QString::number(i));
+        contact.saveDetail(&name);
+        QContactPhoneNumber phone;
+        phone.setNumber(QStringLiteral("5550%1").arg(i));
+        contact.saveDetail(&phone);
+        remoteContacts.append(contact);
+    }
+    {
+        QHash<QContactCollection*, QList<QContact> *> additions;
+        QHash<QContactCollection*, QList<QContact> *> modifications;
+        additions.insert(&remoteAddressbook, &remoteContacts);
+        QVERIFY(cme->storeChanges(
+                &additions,
+                &modifications,
+                QList<QContactCollectionId>(),
+                QtContactsSqliteExtensions::ContactManagerEngine::PreserveLocalChanges,
+                true, &err));
+        QCOMPARE(err, QContactManager::NoError);
+    }
+    QVERIFY(!remoteAddressbook.id().isNull());
+
+    // modify three contacts, remove two and add two locally.
+    QSet<QContactId> modifiedIds;
+    for (int i = 0; i < 3; ++i) {
+        QContact contact = m_cm->contact(remoteContacts.at(i).id());
+        QContactName name = contact.detail<QContactName>();
+        name.setMiddleName(QStringLiteral("Modified"));
+        contact.saveDetail(&name);
+        QVERIFY(m_cm->saveContact(&contact));
+        modifiedIds.insert(contact.id());
+    }
+    QSet<QContactId> deletedIds;
+    for (int i = 3; i < 5; ++i) {
+        QVERIFY(m_cm->removeContact(remoteContacts.at(i).id()));
+        deletedIds.insert(remoteContacts.at(i).id());
+    }
+    QSet<QContactId> addedIds;
+    for (int i = 0; i < 2; ++i) {
+        QContact contact;
+        contact.setCollectionId(remoteAddressbook.id());
+        QContactName name;
+        name.setFirstName(QStringLiteral("Local"));
+        name.setLastName(QString::number(i));
+        contact.saveDetail(&name);
+        QVERIFY(m_cm->saveContact(&contact));
+        addedIds.insert(contact.id());
+    }
+
+    // the unpaged fetch is the reference for the paged fetch.
+    QList<QContact> addedContacts;
+    QList<QContact> modifiedContacts;
+    QList<QContact> deletedContacts;
+    QList<QContact> unmodifiedContacts;
+    QVERIFY(cme->fetchContactChanges(
+                remoteAddressbook.id(),
+                &addedContacts,
+                &modifiedContacts,
+                &deletedContacts,
+                &unmodifiedContacts,
+                &err));
+    QCOMPARE(err, QContactManager::NoError);
+    QCOMPARE(contactIdSet(addedContacts), addedIds);
+    QCOMPARE(contactIdSet(modifiedContacts), modifiedIds);
+    QCOMPARE(contactIdSet(deletedContacts), deletedIds);
+    QCOMPARE(unmodifiedContacts.size(), remoteCount - 5);
+
+    // the paged fetch delivers the same changes, in batches of at most batchSize.
+    const int batchSize = 7;
+    {
+        ContactChangesAccumulator receiver;
+        QVERIFY(cme->fetchContactChanges(
+                    remoteAddressbook.id(),
+                    batchSize,
+                    QtContactsSqliteExtensions::ContactManagerEngine::UnmodifiedContactMetadata,
+                    &receiver,
+                    &err));
+        QCOMPARE(err, QContactManager::NoError);
+        QCOMPARE(receiver.batches, (remoteCount + 2 + batchSize - 1) / batchSize);
+        for (int size : receiver.batchSizes) {
+            QVERIFY(size <= batchSize);
+        }
+        QCOMPARE(contactIdSet(receiver.added), addedIds);
+        QCOMPARE(contactIdSet(receiver.modified), modifiedIds);
+        QCOMPARE(contactIdSet(receiver.deleted), deletedIds);
+        QCOMPARE(contactIdSet(receiver.unmodified), contactIdSet(unmodifiedContacts));
+
+        // changed contacts are complete, unmodified contacts carry only their sync metadata.
+        for (const QContact &contact : receiver.modified) {
+            QCOMPARE(contact.detail<QContactName>().middleName(), QStringLiteral("Modified"));
+            QVERIFY(!contact.detail<QContactPhoneNumber>().number().isEmpty());
+        }
+        for (const QContact &contact : receiver.unmodified) {
+            QVERIFY(contact.detail<QContactGuid>().guid().startsWith(QStringLiteral("paged-")));
+            QVERIFY(contact.details<QContactName>().isEmpty());
+            QVERIFY(contact.details<QContactPhoneNumber>().isEmpty());
+        }
+    }
+
+    // unmodified contacts can be omitted, or returned in full.
+    {
+        ContactChangesAccumulator receiver;
+        QVERIFY(cme->fetchContactChanges(
+                    remoteAddressbook.id(),
+                    batchSize,
+                    QtContactsSqliteExtensions::ContactManagerEngine::ExcludeUnmodifiedContacts,
+                    &receiver,
+                    &err));
+        QCOMPARE(err, QContactManager::NoError);
+        QCOMPARE(receiver.batches, 1);
+        QCOMPARE(receiver.added.size() + receiver.modified.size() + receiver.deleted.size(), 7);
+        QCOMPARE(receiver.unmodified.size(), 0);
+    }
+    {
+        ContactChangesAccumulator receiver;
+        QVERIFY(cme->fetchContactChanges(
+                    remoteAddressbook.id(),
+                    batchSize,
+                    QtContactsSqliteExtensions::ContactManagerEngine::IncludeUnmodifiedContacts,
+                    &receiver,
+                    &err));
+        QCOMPARE(err, QContactManager::NoError);
+        QCOMPARE(receiver.unmodified.size(), remoteCount - 5);
+        for (const QContact &contact : receiver.unmodified) {
+            QVERIFY(!contact.detail<QContactPhoneNumber>().number().isEmpty());
+        }
+    }
+
+    // the receiver can end the fetch early.
+    {
+        ContactChangesAccumulator receiver(1);
+        QVERIFY(cme->fetchContactChanges(
+                    remoteAddressbook.id(),
+                    batchSize,
+                    QtContactsSqliteExtensions::ContactManagerEngine::UnmodifiedContactMetadata,
+                    &receiver,
+                    &err));
+        QCOMPARE(err, QContactManager::NoError);
+        QCOMPARE(receiver.batches, 1);
+        QCOMPARE(receiver.batchSizes.first(), batchSize);
+    }
+
+    // the request can also reduce unmodified contacts to their metadata.
+    {
+        QContactChangesFetchRequest *cfr = new QContactChangesFetchRequest;
+        cfr->setManager(m_cm);
+        cfr->setCollectionId(remoteAddressbook.id());
+        cfr->setUnmodifiedContactsMetadataOnly(true);
+        cfr->start();
+        QVERIFY(cfr->waitForFinished(5000));
+        QCOMPARE(cfr->error(), QContactManager::NoError);
+        QCOMPARE(contactIdSet(cfr->addedContacts()), addedIds);
+        QCOMPARE(contactIdSet(cfr->modifiedContacts()), modifiedIds);
+        QCOMPARE(contactIdSet(cfr->removedContacts()), deletedIds);
+        QCOMPARE(cfr->unmodifiedContacts().size(), remoteCount - 5);
+        QVERIFY(cfr->unmodifiedContacts().first().details<QContactPhoneNumber>().isEmpty());
+        delete cfr;
+    }
+
+    // clean up.
+    QVERIFY(m_cm->removeCollection(remoteAddressbook.id()));
+    QVERIFY(cme->clearChangeFlags(remoteAddressbook.id(), &err));
+}
+
+void tst_synctransactions::storeChangesConflicts_data()
+{
+    QTest::addColumn<int>("policy");
+
+    QTest::newRow("preserve local") << static_cast<int>(QtContactsSqliteExtensions::ContactManagerEngine::PreserveLocalChanges);
+    QTest::newRow("preserve remote") << static_cast<int>(QtContactsSqliteExtensions::ContactManagerEngine::PreserveRemoteChanges);
+}
+
+void tst_synctransactions::storeChangesConflicts()
+{
+    QFETCH(int, policy);
+    const QtContactsSqliteExtensions::ContactManagerEngine::ConflictResolutionPolicy conflictResolutionPolicy(
+            static_cast<QtContactsSqliteExtensions::ContactManagerEngine::ConflictResolutionPolicy>(policy));
+    const bool preserveLocal = (conflictResolutionPolicy == QtContactsSqliteExtensions::ContactManagerEngine::PreserveLocalChanges);
+
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(*m_cm);
+    QContactManager::Error err = QContactManager::NoError;
+
+    QContactCollection remoteAddressbook;
+    remoteAddressbook.setMetaData(QContactCollection::KeyName, QStringLiteral("test"));
+    remoteAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_APPLICATIONNAME, "tst_synctransactions");
+    remoteAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_ACCOUNTID, 5);
+    remoteAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_REMOTEPATH, "/addressbooks/test");
+
+    const QStringList names(QStringList() << QStringLiteral("Alice") << QStringLiteral("Bob")
+                                          << QStringLiteral("Charlie") << QStringLiteral("Dave"));
+    QList<QContact> remoteContacts;
+    for (int i = 0; i < names.size(); ++i) {
+        QContact contact;
+        QContactName name;
+        name.setFirstName(names.at(i));
+        name.setLastName(QStringLiteral("Conflict"));
+        contact.saveDetail(&name);
+        QContactPhoneNumber phone;
+        phone.setNumber(QStringLiteral("%1%1%1").arg(i + 1));
+        contact.saveDetail(&phone);
+        QContactEmailAddress email;
+        email.setEmailAddress(QStringLiteral("%1@conflict.tld").arg(names.at(i).toLower()));
+        contact.saveDetail(&email);
+        remoteContacts.append(contact);
+    }
+    {
+        QHash<QContactCollection*, QList<QContact> *> additions;
+        QHash<QContactCollection*, QList<QContact> *> modifications;
+        additions.insert(&remoteAddressbook, &remoteContacts);
+        QVERIFY(cme->storeChanges(
+                &additions,
+                &modifications,
+                QList<QContactCollectionId>(),
+                conflictResolutionPolicy, true, &err));
+        QCOMPARE(err, QContactManager::NoError);
+    }
+    QVERIFY(!remoteAddressbook.id().isNull());
+
+    // begin a sync cycle.  there are no local changes to upsync.
+    QList<QContact> addedContacts;
+    QList<QContact> modifiedContacts;
+    QList<QContact> deletedContacts;
+    QList<QContact> unmodifiedContacts;
+    QVERIFY(cme->fetchContactChanges(
+                remoteAddressbook.id(),
+                &addedContacts,
+                &modifiedContacts,
+                &deletedContacts,
+                &unmodifiedContacts,
+                &err));
+    QCOMPARE(err, QContactManager::NoError);
+    QCOMPARE(unmodifiedContacts.size(), names.size());
+    QContact syncAlice, syncBob, syncCharlie, syncDave;
+    for (const QContact &contact : unmodifiedContacts) {
+        const QString firstName(contact.detail<QContactName>().firstName());
+        if (firstName == names.at(0)) {
+            syncAlice = contact;
+        } else if (firstName == names.at(1)) {
+            syncBob = contact;
+        } else if (firstName == names.at(2)) {
+            syncCharlie = contact;
+        } else {
+            syncDave = contact;
+        }
+    }
+
+    // while the sync plugin downsyncs the remote changes, the device user:
+    // modifies Alice's phone number, deletes Bob, and adds a hobby for Charlie.
+    QContact localAlice = m_cm->contact(syncAlice.id());
+    QContactPhoneNumber aph = localAlice.detail<QContactPhoneNumber>();
+    aph.setNumber(QStringLiteral("999"));
+    QVERIFY(localAlice.saveDetail(&aph));
+    QVERIFY(m_cm->saveContact(&localAlice));
+    QVERIFY(m_cm->removeContact(syncBob.id()));
+    QContact localCharlie = m_cm->contact(syncCharlie.id());
+    QContactHobby chb;
+    chb.setHobby(QStringLiteral("Chess"));
+    QVERIFY(localCharlie.saveDetail(&chb));
+    QVERIFY(m_cm->saveContact(&localCharlie));
+
+    // the remote changes: Alice's phone number and email address were modified,
+    // Bob's phone number was modified, Charlie was deleted, and Dave's phone number was modified.
+    aph = syncAlice.detail<QContactPhoneNumber>();
+    aph.setNumber(QStringLiteral("888"));
+    QVERIFY(syncAlice.saveDetail(&aph));
+    QContactEmailAddress aem = syncAlice.detail<QContactEmailAddress>();
+    aem.setEmailAddress(QStringLiteral("alice@remote.tld"));
+    QVERIFY(syncAlice.saveDetail(&aem));
+    setRemoteChangeFlag(&syncAlice, QContactStatusFlags::IsModified);
+
+    QContactPhoneNumber bph = syncBob.detail<QContactPhoneNumber>();
+    bph.setNumber(QStringLiteral("555"));
+    QVERIFY(syncBob.saveDetail(&bph));
+    setRemoteChangeFlag(&syncBob, QContactStatusFlags::IsModified);
+
+    setRemoteChangeFlag(&syncCharlie, QContactStatusFlags::IsDeleted);
+
+    QContactPhoneNumber dph = syncDave.detail<QContactPhoneNumber>();
+    dph.setNumber(QStringLiteral("444"));
+    QVERIFY(syncDave.saveDetail(&dph));
+    setRemoteChangeFlag(&syncDave, QContactStatusFlags::IsModified);
+
+    {
+        QHash<QContactCollection*, QList<QContact> *> additions;
+        QHash<QContactCollection*, QList<QContact> *> modifications;
+        QList<QContact> modifiedCollectionContacts;
+        modifiedCollectionContacts << syncAlice << syncBob << syncCharlie << syncDave;
+        modifications.insert(&remoteAddressbook, &modifiedCollectionContacts);
+        QVERIFY(cme->storeChanges(
+                &additions,
+                &modifications,
+                QList<QContactCollectionId>(),
+                conflictResolutionPolicy, true, &err));
+        QCOMPARE(err, QContactManager::NoError);
+        QCOMPARE(modifiedCollectionContacts.size(), 4);
+    }
+
+    // the non-conflicting remote change is always applied.
+    QCOMPARE(m_cm->contact(syncDave.id()).detail<QContactPhoneNumber>().number(), QStringLiteral("444"));
+
+    // the remote change to a detail which was not changed locally is always applied.
+    QContact storedAlice = m_cm->contact(syncAlice.id());
+    QCOMPARE(storedAlice.detail<QContactEmailAddress>().emailAddress(), QStringLiteral("alice@remote.tld"));
+    QCOMPARE(storedAlice.details<QContactPhoneNumber>().size(), 1);
+
+    if (preserveLocal) {
+        QCOMPARE(storedAlice.detail<QContactPhoneNumber>().number(), QStringLiteral("999"));
+        QCOMPARE(m_cm->contact(syncBob.id()).id(), QContactId());
+        QCOMPARE(m_cm->contact(syncCharlie.id()).detail<QContactHobby>().hobby(), QStringLiteral("Chess"));
+    } else {
+        QCOMPARE(storedAlice.detail<QContactPhoneNumber>().number(), QStringLiteral("888"));
+        QCOMPARE(m_cm->contact(syncBob.id()).detail<QContactPhoneNumber>().number(), QStringLiteral("555"));
+        QCOMPARE(m_cm->contact(syncCharlie.id()).id(), QContactId());
+    }
+
+    // the preserved local changes are reported during the next sync cycle,
+    // and the overridden local changes are not.
+    addedContacts.clear();
+    modifiedContacts.clear();
+    deletedContacts.clear();
+    unmodifiedContacts.clear();
+    QVERIFY(cme->fetchContactChanges(
+                remoteAddressbook.id(),
+                &addedContacts,
+                &modifiedContacts,
+                &deletedContacts,
+                &unmodifiedContacts,
+                &err));
+    QCOMPARE(err, QContactManager::NoError);
+    QCOMPARE(addedContacts.size(), 0);
+    if (preserveLocal) {
+        QCOMPARE(contactIdSet(modifiedContacts), QSet<QContactId>() << syncAlice.id() << syncCharlie.id());
+        QCOMPARE(contactIdSet(deletedContacts), QSet<QContactId>() << syncBob.id());
+        QCOMPARE(contactIdSet(unmodifiedContacts), QSet<QContactId>() << syncDave.id());
+        for (const QContact &contact : modifiedContacts) {
+            if (contact.id() == syncAlice.id()) {
+                QVERIFY(contact.detail<QContactPhoneNumber>().value(QContactDetail__FieldChangeFlags).toInt() & QContactDetail__ChangeFlag_IsModified);
+            } else {
+                QVERIFY(contact.detail<QContactHobby>().value(QContactDetail__FieldChangeFlags).toInt() & QContactDetail__ChangeFlag_IsAdded);
+            }
+        }
+    } else {
+        QCOMPARE(modifiedContacts.size(), 0);
+        QCOMPARE(deletedContacts.size(), 0);
+        QCOMPARE(contactIdSet(unmodifiedContacts), QSet<QContactId>() << syncAlice.id() << syncBob.id() << syncDave.id());
+    }
+
+    // clean up.
+    QVERIFY(m_cm->removeCollection(remoteAddressbook.id()));
+    QVERIFY(cme->clearChangeFlags(remoteAddressbook.id(), &err));
+}
+
+void tst_synctransactions::storeChangesLargeVolume_data()
+{
+    QTest::addColumn<int>("policy");
+
+    QTest::newRow("preserve local") << static_cast<int>(QtContactsSqliteExtensions::ContactManagerEngine::PreserveLocalChanges);
+    QTest::newRow("preserve remote") << static_cast<int>(QtContactsSqliteExtensions::ContactManagerEngine::PreserveRemoteChanges);
+}
+
+void tst_synctransactions::storeChangesLargeVolume()
+{
+    QFETCH(int, policy);
+    const QtContactsSqliteExtensions::ContactManagerEngine::ConflictResolutionPolicy conflictResolutionPolicy(
+            static_cast<QtContactsSqliteExtensions::ContactManagerEngine::ConflictResolutionPolicy>(policy));
+    const bool preserveLocal = (conflictResolutionPolicy == QtContactsSqliteExtensions::ContactManagerEngine::PreserveLocalChanges);
+
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(*m_cm);
+    QContactManager::Error err = QContactManager::NoError;
+    QElapsedTimer timer;
+
+    // every contact is modified remotely, and every tenth contact is also modified locally.
+    const int remoteCount = 1000;
+    const int conflictInterval = 10;
+
+    QContactCollection remoteAddressbook;
+    remoteAddressbook.setMetaData(QContactCollection::KeyName, QStringLiteral("test"));
+    remoteAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_APPLICATIONNAME, "tst_synctransactions");
+    remoteAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_ACCOUNTID, 5);
+    remoteAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_REMOTEPATH, "/addressbooks/test");
+    QList<QContact> remoteContacts;
+    for (int i = 0; i < remoteCount; ++i) {
+        QContact contact;
+        QContactGuid guid;
+        guid.setGuid(QStringLiteral("volume-%1").arg(i));
+        contact.saveDetail(&guid);
+        QContactName name;
+        name.setFirstName(QStringLiteral("Volume"));
+        name.setLastName(QString::number(i));
+        contact.saveDetail(&name);
+        QContactPhoneNumber phone;
+        phone.setNumber(QStringLiteral("5551%1").arg(i));
+        contact.saveDetail(&phone);
+        QContactEmailAddress email;
+        email.setEmailAddress(QStringLiteral("volume%1@example.tld").arg(i));
+        contact.saveDetail(&email);
+        remoteContacts.append(contact);
+    }
+    {
+        QHash<QContactCollection*, QList<QContact> *> additions;
+        QHash<QContactCollection*, QList<QContact> *> modifications;
+        additions.insert(&remoteAddressbook, &remoteContacts);
+        timer.start();
+        QVERIFY(cme->storeChanges(
+                &additions,
+                &modifications,
+                QList<QContactCollectionId>(),
+                conflictResolutionPolicy, true, &err));
+        QCOMPARE(err, QContactManager::NoError);
+        qDebug() << "Stored" << remoteCount << "added contacts in" << timer.elapsed() << "ms";
+    }
+
+    QList<QContact> addedContacts;
+    QList<QContact> modifiedContacts;
+    QList<QContact> deletedContacts;
+    QList<QContact> unmodifiedContacts;
+    timer.start();
+    QVERIFY(cme->fetchContactChanges(
+                remoteAddressbook.id(),
+                &addedContacts,
+                &modifiedContacts,
+                &deletedContacts,
+                &unmodifiedContacts,
+                &err));
+    QCOMPARE(err, QContactManager::NoError);
+    QCOMPARE(unmodifiedContacts.size(), remoteCount);
+    qDebug() << "Fetched" << remoteCount << "unmodified contacts in" << timer.elapsed() << "ms";
+
+    // local modifications, made after the fetch.
+    QList<QContact> localContacts;
+    QSet<QContactId> conflictingIds;
+    for (int i = 0; i < unmodifiedContacts.size(); i += conflictInterval) {
+        QContact contact = m_cm->contact(unmodifiedContacts.at(i).id());
+        QContactPhoneNumber phone = contact.detail<QContactPhoneNumber>();
+        phone.setNumber(QStringLiteral("local"));
+        contact.saveDetail(&phone);
+        localContacts.append(contact);
+        conflictingIds.insert(contact.id());
+    }
+    QVERIFY(m_cm->saveContacts(&localContacts));
+
+    // remote modifications of every contact.
+    QList<QContact> modifiedCollectionContacts;
+    for (QContact contact : unmodifiedContacts) {
+        QContactPhoneNumber phone = contact.detail<QContactPhoneNumber>();
+        phone.setNumber(QStringLiteral("remote"));
+        contact.saveDetail(&phone);
+        QContactEmailAddress email = contact.detail<QContactEmailAddress>();
+        email.setEmailAddress(email.emailAddress() + QStringLiteral(".remote"));
+        contact.saveDetail(&email);
+        setRemoteChangeFlag(&contact, QContactStatusFlags::IsModified);
+        modifiedCollectionContacts.append(contact);
+    }
+    {
+        QHash<QContactCollection*, QList<QContact> *> additions;
+        QHash<QContactCollection*, QList<QContact> *> modifications;
+        modifications.insert(&remoteAddressbook, &modifiedCollectionContacts);
+        timer.start();
+        QVERIFY(cme->storeChanges(
+                &additions,
+                &modifications,
+                QList<QContactCollectionId>(),
+                conflictResolutionPolicy, true, &err));
+        QCOMPARE(err, QContactManager::NoError);
+        qDebug() << "Stored" << remoteCount << "modified contacts with" << conflictingIds.size()
+                 << "conflicts in" << timer.elapsed() << "ms";
+    }
+
+    // the conflicts are resolved according to the policy.
+    QContactCollectionFilter collectionFilter;
+    collectionFilter.setCollectionId(remoteAddressbook.id());
+    const QList<QContact> storedContacts = m_cm->contacts(collectionFilter);
+    QCOMPARE(storedContacts.size(), remoteCount);
+    int remotePhones = 0;
+    int localPhones = 0;
+    int remoteEmails = 0;
+    for (const QContact &contact : storedContacts) {
+        const QString number(contact.detail<QContactPhoneNumber>().number());
+        if (number == QStringLiteral("local")) {
+            QVERIFY(conflictingIds.contains(contact.id()));
+            ++localPhones;
+        } else if (number == QStringLiteral("remote")) {
+            ++remotePhones;
+        }
+        if (contact.detail<QContactEmailAddress>().emailAddress().endsWith(QStringLiteral(".remote"))) {
+            ++remoteEmails;
+        }
+    }
+    QCOMPARE(remoteEmails, remoteCount);
+    QCOMPARE(localPhones, preserveLocal ? conflictingIds.size() : 0);
+    QCOMPARE(remotePhones, remoteCount - localPhones);
+
+    // only the preserved local changes are reported during the next sync cycle.
+    addedContacts.clear();
+    modifiedContacts.clear();
+    deletedContacts.clear();
+    unmodifiedContacts.clear();
+    QVERIFY(cme->fetchContactChanges(
+                remoteAddressbook.id(),
+                &addedContacts,
+                &modifiedContacts,
+                &deletedContacts,
+                &unmodifiedContacts,
+                &err));
+    QCOMPARE(err, QContactManager::NoError);
+    QCOMPARE(addedContacts.size(), 0);
+    QCOMPARE(deletedContacts.size(), 0);
+    QCOMPARE(contactIdSet(modifiedContacts), preserveLocal ? conflictingIds : QSet<QContactId>());
+    QCOMPARE(unmodifiedContacts.size(), remoteCount - modifiedContacts.size());
+
+    // clean up.
+    timer.start();
+    QVERIFY(m_cm->removeCollection(remoteAddressbook.id()));
+    QVERIFY(cme->clearChangeFlags(remoteAddressbook.id(), &err));
+    qDebug() << "Removed collection of" << remoteCount << "contacts in" << timer.elapsed() << "ms";
+}
+
 void tst_synctransactions::twcsa_nodelta()
 {
     // construct a sync adaptor, and prefill its read-write collection with 3 contacts.
@@ -1661,6 +2258,255 @@ void tst_synctransactions::twcsa_oneway()
     // TODO: a sync plugin which only supports to-device sync.
 }
 
+void tst_synctransactions::contentHash()
+{
+    QContactName name;
+    name.setFirstName(QStringLiteral("First"));
+    name.setLastName(QStringLiteral("Last"));
+
+    QContactPhoneNumber phone;
+    phone.setNumber(QStringLiteral("1234567"));
+    phone.setSubTypes(QList<int>() << QContactPhoneNumber::SubTypeMobile);
+
+    QContactEmailAddress email;
+    email.setEmailAddress(QStringLiteral("first@example.com"));
+
+    // ignorable fields and empty values do not affect the detail hash
+    QContactPhoneNumber equivalentPhone(phone);
+    equivalentPhone.setValue(QContactPhoneNumber::FieldNormalizedNumber, QStringLiteral("1234567"));
+    equivalentPhone.setValue(QContactDetail__FieldDatabaseId, 42);
+    equivalentPhone.setValue(QContactDetail__FieldModifiable, true);
+    equivalentPhone.setValue(QContactDetail::FieldProvenance, QStringLiteral("2:3:42"));
+    equivalentPhone.setValue(QContactDetail::FieldDetailUri, QString());
+    QCOMPARE(QtContactsSqliteExtensions::detailContentHash(equivalentPhone),
+             QtContactsSqliteExtensions::detailContentHash(phone));
+
+    // but significant fields do
+    QContactPhoneNumber differentPhone(phone);
+    differentPhone.setNumber(QStringLiteral("1234568"));
+    QVERIFY(QtContactsSqliteExtensions::detailContentHash(differentPhone)
+            != QtContactsSqliteExtensions::detailContentHash(phone));
+    differentPhone = phone;
+    differentPhone.setSubTypes(QList<int>() << QContactPhoneNumber::SubTypeLandline);
+    QVERIFY(QtContactsSqliteExtensions::detailContentHash(differentPhone)
+            != QtContactsSqliteExtensions::detailContentHash(phone));
+
+    // the order of details within a contact does not affect the contact hash
+    QContact a;
+    a.saveDetail(&name);
+    a.saveDetail(&phone);
+    a.saveDetail(&email);
+
+    QContact b;
+    b.saveDetail(&email);
+    b.saveDetail(&equivalentPhone);
+    b.saveDetail(&name);
+
+    QCOMPARE(QtContactsSqliteExtensions::contactContentHash(a),
+             QtContactsSqliteExtensions::contactContentHash(b));
+    QCOMPARE(QtContactsSqliteExtensions::exactContactMatchExistsInList(
+                    a, QList<QContact>() << b,
+                    QtContactsSqliteExtensions::defaultIgnorableDetailTypes(),
+                    QtContactsSqliteExtensions::defaultIgnorableDetailFields(),
+                    QtContactsSqliteExtensions::defaultIgnorableCommonFields()), 0);
+
+    // a duplicated detail changes the contact hash
+    QContactEmailAddress duplicateEmail;
+    duplicateEmail.setEmailAddress(QStringLiteral("first@example.com"));
+    duplicateEmail.setValue(QContactDetail__FieldDatabaseId, 43);
+    b.saveDetail(&duplicateEmail);
+    QVERIFY(QtContactsSqliteExtensions::contactContentHash(a)
+            != QtContactsSqliteExtensions::contactContentHash(b));
+    QCOMPARE(QtContactsSqliteExtensions::exactContactMatchExistsInList(
+                    a, QList<QContact>() << b,
+                    QtContactsSqliteExtensions::defaultIgnorableDetailTypes(),
+                    QtContactsSqliteExtensions::defaultIgnorableDetailFields(),
+                    QtContactsSqliteExtensions::defaultIgnorableCommonFields()), -1);
+
+    // unless the detail type is ignored
+    QSet<QContactDetail::DetailType> ignorableTypes(QtContactsSqliteExtensions::defaultIgnorableDetailTypes());
+    ignorableTypes.insert(QContactDetail::TypeEmailAddress);
+    QCOMPARE(QtContactsSqliteExtensions::contactContentHash(a, ignorableTypes),
+             QtContactsSqliteExtensions::contactContentHash(b, ignorableTypes));
+
+    // values of differing types which compare as equal have equal hashes,
+    // and still match exactly.
+    QContactUrl url;
+    url.setValue(QContactUrl::FieldUrl, QUrl(QStringLiteral("http://www.example.com/first")));
+    QContactFavorite favorite;
+    favorite.setValue(QContactFavorite::FieldFavorite, true);
+    QContactBirthday birthday;
+    birthday.setValue(QContactBirthday::FieldBirthday, QDateTime(QDate(1980, 5, 4), QTime(12, 0), Qt::UTC));
+
+    QContactUrl stringUrl;
+    stringUrl.setValue(QContactUrl::FieldUrl, QStringLiteral("http://www.example.com/first"));
+    QContactFavorite intFavorite;
+    intFavorite.setValue(QContactFavorite::FieldFavorite, 1);
+    QContactBirthday stringBirthday;
+    stringBirthday.setValue(QContactBirthday::FieldBirthday, QStringLiteral("1980-05-04T12:00:00Z"));
+
+    QContact typed(a);
+    typed.saveDetail(&url);
+    typed.saveDetail(&favorite);
+    typed.saveDetail(&birthday);
+
+    QContact mixed(a);
+    mixed.saveDetail(&stringUrl);
+    mixed.saveDetail(&intFavorite);
+    mixed.saveDetail(&stringBirthday);
+
+    QCOMPARE(QtContactsSqliteExtensions::detailContentHash(stringUrl),
+             QtContactsSqliteExtensions::detailContentHash(url));
+    QCOMPARE(QtContactsSqliteExtensions::detailContentHash(intFavorite),
+             QtContactsSqliteExtensions::detailContentHash(favorite));
+    QCOMPARE(QtContactsSqliteExtensions::detailContentHash(stringBirthday),
+             QtContactsSqliteExtensions::detailContentHash(birthday));
+    QCOMPARE(QtContactsSqliteExtensions::contactContentHash(mixed),
+             QtContactsSqliteExtensions::contactContentHash(typed));
+
+    QCOMPARE(QtContactsSqliteExtensions::exactContactMatchExistsInList(
+                    typed, QList<QContact>() << b << mixed,
+                    QtContactsSqliteExtensions::defaultIgnorableDetailTypes(),
+                    QtContactsSqliteExtensions::defaultIgnorableDetailFields(),
+                    QtContactsSqliteExtensions::defaultIgnorableCommonFields()), 1);
+    QCOMPARE(QtContactsSqliteExtensions::exactContactMatchExistsInList(
+                    mixed, QList<QContact>() << typed,
+                    QtContactsSqliteExtensions::defaultIgnorableDetailTypes(),
+                    QtContactsSqliteExtensions::defaultIgnorableDetailFields(),
+                    QtContactsSqliteExtensions::defaultIgnorableCommonFields()), 0);
+
+    // the first of several matches is reported
+    QCOMPARE(QtContactsSqliteExtensions::exactContactMatchExistsInList(
+                    typed, QList<QContact>() << b << mixed << typed,
+                    QtContactsSqliteExtensions::defaultIgnorableDetailTypes(),
+                    QtContactsSqliteExtensions::defaultIgnorableDetailFields(),
+                    QtContactsSqliteExtensions::defaultIgnorableCommonFields()), 1);
+
+    // and a mixed-type value which differs does not match
+    stringUrl.setValue(QContactUrl::FieldUrl, QStringLiteral("http://www.example.com/second"));
+    mixed.saveDetail(&stringUrl);
+    QVERIFY(QtContactsSqliteExtensions::contactContentHash(mixed)
+            != QtContactsSqliteExtensions::contactContentHash(typed));
+    QCOMPARE(QtContactsSqliteExtensions::exactContactMatchExistsInList(
+                    typed, QList<QContact>() << mixed,
+                    QtContactsSqliteExtensions::defaultIgnorableDetailTypes(),
+                    QtContactsSqliteExtensions::defaultIgnorableDetailFields(),
+                    QtContactsSqliteExtensions::defaultIgnorableCommonFields()), -1);
+}
+
+void tst_synctransactions::skipUnchangedWrites()
+{
+    QMap<QString, QString> parameters;
+    parameters.insert(QString::fromLatin1("autoTest"), QString::fromLatin1("true"));
+    parameters.insert(QString::fromLatin1("mergePresenceChanges"), QString::fromLatin1("true"));
+    parameters.insert(QString::fromLatin1("skipUnchangedWrites"), QString::fromLatin1("true"));
+    QContactManager manager(QString::fromLatin1("org.nemomobile.contacts.sqlite"), parameters);
+
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(manager);
+    QVERIFY(cme->skipUnchangedWrites());
+    cme->resetElidedWriteCounts();
+
+    QContact contact;
+    QContactName name;
+    name.setFirstName(QStringLiteral("Unchanged"));
+    name.setLastName(QStringLiteral("Writes"));
+    contact.saveDetail(&name);
+    QContactPhoneNumber phone;
+    phone.setNumber(QStringLiteral("1234567"));
+    contact.saveDetail(&phone);
+    QVERIFY(manager.saveContact(&contact));
+    m_createdIds.insert(contact.id());
+    waitForSignalPropagation();
+
+    QSignalSpy changedSpy(&manager, contactsChangedSignal);
+
+    // re-saving the stored contact is elided, and the modification timestamp is retained
+    QContact stored = manager.contact(contact.id());
+    const QDateTime lastModified = stored.detail<QContactTimestamp>().lastModified();
+    QVERIFY(manager.saveContact(&stored));
+    waitForSignalPropagation();
+    QCOMPARE(cme->unchangedWriteCheckCount(), 1);
+    QCOMPARE(cme->elidedWriteCount(), 1);
+    QCOMPARE(changedSpy.count(), 0);
+    QCOMPARE(manager.contact(contact.id()).detail<QContactTimestamp>().lastModified(), lastModified);
+
+    // so is a save which differs only in ignorable fields
+    phone = stored.detail<QContactPhoneNumber>();
+    phone.setValue(QContactPhoneNumber::FieldNormalizedNumber, QStringLiteral("7654321"));
+    stored.saveDetail(&phone);
+    QVERIFY(manager.saveContact(&stored));
+    waitForSignalPropagation();
+    QCOMPARE(cme->unchangedWriteCheckCount(), 2);
+    QCOMPARE(cme->elidedWriteCount(), 2);
+    QCOMPARE(changedSpy.count(), 0);
+
+    // a significant change is written and reported
+    phone.setNumber(QStringLiteral("7654321"));
+    stored.saveDetail(&phone);
+    QVERIFY(manager.saveContact(&stored));
+    QTRY_COMPARE(changedSpy.count(), 1);
+    QCOMPARE(cme->unchangedWriteCheckCount(), 3);
+    QCOMPARE(cme->elidedWriteCount(), 2);
+    QCOMPARE(manager.contact(contact.id()).detail<QContactPhoneNumber>().number(), QStringLiteral("7654321"));
+    QVERIFY(manager.contact(contact.id()).detail<QContactTimestamp>().lastModified() >= lastModified);
+
+    // a save matching the stored details is not elided while a transient update supersedes them
+    stored = manager.contact(contact.id());
+    QContactPresence presence;
+    presence.setPresenceState(QContactPresence::PresenceAvailable);
+    stored.saveDetail(&presence);
+    QVERIFY(manager.saveContact(&stored));
+    waitForSignalPropagation();
+    QCOMPARE(cme->unchangedWriteCheckCount(), 4);
+    QCOMPARE(cme->elidedWriteCount(), 2);
+
+    stored = manager.contact(contact.id());
+    QContact transient(stored);
+    presence = transient.detail<QContactPresence>();
+    presence.setPresenceState(QContactPresence::PresenceBusy);
+    transient.saveDetail(&presence);
+    QList<QContact> transientContacts;
+    transientContacts.append(transient);
+    QVERIFY(manager.saveContacts(&transientContacts, QList<QContactDetail::DetailType>() << QContactPresence::Type));
+    waitForSignalPropagation();
+    QCOMPARE(manager.contact(contact.id()).detail<QContactPresence>().presenceState(), QContactPresence::PresenceBusy);
+
+    QVERIFY(manager.saveContact(&stored));
+    waitForSignalPropagation();
+    QCOMPARE(cme->unchangedWriteCheckCount(), 4);
+    QCOMPARE(cme->elidedWriteCount(), 2);
+    QCOMPARE(manager.contact(contact.id()).detail<QContactPresence>().presenceState(), QContactPresence::PresenceAvailable);
+}
+
+void tst_synctransactions::checkpointScheduler()
+{
+    QMap<QString, QString> parameters;
+    parameters.insert(QString::fromLatin1("autoTest"), QString::fromLatin1("true"));
+    parameters.insert(QString::fromLatin1("mergePresenceChanges"), QString::fromLatin1("true"));
+    parameters.insert(QString::fromLatin1("durability"), QString::fromLatin1("normal"));
+    parameters.insert(QString::fromLatin1("checkpointInterval"), QString::fromLatin1("100"));
+    QContactManager manager(QString::fromLatin1("org.nemomobile.contacts.sqlite"), parameters);
+
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(manager);
+    QCOMPARE(cme->durabilityProfile(), QtContactsSqliteExtensions::ContactManagerEngine::NormalDurability);
+    QCOMPARE(cme->checkpointInterval(), 100);
+
+    const int checkpoints = cme->checkpointCount();
+
+    // a commit is checkpointed once the engine has been idle for the checkpoint interval
+    QContact contact;
+    QContactName name;
+    name.setFirstName(QStringLiteral("Checkpoint"));
+    name.setLastName(QStringLiteral("Scheduler"));
+    contact.saveDetail(&name);
+    QVERIFY(manager.saveContact(&contact));
+    m_createdIds.insert(contact.id());
+
+    QTRY_VERIFY(cme->checkpointCount() > checkpoints);
+    QVERIFY(cme->walSize() > 0);
+    QVERIFY(cme->maximumCheckpointDuration() >= cme->lastCheckpointDuration());
+}
+
 
 
 /*
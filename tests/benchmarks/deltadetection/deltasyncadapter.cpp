@@ -144,9 +144,11 @@ void DeltaSyncAdapter::addRemoteContact(const QString &accountId, const QString
 
     QContact newContact;
     newContact.saveDetail(&ncn);
-    if (phone == QStringLiteral("insert250phones")) {
+    if (phone.startsWith(QStringLiteral("insert")) && phone.endsWith(QStringLiteral("phones"))) {
+        // eg: insert250phones, insert500phones, insert1000phones
+        const int phoneCount = phone.mid(6, phone.length() - 12).toInt();
         QStringList seen;
-        for (int i = 0; i < 250; ++i) {
+        for (int i = 0; i < phoneCount; ++i) {
             QContactPhoneNumber p = generatePhoneNumber(&seen);
             newContact.saveDetail(&p);
         }
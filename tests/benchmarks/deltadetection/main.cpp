@@ -47,6 +47,8 @@ int main(int argc, char *argv[])
     dsa.addRemoteContact(accountId, "First", "Contact", "1111111", DeltaSyncAdapter::ImplicitlyModifiable);
     dsa.addRemoteContact(accountId, "Second", "Contact", "insert250phones", DeltaSyncAdapter::ExplicitlyModifiable);
     dsa.addRemoteContact(accountId, "Third", "Contact", "3333333", DeltaSyncAdapter::ExplicitlyNonModifiable);
+    dsa.addRemoteContact(accountId, "Fourth", "Contact", "insert500phones", DeltaSyncAdapter::ExplicitlyModifiable);
+    dsa.addRemoteContact(accountId, "Fifth", "Contact", "insert1000phones", DeltaSyncAdapter::ExplicitlyModifiable);
 
     qWarning() << "================================ performing first sync";
     QElapsedTimer et;
@@ -57,6 +59,8 @@ int main(int argc, char *argv[])
     dsa.changeRemoteContactPhone(accountId, QStringLiteral("First"), QStringLiteral("Contact"), QStringLiteral("1111112"));
     //dsa.changeRemoteContactPhone(accountId, QStringLiteral("Second"), QStringLiteral("Contact"), QStringLiteral("modify10phones"));
     dsa.changeRemoteContactPhone(accountId, QStringLiteral("Second"), QStringLiteral("Contact"), QStringLiteral("modifyallphones"));
+    dsa.changeRemoteContactPhone(accountId, QStringLiteral("Fourth"), QStringLiteral("Contact"), QStringLiteral("modifyallphones"));
+    dsa.changeRemoteContactPhone(accountId, QStringLiteral("Fifth"), QStringLiteral("Contact"), QStringLiteral("modifyallphones"));
 
     qWarning() << "================================ performing second sync";
     et.restart();
@@ -66,6 +70,8 @@ int main(int argc, char *argv[])
     dsa.removeRemoteContact(accountId, "First", "Contact");
     dsa.removeRemoteContact(accountId, "Second", "Contact");
     dsa.removeRemoteContact(accountId, "Third", "Contact");
+    dsa.removeRemoteContact(accountId, "Fourth", "Contact");
+    dsa.removeRemoteContact(accountId, "Fifth", "Contact");
 
     qWarning() << "================================ performing third sync";
     et.restart();
@@ -30,6 +30,7 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE."
  */
 
+#include <stdio.h>
 #include <time.h>
 
 #include <QContactManager>
@@ -47,6 +48,8 @@
 #include <QContactAddress>
 #include <QContactPresence>
 #include <QContactNickname>
+#include <QContactNote>
+#include <QContactRingtone>
 #include <QContactOnlineAccount>
 #include <QContactGuid>
 #include <QContactDetailFilter>
@@ -55,7 +58,9 @@
 #include <QCoreApplication>
 #include <QElapsedTimer>
 #include <QDateTime>
+#include <QProcess>
 #include <QUuid>
+#include <QSet>
 #include <QtDebug>
 
 #include "qtcontacts-extensions.h"
@@ -776,6 +781,331 @@ static qint64 smallBatchPresenceUpdate(QContactManager &manager, bool quickMode)
     return elapsedTimeTotal;
 }
 
+static qint64 presenceUpdateApi(QContactManager &manager, bool quickMode)
+{
+    qint64 elapsedTimeTotal = 0;
+    QElapsedTimer syncTimer;
+
+    // This benchmark compares masked presence updates via saveContacts() with
+    // the dedicated batch presence update API, for contacts with linked accounts.
+    qDebug() << "--------";
+    qDebug() << "Performing presence update API tests:";
+
+    // create test collections for this benchmark.
+    QContactCollection testAddressbook;
+    testAddressbook.setMetaData(QContactCollection::KeyName, QStringLiteral("presenceUpdateApi"));
+    testAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_ACCOUNTID, 5);
+    testAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_REMOTEPATH, "/addressbooks/presenceUpdateApi");
+    manager.saveCollection(&testAddressbook);
+
+    // prefill the database with contacts having an online account and linked presence
+    const int prefillCount = quickMode ? 250 : 1000;
+    QList<QContact> prefillData;
+    prefillData.reserve(prefillCount);
+    for (int i = 0; i < prefillCount; ++i) {
+        QContact curr = generateContact(testAddressbook.id(), (i % 2) == 1);
+        const QString accountUri(QString::fromLatin1("presence%1@im.example.com").arg(i));
+
+        QContactOnlineAccount oa;
+        oa.setAccountUri(accountUri);
+        oa.setDetailUri(accountUri);
+        curr.saveDetail(&oa);
+
+        QContactPresence cp;
+        cp.setDetailUri(accountUri + QStringLiteral(":presence"));
+        cp.setLinkedDetailUris(accountUri);
+        cp.setPresenceState(QContactPresence::PresenceOffline);
+        curr.saveDetail(&cp);
+
+        prefillData.append(curr);
+    }
+    qDebug() << "    prefilling database with" << prefillData.size() << "contacts... this will take a while...";
+    manager.saveContacts(&prefillData);
+    QList<QContactId> deleteIds;
+    for (const QContact &c : prefillData) {
+        deleteIds.append(c.id());
+    }
+
+    // update the presence of every contact via a masked save.
+    QList<QContact> contactsToUpdate;
+    for (int j = 0; j < prefillData.size(); ++j) {
+        QContact curr = prefillData.at(j);
+        QContactPresence cp = curr.detail<QContactPresence>();
+        cp.setCustomMessage(QString::number(j));
+        cp.setTimestamp(QDateTime::currentDateTime());
+        cp.setPresenceState(static_cast<QContactPresence::PresenceState>((qrand() % 4) + 1));
+        curr.saveDetail(&cp);
+        contactsToUpdate.append(curr);
+    }
+
+    QList<QContactDetail::DetailType> typeMask;
+    typeMask << QContactDetail::TypePresence;
+    syncTimer.start();
+    manager.saveContacts(&contactsToUpdate, typeMask);
+    qint64 presenceElapsed = syncTimer.elapsed();
+    int totalAggregatesInDatabase = manager.contactIds().count();
+    qDebug() << "    update ( batch of" << contactsToUpdate.size() << ") masked presence only (with" << totalAggregatesInDatabase << "existing in database, partial overlap):" << presenceElapsed
+             << "milliseconds (" << ((1.0 * presenceElapsed) / (1.0 * contactsToUpdate.size())) << " msec per updated contact )";
+    elapsedTimeTotal += presenceElapsed;
+
+    // now update the presence of every contact via the presence update API.
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(manager);
+    QList<QtContactsSqliteExtensions::ContactManagerEngine::PresenceUpdate> updates;
+    for (int j = 0; j < prefillData.size(); ++j) {
+        QtContactsSqliteExtensions::ContactManagerEngine::PresenceUpdate update;
+        update.contactId = prefillData.at(j).id();
+        update.accountUri = prefillData.at(j).detail<QContactOnlineAccount>().accountUri();
+        update.presenceState = static_cast<QContactPresence::PresenceState>((qrand() % 4) + 1);
+        update.customMessage = QString::number(j) + "5";
+        updates.append(update);
+    }
+
+    QMap<int, QContactManager::Error> errorMap;
+    QContactManager::Error updateError = QContactManager::NoError;
+    syncTimer.start();
+    cme->updatePresence(updates, &errorMap, &updateError);
+    presenceElapsed = syncTimer.elapsed();
+    qDebug() << "    update ( batch of" << updates.size() << ") presence via updatePresence (with" << totalAggregatesInDatabase << "existing in database, partial overlap):" << presenceElapsed
+             << "milliseconds (" << ((1.0 * presenceElapsed) / (1.0 * updates.size())) << " msec per updated contact )";
+    if (updateError != QContactManager::NoError) {
+        qWarning() << "    presence update API reported error:" << updateError;
+    }
+    elapsedTimeTotal += presenceElapsed;
+
+    QContactManager::Error purgeError = QContactManager::NoError;
+    syncTimer.start();
+    manager.removeContacts(deleteIds);
+    cme->clearChangeFlags(deleteIds, &purgeError);
+    qint64 deleteTime = syncTimer.elapsed();
+    qDebug() << "    deleted" << deleteIds.size() << "contacts in" << deleteTime << "milliseconds";
+    elapsedTimeTotal += deleteTime;
+
+    syncTimer.start();
+    manager.removeCollection(testAddressbook.id());
+    cme->clearChangeFlags(testAddressbook.id(), &purgeError);
+    qint64 colDeleteTime = syncTimer.elapsed();
+    qDebug() << "    deleted 1 addressbooks in" << colDeleteTime << "milliseconds";
+    // note: we omit this collection deletion time from the benchmark.
+
+    return elapsedTimeTotal;
+}
+
+static qint64 changeNotificationRefetches(QContactManager &manager, bool quickMode)
+{
+    qint64 elapsedTimeTotal = 0;
+    QElapsedTimer syncTimer;
+
+    // This benchmark models a list which displays only a few detail types of each contact.
+    // A list which ignores the changed detail types must refetch every contact reported as
+    // changed; one which inspects them can skip changes to other types.
+    qDebug() << "--------";
+    qDebug() << "Performing change notification refetch tests:";
+
+    QContactCollection testAddressbook;
+    testAddressbook.setMetaData(QContactCollection::KeyName, QStringLiteral("changeNotificationRefetches"));
+    testAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_ACCOUNTID, 5);
+    testAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_REMOTEPATH, "/addressbooks/changeNotificationRefetches");
+    manager.saveCollection(&testAddressbook);
+
+    const int prefillCount = quickMode ? 300 : 1500;
+    QList<QContact> prefillData;
+    prefillData.reserve(prefillCount);
+    for (int i = 0; i < prefillCount; ++i) {
+        prefillData.append(generateContact(testAddressbook.id(), false));
+    }
+    qDebug() << "    prefilling database with" << prefillData.size() << "contacts... this will take a while...";
+    manager.saveContacts(&prefillData);
+    QList<QContactId> deleteIds;
+    for (const QContact &c : prefillData) {
+        deleteIds.append(c.id());
+    }
+
+    const QList<QContactDetail::DetailType> listTypes(QList<QContactDetail::DetailType>()
+            << QContactDetail::TypeDisplayLabel << QContactDetail::TypeName
+            << QContactDetail::TypeAvatar << QContactDetail::TypePhoneNumber
+            << QContactDetail::TypeFavorite);
+
+    // Receive the change notifications, including those for the aggregates
+    QSet<QContactId> unawareRefetchIds;
+    QSet<QContactId> awareRefetchIds;
+    int signalCount = 0;
+    QElapsedTimer lastSignalTimer;
+    lastSignalTimer.start();
+    QMetaObject::Connection connection = QObject::connect(&manager, &QContactManager::contactsChanged,
+            [&](const QList<QContactId> &contactIds, const QList<QContactDetail::DetailType> &typesChanged) {
+        ++signalCount;
+        lastSignalTimer.restart();
+
+        bool relevant = typesChanged.isEmpty();
+        for (QContactDetail::DetailType type : typesChanged) {
+            relevant |= listTypes.contains(type);
+        }
+        for (const QContactId &id : contactIds) {
+            unawareRefetchIds.insert(id);
+            if (relevant) {
+                awareRefetchIds.insert(id);
+            }
+        }
+    });
+
+    // Update a ringtone, a note, or a name of each contact, in small batches
+    const int batchSize = 50;
+    syncTimer.start();
+    for (int round = 0; round < 3; ++round) {
+        for (int start = round * batchSize; start < prefillData.size(); start += 3 * batchSize) {
+            QList<QContact> batch;
+            for (int j = start; j < qMin(start + batchSize, prefillData.size()); ++j) {
+                QContact curr = prefillData.at(j);
+                if (round == 0) {
+                    QContactRingtone ringtone = curr.detail<QContactRingtone>();
+                    ringtone.setAudioRingtoneUrl(QUrl(QStringLiteral("file:///ringtones/%1.ogg").arg(j)));
+                    curr.saveDetail(&ringtone);
+                } else if (round == 1) {
+                    QContactNote note = curr.detail<QContactNote>();
+                    note.setNote(QString::fromLatin1("Note %1").arg(j));
+                    curr.saveDetail(&note);
+                } else {
+                    QContactName name = curr.detail<QContactName>();
+                    name.setMiddleName(QString::fromLatin1("M%1").arg(j));
+                    curr.saveDetail(&name);
+                }
+                batch.append(curr);
+            }
+            manager.saveContacts(&batch);
+        }
+    }
+    qint64 updateElapsed = syncTimer.elapsed();
+    qDebug() << "    updated" << prefillData.size() << "contacts in batches of" << batchSize << "in" << updateElapsed << "milliseconds";
+    elapsedTimeTotal += updateElapsed;
+
+    // Wait until the notifications have been delivered
+    syncTimer.start();
+    while (syncTimer.elapsed() < 30000 && (signalCount == 0 || lastSignalTimer.elapsed() < 1000)) {
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 100);
+    }
+    QObject::disconnect(connection);
+
+    QContactFetchHint listHint;
+    listHint.setDetailTypesHint(listTypes);
+    listHint.setOptimizationHints(QContactFetchHint::NoRelationships);
+
+    syncTimer.start();
+    const QList<QContact> unawareRefetched = manager.contacts(unawareRefetchIds.toList(), listHint);
+    const qint64 unawareElapsed = syncTimer.elapsed();
+
+    syncTimer.start();
+    const QList<QContact> awareRefetched = manager.contacts(awareRefetchIds.toList(), listHint);
+    const qint64 awareElapsed = syncTimer.elapsed();
+
+    qDebug() << "    received" << signalCount << "change notifications reporting" << unawareRefetchIds.size() << "changed contacts";
+    qDebug() << "    type-unaware list refetched" << unawareRefetched.size() << "contacts in" << unawareElapsed << "milliseconds";
+    qDebug() << "    type-aware list refetched" << awareRefetched.size() << "contacts in" << awareElapsed << "milliseconds, avoiding"
+             << (unawareRefetchIds.size() - awareRefetchIds.size()) << "refetches";
+    elapsedTimeTotal += awareElapsed;
+
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(manager);
+    QContactManager::Error purgeError = QContactManager::NoError;
+    syncTimer.start();
+    manager.removeContacts(deleteIds);
+    cme->clearChangeFlags(deleteIds, &purgeError);
+    qint64 deleteTime = syncTimer.elapsed();
+    qDebug() << "    deleted" << deleteIds.size() << "contacts in" << deleteTime << "milliseconds";
+    elapsedTimeTotal += deleteTime;
+
+    manager.removeCollection(testAddressbook.id());
+    cme->clearChangeFlags(testAddressbook.id(), &purgeError);
+    // note: we omit this collection deletion time from the benchmark.
+
+    return elapsedTimeTotal;
+}
+
+static void printLockHistogram(const QList<int> &counts)
+{
+    QStringList buckets;
+    for (int i = 0; i < counts.size(); ++i) {
+        if (counts.at(i) > 0) {
+            buckets.append(i < counts.size() - 1
+                    ? QString::fromLatin1("<%1us: %2").arg(250 << i).arg(counts.at(i))
+                    : QString::fromLatin1(">=%1us: %2").arg(250 << (i - 1)).arg(counts.at(i)));
+        }
+    }
+    qDebug() << "        " << qPrintable(buckets.join(QStringLiteral(", ")));
+}
+
+static qint64 writeLockHoldTimes(QContactManager &manager, bool quickMode)
+{
+    qint64 elapsedTimeTotal = 0;
+    QElapsedTimer syncTimer;
+
+    // Compare the time for which the write lock is held when the work of saving is prepared
+    // before the lock is taken, with that when all of the work is performed under the lock.
+    qDebug() << "--------";
+    qDebug() << "Performing write lock hold time tests:";
+
+    QMap<QString, QString> parameters(manager.managerParameters());
+    parameters.insert(QString::fromLatin1("prepareWrites"), QString::fromLatin1("false"));
+    QContactManager unpreparedManager(manager.managerName(), parameters);
+
+    QContactCollection testAddressbook;
+    testAddressbook.setMetaData(QContactCollection::KeyName, QStringLiteral("writeLockHoldTimes"));
+    testAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_ACCOUNTID, 5);
+    testAddressbook.setExtendedMetaData(COLLECTION_EXTENDEDMETADATA_KEY_REMOTEPATH, "/addressbooks/writeLockHoldTimes");
+    manager.saveCollection(&testAddressbook);
+
+    const int prefillCount = quickMode ? 250 : 1000;
+    QList<QContact> prefillData;
+    prefillData.reserve(prefillCount);
+    for (int i = 0; i < prefillCount; ++i) {
+        prefillData.append(generateContact(testAddressbook.id(), true));
+    }
+    qDebug() << "    prefilling database with" << prefillData.size() << "contacts... this will take a while...";
+    manager.saveContacts(&prefillData);
+    QList<QContactId> deleteIds;
+    for (const QContact &c : prefillData) {
+        deleteIds.append(c.id());
+    }
+
+    const int batchSize = 25;
+    QContactManager *managers[] = { &unpreparedManager, &manager };
+    for (int m = 0; m < 2; ++m) {
+        QContactManager &writer(*managers[m]);
+        QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(writer);
+        cme->resetWriteLockStatistics();
+
+        syncTimer.start();
+        for (int start = 0; start < prefillData.size(); start += batchSize) {
+            QList<QContact> batch(writer.contacts(deleteIds.mid(start, batchSize)));
+            for (int j = 0; j < batch.size(); ++j) {
+                QContactName name = batch[j].detail<QContactName>();
+                name.setMiddleName(QString::fromLatin1("M%1-%2").arg(m).arg(start + j));
+                batch[j].saveDetail(&name);
+            }
+            writer.saveContacts(&batch);
+        }
+        const qint64 updateElapsed = syncTimer.elapsed();
+        qDebug() << "    updated" << prefillData.size() << "contacts in batches of" << batchSize << "in" << updateElapsed << "milliseconds,"
+                 << (cme->prepareWrites() ? "preparing writes before locking" : "performing all work under the lock");
+        qDebug() << "        write lock hold times:";
+        printLockHistogram(cme->writeLockHoldTimes());
+        elapsedTimeTotal += updateElapsed;
+    }
+
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(manager);
+    QContactManager::Error purgeError = QContactManager::NoError;
+    syncTimer.start();
+    manager.removeContacts(deleteIds);
+    cme->clearChangeFlags(deleteIds, &purgeError);
+    qint64 deleteTime = syncTimer.elapsed();
+    qDebug() << "    deleted" << deleteIds.size() << "contacts in" << deleteTime << "milliseconds";
+    elapsedTimeTotal += deleteTime;
+
+    manager.removeCollection(testAddressbook.id());
+    cme->clearChangeFlags(testAddressbook.id(), &purgeError);
+    // note: we omit this collection deletion time from the benchmark.
+
+    return elapsedTimeTotal;
+}
+
 static qint64 aggregationOperations(QContactManager &manager, bool quickMode)
 {
     qint64 elapsedTimeTotal = 0;
@@ -1774,6 +2104,324 @@ qint64 performQueryPlanOperations(QContactManager &manager)
     return totalTime;
 }
 
+static qint64 oobScopes(QContactManager &manager, bool quickMode)
+{
+    qint64 elapsedTimeTotal = 0;
+    QElapsedTimer syncTimer;
+
+    // Sync plugins keep per-account state in OOB scopes; measure scope-wide
+    // operations when many scopes share the table.
+    qDebug() << "--------";
+    qDebug() << "Performing OOB scope tests:";
+
+    QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(manager);
+
+    const int scopeCount = 20;
+    const int keyCount = quickMode ? 20000 : 100000;
+    const int keysPerScope = keyCount / scopeCount;
+    const int batchSize = 1000;
+
+    QStringList scopes;
+    for (int i = 0; i < scopeCount; ++i) {
+        scopes.append(QString::fromLatin1("fetchtimes-account-%1").arg(i));
+    }
+
+    syncTimer.start();
+    for (const QString &scope : scopes) {
+        for (int start = 0; start < keysPerScope; start += batchSize) {
+            QMap<QString, QVariant> values;
+            for (int i = start; i < qMin(start + batchSize, keysPerScope); ++i) {
+                values.insert(QString::fromLatin1("contact-%1-etag").arg(i), QString::fromLatin1("\"%1\"").arg(qrand()));
+            }
+            cme->storeOOB(scope, values);
+        }
+    }
+    qint64 elapsed = syncTimer.elapsed();
+    qDebug() << "    stored" << keyCount << "OOB values in" << scopeCount << "scopes in" << elapsed << "milliseconds";
+    elapsedTimeTotal += elapsed;
+
+    int fetched = 0;
+    syncTimer.start();
+    for (const QString &scope : scopes) {
+        QMap<QString, QVariant> values;
+        cme->fetchOOB(scope, &values);
+        fetched += values.count();
+    }
+    elapsed = syncTimer.elapsed();
+    qDebug() << "    fetched" << fetched << "OOB values by scope in" << elapsed << "milliseconds";
+    elapsedTimeTotal += elapsed;
+
+    fetched = 0;
+    syncTimer.start();
+    for (const QString &scope : scopes) {
+        QStringList keys;
+        cme->fetchOOBKeys(scope, &keys);
+        fetched += keys.count();
+    }
+    elapsed = syncTimer.elapsed();
+    qDebug() << "    fetched" << fetched << "OOB keys by scope in" << elapsed << "milliseconds";
+    elapsedTimeTotal += elapsed;
+
+    QStringList someKeys;
+    for (int i = 0; i < keysPerScope; i += keysPerScope / 50) {
+        someKeys.append(QString::fromLatin1("contact-%1-etag").arg(i));
+    }
+    fetched = 0;
+    syncTimer.start();
+    for (const QString &scope : scopes) {
+        QMap<QString, QVariant> values;
+        cme->fetchOOB(scope, someKeys, &values);
+        fetched += values.count();
+    }
+    elapsed = syncTimer.elapsed();
+    qDebug() << "    fetched" << fetched << "OOB values by key in" << elapsed << "milliseconds";
+    elapsedTimeTotal += elapsed;
+
+    syncTimer.start();
+    for (const QString &scope : scopes) {
+        cme->removeOOB(scope);
+    }
+    elapsed = syncTimer.elapsed();
+    qDebug() << "    removed" << scopeCount << "OOB scopes in" << elapsed << "milliseconds";
+    elapsedTimeTotal += elapsed;
+
+    return elapsedTimeTotal;
+}
+
+static qint64 oobCompressionPayload(QtContactsSqliteExtensions::ContactManagerEngine *cme, const QString &codec,
+                                    const QString &label, const QMap<QString, QVariant> &values)
+{
+    qint64 elapsedTimeTotal = 0;
+    QElapsedTimer syncTimer;
+
+    const QString scope(QString::fromLatin1("fetchtimes-compression-") + label);
+
+    qint64 rawSize = 0;
+    for (const QVariant &value : values) {
+        rawSize += value.type() == QVariant::String ? value.toString().toUtf8().size() : value.toByteArray().size();
+    }
+
+    syncTimer.start();
+    cme->storeOOB(scope, values);
+    const qint64 storeElapsed = syncTimer.elapsed();
+    elapsedTimeTotal += storeElapsed;
+
+    QMap<QString, QVariant> fetched;
+    syncTimer.start();
+    cme->fetchOOB(scope, &fetched);
+    const qint64 fetchElapsed = syncTimer.elapsed();
+    elapsedTimeTotal += fetchElapsed;
+
+    qint64 storedSize = 0;
+    cme->fetchOOBStorageSize(scope, &storedSize);
+
+    qDebug() << "    " << codec << label << ":" << values.count() << "values," << (rawSize / 1024) << "KiB:"
+             << "stored in" << storeElapsed << "ms (" << (storeElapsed ? (rawSize / 1024) * 1000 / storeElapsed : 0) << "KiB/s ),"
+             << "fetched in" << fetchElapsed << "ms (" << (fetchElapsed ? (rawSize / 1024) * 1000 / fetchElapsed : 0) << "KiB/s ),"
+             << (storedSize / 1024) << "KiB stored (" << (rawSize ? storedSize * 100 / rawSize : 0) << "% )";
+    if (fetched != values) {
+        qWarning() << "    fetched values differ from stored values!";
+    }
+
+    return elapsedTimeTotal;
+}
+
+static qint64 oobCompression(QContactManager &manager, bool quickMode)
+{
+    qint64 elapsedTimeTotal = 0;
+
+    // Measure the throughput and stored size of representative sync payloads with each of the
+    // OOB compression codecs; codecs not built into the engine are skipped.
+    qDebug() << "--------";
+    qDebug() << "Performing OOB compression tests:";
+
+    // Serialized vCards, as stored by CardDAV sync
+    const QStringList firstNames(generateFirstNamesList());
+    const QStringList lastNames(generateLastNamesList());
+    const QStringList phoneNumbers(generatePhoneNumbersList());
+    const QStringList emailProviders(generateEmailProvidersList());
+    QMap<QString, QVariant> vcards;
+    const int vcardCount = quickMode ? 500 : 2000;
+    for (int i = 0; i < vcardCount; ++i) {
+        const QString &firstName(firstNames.at(qrand() % firstNames.size()));
+        const QString &lastName(lastNames.at(qrand() % lastNames.size()));
+        vcards.insert(QString::fromLatin1("contact-%1").arg(i), QString::fromLatin1(
+                "BEGIN:VCARD\r\nVERSION:3.0\r\nUID:%1\r\nFN:%2 %3\r\nN:%3;%2;;;\r\n"
+                "TEL;TYPE=CELL:%4\r\nEMAIL;TYPE=INTERNET:%2.%3%5\r\n"
+                "ADR;TYPE=HOME:;;%6 Main Street;Springfield;;%7;Country\r\n"
+                "REV:2020-01-01T00:00:00Z\r\nEND:VCARD\r\n")
+                .arg(QUuid::createUuid().toString().mid(1, 36)).arg(firstName).arg(lastName)
+                .arg(phoneNumbers.at(qrand() % phoneNumbers.size()))
+                .arg(emailProviders.at(qrand() % emailProviders.size()))
+                .arg(qrand() % 1000).arg(qrand() % 100000));
+    }
+
+    // Per-contact sync metadata: small, similar values
+    QMap<QString, QVariant> metadata;
+    const int metadataCount = quickMode ? 2000 : 10000;
+    for (int i = 0; i < metadataCount; ++i) {
+        metadata.insert(QString::fromLatin1("contact-%1").arg(i), QString::fromLatin1(
+                "{\"etag\":\"\\\"%1\\\"\",\"href\":\"/carddav/user/contacts/%2.vcf\",\"modified\":\"2020-01-%3T12:%4:00Z\"}")
+                .arg(qrand(), 8, 16, QLatin1Char('0')).arg(QUuid::createUuid().toString().mid(1, 36))
+                .arg(i % 28 + 1, 2, 10, QLatin1Char('0')).arg(i % 60, 2, 10, QLatin1Char('0')));
+    }
+
+    // A large serialized sync state
+    QMap<QString, QVariant> state;
+    QByteArray stateData;
+    const int stateSize = (quickMode ? 1 : 4) * 1024 * 1024;
+    while (stateData.size() < stateSize) {
+        stateData.append(QUuid::createUuid().toRfc4122()).append("\x01\x00\x00\x00remote-id\x00").append(QByteArray::number(qrand()));
+    }
+    state.insert(QString::fromLatin1("state"), stateData);
+
+    const QStringList codecs(QStringList() << QString::fromLatin1("zlib") << QString::fromLatin1("lz4") << QString::fromLatin1("zstd"));
+    for (const QString &codec : codecs) {
+        QMap<QString, QString> parameters(manager.managerParameters());
+        parameters.insert(QString::fromLatin1("oobCompression"), codec);
+        QContactManager codecManager(manager.managerName(), parameters);
+        QtContactsSqliteExtensions::ContactManagerEngine *cme = QtContactsSqliteExtensions::contactManagerEngine(codecManager);
+        if (codec != QLatin1String("zlib") && cme->oobCompression() == QtContactsSqliteExtensions::ContactManagerEngine::ZlibCompression) {
+            qDebug() << "    " << codec << "is not available";
+            continue;
+        }
+
+        elapsedTimeTotal += oobCompressionPayload(cme, codec, QString::fromLatin1("vcards"), vcards);
+        elapsedTimeTotal += oobCompressionPayload(cme, codec, QString::fromLatin1("metadata"), metadata);
+        elapsedTimeTotal += oobCompressionPayload(cme, codec, QString::fromLatin1("state"), state);
+
+        if (codec == QLatin1String("zstd")) {
+            QElapsedTimer syncTimer;
+            syncTimer.start();
+            if (cme->trainOOBDictionary(QString::fromLatin1("fetchtimes-compression-metadata"))) {
+                qDebug() << "    trained metadata dictionary in" << syncTimer.elapsed() << "milliseconds";
+                elapsedTimeTotal += oobCompressionPayload(cme, codec, QString::fromLatin1("metadata"), metadata);
+            }
+        }
+
+        for (const QString &label : QStringList() << QString::fromLatin1("vcards") << QString::fromLatin1("metadata") << QString::fromLatin1("state")) {
+            cme->removeOOB(QString::fromLatin1("fetchtimes-compression-") + label);
+        }
+    }
+
+    return elapsedTimeTotal;
+}
+
+static qint64 contentionWriter(QContactManager &manager, int saveCount)
+{
+    typedef QtContactsSqliteExtensions::ContactManagerEngine Engine;
+
+    // hidden/undocumented feature: the writer process spawned by writeLockContention.
+    // Saves contacts individually, so that each save contends for the write lock,
+    // then reports the wait and hold statistics for the saves on stdout.
+    Engine *cme = QtContactsSqliteExtensions::contactManagerEngine(manager);
+    cme->resetWriteLockStatistics();
+
+    QElapsedTimer timer;
+    timer.start();
+    QList<QContactId> saveIds;
+    for (int i = 0; i < saveCount; ++i) {
+        QContact c = generateContact();
+        if (manager.saveContact(&c)) {
+            saveIds.append(c.id());
+        }
+    }
+    const qint64 elapsed = timer.elapsed();
+
+    const Engine::WriteLockStatistics statistics = cme->writeLockStatistics(Engine::SaveLockSite);
+    QStringList waitTimes;
+    for (int count : statistics.waitTimes) {
+        waitTimes.append(QString::number(count));
+    }
+    const QString report = QString::fromLatin1("%1 %2 %3 %4 %5 %6 %7\n")
+            .arg(elapsed)
+            .arg(statistics.acquisitions)
+            .arg(statistics.totalWaitTime)
+            .arg(statistics.maximumWaitTime)
+            .arg(statistics.totalHoldTime)
+            .arg(statistics.maximumHoldTime)
+            .arg(waitTimes.join(QStringLiteral(",")));
+    fputs(report.toLatin1().constData(), stdout);
+    fflush(stdout);
+
+    QContactManager::Error purgeError = QContactManager::NoError;
+    manager.removeContacts(saveIds);
+    cme->clearChangeFlags(saveIds, &purgeError);
+
+    return elapsed;
+}
+
+static qint64 writeLockContention(QContactManager &manager, bool quickMode, int writerCount)
+{
+    Q_UNUSED(manager)
+
+    // Spawn writer processes which save contacts to the same database concurrently,
+    // and report how long each waited to acquire the cross-process write lock.
+    qDebug() << "--------";
+    qDebug() << "Performing multi-process write lock contention tests:";
+
+    const int saveCount = quickMode ? 50 : 200;
+    QList<QProcess *> writers;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < writerCount; ++i) {
+        QProcess *writer = new QProcess;
+        writer->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        writer->start(QCoreApplication::applicationFilePath(),
+                      QStringList() << QString::fromLatin1("--contentionWriter=%1").arg(saveCount));
+        writers.append(writer);
+    }
+
+    int acquisitions = 0;
+    qint64 totalWaitTime = 0;
+    qint64 totalHoldTime = 0;
+    int maximumWaitTime = 0;
+    int maximumHoldTime = 0;
+    QList<int> waitTimes;
+    for (int i = 0; i < writers.size(); ++i) {
+        QProcess *writer = writers.at(i);
+        if (!writer->waitForFinished(-1) || writer->exitCode() != 0) {
+            qWarning() << "    writer" << i << "failed:" << writer->errorString();
+            delete writer;
+            continue;
+        }
+
+        const QStringList fields = QString::fromLatin1(writer->readAllStandardOutput()).trimmed().split(QLatin1Char(' '));
+        delete writer;
+        if (fields.size() != 7) {
+            qWarning() << "    writer" << i << "reported no statistics";
+            continue;
+        }
+
+        qDebug() << "    writer" << i << "saved" << fields.at(1).toInt() << "contacts in" << fields.at(0).toLongLong() << "milliseconds,"
+                 << "maximum wait" << fields.at(3).toInt() << "us, maximum hold" << fields.at(5).toInt() << "us";
+        acquisitions += fields.at(1).toInt();
+        totalWaitTime += fields.at(2).toLongLong();
+        maximumWaitTime = qMax(maximumWaitTime, fields.at(3).toInt());
+        totalHoldTime += fields.at(4).toLongLong();
+        maximumHoldTime = qMax(maximumHoldTime, fields.at(5).toInt());
+        const QStringList counts = fields.at(6).split(QLatin1Char(','));
+        for (int j = 0; j < counts.size(); ++j) {
+            if (j < waitTimes.size()) {
+                waitTimes[j] += counts.at(j).toInt();
+            } else {
+                waitTimes.append(counts.at(j).toInt());
+            }
+        }
+    }
+    const qint64 elapsed = timer.elapsed();
+
+    qDebug() << "    " << writerCount << "writers acquired the write lock" << acquisitions << "times in" << elapsed << "milliseconds";
+    if (acquisitions > 0) {
+        qDebug() << "    mean wait" << (totalWaitTime / acquisitions) << "us, maximum wait" << maximumWaitTime << "us,"
+                 << "mean hold" << (totalHoldTime / acquisitions) << "us, maximum hold" << maximumHoldTime << "us";
+        qDebug() << "        write lock wait times:";
+        printLockHistogram(waitTimes);
+    }
+
+    return elapsed;
+}
+
 int main(int argc, char  *argv[])
 {
     QCoreApplication application(argc, argv);
@@ -1799,6 +2447,12 @@ int main(int argc, char  *argv[])
         qDebug() << "    scalingPresenceUpdate";
         qDebug() << "    nonAggregatedPresenceUpdate";
         qDebug() << "    aggregatedPresenceUpdate";
+        qDebug() << "    presenceUpdateApi";
+        qDebug() << "    changeNotificationRefetches";
+        qDebug() << "    writeLockHoldTimes";
+        qDebug() << "    writeLockContention [--writers=<count>]";
+        qDebug() << "    oobScopes";
+        qDebug() << "    oobCompression";
         return 0;
     }
 
@@ -1824,18 +2478,31 @@ int main(int argc, char  *argv[])
     const bool stable(args.contains(QStringLiteral("-s")) || args.contains(QStringLiteral("--stable")));
     const bool runAll(args.contains(QStringLiteral("-a")) || args.contains(QStringLiteral("--all")));
 
+    int writerCount = 4;
+    int contentionWriterSaves = 0;
+    for (const QString &arg : args) {
+        if (arg.startsWith(QStringLiteral("--writers="))) {
+            writerCount = qMax(1, arg.mid(10).toInt());
+        } else if (arg.startsWith(QStringLiteral("--contentionWriter="))) {
+            contentionWriterSaves = arg.mid(19).toInt();
+        }
+    }
+
     QMap<QString, QString> parameters;
     parameters.insert(QString::fromLatin1("autoTest"), QString::fromLatin1("true"));
     parameters.insert(QString::fromLatin1("mergePresenceChanges"), QString::fromLatin1("false"));
     QContactManager manager(QString::fromLatin1("org.nemomobile.contacts.sqlite"), parameters);
     QList<QContactId> aggregateIds = manager.contactIds(); // ensure the database has been created.
-    if (!aggregateIds.isEmpty()) {
+    if (!aggregateIds.isEmpty() && contentionWriterSaves == 0) {
         qWarning() << "Database not empty at beginning of test!  Contains:" << aggregateIds.size() << "aggregate contacts!";
     }
 
     qint64 elapsedTimeTotal = 0;
     clock_t startTicks = clock();
-    if (queryPlan) {
+    if (contentionWriterSaves > 0) {
+        contentionWriter(manager, contentionWriterSaves);
+        return 0;
+    } else if (queryPlan) {
         // hidden/undocumented feature: perform two writes and one read
         // which we will use to inspect the query plans.
         qsrand(42);
@@ -1861,6 +2528,12 @@ int main(int argc, char  *argv[])
         elapsedTimeTotal += (runAll || functionArgs.contains("scalingPresenceUpdate")) ? scalingPresenceUpdate(manager, quickMode) : 0;
         elapsedTimeTotal += (runAll || functionArgs.contains("nonAggregatedPresenceUpdate")) ? nonAggregatedPresenceUpdate(manager, quickMode) : 0;
         elapsedTimeTotal += (runAll || functionArgs.contains("aggregatedPresenceUpdate")) ? aggregatedPresenceUpdate(manager, quickMode) : 0;
+        elapsedTimeTotal += (runAll || functionArgs.contains("presenceUpdateApi")) ? presenceUpdateApi(manager, quickMode) : 0;
+        elapsedTimeTotal += (runAll || functionArgs.contains("changeNotificationRefetches")) ? changeNotificationRefetches(manager, quickMode) : 0;
+        elapsedTimeTotal += (runAll || functionArgs.contains("writeLockHoldTimes")) ? writeLockHoldTimes(manager, quickMode) : 0;
+        elapsedTimeTotal += (runAll || functionArgs.contains("writeLockContention")) ? writeLockContention(manager, quickMode, writerCount) : 0;
+        elapsedTimeTotal += (runAll || functionArgs.contains("oobScopes")) ? oobScopes(manager, quickMode) : 0;
+        elapsedTimeTotal += (runAll || functionArgs.contains("oobCompression")) ? oobCompression(manager, quickMode) : 0;
     }
     clock_t endTicks = clock();
     qDebug() << "\n\nCumulative elapsed time:" << elapsedTimeTotal << "milliseconds, with: " << (endTicks - startTicks) << " clock ticks.";